@@ -5,10 +5,11 @@
 #include "mediasource/M_AudioSource.h"
 #include "utils/CircularDeque.h"
 #include "utils/Configs.h"
-#include "utils/FrameBuffer.h"
+#include "utils/FramePool.h"
 #include "utils/Platform.h"
 
-typedef void (*E_AACFrameCallback)(void *context, const FrameBuffer<MAX_AUDIO_FRAME_SIZE> &);
+// Listeners Retain() the frame to keep it after the callback
+typedef void (*E_AACFrameCallback)(void *context, SharedFrame *frame);
 
 typedef struct {
     E_AACFrameCallback callback;
@@ -1,37 +1,24 @@
 #pragma once
 
 #include "utils/Configs.h"
-#include "utils/FrameBuffer.h"
-#include "utils/HierarchyMemoryPool.h"
+#include "utils/FramePool.h"
 #include "utils/CircularDeque.h"
 #include "utils/Platform.h"
 
-typedef void (*E_AACQueueCbFnc)(void* context, const FrameBuffer<MAX_AUDIO_FRAME_SIZE>&);
+// The callee Retain() the frame to keep it after the callback
+typedef void (*E_AACQueueCbFnc)(void* context, SharedFrame* frame);
 
 typedef struct {
     void* context;
     E_AACQueueCbFnc fnc;
 } E_AACQueueCb;
 
-typedef HierarchyMemoryPool<
-        MAX_AUDIO_FRAME_QUEUE_SIZE,
-        NORMAL_AUDIO_FRAME_SIZE,
+typedef FramePool<
+        AUDIO_FRAME_POOL_SIZE,
         MAX_AUDIO_FRAME_SIZE> QPool;
 
-typedef HierarchyBuffer<
-        MAX_AUDIO_FRAME_QUEUE_SIZE,
-        NORMAL_AUDIO_FRAME_SIZE,
-        MAX_AUDIO_FRAME_SIZE> QBuffer;
-
-typedef struct {
-    QBuffer data;
-    tm_t presentation_time_us;
-    sz_t size;
-    int_t flags;
-} QueueBuffer;
-
 typedef CircularDeque<
-        QueueBuffer,
+        SharedFrame*,
         MAX_AUDIO_FRAME_QUEUE_SIZE> QDeque;
 
 typedef struct {
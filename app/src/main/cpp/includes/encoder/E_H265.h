@@ -4,10 +4,11 @@
 #include "encoder/E_Platform.h"
 #include "mediasource/M_VideoSource.h"
 #include "utils/Configs.h"
-#include "utils/FrameBuffer.h"
+#include "utils/FramePool.h"
 #include "utils/Platform.h"
 
-typedef void (*E_H265FrameCallback)(void *context, const FrameBuffer<MAX_VIDEO_FRAME_SIZE> &);
+// Listeners Retain() the frame to keep it after the callback
+typedef void (*E_H265FrameCallback)(void *context, SharedFrame *frame);
 
 typedef struct {
     E_H265FrameCallback callback;
@@ -19,7 +20,10 @@ typedef struct{
     char vps[H265_PARAMS_SIZE];
     char sps[H265_PARAMS_SIZE];
     char pps[H265_PARAMS_SIZE];
+    byte_t config[H265_CONFIG_SIZE];
+    sz_t config_size;
     a_bool_t params_initialized;
+    a_int_t params_version; // +1 each time the parameter sets change
     lock_t params_lock;
     cond_t params_cond;
 
@@ -27,6 +31,16 @@ typedef struct{
     lock_t listener_lock;
     E_H265FrameListener listeners[MAX_H265_LISTENER];
 
+    // Encoded frames, shared with the listeners
+    FramePool<VIDEO_FRAME_POOL_SIZE, NORMAL_VIDEO_FRAME_SIZE> frames;
+    FramePool<VIDEO_KEYFRAME_POOL_SIZE, MAX_VIDEO_FRAME_SIZE> keyframes;
+
+    // GOP cache: latest keyframe and every frame since,
+    // so a new session can start decoding right away
+    SharedFrame* gop[GOP_CACHE_MAX_FRAMES];
+    sz_t gop_count;
+    lock_t gop_lock;
+
     // Video source
     M_VideoSource* source;
     
@@ -36,6 +50,13 @@ typedef struct{
     E_Window *encoder_window;
     E_BufferInfo buffer_info;
 
+    // Sync frame asked by a client (PLI/FIR), served by the encoding thread
+    a_bool_t key_frame_requested;
+
+    // Target bit rate, set by the rate control, served by the encoding thread
+    a_int_t bit_rate;
+    a_int_t bit_rate_requested; // 0 if nothing new
+
     // Threading
     // Idle: recording false, stopping false
     // Start: recording true, stopping false
@@ -53,5 +74,21 @@ bool E_AddListener(E_H265 &encoder,
                    E_H265FrameCallback callback,
                    void *ctx);
 bool E_RemoveListener(E_H265 &encoder, void *ctx);
+// Next frame will be a sync frame, can be called from any thread
+void E_RequestKeyFrame(E_H265 &encoder);
+// Change the target bit rate of the running codec, can be called from any thread
+void E_SetBitRate(E_H265 &encoder, int_t bit_rate);
+int_t E_GetBitRate(E_H265 &encoder);
+// Cached GOP in order, keyframe first, each frame retained for the caller.
+// Return the frame count, 0 if there is no keyframe yet.
+sz_t E_GetGop(E_H265 &encoder, SharedFrame **frames, sz_t max);
 // This function will lock until params are available
-void E_GetParams(E_H265 &encoder, char *vps, char *sps, char *pps);
\ No newline at end of file
+void E_GetParams(E_H265 &encoder, char *vps, char *sps, char *pps);
+// Same, but waits at most timeout_us.
+// Return the version of the params, 0 if there are none yet.
+int_t E_GetParams(E_H265 &encoder, char *vps, char *sps, char *pps, tm_t timeout_us);
+// Version of the current params without waiting, 0 if there are none yet
+int_t E_ParamsVersion(E_H265 &encoder);
+// The params as given by the codec (start codes + NAL units), without waiting.
+// Return their version, 0 if there are none yet or they don't fit in size.
+int_t E_GetConfig(E_H265 &encoder, byte_t *data, sz_t size, sz_t &length);
\ No newline at end of file
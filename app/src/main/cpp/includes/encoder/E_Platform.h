@@ -21,6 +21,9 @@
 #define E_KEY_FRAME_RATE "frame-rate"
 #define E_KEY_PROFILE "profile"
 #define E_KEY_LEVEL "level"
+#define E_KEY_REQUEST_SYNC_FRAME "request-sync"
+#define E_KEY_VIDEO_BIT_RATE "video-bitrate"
+#define E_KEY_CSD_0 "csd-0"
 
 #define E_COLOR_FORMAT_SURFACE 0x7F000789
 
@@ -29,6 +32,8 @@
 #define E_INFO_FLAG_CODEC_CONFIG 2
 #define E_INFO_FLAG_END_OF_STREAM 4
 
+#define E_INFO_OUTPUT_FORMAT_CHANGED AMEDIACODEC_INFO_OUTPUT_FORMAT_CHANGED
+
 typedef AMediaCodec E_Codec;
 typedef AMediaFormat E_Format;
 typedef ANativeWindow E_Window;
@@ -98,3 +103,12 @@ static inline result_t E_ReleaseOutput(E_Codec* codec, sz_t idx, bool_t render)
 static inline result_t E_SignalEOS(E_Codec *codec) {
     return AMediaCodec_signalEndOfInputStream(codec);
 }
+static inline result_t E_SetParameters(E_Codec *codec, const E_Format *format) {
+    return AMediaCodec_setParameters(codec, format);
+}
+static inline E_Format* E_OutputFormat(E_Codec *codec) {
+    return AMediaCodec_getOutputFormat(codec);
+}
+static inline bool_t E_GetBuffer(E_Format* format, const char* name, void** data, sz_t* size) {
+    return AMediaFormat_getBuffer(format, name, data, size);
+}
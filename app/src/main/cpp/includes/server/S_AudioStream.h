@@ -1,40 +1,47 @@
 #pragma once
 
 #include "encoder/E_AAC.h"
+#include "server/S_PacketBatch.h"
 #include "server/S_Platform.h"
 #include "server/S_StreamState.h"
+#include "server/S_Transport.h"
+#include "utils/FrameRing.h"
+#include "utils/MediaClock.h"
 #include "utils/StreamStats.h"
 
 
 typedef struct {
-    // Double buffer
-    FrameBuffer<MAX_AUDIO_FRAME_SIZE> frame_buffer[2];
+    // Frames shared with the encoder (no copy), in order.
+    // On overflow, the oldest frame is dropped.
+    FrameRing<AUDIO_FRAME_RING_SIZE> ring;
 
-    // Socket buffer
-    FrameBuffer<RTP_MAX_PACKET_SIZE> socket_buffer;
+    // AUs waiting to be grouped in one packet, held until sent
+    SharedFrame* pending[AAC_MAX_AUS_PER_PACKET];
+    sz_t pending_count;
+    sz_t max_aus;
+    uint_t pending_rtp_ts;
+
+    // Socket buffer, only headers are written here.
+    // Payload is sent straight from the pending AUs.
+    // One packet (+ Sender Report) per sendmsg().
+    PacketBatch<AAC_MAX_AUS_PER_PACKET> batch;
 
     // Stats
     StreamStats stats;
 
     // Socket data
-    CancellableSocket* socket;
+    S_Transport transport;
     tm_t last_time_us;
     int_t ssrc;
-    uint_t last_rtp_ts;
-    byte_t interleave;
+    RtpHeader rtp_header;
+    MediaClock clock;
+    S_RtpStart start;   // First packet, see RTP-Info
 
     // Report data
-    tm_t last_report_sec;
+    tm_t next_report_us;
     uint_t packet_count;
     uint_t octet_count;
 
-    // Double buffer synchronization
-    lock_t frame_mutex;
-    cond_t frame_condition;
-    bool_t frame_ready[2];
-    a_int_t write_idx;
-    a_int_t read_idx;
-
     // Threading
     thread_t thread;
 
@@ -48,8 +55,11 @@ typedef struct {
 void S_Init(S_AACStream& stream, E_AAC* encoder);
 void S_Prepare(S_AACStream& stream);
 void S_Start(S_AACStream& stream,
-             CancellableSocket* socket,
-             byte_t interleave,
-             int_t ssrc);
+             const S_Transport& transport,
+             const S_RtpStart& start);
 void S_Stop(S_AACStream& stream);
-bool_t S_IsRunning(const S_AACStream& stream);
\ No newline at end of file
+bool_t S_IsRunning(const S_AACStream& stream);
+// Compound RTCP packet from the client, called from the RTSP thread
+void S_HandleRtcp(S_AACStream& stream, const byte_t *data, sz_t size);
+sz_t S_MaxAUsPerPacket();
+sz_t S_MaxPacketTimeMs();
\ No newline at end of file
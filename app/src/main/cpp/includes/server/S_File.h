@@ -0,0 +1,70 @@
+#pragma once
+
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/falloc.h>
+#include <sys/stat.h>
+
+#include "utils/Platform.h"
+
+// Files of the recorder: written at offsets, preallocated, synced
+// by the writer thread
+
+static inline int_t MakeDir(const char_t *path) {
+    if (mkdir(path, 0755) < 0 && errno != EEXIST) {
+        return -1;
+    }
+    return 0;
+}
+
+// Last modification, 0 if the file doesn't exist
+static inline tm_t ModifiedSecs(const char_t *path) {
+    struct stat st {};
+    if (stat(path, &st) < 0) {
+        return 0;
+    }
+    return (tm_t)st.st_mtime;
+}
+
+// Truncated: the blocks of the previous content go back first
+static inline int_t CreateFile(const char_t *path) {
+    return open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+}
+
+// Reserve blocks past the end, the size only grows with the writes
+static inline int_t Preallocate(int_t fd, sz_t size) {
+    int_t result;
+    do {
+        result = fallocate(fd, FALLOC_FL_KEEP_SIZE, 0, (off_t)size);
+    } while (result < 0 && errno == EINTR);
+    return result;
+}
+
+static inline bool_t WriteAt(int_t fd, const void *data, sz_t size, sz_t offset) {
+    auto bytes = static_cast<const byte_t*>(data);
+    ssz_t result;
+
+    while (size > 0) {
+        result = pwrite(fd, bytes, size, (off_t)offset);
+        if (result < 0 && errno == EINTR) {
+            continue;
+        }
+        if (result <= 0) {
+            return false;
+        }
+        bytes += result;
+        offset += result;
+        size -= result;
+    }
+    return true;
+}
+
+static inline int_t SyncData(int_t fd) {
+    return fdatasync(fd);
+}
+
+// Blocks reserved past size are given back
+static inline void CloseFile(int_t fd, sz_t size) {
+    ftruncate(fd, (off_t)size);
+    close(fd);
+}
@@ -0,0 +1,134 @@
+#pragma once
+
+#include "encoder/E_AAC.h"
+#include "encoder/E_H265.h"
+#include "server/S_Platform.h"
+#include "server/S_StreamState.h"
+#include "utils/FrameRing.h"
+#include "utils/Mp4Writer.h"
+
+// A part ends before a frame would make it longer than HLS_PART_TARGET_MS,
+// these only bound odd streams (many slices, a video stall)
+#define HLS_PART_MAX_SAMPLES 64   // Per track
+#define HLS_PART_MAX_NALS 64      // Video, each is sent as length + data
+#define HLS_PART_HEADER_SIZE 2048 // moof + mdat header + NAL lengths
+#define HLS_PART_MAX_VECTORS (1 + HLS_PART_MAX_NALS * 2 + HLS_PART_MAX_SAMPLES)
+
+// Parts in the window, the open segment and the ones HTTP clients still send
+#define HLS_PART_POOL_SIZE ((HLS_WINDOW_SEGMENTS + 3) * HLS_MAX_PARTS)
+#define HLS_SEGMENT_SLOTS (HLS_WINDOW_SEGMENTS + 1)
+#define HLS_TARGET_DURATION_S ((HLS_MAX_PARTS * HLS_PART_TARGET_MS + 999) / 1000)
+
+#define HLS_INIT_SIZE 2048
+#define HLS_PLAYLIST_SIZE 8192
+
+enum S_HlsPartState {
+    HLS_PART_FREE,
+    HLS_PART_PUBLISHED,     // In the window
+    HLS_PART_RETIRED        // Out of the window, free once no client sends it
+};
+
+// moof + mdat of one part, muxed once. The vectors are the whole response:
+// boxes and NAL lengths from header, samples straight from the frames.
+typedef struct {
+    byte_t header[HLS_PART_HEADER_SIZE];
+    s_iovec_t vectors[HLS_PART_MAX_VECTORS];
+    sz_t vector_count;
+    sz_t size;
+
+    // Retained until the part is free again
+    SharedFrame* frames[HLS_PART_MAX_SAMPLES * 2];
+    sz_t frame_count;
+    sz_t video_count;
+
+    int_t msn;          // Media sequence number of its segment
+    int_t index;        // In the segment
+    tm_t duration_us;
+    bool_t independent; // Starts with an IDR
+
+    // Under the stream lock, refs are taken under it too (HTTP senders)
+    int_t state;
+    a_int_t refs;
+} S_HlsPart;
+
+typedef struct {
+    int_t msn;
+    S_HlsPart* parts[HLS_MAX_PARTS];
+    sz_t part_count;
+    tm_t duration_us;
+} S_HlsSegment;
+
+// LL-HLS output of the encoders: one muxer thread cuts CMAF parts on its own
+// clock, the HTTP server only copies the playlist and sends the parts by
+// reference. Segments first_msn .. last_msn - 1 are complete, last_msn is open.
+typedef struct {
+    // Frames shared with the encoders (no copy), in order
+    FrameRing<VIDEO_FRAME_RING_SIZE> video_ring;
+    FrameRing<AUDIO_FRAME_RING_SIZE> audio_ring;
+    bool_t skip_to_keyframe; // Encoder thread
+
+    // Muxer thread: frames of the part being built, AUs not muxed yet
+    SharedFrame* video[HLS_PART_MAX_SAMPLES];
+    sz_t video_count;
+    SharedFrame* audio[HLS_PART_MAX_SAMPLES];
+    sz_t audio_count;
+    tm_t part_start_us;
+    tm_t origin_us;         // Time 0 of both tracks, the first video frame
+    bool_t origin_set;
+    tm_t audio_dts;         // Next AU, AUDIO_SAMPLE_RATE
+    bool_t audio_dts_set;
+    bool_t wait_keyframe;
+    bool_t keyframe_requested;
+    uint_t fragment_seq;
+    sz_t window_video;      // Frames held by the window
+    sz_t window_audio;
+    byte_t config[H265_CONFIG_SIZE];
+
+    // Published, under lock
+    S_HlsPart parts[HLS_PART_POOL_SIZE];
+    S_HlsSegment segments[HLS_SEGMENT_SLOTS];
+    int_t first_msn;
+    int_t last_msn;
+    int_t discontinuity;    // +1 each time the parameter sets change
+    byte_t init[HLS_INIT_SIZE];
+    sz_t init_size;
+    int_t init_version;     // 0 until the first parameter sets
+    char_t playlist[HLS_PLAYLIST_SIZE];
+    sz_t playlist_len;
+    lock_t lock;
+
+    // Tells the HTTP reactor a part was published
+    int_t notify_fd;
+    bool_t has_audio;
+
+    // Threading
+    thread_t thread;
+
+    // Status
+    a_int_t state;
+
+    // Encoders
+    E_H265* video_encoder;
+    E_AAC* audio_encoder;
+} S_HlsStream;
+
+void S_Init(S_HlsStream& stream, E_H265* video_encoder, E_AAC* audio_encoder);
+void S_Start(S_HlsStream& stream, bool_t start_audio, int_t notify_fd);
+// HTTP clients must have released their parts
+void S_Stop(S_HlsStream& stream);
+
+// Blocking playlist reload: msn / part of the request, -1 if not given.
+// Return 1 with the playlist copied, 0 if it doesn't have them yet,
+// -1 if they are too far ahead to wait for.
+int_t S_GetPlaylist(S_HlsStream& stream,
+                    int_t msn,
+                    int_t part,
+                    char_t *dst,
+                    sz_t size,
+                    sz_t &length);
+// Return 1 with the init segment of version copied, -1 if it is not the current one
+int_t S_GetInit(S_HlsStream& stream, int_t version, byte_t *dst, sz_t size, sz_t &length);
+// Parts of segment msn (part -1: the whole segment), retained for the caller.
+// Return their count, 0 if they are next to come (preload hint), -1 if gone / unknown.
+int_t S_GetParts(S_HlsStream& stream, int_t msn, int_t part, S_HlsPart **parts, sz_t max);
+void S_Release(S_HlsPart* part);
@@ -0,0 +1,74 @@
+#pragma once
+
+#include "server/S_HlsStream.h"
+#include "server/S_Platform.h"
+#include "utils/Configs.h"
+#include "utils/Platform.h"
+#include "utils/RtspParser.h"
+
+#define HTTP_BUFFER_LEN 2048        // Requests are one line and a few headers
+#define HTTP_HEADER_ROOM 512        // Status line + headers of a response
+#define HTTP_HEAD_SIZE (HTTP_HEADER_ROOM + HLS_PLAYLIST_SIZE) // + copied body
+#define HTTP_MAX_VECTORS 64         // Per sendmsg()
+#define HTTP_TIMER_MS 250           // Blocked requests time out at this precision
+
+enum S_HttpWait {
+    HTTP_WAIT_NONE,
+    HTTP_WAIT_PLAYLIST,     // _HLS_msn / _HLS_part not in the playlist yet
+    HTTP_WAIT_PART,         // Preload hint
+    HTTP_WAIT_SEGMENT       // Open segment
+};
+
+// One keep-alive connection. The response is the head (status, headers
+// and a copied playlist / init segment) then the parts by reference,
+// sent from the cursor as the socket takes it. Pipelined requests wait
+// in the receive buffer until it is out.
+typedef struct {
+    CancellableSocket socket;
+
+    byte_t recv_buf[HTTP_BUFFER_LEN];
+    sz_t recv_start;
+    sz_t recv_end;
+    RtspParser parser;
+
+    // Response being sent, total is 0 if none
+    char_t head[HTTP_HEAD_SIZE];
+    sz_t head_len;
+    S_HlsPart* parts[HLS_MAX_PARTS];
+    sz_t part_count;
+    sz_t sent;
+    sz_t total;
+
+    // Blocked request, answered when the stream publishes it
+    int_t wait;
+    int_t wait_msn;
+    int_t wait_part;
+    tm_t wait_until_us;
+} S_HttpClient;
+
+struct S_HttpServer {
+    S_HttpClient clients[HTTP_MAX_CONNECTIONS];
+
+    // Muxed once, sent to every client
+    S_HlsStream hls;
+
+    CancellableSocket server_socket;
+
+    // Reactor like S_RtspServer: the event fd stops it, the notify fd
+    // tells a part was published, the timer fd ends blocked requests
+    int_t poll_fd;
+    int_t event_fd;
+    int_t notify_fd;
+    int_t timer_fd;
+
+    a_bool_t is_running;
+    a_bool_t is_stopping;
+    thread_t thread;
+};
+
+void S_Init(S_HttpServer& server,
+            E_H265* video_encoder,
+            E_AAC* audio_encoder);
+// Video is required, audio is muxed if started
+void S_Start(S_HttpServer& server, bool_t start_audio);
+void S_Stop(S_HttpServer& server);
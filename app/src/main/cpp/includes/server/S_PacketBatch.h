@@ -0,0 +1,308 @@
+#pragma once
+
+#include "server/S_Platform.h"
+#include "server/S_Transport.h"
+#include "utils/Packetizer.h"
+#include "utils/Platform.h"
+
+#define TCP_PREFIX_LEN 4
+#define UDP_MAX_SEGMENT_BYTES 65000
+
+// All packets of one frame, flushed with a single sendmsg() (TCP)
+// or sendmmsg() (UDP).
+// Headers are stored here, payload vectors point to the frame buffer.
+// Each packet is 2 vectors (header + payload), RTCP report is 1.
+template <sz_t CAPACITY>
+struct PacketBatch {
+    byte_t headers[CAPACITY * RTP_MAX_HEADER_SIZE + RTCP_REPORT_SIZE];
+    s_iovec_t vectors[CAPACITY * 2 + 1];
+    sz_t header_size;
+    sz_t vector_count;
+    sz_t packet_count;
+    sz_t syscalls;
+
+    // First vector and size (with TCP prefix) of each packet
+    sz_t packet_vectors[CAPACITY + 2];
+    sz_t packet_sizes[CAPACITY + 1];
+    int_t report_idx;
+
+    // UDP: one message per datagram, or per run of equal datagrams with GSO
+    s_mmsghdr_t messages[CAPACITY + 1];
+    sz_t message_packets[CAPACITY + 1];
+    byte_t controls[CAPACITY + 1][UDP_SEGMENT_CONTROL_SIZE];
+};
+
+template <sz_t CAPACITY>
+void Reset(PacketBatch<CAPACITY>& batch) {
+    batch.header_size = 0;
+    batch.vector_count = 0;
+    batch.packet_count = 0;
+    batch.report_idx = -1;
+}
+
+template <sz_t CAPACITY>
+bool_t Empty(const PacketBatch<CAPACITY>& batch) {
+    return batch.vector_count == 0;
+}
+
+// Room for one more packet made of vector_count vectors and header_size bytes of headers
+template <sz_t CAPACITY>
+bool_t Fits(const PacketBatch<CAPACITY>& batch,
+            sz_t vector_count,
+            sz_t header_size) {
+    return batch.packet_count < CAPACITY &&
+           batch.vector_count + vector_count <= CAPACITY * 2 &&
+           batch.header_size + header_size <= CAPACITY * RTP_MAX_HEADER_SIZE;
+}
+
+template <sz_t CAPACITY>
+bool_t Full(const PacketBatch<CAPACITY>& batch) {
+    return !Fits(batch, 2, RTP_MAX_HEADER_SIZE);
+}
+
+// Space for the next header, at least RTP_MAX_HEADER_SIZE bytes,
+// there is always room for one more RTCP report.
+template <sz_t CAPACITY>
+byte_t *NextHeader(PacketBatch<CAPACITY>& batch) {
+    return batch.headers + batch.header_size;
+}
+
+// Commit the header written at NextHeader(), payload may be empty
+template <sz_t CAPACITY>
+void AddPacket(PacketBatch<CAPACITY>& batch,
+               sz_t header_size,
+               const byte_t *payload,
+               sz_t payload_size) {
+
+    batch.packet_vectors[batch.packet_count] = batch.vector_count;
+    batch.packet_sizes[batch.packet_count] = header_size + payload_size;
+
+    SetVector(batch.vectors[batch.vector_count++],
+              batch.headers + batch.header_size,
+              header_size);
+    batch.header_size += header_size;
+
+    if (payload_size > 0) {
+        SetVector(batch.vectors[batch.vector_count++], payload, payload_size);
+    }
+    batch.packet_count++;
+}
+
+// Append a header written at NextHeader() and its payload to the last packet,
+// used by packets carrying more than one payload (Aggregation Packets)
+template <sz_t CAPACITY>
+void AddFragment(PacketBatch<CAPACITY>& batch,
+                 sz_t header_size,
+                 const byte_t *payload,
+                 sz_t payload_size) {
+
+    batch.packet_sizes[batch.packet_count - 1] += header_size + payload_size;
+
+    if (header_size > 0) {
+        SetVector(batch.vectors[batch.vector_count++],
+                  batch.headers + batch.header_size,
+                  header_size);
+        batch.header_size += header_size;
+    }
+
+    if (payload_size > 0) {
+        SetVector(batch.vectors[batch.vector_count++], payload, payload_size);
+    }
+}
+
+// Commit the RTCP report written at NextHeader(), only one per batch
+template <sz_t CAPACITY>
+void AddReport(PacketBatch<CAPACITY>& batch, sz_t report_size) {
+    batch.report_idx = static_cast<int_t>(batch.packet_count);
+    AddPacket(batch, report_size, nullptr, 0);
+}
+
+// Vectors of packet i, the first one starts with the TCP prefix.
+// Only valid before the batch is flushed.
+template <sz_t CAPACITY>
+sz_t PacketVectors(const PacketBatch<CAPACITY>& batch,
+                   sz_t i,
+                   const s_iovec_t *&vectors) {
+    sz_t end = i + 1 < batch.packet_count ? batch.packet_vectors[i + 1] : batch.vector_count;
+    vectors = &batch.vectors[batch.packet_vectors[i]];
+    return end - batch.packet_vectors[i];
+}
+
+// Group packets into messages starting from packet first.
+// With segmentation, a run of equal-sized packets (the last one may be smaller)
+// becomes one message, the kernel splits it again into datagrams.
+template <sz_t CAPACITY>
+sz_t BuildMessages(PacketBatch<CAPACITY>& batch,
+                   sz_t first,
+                   bool_t segmentation) {
+    sz_t count = 0;
+    sz_t i = first;
+    sz_t run;
+    sz_t run_bytes;
+    sz_t segment_size;
+    s_mmsghdr_t *message;
+
+    while (i < batch.packet_count) {
+        if ((int_t)i == batch.report_idx) {
+            ++i;
+            continue;
+        }
+
+        segment_size = batch.packet_sizes[i] - TCP_PREFIX_LEN;
+        run = 1;
+        run_bytes = segment_size;
+        while (segmentation &&
+               i + run < batch.packet_count &&
+               (int_t)(i + run) != batch.report_idx &&
+               run < UDP_MAX_SEGMENTS &&
+               batch.packet_sizes[i + run] - TCP_PREFIX_LEN <= segment_size &&
+               run_bytes + batch.packet_sizes[i + run] - TCP_PREFIX_LEN <= UDP_MAX_SEGMENT_BYTES) {
+            run_bytes += batch.packet_sizes[i + run] - TCP_PREFIX_LEN;
+            ++run;
+            // Only the last segment may be smaller
+            if (batch.packet_sizes[i + run - 1] - TCP_PREFIX_LEN < segment_size) {
+                break;
+            }
+        }
+
+        message = &batch.messages[count];
+        Reset(message, sizeof(s_mmsghdr_t));
+        message->msg_hdr.msg_iov = &batch.vectors[batch.packet_vectors[i]];
+        message->msg_hdr.msg_iovlen =
+                batch.packet_vectors[i + run] - batch.packet_vectors[i];
+        if (run > 1) {
+            SetSegmentation(*message, batch.controls[count], (ushort_t)segment_size);
+        }
+        batch.message_packets[count] = i;
+
+        ++count;
+        i += run;
+    }
+    return count;
+}
+
+// Never blocks, a partial send is finished from the client send queue
+template <sz_t CAPACITY>
+ssz_t FlushTcp(PacketBatch<CAPACITY>& batch,
+               S_Transport& transport,
+               bool_t more) {
+    CancellableSocket& socket = *transport.socket;
+    ssz_t sent;
+
+    // Audio and video share the socket, never interleave inside a frame
+    Lock(&socket.send_lock);
+    sent = S_SendMedia(*transport.queue,
+                       batch.vectors,
+                       batch.vector_count,
+                       more ? MSG_MORE : 0,
+                       batch.syscalls);
+    Unlock(&socket.send_lock);
+    return sent;
+}
+
+// Move the first vector of each packet past the TCP prefix, or back
+template <sz_t CAPACITY>
+void SkipPrefix(PacketBatch<CAPACITY>& batch, bool_t skip) {
+    sz_t i;
+
+    for (i = 0; i < batch.packet_count; ++i) {
+        s_iovec_t &header = batch.vectors[batch.packet_vectors[i]];
+        if (skip) {
+            header.iov_base = static_cast<byte_t *>(header.iov_base) + TCP_PREFIX_LEN;
+            header.iov_len -= TCP_PREFIX_LEN;
+        } else {
+            header.iov_base = static_cast<byte_t *>(header.iov_base) - TCP_PREFIX_LEN;
+            header.iov_len += TCP_PREFIX_LEN;
+        }
+    }
+}
+
+static inline sz_t SendMessages(S_Transport& transport,
+                                s_mmsghdr_t *messages,
+                                sz_t count,
+                                sz_t &calls) {
+    if (transport.uring) {
+        return S_SendMessages(*transport.uring, transport.rtp_socket, messages, count, calls);
+    }
+    return SendMessages(transport.rtp_socket, messages, count, calls);
+}
+
+template <sz_t CAPACITY>
+ssz_t FlushUdp(PacketBatch<CAPACITY>& batch,
+               S_Transport& transport) {
+    s_iovec_t *report;
+    sz_t count;
+    sz_t sent;
+
+    // UDP has no interleave prefix
+    batch.packet_vectors[batch.packet_count] = batch.vector_count;
+    SkipPrefix(batch, true);
+
+    count = BuildMessages(batch, 0, transport.segmentation);
+    sent = SendMessages(transport, batch.messages, count, batch.syscalls);
+
+    // GSO is not supported by this route, send datagrams one by one from now on
+    if (sent < count && transport.segmentation &&
+        (errno == EIO || errno == EINVAL || errno == EOPNOTSUPP)) {
+        transport.segmentation = false;
+        count = BuildMessages(batch, batch.message_packets[sent], false);
+        sent = SendMessages(transport, batch.messages, count, batch.syscalls);
+    }
+
+    // Path MTU dropped, the rest of this frame is lost,
+    // next frames are packetized with the new size
+    if (sent < count && errno == EMSGSIZE) {
+        S_RefreshMtu(transport);
+    }
+
+    // Client has not opened its ports yet, or the socket buffer is full,
+    // not an error
+    if (sent < count && errno != ECONNREFUSED && errno != EMSGSIZE &&
+        errno != EAGAIN && errno != EWOULDBLOCK) {
+        SkipPrefix(batch, false);
+        return -1;
+    }
+
+    // RTCP goes to its own port
+    if (batch.report_idx >= 0) {
+        report = &batch.vectors[batch.packet_vectors[batch.report_idx]];
+        send(transport.rtcp_socket, report->iov_base, report->iov_len, 0);
+        ++batch.syscalls;
+    }
+
+    // The same batch may be sent again to another client
+    SkipPrefix(batch, false);
+    return (ssz_t)sent;
+}
+
+// Send everything in one go, use more = true if the frame is not done yet,
+// so TCP keeps the segment open for the rest (MSG_MORE).
+// The batch is kept, it can be patched and sent to the next client.
+// Media should S_CheckBudget() first, TCP still returns SEND_BLOCKED
+// if the rest of an earlier batch is waiting.
+template <sz_t CAPACITY>
+ssz_t Send(PacketBatch<CAPACITY>& batch,
+           S_Transport& transport,
+           bool_t more) {
+    ssz_t sent = 0;
+
+    if (!Empty(batch)) {
+        if (transport.type == TRANSPORT_TCP) {
+            sent = FlushTcp(batch, transport, more);
+        } else if (transport.type == TRANSPORT_UDP) {
+            sent = FlushUdp(batch, transport);
+        }
+    }
+    return sent;
+}
+
+// Send, then start a new batch
+template <sz_t CAPACITY>
+ssz_t Flush(PacketBatch<CAPACITY>& batch,
+            S_Transport& transport,
+            bool_t more) {
+    ssz_t sent = Send(batch, transport, more);
+
+    Reset(batch);
+    return sent;
+}
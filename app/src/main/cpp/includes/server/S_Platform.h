@@ -1,22 +1,62 @@
 #pragma once
 
 #include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/errqueue.h>
+#include <linux/sockios.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <netinet/udp.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
 #include <sys/socket.h>
+#include <sys/timerfd.h>
+#include <sys/uio.h>
 
 #include "utils/Platform.h"
 
 #define SOCKET_ADDR_LEN INET_ADDRSTRLEN
 
+// UDP GSO, kernel 4.18+
+#ifndef UDP_SEGMENT
+#define UDP_SEGMENT 103
+#endif
+#define UDP_MAX_SEGMENTS 64
+
+#ifndef IP_MTU
+#define IP_MTU 14
+#endif
+#define UDP_SEGMENT_CONTROL_SIZE CMSG_SPACE(sizeof(ushort_t))
+
+// MSG_ZEROCOPY, kernel 4.14+
+#ifndef SO_ZEROCOPY
+#define SO_ZEROCOPY 60
+#endif
+#ifndef MSG_ZEROCOPY
+#define MSG_ZEROCOPY 0x4000000
+#endif
+#ifndef SO_EE_ORIGIN_ZEROCOPY
+#define SO_EE_ORIGIN_ZEROCOPY 5
+#endif
+#ifndef SO_EE_CODE_ZEROCOPY_COPIED
+#define SO_EE_CODE_ZEROCOPY_COPIED 1
+#endif
+
 typedef sockaddr_in s_addr_t;
 typedef socklen_t s_addrlen_t;
+typedef iovec s_iovec_t;
+typedef mmsghdr s_mmsghdr_t;
+typedef epoll_event s_event_t;
+typedef uint64_t s_token_t;
 
+// Cancelled from the reactor (see S_RtspServer), which owns the poll
 typedef struct {
     s_addr_t address;
     s_addrlen_t addrlen;
-    fd_set read_fds;
-    int_t pipe_fd[2];
     int_t socket;
+    lock_t send_lock;
 } CancellableSocket;
 
 // Socket functions
@@ -57,7 +97,8 @@ static inline int_t InitServer(
         return -4;
     }
 
-    if (pipe(sock.pipe_fd) < 0) {
+    // Accepted until EAGAIN on each poll event
+    if (fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK) < 0) {
         close(fd);
         return -5;
     }
@@ -70,26 +111,78 @@ static inline bool_t IsConnected(const CancellableSocket& socket) {
     return socket.socket >= 0;
 }
 
-// Some magic I copy from internet
-static inline int_t Wait(CancellableSocket& socket) {
-    FD_ZERO(&socket.read_fds);
-    FD_SET(socket.socket, &socket.read_fds);
-    FD_SET(socket.pipe_fd[0], &socket.read_fds);
+// Poll functions, edge-triggered: after an event the owner
+// reads the fd until EAGAIN, then waits for the next one
+static inline int_t InitPoll() {
+    return epoll_create1(EPOLL_CLOEXEC);
+}
+
+// A closed fd leaves the poll by itself
+static inline int_t AddPoll(int_t poll_fd, int_t fd, s_token_t token) {
+    s_event_t event {};
+    event.events = EPOLLIN | EPOLLRDHUP | EPOLLET;
+    event.data.u64 = token;
+    return epoll_ctl(poll_fd, EPOLL_CTL_ADD, fd, &event);
+}
+
+// Same, and an event when the socket can take more bytes again
+static inline int_t AddPollWritable(int_t poll_fd, int_t fd, s_token_t token) {
+    s_event_t event {};
+    event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    event.data.u64 = token;
+    return epoll_ctl(poll_fd, EPOLL_CTL_ADD, fd, &event);
+}
+
+// Sleep until at least one fd is ready, return the number of events
+static inline int_t WaitPoll(int_t poll_fd, s_event_t *events, sz_t max) {
+    int_t count;
+    do {
+        count = epoll_wait(poll_fd, events, (int)max, -1);
+    } while (count < 0 && errno == EINTR);
+    return count;
+}
 
-    int_t max_fd = socket.socket > socket.pipe_fd[0] ?
-            socket.socket : socket.pipe_fd[0];
-    select(max_fd + 1, &socket.read_fds, nullptr, nullptr, nullptr);
+static inline s_token_t Token(const s_event_t& event) {
+    return event.data.u64;
+}
 
-    if (FD_ISSET(socket.pipe_fd[0], &socket.read_fds)) {
-        char_t buffer[1]; // Flush
-        read(socket.pipe_fd[0], buffer, 1);
+// Counter readable by poll, used to wake the reactor up
+static inline int_t InitEvent() {
+    return eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+}
+
+static inline void Notify(int_t event_fd) {
+    uint64_t value = 1;
+    WriteFile(event_fd, &value, sizeof(value));
+}
+
+// Take the count, so the next Notify() is an edge again
+static inline void ReadEvent(int_t event_fd) {
+    uint64_t value;
+    read(event_fd, &value, sizeof(value));
+}
+
+// Periodic timer readable by poll, ReadTimer() after each event
+static inline int_t InitTimer(tm_t period_ms) {
+    itimerspec spec {};
+    int_t fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+
+    if (fd < 0) {
         return -1;
     }
-
-    if (FD_ISSET(socket.socket, &socket.read_fds)) {
-        return 0;
+    spec.it_interval.tv_sec = (time_t)(period_ms / 1000);
+    spec.it_interval.tv_nsec = (long)(period_ms % 1000) * 1000000;
+    spec.it_value = spec.it_interval;
+    if (timerfd_settime(fd, 0, &spec, nullptr) < 0) {
+        close(fd);
+        return -1;
     }
-    return -1;
+    return fd;
+}
+
+static inline void ReadTimer(int_t timer_fd) {
+    uint64_t expirations;
+    read(timer_fd, &expirations, sizeof(expirations));
 }
 
 static inline int_t Accept(CancellableSocket& client, const CancellableSocket& server_socket) {
@@ -101,11 +194,6 @@ static inline int_t Accept(CancellableSocket& client, const CancellableSocket& s
         return -1;
     }
 
-    if (pipe(client.pipe_fd) < 0) {
-        close(client_socket);
-        return -2;
-    }
-
     client.socket = client_socket;
     return 0;
 }
@@ -128,6 +216,121 @@ static inline ssz_t Send(
     return send(socket.socket, buf, len, flags);
 }
 
+static inline void SetVector(s_iovec_t& vec, const void *buf, sz_t len) {
+    vec.iov_base = const_cast<void *>(buf);
+    vec.iov_len = len;
+}
+
+// Gather all vectors in one sendmsg(), the kernel reads directly from each buffer.
+// Vectors are not changed, the same ones may be sent to another client.
+// Return the bytes the socket took, it can be less than all with MSG_DONTWAIT.
+// calls is increased by the number of syscalls made.
+static inline ssz_t SendVector(
+        const CancellableSocket& socket,
+        const s_iovec_t *vec,
+        sz_t count,
+        int_t flags,
+        sz_t &calls) {
+
+    msghdr msg {};
+    msg.msg_iov = const_cast<s_iovec_t *>(vec);
+    msg.msg_iovlen = count;
+    ++calls;
+    return sendmsg(socket.socket, &msg, flags | MSG_NOSIGNAL);
+}
+
+// Bytes in the socket send queue, not sent or not acked yet (TCP),
+// not sent yet (UDP)
+static inline int_t QueuedBytes(int_t fd) {
+    int_t value = 0;
+    if (ioctl(fd, SIOCOUTQ, &value) < 0) {
+        return 0;
+    }
+    return value;
+}
+
+// Kernel struct tcp_info up to tcpi_delivery_rate (4.9+),
+// libc headers may be older. Missing fields read as 0.
+typedef struct {
+    uint8_t state;
+    uint8_t ca_state;
+    uint8_t retransmits;
+    uint8_t probes;
+    uint8_t backoff;
+    uint8_t options;
+    uint8_t wscale;
+    uint8_t app_limited;
+    uint32_t rto, ato, snd_mss, rcv_mss;
+    uint32_t unacked, sacked, lost, retrans, fackets;
+    uint32_t last_data_sent, last_ack_sent, last_data_recv, last_ack_recv;
+    uint32_t pmtu, rcv_ssthresh, rtt, rttvar, snd_ssthresh, snd_cwnd, advmss, reordering;
+    uint32_t rcv_rtt, rcv_space;
+    uint32_t total_retrans;
+    uint64_t pacing_rate, max_pacing_rate;
+    uint64_t bytes_acked, bytes_received;
+    uint32_t segs_out, segs_in;
+    uint32_t notsent_bytes;       // Not sent yet
+    uint32_t min_rtt;             // us
+    uint32_t data_segs_in, data_segs_out;
+    uint64_t delivery_rate;       // Bytes per second
+} s_tcp_info_t;
+
+static inline int_t GetTcpInfo(int_t fd, s_tcp_info_t& info) {
+    socklen_t len = sizeof(info);
+
+    Reset(&info, sizeof(info));
+    return getsockopt(fd, IPPROTO_TCP, TCP_INFO, &info, &len);
+}
+
+// Allow MSG_ZEROCOPY sends, without it the flag is ignored
+static inline int_t EnableZeroCopy(int_t fd) {
+    int_t on = 1;
+    return setsockopt(fd, SOL_SOCKET, SO_ZEROCOPY, &on, sizeof(on));
+}
+
+// Unacked data is given up after timeout_ms, then the connection is reset
+static inline int_t SetUserTimeout(int_t fd, int_t timeout_ms) {
+    return setsockopt(fd, IPPROTO_TCP, TCP_USER_TIMEOUT, &timeout_ms, sizeof(timeout_ms));
+}
+
+// Next MSG_ZEROCOPY completion from the error queue: sends lo..hi
+// (counted from 0 per socket) are done, copied if the kernel copied anyway.
+// Return false if there is none.
+static inline bool_t ReadZeroCopy(int_t fd, uint_t &lo, uint_t &hi, bool_t &copied) {
+    byte_t control[CMSG_SPACE(sizeof(sock_extended_err) + sizeof(sockaddr_in))];
+    msghdr msg {};
+    cmsghdr *cmsg;
+    const sock_extended_err *err;
+
+    while (true) {
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        if (recvmsg(fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0) {
+            return false;
+        }
+        for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+            err = reinterpret_cast<const sock_extended_err *>(CMSG_DATA(cmsg));
+            if (err->ee_origin == SO_EE_ORIGIN_ZEROCOPY && err->ee_errno == 0) {
+                lo = err->ee_info;
+                hi = err->ee_data;
+                copied = (err->ee_code & SO_EE_CODE_ZEROCOPY_COPIED) != 0;
+                return true;
+            }
+        }
+    }
+}
+
+// Writable only while less than bytes are not sent yet,
+// keeps the kernel queue short so the latency stays in user space
+static inline int_t SetSendLowWater(int_t fd, int_t bytes) {
+    return setsockopt(fd, IPPROTO_TCP, TCP_NOTSENT_LOWAT, &bytes, sizeof(bytes));
+}
+
+// Wake the peer and the poll up with a hang up
+static inline void Shutdown(const CancellableSocket& socket) {
+    shutdown(socket.socket, SHUT_RDWR);
+}
+
 static inline ssz_t Receive(
         const CancellableSocket& socket,
         void *buf,
@@ -136,13 +339,119 @@ static inline ssz_t Receive(
     return recv(socket.socket, buf, len, flags);
 }
 
-static inline void Interrupt(CancellableSocket& socket) {
-    WriteFile(socket.pipe_fd[1], "x", 1);
+// UDP functions
+static inline int_t BindUdp(int_t port) {
+    s_addr_t address {};
+    int_t fd = socket(AF_INET, SOCK_DGRAM, 0);
+
+    if (fd < 0) {
+        return -1;
+    }
+
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = INADDR_ANY;
+    address.sin_port = htons(port);
+    if (bind(fd, (struct sockaddr*)&address, sizeof(address)) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// RTP on even port, RTCP on the next one
+// Return the RTP port
+static inline int_t BindUdpPair(int_t *fds, int_t base_port, int_t range) {
+    for (int_t port = base_port; port + 1 < base_port + range; port += 2) {
+        fds[0] = BindUdp(port);
+        if (fds[0] < 0) {
+            continue;
+        }
+        fds[1] = BindUdp(port + 1);
+        if (fds[1] < 0) {
+            close(fds[0]);
+            continue;
+        }
+        return port;
+    }
+    return -1;
+}
+
+// Send to the client's address (same IP as the RTSP socket) at port
+static inline int_t ConnectUdp(int_t fd, const CancellableSocket& client, int_t port) {
+    s_addr_t address = client.address;
+    address.sin_port = htons(port);
+    return connect(fd, (struct sockaddr*)&address, sizeof(address));
+}
+
+// Set DF on outgoing datagrams, the kernel learns the path MTU from ICMP
+static inline int_t SetMtuDiscovery(int_t fd) {
+    int_t value = IP_PMTUDISC_DO;
+    return setsockopt(fd, IPPROTO_IP, IP_MTU_DISCOVER, &value, sizeof(value));
+}
+
+// Path MTU of a connected UDP socket, -1 if unknown
+static inline int_t GetPathMtu(int_t fd) {
+    int_t mtu = -1;
+    socklen_t len = sizeof(mtu);
+    if (getsockopt(fd, IPPROTO_IP, IP_MTU, &mtu, &len) < 0) {
+        return -1;
+    }
+    return mtu;
+}
+
+// One datagram gathered from vectors.
+// Never blocks, a full socket buffer fails with EAGAIN.
+static inline ssz_t SendDatagram(int_t fd, const s_iovec_t *vec, sz_t count) {
+    msghdr msg {};
+    msg.msg_iov = const_cast<s_iovec_t *>(vec);
+    msg.msg_iovlen = count;
+    return sendmsg(fd, &msg, MSG_DONTWAIT);
+}
+
+// Check if the kernel can split one large datagram into many (GSO)
+static inline bool_t SupportSegmentation(int_t fd) {
+    int_t size = 0;
+    return setsockopt(fd, IPPROTO_UDP, UDP_SEGMENT, &size, sizeof(size)) == 0;
+}
+
+// Ask the kernel to split this message into segment_size datagrams
+static inline void SetSegmentation(s_mmsghdr_t& message, byte_t *control, ushort_t segment_size) {
+    cmsghdr *cmsg;
+
+    message.msg_hdr.msg_control = control;
+    message.msg_hdr.msg_controllen = UDP_SEGMENT_CONTROL_SIZE;
+
+    cmsg = CMSG_FIRSTHDR(&message.msg_hdr);
+    cmsg->cmsg_level = IPPROTO_UDP;
+    cmsg->cmsg_type = UDP_SEGMENT;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(ushort_t));
+    Copy(CMSG_DATA(cmsg), &segment_size, sizeof(segment_size));
+}
+
+// Send all messages with as few sendmmsg() as possible
+// Return the number of messages sent before any error
+static inline sz_t SendMessages(
+        int_t fd,
+        s_mmsghdr_t *messages,
+        sz_t count,
+        sz_t &calls) {
+
+    sz_t sent = 0;
+    int_t result;
+
+    while (sent < count) {
+        // Never blocks, a full socket buffer is a loss like on the network
+        result = sendmmsg(fd, messages + sent, count - sent, MSG_DONTWAIT);
+        ++calls;
+        if (result <= 0) {
+            break;
+        }
+        sent += result;
+    }
+    return sent;
 }
 
 static inline void Destroy(CancellableSocket& socket) {
     close(socket.socket);
-    close(socket.pipe_fd[0]);
-    close(socket.pipe_fd[1]);
     socket.socket = -1;
 }
\ No newline at end of file
@@ -0,0 +1,41 @@
+#pragma once
+
+#include "encoder/E_H265.h"
+#include "server/S_SendQueue.h"
+#include "utils/Configs.h"
+#include "utils/Platform.h"
+
+// What one client's path looks like right now, -1 if unknown
+typedef struct {
+    int_t delivery_rate;  // bits/s the path delivered (TCP)
+    int_t queue_ms;       // Media not sent yet, kernel + send queue
+    int_t rtt_growth_ms;  // RTT above the path minimum (TCP)
+    int_t loss_percent;   // Last RTCP report (UDP)
+} S_RateSample;
+
+// Additive increase, multiplicative decrease on the encoder bit rate.
+// Down at once when a client is congested, up only after
+// RATE_INCREASE_SAMPLES samples in a row with every client clear.
+typedef struct {
+    int_t bit_rate;
+    sz_t clear_samples;
+    E_H265* encoder;
+} S_RateControl;
+
+// Sample of a client's media socket: TCP_INFO for TCP, the kernel and
+// send queue depth otherwise. Loss is the caller's (RTCP).
+void S_SampleSocket(S_SendQueue& queue, int_t fd, bool_t tcp, S_RateSample& sample);
+
+void S_Init(S_RateControl& control, E_H265* encoder);
+void S_Reset(S_RateControl& control);
+
+// New bit rate for the samples of all clients, no side effects
+int_t S_NextBitRate(S_RateControl& control,
+                    const S_RateSample *samples,
+                    sz_t count);
+
+// S_NextBitRate(), then set it on the encoder if it changed.
+// Return the bit rate.
+int_t S_Update(S_RateControl& control,
+               const S_RateSample *samples,
+               sz_t count);
@@ -0,0 +1,124 @@
+#pragma once
+
+#include "encoder/E_AAC.h"
+#include "encoder/E_H265.h"
+#include "server/S_File.h"
+#include "server/S_Platform.h"
+#include "server/S_StreamState.h"
+#include "utils/FrameRing.h"
+#include "utils/Mp4Writer.h"
+
+// A fragment ends before RECORD_FRAGMENT_MS, these only bound odd streams
+#define RECORD_FRAGMENT_MAX_SAMPLES 64  // Per track
+#define RECORD_FRAGMENT_MAX_NALS 256    // Video, each gets a NAL length
+#define RECORD_HEADER_SIZE 2048         // moof + mdat header
+#define RECORD_INIT_SIZE 2048
+#define RECORD_PATH_SIZE 256
+
+// Batches are written from offsets aligned to RECORD_ALIGN: a batch that
+// goes out early (RECORD_SYNC_MS) is padded with a free box
+#define RECORD_FREE_BOX_MIN 8
+
+// Filled by the muxer thread, written by the writer thread in one pwrite().
+// A file is written by consecutive batches, first to last.
+typedef struct {
+    alignas(RECORD_ALIGN) byte_t data[RECORD_BATCH_SIZE];
+    sz_t size;
+    int_t file;         // Slot in the ring on disk
+    bool_t first;       // Opens the file: truncated, then preallocated
+    bool_t last;        // Closes the file: synced, cut to what was written
+} S_RecordBatch;
+
+typedef struct {
+    sz_t queue_depth;       // Batches waiting for the writer
+    sz_t max_queue_depth;   // Since the last log
+    double_t write_ms;      // pwrite() of a batch, average since the last log
+    double_t max_write_ms;
+    double_t sync_ms;       // fdatasync(), average since the last log
+    sz_t written_bytes;
+    sz_t dropped_fragments; // Writer queue full
+    sz_t errors;            // Open / write / sync failures
+} S_RecordStats;
+
+// Local recording of the encoders: fragmented MP4 files that start on an
+// IDR, in a fixed ring of RECORD_FILE_COUNT files on disk. The encoder
+// threads only push references; the muxer thread keeps the pre-roll and
+// copies fragments into aligned batches; the writer thread does the I/O.
+typedef struct {
+    // Frames shared with the encoders (no copy), in order
+    FrameRing<VIDEO_FRAME_RING_SIZE> video_ring;
+    FrameRing<AUDIO_FRAME_RING_SIZE> audio_ring;
+    bool_t skip_to_keyframe; // Encoder thread
+
+    // Muxer thread: the pre-roll while not recording, else the fragment
+    // being built. Video starts on an IDR.
+    SharedFrame* video[RECORD_PREROLL_VIDEO_FRAMES];
+    sz_t video_count;
+    SharedFrame* audio[RECORD_PREROLL_AUDIO_FRAMES];
+    sz_t audio_count;
+    bool_t wait_keyframe;
+    byte_t config[H265_CONFIG_SIZE];
+    int_t config_version;
+    byte_t init[RECORD_INIT_SIZE];
+    sz_t init_size;
+    byte_t header[RECORD_HEADER_SIZE];
+    NalUnit nals[RECORD_FRAGMENT_MAX_NALS];
+
+    // Muxer thread: the open file, -1 if none
+    int_t file;
+    int_t next_file;
+    sz_t file_size;
+    tm_t file_start_us;
+    tm_t origin_us;         // Time 0 of both tracks, the first IDR of the file
+    tm_t audio_dts;         // Next AU, AUDIO_SAMPLE_RATE
+    bool_t audio_dts_set;
+    uint_t fragment_seq;
+    bool_t keyframe_requested;
+    bool_t gap;             // A fragment was dropped, the file goes on at an IDR
+    tm_t batch_start_us;    // First byte in the batch being filled
+
+    // Writer queue: batches queued .. written - 1 wait for the writer,
+    // queued % RECORD_BATCHES is the one the muxer fills. Both only grow.
+    S_RecordBatch batches[RECORD_BATCHES];
+    a_int_t queued;
+    a_int_t written;
+
+    // Writer thread
+    int_t fd;
+    sz_t fd_offset;
+    bool_t fd_failed;       // Batches go nowhere until the next file
+    tm_t synced_us;
+    bool_t dirty;
+
+    S_RecordStats stats;
+    double_t write_ms_sum;
+    sz_t writes;
+    double_t sync_ms_sum;
+    sz_t syncs;
+    tm_t log_us;
+    lock_t stats_lock;
+
+    // Threading
+    thread_t mux_thread;
+    thread_t write_thread;
+    a_bool_t writer_running;
+
+    // Status
+    a_int_t state;
+    a_bool_t recording;     // Files are written, else only the pre-roll is kept
+    bool_t has_audio;
+
+    // Encoders
+    E_H265* video_encoder;
+    E_AAC* audio_encoder;
+} S_Recorder;
+
+void S_Init(S_Recorder& recorder, E_H265* video_encoder, E_AAC* audio_encoder);
+// Video is required, audio is recorded if started.
+// Files are written from the start if RECORD_CONTINUOUS.
+void S_Start(S_Recorder& recorder, bool_t start_audio);
+void S_Stop(S_Recorder& recorder);
+
+// Start / stop writing files, a file starts with the pre-roll
+void S_SetRecording(S_Recorder& recorder, bool_t recording);
+void S_GetStats(S_Recorder& recorder, S_RecordStats& stats);
@@ -4,21 +4,33 @@
 #include "server/S_AudioStream.h"
 #include "utils/Platform.h"
 
+// Audio is packetized per client, video is shared by all clients
 typedef struct {
     S_AACStream audio_stream;
-    S_VideoStream video_stream;
+    S_VideoViewer video_viewer;
 } S_RtpSession;
 
 void S_Init(S_RtpSession& session,
-            E_H265* video_encoder,
+            S_VideoStream* video_stream,
             E_AAC* audio_encoder);
 void S_Prepare(S_RtpSession& session,
                bool_t video,
                bool_t audio);
+// Random SSRC, seq and rtptime for a track about to start
+void S_Init(S_RtpStart& start, tm_t connect_us);
 void S_Start(
         S_RtpSession& session,
-        CancellableSocket* socket,
-        int_t video_interleave,
-        int_t audio_interleave);
+        const S_Transport& video_transport,
+        const S_Transport& audio_transport,
+        const S_RtpStart& video_start,
+        const S_RtpStart& audio_start);
 void S_Stop(S_RtpSession& session);
+// After S_Stop(), true while the socket may still send from frames
+bool_t S_ReapZeroCopy(S_RtpSession& session);
 bool_t S_IsRunning(const S_RtpSession& session);
+// The track sends on its transport: PLAY, no TEARDOWN since
+bool_t S_IsPlaying(const S_RtpSession& session, bool_t video);
+void S_HandleRtcp(S_RtpSession& session,
+                  bool_t video,
+                  const byte_t *data,
+                  sz_t size);
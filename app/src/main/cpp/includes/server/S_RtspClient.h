@@ -2,8 +2,14 @@
 
 #include "utils/Configs.h"
 #include "utils/Platform.h"
+#include "utils/RtspParser.h"
 #include "server/S_Platform.h"
+#include "server/S_RateControl.h"
 #include "server/S_RtpSession.h"
+#include "server/S_SendQueue.h"
+#include "server/S_Transport.h"
+
+#define MAX_SDP_LEN 2048
 
 struct S_RtspMedia {
     int_t video_idx;
@@ -12,29 +18,91 @@ struct S_RtspMedia {
     int_t audio_interleave;
     E_H265* video_encoder;
     E_AAC* audio_encoder;
+
+    // Media sections of the SDP, the same for every client.
+    // Rendered again only when the parameter sets change (RTSP thread).
+    char_t sdp[MAX_SDP_LEN];
+    sz_t sdp_len;
+    int_t sdp_version;  // E_ParamsVersion() of sdp, 0 if not rendered
 };
 
+#define RTSP_BUFFER_LEN 2048
+#define RTSP_SEND_BUFFER_LEN (RTSP_BUFFER_LEN * 4)
+#define RTSP_CLIENT_ID_LEN 10
+
+// What woke the reactor up for a client, packed with its slot in the poll token
+enum S_RtspSource {
+    RTSP_SOURCE_CONTROL,
+    RTSP_SOURCE_VIDEO_RTCP,
+    RTSP_SOURCE_AUDIO_RTCP
+};
+
+#define RTSP_POLL_TOKEN(slot, source) (((s_token_t)(slot) << 2) | (source))
+#define RTSP_POLL_SLOT(token) ((int_t)((token) >> 2))
+#define RTSP_POLL_SOURCE(token) ((int_t)((token) & 3))
+
+// No thread of its own, the server reactor calls S_HandleEvent()
+// when the RTSP socket is readable or writable, or a UDP RTCP socket
+// is readable
 struct S_RtspClient {
     S_RtpSession rtp_session;
 
+    // Negotiated in SETUP
+    S_Transport video_transport;
+    S_Transport audio_transport;
+
     CancellableSocket socket;
+    S_SendQueue send_queue;
     S_RtspMedia* media;
 
-    int_t id;
+    // A recv() can end in the middle of a request, the rest comes
+    // with the next event. Messages are parsed in place from recv_start,
+    // the buffer is only compacted when recv_end reaches its end.
+    byte_t recv_buf[RTSP_BUFFER_LEN];
+    sz_t recv_start;
+    sz_t recv_end;
+    RtspParser parser;
+
+    // Responses to all requests of one read go out together,
+    // e.g. a pipelined SETUP / SETUP / PLAY
+    char_t send_buf[RTSP_SEND_BUFFER_LEN];
+    sz_t send_len;
+    char_t ip[SOCKET_ADDR_LEN];
+    char_t session_id[RTSP_CLIENT_ID_LEN];
 
-    thread_t thread;
-    a_bool_t thread_start;
+    // Reactor
+    int_t poll_fd;
+    int_t slot;
+    tm_t connect_us;
+    bool_t closing;     // Socket open only for the MSG_ZEROCOPY completions
+
+    int_t id;
 };
 
 void S_Init(S_RtspClient& client,
             S_RtspMedia* media,
-            E_H265* video_encoder,
+            S_VideoStream* video_stream,
             E_AAC* audio_encoder);
 
 int_t S_Accept(S_RtspClient& client, const CancellableSocket& server_socket);
 
-void S_Start(S_RtspClient& client);
+// Add the accepted client to the poll, its events carry slot
+void S_Open(S_RtspClient& client, int_t poll_fd, int_t slot);
+
+// Send what is pending and read everything available from source,
+// return -1 if the client is gone
+int_t S_HandleEvent(S_RtspClient& client, int_t source);
 
 bool_t S_IsConnected(const S_RtspClient& client);
 
-void S_Stop(S_RtspClient& client);
\ No newline at end of file
+// Media sent but not delivered yet, in ms, as of the last send
+int_t S_QueueDepthMs(const S_RtspClient& client);
+
+// Path of the video track now, false if no video is sent
+bool_t S_Sample(S_RtspClient& client, S_RateSample& sample);
+
+// The socket is closed once the kernel is done with the MSG_ZEROCOPY
+// sends, until then the reactor only reaps them (S_HandleEvent() < 0 when done)
+void S_Close(S_RtspClient& client);
+// Server stop: S_Close() that waits for them, ZEROCOPY_CLOSE_TIMEOUT_MS at most
+void S_CloseNow(S_RtspClient& client);
@@ -3,14 +3,28 @@
 #include "utils/Configs.h"
 #include "utils/Platform.h"
 #include "server/S_Platform.h"
+#include "server/S_RateControl.h"
 #include "server/S_RtspClient.h"
 
 struct S_RtspServer {
     S_RtspClient clients[RTSP_MAX_CONNECTIONS];
 
+    // Packetized once, sent to every client
+    S_VideoStream video_stream;
+
     CancellableSocket server_socket;
     S_RtspMedia media;
 
+    // Video bit rate for the slowest client
+    S_RateControl rate_control;
+
+    // Reactor: one thread polls the listen socket, every client socket
+    // and the UDP RTCP sockets. The event fd stops it, the timer fd
+    // samples the clients for the rate control.
+    int_t poll_fd;
+    int_t event_fd;
+    int_t timer_fd;
+
     a_bool_t is_running;
     a_bool_t is_stopping;
     thread_t thread;
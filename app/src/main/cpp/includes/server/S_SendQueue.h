@@ -0,0 +1,72 @@
+#pragma once
+
+#include "server/S_Platform.h"
+#include "utils/Configs.h"
+#include "utils/Platform.h"
+
+// Nothing was sent, the client is behind (see SEND_POLICY)
+#define SEND_BLOCKED -2
+
+// Media and responses of one client that its sockets didn't take yet.
+// Sends never block: interleaved TCP packets can't be cut, so the rest
+// of a partial send waits here and goes out before anything else.
+// The reactor drains it when the socket is writable again (S_Drain()).
+// Depth is this plus the kernel queue, in ms of media.
+typedef struct {
+    byte_t data[SEND_QUEUE_SIZE];
+    sz_t start;
+    sz_t end;
+
+    CancellableSocket* socket;  // RTSP socket, closed by SEND_POLICY_DISCONNECT
+    uint_t zerocopy_id;         // Id of the next MSG_ZEROCOPY send on the socket
+    a_int_t depth_ms;
+    a_int_t bit_rate;           // Of the session (video + audio), bytes -> ms
+    a_int_t behind;             // 1 while over budget, to log once
+
+    // Keyframe / GOP burst: its bytes fill the queue by themselves and
+    // are not congestion until the path had time to send them.
+    // Under send_lock.
+    sz_t burst_bytes;
+    tm_t burst_us;
+} S_SendQueue;
+
+void S_Init(S_SendQueue& queue, CancellableSocket* socket);
+void S_Reset(S_SendQueue& queue);
+
+// Kept up to date by the rate control
+void S_SetBitRate(S_SendQueue& queue, int_t bit_rate);
+
+// Bytes of media -> ms at the session bit rate
+int_t S_BytesToMs(const S_SendQueue& queue, sz_t bytes);
+
+// Queued media in ms for a socket of the client, also kept for S_DepthMs()
+int_t S_UpdateDepth(S_SendQueue& queue, int_t fd);
+int_t S_DepthMs(const S_SendQueue& queue);
+// Bytes copied here and not sent yet
+sz_t S_PendingBytes(S_SendQueue& queue);
+
+// A keyframe (or the cached GOP) of bytes was just sent
+void S_AddBurst(S_SendQueue& queue, sz_t bytes);
+// Queue depth without what the last burst still explains
+int_t S_BacklogMs(S_SendQueue& queue, int_t depth_ms);
+
+// 0 if fd may send, SEND_BLOCKED over budget, -1 if the client is disconnected
+int_t S_CheckBudget(S_SendQueue& queue, int_t fd);
+
+// Media on the RTSP socket, caller holds socket.send_lock.
+// Return the bytes sent or queued, SEND_BLOCKED if the pending
+// bytes are still there, -1 on error.
+ssz_t S_SendMedia(S_SendQueue& queue,
+                  const s_iovec_t *vec,
+                  sz_t count,
+                  int_t flags,
+                  sz_t &calls);
+
+// RTSP response after the pending media, never blocks either.
+// Caller holds socket.send_lock. Return size, -1 on error or if
+// the queue is full.
+ssz_t S_SendControl(S_SendQueue& queue, const void *data, sz_t size);
+
+// Reactor: the socket is writable, send what is pending.
+// Return -1 if the client is gone.
+int_t S_Drain(S_SendQueue& queue);
@@ -1,8 +1,20 @@
 #pragma once
 
+#include "utils/Platform.h"
+
 enum StreamState {
     IDLE,
     PREPARED,
     RECORD,
     STOPPING
-};
\ No newline at end of file
+};
+
+// Chosen in PLAY and told to the client in RTP-Info: the first packet
+// of the track has seq and rtptime, the stream shifts its timestamps
+// so the first frame it sends gets rtptime
+typedef struct {
+    int_t ssrc;
+    ushort_t seq;
+    uint_t rtptime;
+    tm_t connect_us;    // Client connected, for the time to first frame
+} S_RtpStart;
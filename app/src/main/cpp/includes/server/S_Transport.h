@@ -0,0 +1,51 @@
+#pragma once
+
+#include "server/S_Platform.h"
+#include "server/S_SendQueue.h"
+#include "server/S_Uring.h"
+#include "utils/Configs.h"
+#include "utils/Platform.h"
+
+enum S_TransportType {
+    TRANSPORT_NONE,
+    TRANSPORT_TCP,
+    TRANSPORT_UDP
+};
+
+// Negotiated in SETUP, one per track
+typedef struct {
+    S_TransportType type;
+
+    // TCP: RTP and RTCP are interleaved in the RTSP socket
+    CancellableSocket* socket;
+    byte_t interleave;
+
+    // Max RTP packet size (without TCP prefix)
+    sz_t packet_size;
+
+    // UDP: separate RTP and RTCP sockets, connected to the client ports
+    int_t rtp_socket;
+    int_t rtcp_socket;
+    int_t server_port;
+    int_t client_port;
+    bool_t segmentation;
+
+    // Media not taken by the socket yet, of the client (both tracks)
+    S_SendQueue* queue;
+
+    // UDP: submit ring of the sending thread, nullptr for sendmmsg()
+    S_Uring* uring;
+} S_Transport;
+
+void S_Init(S_Transport& transport);
+void S_SetupTcp(S_Transport& transport,
+                S_SendQueue* queue,
+                byte_t interleave);
+bool_t S_SetupUdp(S_Transport& transport,
+                  S_SendQueue* queue,
+                  int_t client_port);
+// 0 if the client may be sent more media, see S_CheckBudget()
+int_t S_CheckBudget(S_Transport& transport);
+// Re-read the path MTU after EMSGSIZE, return true if packet_size changed
+bool_t S_RefreshMtu(S_Transport& transport);
+void S_Close(S_Transport& transport);
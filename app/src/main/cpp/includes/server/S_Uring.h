@@ -0,0 +1,60 @@
+#pragma once
+
+#include "server/S_Platform.h"
+#include "utils/Configs.h"
+#include "utils/Platform.h"
+
+// One UDP socket per viewer
+#define URING_MAX_FILES RTSP_MAX_CONNECTIONS
+
+// Submission ring of one sending thread (io_uring, kernel 5.1+).
+// A batch of messages goes in as linked SENDMSG entries, in order,
+// with one io_uring_enter(). fd is -1 if the kernel or the seccomp
+// policy doesn't allow io_uring, callers use sendmmsg() then.
+typedef struct {
+    int_t fd;
+    uint_t entries;
+
+    // Shared with the kernel
+    uint_t *sq_head;
+    uint_t *sq_tail;
+    uint_t *sq_mask;
+    uint_t *sq_array;
+    void *sqes;
+    uint_t *cq_head;
+    uint_t *cq_tail;
+    uint_t *cq_mask;
+    void *cqes;
+
+    // Mappings, unmapped by S_Close()
+    void *sq_ring;
+    sz_t sq_ring_size;
+    void *cq_ring;
+    sz_t cq_ring_size;
+    sz_t sqes_size;
+
+    // Registered sockets (5.5+), -1 for a free slot: sends to them skip
+    // the fd lookup and reference counting of every entry
+    int_t files[URING_MAX_FILES];
+    bool_t fixed_files;
+} S_Uring;
+
+void S_Init(S_Uring& uring);
+// At least entries messages per S_SendMessages(), false if unavailable
+bool_t S_Open(S_Uring& uring, uint_t entries);
+bool_t S_IsOpen(const S_Uring& uring);
+void S_Close(S_Uring& uring);
+
+// Sends to fd use the registered file, until S_Unregister().
+// The kernel holds the socket while it is registered.
+// Return false if it can't, sends still work then.
+bool_t S_Register(S_Uring& uring, int_t fd);
+void S_Unregister(S_Uring& uring, int_t fd);
+
+// Same as SendMessages(): return the number of messages sent
+// before the first error, errno is the error
+sz_t S_SendMessages(S_Uring& uring,
+                    int_t fd,
+                    s_mmsghdr_t *messages,
+                    sz_t count,
+                    sz_t &calls);
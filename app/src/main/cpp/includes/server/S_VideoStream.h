@@ -1,41 +1,159 @@
 #pragma once
 
 #include "encoder/E_H265.h"
+#include "server/S_PacketBatch.h"
 #include "server/S_Platform.h"
 #include "server/S_StreamState.h"
+#include "server/S_Transport.h"
+#include "utils/FrameRing.h"
+#include "utils/MediaClock.h"
+#include "utils/PacketHistory.h"
 #include "utils/StreamStats.h"
 
+// Repair packets of one media batch: one per row + one per column
+#define FEC_MAX_PACKETS (RTP_BATCH_MAX_PACKETS / FEC_COLUMNS + FEC_COLUMNS + 1)
+
+// FEC state of a viewer is only allocated when FEC is on
+#define FEC_VIEWER_PACKETS (FEC_ENABLED ? FEC_MAX_PACKETS : 1)
+#define FEC_VIEWER_COLUMNS (FEC_ENABLED ? FEC_COLUMNS : 1)
+
+// MSG_ZEROCOPY batches of a viewer, at most this many vectors
+#define ZEROCOPY_MAX_VECTORS 64
+#define ZEROCOPY_VIEWER_SENDS (RTP_ZEROCOPY ? ZEROCOPY_MAX_INFLIGHT : 1)
+
+// Live viewers are sent in lanes by transport: TCP viewers get large
+// packets, UDP ones datagrams that fit their path. A frame is
+// packetized once per lane, each lane has its own seq.
+#define VIDEO_LANE_TCP 0
+#define VIDEO_LANE_UDP 1
+#define VIDEO_LANES 2
+
 typedef struct {
-    // We need to re-send keyframe in case the client missed it.
-    // So store respective keyframe too.
-    // Double buffers for each frame sizes
-    FrameBuffer<MAX_VIDEO_FRAME_SIZE> keyframe_buffer[2];
-    FrameBuffer<NORMAL_VIDEO_FRAME_SIZE> frame_buffer[2];
+    ushort_t seq;           // Before the viewer offsets
+    sz_t packet_size;       // Smallest of its live viewers
+} S_VideoLane;
 
-    // Socket buffer
-    FrameBuffer<RTP_MAX_PACKET_SIZE> socket_buffer;
+// A batch the kernel may still read from: the frame is retained
+// and the patched headers are kept here until the completion
+typedef struct {
+    SharedFrame* frame;     // nullptr if free
+    uint_t id;
+    byte_t headers[ZEROCOPY_MAX_VECTORS / 2 * RTP_MAX_HEADER_SIZE];
+    s_iovec_t vectors[ZEROCOPY_MAX_VECTORS];
+} S_ZeroCopySend;
 
-    // Stats
-    StreamStats stats;
+struct S_VideoStream;
+
+// One client of the shared video stream. Only what differs between
+// clients lives here: transport, SSRC, seq / timestamp offsets,
+// Sender Report counts, RTX and FEC state.
+typedef struct {
+    S_VideoStream* stream;
 
     // Socket data
-    CancellableSocket* socket;
-    tm_t last_time_us;
+    S_Transport transport;
     int_t ssrc;
-    uint_t last_rtp_ts;
-    byte_t interleave;
+    bool_t failed; // Send failed, skipped until stopped
+
+    // Viewer seq = lane seq + seq_offset, from the first live packet.
+    // Viewer timestamp = stream timestamp + ts_offset, from the first frame
+    // sent, which gets start_rtp_ts (RTP-Info).
+    ushort_t seq_offset;
+    uint_t ts_offset;
+    uint_t start_rtp_ts;
+    bool_t ts_set;
+    ushort_t next_seq;  // Before live: own numbering of the cached GOP
+    ushort_t live_seq;  // Lane seq of the first live packet
+    bool_t live;
+    bool_t behind;      // Over SEND_BUDGET_MS, skips to the next keyframe
 
-    // Report data
-    tm_t last_report_sec;
+    // Thinning (see THIN_NON_REFERENCE_MS), the frame being sent
+    // is not delivered to this viewer and its seq goes on without a gap
+    bool_t thinned;
+    int_t max_temporal_id;  // Sub-layers above are dropped until an IRAP / TSA
+
+    // Session starts with the cached GOP or a keyframe
+    bool_t wait_start;
+    bool_t wait_keyframe;
+    tm_t last_time_us;
+    tm_t play_us;       // Session start, for time to first picture
+    tm_t connect_us;    // Client connected
+
+    // Report data, the Sender Report is sent after each frame when due
+    PacketBatch<1> report;
+    tm_t next_report_us;
     uint_t packet_count;
     uint_t octet_count;
+    int_t loss_percent;  // Last receiver report, -1 before, for the rate control (reactor only)
+
+    // RFC 4588, answered from the stream history
+    int_t rtx_ssrc;
+    ushort_t rtx_seq;
+
+    // FlexFEC (UDP): the parity covers the patched packets of this viewer,
+    // see S_VideoStream for the layout
+    FecGroup fec_row;
+    FecGroup fec_columns[FEC_VIEWER_COLUMNS];
+    sz_t fec_index;
+    PacketBatch<FEC_VIEWER_PACKETS> fec_batch;
+    byte_t fec_packets[FEC_VIEWER_PACKETS][RTP_FEC_MAX_HEADER_SIZE + FEC_MAX_PAYLOAD];
+    RtpHeader fec_header;
+    int_t fec_ssrc;
+    ushort_t fec_seq;
 
-    // Double buffer synchronization
-    lock_t frame_mutex;
-    cond_t frame_condition;
-    int_t frame_ready[2];
-    a_int_t write_idx;
-    a_int_t read_idx;
+    // MSG_ZEROCOPY (TCP), completions are read by the streaming thread,
+    // after S_Stop() by the RTSP thread
+    S_ZeroCopySend zc_sends[ZEROCOPY_VIEWER_SENDS];
+
+    // Status
+    a_int_t state;
+} S_VideoViewer;
+
+// Each frame is NAL-scanned and packetized once per lane of viewers.
+// Every viewer of a lane gets the same batch, only the header fields in
+// S_VideoViewer are patched before it is sent.
+struct S_VideoStream {
+    // Frames shared with the encoder (no copy), in order.
+    // On overflow, frames are dropped until the next keyframe.
+    FrameRing<VIDEO_FRAME_RING_SIZE> ring;
+    bool_t skip_to_keyframe; // Encoder thread
+
+    // Socket buffer, only headers are written here.
+    // Payload is sent straight from the frame buffer.
+    // A whole frame goes out in one sendmsg() per viewer.
+    PacketBatch<RTP_BATCH_MAX_PACKETS> batch;
+    S_VideoLane lanes[VIDEO_LANES];
+    sz_t lane;              // Being sent
+    SharedFrame* frame;     // Being sent, retained by MSG_ZEROCOPY sends
+
+    // Sent packets (UDP), in UDP lane seq, answered again on NACK (RFC 4588)
+    PacketHistory<RTX_HISTORY_PACKETS, RTX_HISTORY_SIZE> history;
+
+    // FlexFEC: one packet of a viewer, gathered for the parity
+    byte_t fec_packet[RTP_FIXED_HEADER_SIZE + FEC_MAX_PAYLOAD];
+
+    // RTP_IO_URING: UDP viewers are sent through this ring,
+    // under viewers_lock
+    S_Uring uring;
+
+    // Stats, of all viewers
+    StreamStats stats;
+
+    // Stream data, timestamp before the viewer offsets
+    tm_t last_time_us;
+    RtpHeader rtp_header;
+    MediaClock clock;
+
+    // Viewers in RECORD, the streaming thread sends under viewers_lock
+    S_VideoViewer* viewers[RTSP_MAX_CONNECTIONS];
+    sz_t viewer_count;
+    lock_t viewers_lock;
+
+    // Viewers in PREPARED or RECORD, the first one adds the encoder
+    // listener and the first one in RECORD starts the thread
+    sz_t prepared;
+    sz_t recording;
+    lock_t lock;
 
     // Threading
     thread_t thread;
@@ -45,13 +163,19 @@ typedef struct {
 
     // Encoder
     E_H265* encoder;
-} S_VideoStream;
+};
 
 void S_Init(S_VideoStream& stream, E_H265* encoder);
-void S_Prepare(S_VideoStream& stream);
-void S_Start(S_VideoStream& stream,
-             CancellableSocket* socket,
-             byte_t interleave,
-             int_t ssrc);
-void S_Stop(S_VideoStream& stream);
-bool_t S_IsRunning(const S_VideoStream& stream);
+
+void S_Init(S_VideoViewer& viewer, S_VideoStream* stream);
+void S_Prepare(S_VideoViewer& viewer);
+void S_Start(S_VideoViewer& viewer,
+             const S_Transport& transport,
+             const S_RtpStart& start);
+void S_Stop(S_VideoViewer& viewer);
+// After S_Stop(): free the MSG_ZEROCOPY sends the kernel is done with.
+// Return true while some are left, the socket must stay open until then.
+bool_t S_ReapZeroCopy(S_VideoViewer& viewer);
+bool_t S_IsRunning(const S_VideoViewer& viewer);
+// Compound RTCP packet from the client, called from the RTSP thread
+void S_HandleRtcp(S_VideoViewer& viewer, const byte_t *data, sz_t size);
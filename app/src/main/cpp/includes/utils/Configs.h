@@ -8,7 +8,7 @@
 #define SIZE_PER_SAMPLE (sizeof(int16_t) * AUDIO_CHANNEL_COUNT)
 #define MAX_AUDIO_RECORD_SIZE (MAX_AUDIO_RECORD_SAMPLE * SIZE_PER_SAMPLE)
 #define MAX_AUDIO_LISTENER 2 // 1 for encoder, 1 for reader
-#define MAX_AAC_LISTENER 1
+#define MAX_AAC_LISTENER (RTSP_MAX_CONNECTIONS + 2) // 1 audio stream per client + HLS + recorder
 
 // Video record config
 #define VIDEO_WIDTH 1280
@@ -17,7 +17,7 @@
 #define VIDEO_MIN_FRAME_RATE 15     // Query camera_id supported frame rate
 #define CAMERA_ID "0"
 #define MAX_VIDEO_LISTENER 2 // 1 for encoder, 1 for reader
-#define MAX_H265_LISTENER 1
+#define MAX_H265_LISTENER 3 // Shared RTSP video stream + HLS + recorder
 #define IMAGE_READER_CACHE_SIZE 1
 
 // Audio encoder config
@@ -32,6 +32,8 @@
 #define VIDEO_CODEC_PROFILE 1
 #define VIDEO_CODEC_LEVEL 2097152
 #define H265_PARAMS_SIZE 64
+#define H265_CONFIG_SIZE 256 // VPS + SPS + PPS as given by the codec (Annex B)
+#define GOP_CACHE_MAX_FRAMES (VIDEO_DEFAULT_FRAME_RATE * VIDEO_IFRAME_INTERVAL + 2) // Longer GOPs aren't cached
 
 // Buffer config
 #define MAX_AUDIO_FRAME_SIZE 512      // NORMAL_AUDIO_FRAME_SIZE x 2
@@ -39,16 +41,129 @@
 #define MAX_VIDEO_FRAME_SIZE 128000   // Keyframe: normal frame x 4)
 #define NORMAL_VIDEO_FRAME_SIZE 32000 // Normal frame: 3Mbps / 15 frames per second / 8 bits per byte
 
+// Frame rings between encoder and stream threads, power of 2
+#define VIDEO_FRAME_RING_SIZE 8
+#define AUDIO_FRAME_RING_SIZE 16
+
+// Shared frame pools, a frame is held by the encoder while listeners run,
+// then by the GOP cache and each stream (frame ring, frame being sent, pending AUs)
+#define VIDEO_FRAME_POOL_SIZE (VIDEO_FRAME_RING_SIZE + GOP_CACHE_MAX_FRAMES + 4 + \
+                               (HLS_ENABLED ? VIDEO_FRAME_RING_SIZE + HLS_WINDOW_VIDEO_FRAMES : 0) + \
+                               (RECORD_ENABLED ? VIDEO_FRAME_RING_SIZE + RECORD_PREROLL_VIDEO_FRAMES : 0)) // NORMAL_VIDEO_FRAME_SIZE frames
+#define VIDEO_KEYFRAME_POOL_SIZE (4 + (HLS_ENABLED ? HLS_WINDOW_SEGMENTS + 2 : 0) + \
+                                  (RECORD_ENABLED ? RECORD_PREROLL_GOPS + 1 : 0)) // MAX_VIDEO_FRAME_SIZE frames, used when a frame is larger
+#define AUDIO_FRAME_POOL_SIZE (MAX_AUDIO_FRAME_QUEUE_SIZE + (AUDIO_FRAME_RING_SIZE + AAC_MAX_AUS_PER_PACKET) * RTSP_MAX_CONNECTIONS + 4 + \
+                               (HLS_ENABLED ? AUDIO_FRAME_RING_SIZE + HLS_WINDOW_AUDIO_FRAMES : 0) + \
+                               (RECORD_ENABLED ? AUDIO_FRAME_RING_SIZE + RECORD_PREROLL_AUDIO_FRAMES : 0))
+
 // RTSP Config
 #define RTSP_PORT 8554
-#define RTSP_MAX_CONNECTIONS 1
+#define RTSP_MAX_CONNECTIONS 8
 #define RTSP_VIDEO_INTERLEAVE 0
 #define RTSP_AUDIO_INTERLEAVE 2
+#define RTP_UDP_PORT_BASE 50000 // RTP/RTCP port pairs for UDP transport
+#define RTP_UDP_PORT_RANGE 100
+
+// Client send budget: media queued for one client (kernel + user space).
+// Over it, SEND_POLICY_SKIP drops frames for this client (video resumes at
+// the next keyframe), SEND_POLICY_DISCONNECT closes the client.
+#define SEND_POLICY_SKIP 0
+#define SEND_POLICY_DISCONNECT 1
+#define SEND_POLICY SEND_POLICY_SKIP
+#define SEND_BUDGET_MS 500
+#define SEND_QUEUE_SIZE ((VIDEO_BIT_RATE + AUDIO_BIT_RATE) / 8 * SEND_BUDGET_MS / 1000 + \
+                         MAX_VIDEO_FRAME_SIZE + RTP_TCP_PACKET_SIZE) // Budget + one frame
+#define RTSP_NOTSENT_LOWAT 16384   // Unsent bytes the kernel takes, more waits in the send queue
+
+// Video thinning before the budget is reached, by client queue depth:
+// non-reference pictures go first, then pictures above temporal layer 0.
+// Over SEND_BUDGET_MS the client skips to the next IRAP.
+#define THIN_NON_REFERENCE_MS (SEND_BUDGET_MS / 4)
+#define THIN_TEMPORAL_MS (SEND_BUDGET_MS / 2)
+#define THIN_REQUEST_IRAP 1 // Ask the encoder for an IRAP when a client skips to one
+
+// Rate control: the video bit rate follows the slowest client,
+// sampled by the RTSP thread (TCP_INFO, queue depth, RTCP reports)
+#define RATE_CONTROL_ENABLED true
+#define RATE_CONTROL_INTERVAL_MS 500
+#define RATE_MIN_BIT_RATE 250000
+#define RATE_MAX_BIT_RATE VIDEO_BIT_RATE
+#define RATE_CONGESTED_MS (THIN_NON_REFERENCE_MS / 2) // Queue depth past the last keyframe, or RTT growth, that lowers the rate
+#define RATE_CLEAR_MS (RATE_CONGESTED_MS / 4)         // Under it the rate may go up
+#define RATE_LOSS_HIGH 10        // % lost that lowers the rate
+#define RATE_LOSS_LOW 2          // % lost under which the rate may go up
+#define RATE_DECREASE 85         // % of the rate kept when congested
+#define RATE_INCREASE 8          // % added after RATE_INCREASE_SAMPLES clear samples
+#define RATE_INCREASE_SAMPLES 6  // Hysteresis, 3 s without congestion
 
 // RTP config
-#define RTP_MAX_PACKET_SIZE 1024
+// RTP packet size is chosen per session from the transport
+#define RTP_TCP_PACKET_SIZE 16384  // Interleaved '$' length is 16 bits, max 65535
+#define RTP_UDP_DEFAULT_MTU 1500   // Path MTU is learned with IP_MTU_DISCOVER
+#define RTP_UDP_MIN_MTU 576
+#define RTP_UDP_MTU_DISCOVERY true
+#define RTP_BATCH_MAX_PACKETS 256  // Packets per sendmsg(), keyframe at UDP packet size fits in 1 call
+#define RTP_ZEROCOPY false         // MSG_ZEROCOPY for large TCP video batches (keyframes)
+#define RTP_IO_URING false         // Video UDP batches through io_uring, sendmmsg() if unavailable
+#define ZEROCOPY_MIN_BYTES 32768   // Smaller batches are cheaper to copy than to track
+#define ZEROCOPY_MAX_INFLIGHT 4    // Batches per viewer the kernel may still hold
+#define ZEROCOPY_CLOSE_TIMEOUT_MS 5000 // A closing client that doesn't ack them is reset
+#define AAC_MAX_AUS_PER_PACKET 8   // Upper bound of AUs in one RTP packet
+#define AAC_MAX_PACKET_LATENCY_MS 50 // Added latency for grouping AUs, 0 = one AU per packet
 #define AAC_PAYLOAD_TYPE 96
 #define H265_PAYLOAD_TYPE 97
+#define RTX_PAYLOAD_TYPE 98       // RFC 4588 retransmission of H265, UDP only
+#define RTX_HISTORY_MS 1000       // Retransmit packets sent in this window
+#define RTX_HISTORY_PACKETS 1024  // Power of 2, > packets sent in RTX_HISTORY_MS
+#define RTX_HISTORY_SIZE (VIDEO_BIT_RATE / 8 * RTX_HISTORY_MS / 1000 * 2) // 2x for keyframes
+#define FEC_ENABLED false         // FlexFEC (RFC 8627) repair packets for H265, UDP only
+#define FEC_PAYLOAD_TYPE 99
+#define FEC_COLUMNS 10            // L: packets per row, one repair packet each row
+#define FEC_ROWS 0                // D: rows per block, > 1 adds one repair packet per column
+#define FEC_REPAIR_WINDOW_MS 200
+
+// HTTP output: LL-HLS with CMAF (fragmented MP4) parts. Parts are muxed
+// once and only hold boxes, the samples are sent to every HTTP client
+// straight from the encoder frames, which the window keeps retained.
+#define HLS_ENABLED false
+#define HTTP_PORT 8080
+#define HTTP_MAX_CONNECTIONS 16
+#define HLS_PART_TARGET_MS 200      // Parts end before a frame would make them longer
+#define HLS_SEGMENT_MIN_MS (VIDEO_IFRAME_INTERVAL * 1000 / 2) // Segments start at the first IDR after it
+#define HLS_MAX_PARTS 10            // Per segment, then it ends without an IDR (sets the target duration)
+#define HLS_WINDOW_SEGMENTS 4       // Complete segments in the playlist
+#define HLS_BLOCK_TIMEOUT_MS 3000   // Blocking playlist reload / preload hint, then 503
+// Frames the window may hold, older segments leave it early past that
+#define HLS_WINDOW_MS ((HLS_WINDOW_SEGMENTS + 1) * VIDEO_IFRAME_INTERVAL * 1000 + HLS_PART_TARGET_MS)
+#define HLS_WINDOW_VIDEO_FRAMES (HLS_WINDOW_MS * VIDEO_DEFAULT_FRAME_RATE / 1000)
+#define HLS_WINDOW_AUDIO_FRAMES (HLS_WINDOW_MS * AUDIO_SAMPLE_RATE / 1024 / 1000)
+
+// Local recording: fragmented MP4 files that start on an IDR, in a ring of
+// RECORD_FILE_COUNT preallocated files (the oldest is overwritten).
+// Fragments are copied into aligned batches, a writer thread writes them.
+#define RECORD_ENABLED false
+#define RECORD_CONTINUOUS false     // Else files are written from S_SetRecording()
+// The host tests set their own directory, ring and file length
+#ifndef RECORD_DIR
+#define RECORD_DIR "/data/data/com.pntt3011.cameraserver/files/records"
+#endif
+#ifndef RECORD_FILE_COUNT
+#define RECORD_FILE_COUNT 30
+#endif
+#ifndef RECORD_SEGMENT_S
+#define RECORD_SEGMENT_S 60         // A file ends at the first IDR after it
+#endif
+#define RECORD_FILE_SIZE ((VIDEO_BIT_RATE + AUDIO_BIT_RATE) / 8 * RECORD_SEGMENT_S * 5 / 4) // Preallocated, ends at an IDR past 3/4
+#define RECORD_FRAGMENT_MS 1000     // moof + mdat, an IDR starts a new one
+#define RECORD_PREROLL_MS 3000      // Kept while not recording, from an IDR
+#define RECORD_ALIGN 4096
+#define RECORD_BATCH_SIZE (512 * 1024) // One pwrite(), multiple of RECORD_ALIGN
+#define RECORD_BATCHES 8            // Writer queue, fragments are dropped when it is full
+#define RECORD_SYNC_MS 2000         // Written and synced at least this often
+// Frames the pre-roll may hold: RECORD_PREROLL_MS from the IDR before it
+#define RECORD_PREROLL_GOPS (RECORD_PREROLL_MS / (VIDEO_IFRAME_INTERVAL * 1000) + 2)
+#define RECORD_PREROLL_VIDEO_FRAMES (RECORD_PREROLL_GOPS * VIDEO_IFRAME_INTERVAL * VIDEO_DEFAULT_FRAME_RATE)
+#define RECORD_PREROLL_AUDIO_FRAMES (RECORD_PREROLL_GOPS * VIDEO_IFRAME_INTERVAL * AUDIO_SAMPLE_RATE / 1024)
 
 // Stats config
 #define STATS_LOG_INTERVAL 10000
\ No newline at end of file
@@ -0,0 +1,24 @@
+#pragma once
+
+#include "utils/Configs.h"
+#include "utils/Platform.h"
+
+// FlexFEC (RFC 8627) parity of one group of RTP packets
+// Recovery fields: first 2 bytes of RTP header, payload length, timestamp
+#define FEC_RECOVERY_SIZE 8
+#define FEC_MAX_PAYLOAD 1500
+
+typedef struct {
+    byte_t recovery[FEC_RECOVERY_SIZE];
+    byte_t payload[FEC_MAX_PAYLOAD];
+    sz_t size;      // Longest protected payload
+    sz_t count;     // Protected packets
+    ushort_t base;  // Seq of the first protected packet
+} FecGroup;
+
+void Init(FecGroup& group);
+void Reset(FecGroup& group);
+
+// XOR one RTP packet (without TCP prefix) into the group
+// Return false if the packet is too large
+bool_t Protect(FecGroup& group, const byte_t *packet, sz_t size);
@@ -0,0 +1,76 @@
+#pragma once
+
+#include "Platform.h"
+
+// Encoded frame shared by the encoder and all of its listeners.
+// The encoder fills it once, listeners Retain() what they keep
+// and Release() it when done. It goes back to the pool at 0 refs.
+typedef struct {
+    byte_t *data;
+    sz_t capacity;
+    sz_t size;
+    tm_t timeUs;
+    int_t flags;
+    a_int_t refs;
+    a_int_t copies; // Times data was written, 1 per frame
+} SharedFrame;
+
+template <sz_t POOL_SIZE, sz_t CAPACITY>
+struct FramePool {
+    SharedFrame frames[POOL_SIZE];
+    byte_t data[POOL_SIZE][CAPACITY];
+};
+
+template <sz_t POOL_SIZE, sz_t CAPACITY>
+void Init(FramePool<POOL_SIZE, CAPACITY> &pool) {
+    for (sz_t i = 0; i < POOL_SIZE; ++i) {
+        pool.frames[i].data = pool.data[i];
+        pool.frames[i].capacity = CAPACITY;
+        pool.frames[i].size = 0;
+        pool.frames[i].timeUs = 0;
+        pool.frames[i].flags = 0;
+        Reset(&pool.frames[i].refs);
+        Reset(&pool.frames[i].copies);
+    }
+}
+
+// Free frame with 1 ref, nullptr if all frames are still in use
+template <sz_t POOL_SIZE, sz_t CAPACITY>
+SharedFrame *Acquire(FramePool<POOL_SIZE, CAPACITY> &pool, sz_t size) {
+    if (size > CAPACITY) {
+        return nullptr;
+    }
+
+    for (sz_t i = 0; i < POOL_SIZE; ++i) {
+        if (CompareAndSet(&pool.frames[i].refs, 0, 1)) {
+            Store(&pool.frames[i].copies, 0);
+            return &pool.frames[i];
+        }
+    }
+    return nullptr;
+}
+
+static inline void Retain(SharedFrame *frame) {
+    if (frame) {
+        Add(&frame->refs, 1);
+    }
+}
+
+static inline void Release(SharedFrame *frame) {
+    if (frame) {
+        Add(&frame->refs, -1);
+    }
+}
+
+// The only copy of the frame data
+static inline void Fill(SharedFrame *frame,
+                        const byte_t *data,
+                        sz_t size,
+                        tm_t timeUs,
+                        int_t flags) {
+    Copy(frame->data, data, size);
+    frame->size = size;
+    frame->timeUs = timeUs;
+    frame->flags = flags;
+    Add(&frame->copies, 1);
+}
@@ -0,0 +1,124 @@
+#pragma once
+
+#include "utils/FramePool.h"
+#include "utils/Platform.h"
+
+// Consumer sleeps at most this long, so it can see a stop request
+#define FRAME_RING_WAIT_US 100000
+
+// Single producer (encoder thread), single consumer (stream thread).
+// head and tail only grow, slot = index % CAPACITY.
+// The producer may also drop the oldest frame, so head moves with CAS.
+template <sz_t CAPACITY>
+struct FrameRing {
+    static_assert((CAPACITY & (CAPACITY - 1)) == 0, "CAPACITY must be a power of 2");
+
+    SharedFrame *slots[CAPACITY];
+    a_int_t head;     // Next to read, consumer
+    a_int_t tail;     // Next to write, producer
+    a_int_t waiting;  // Futex word, 1 while the consumer sleeps on empty
+};
+
+template <sz_t CAPACITY>
+void Init(FrameRing<CAPACITY> &ring) {
+    Reset(ring.slots, sizeof(ring.slots));
+    Reset(&ring.head);
+    Reset(&ring.tail);
+    Reset(&ring.waiting);
+}
+
+template <sz_t CAPACITY>
+sz_t Count(FrameRing<CAPACITY> &ring) {
+    return (uint_t)SyncAndGet(&ring.tail) - (uint_t)SyncAndGet(&ring.head);
+}
+
+template <sz_t CAPACITY>
+bool_t Empty(FrameRing<CAPACITY> &ring) {
+    return Count(ring) == 0;
+}
+
+template <sz_t CAPACITY>
+bool_t Full(FrameRing<CAPACITY> &ring) {
+    return Count(ring) >= CAPACITY;
+}
+
+// Producer: the ring takes over the caller's reference.
+// The consumer is only woken on empty -> non-empty (it sleeps on empty).
+template <sz_t CAPACITY>
+bool_t Push(FrameRing<CAPACITY> &ring, SharedFrame *frame) {
+    int_t tail = Load(&ring.tail);
+
+    if ((uint_t)tail - (uint_t)SyncAndGet(&ring.head) >= CAPACITY) {
+        return false;
+    }
+    ring.slots[(uint_t)tail % CAPACITY] = frame;
+    // Sequentially consistent with waiting, see Sleep()
+    Store(&ring.tail, tail + 1);
+
+    if (GetAndSet(&ring.waiting, 0) == 1) {
+        Wake(&ring.waiting);
+    }
+    return true;
+}
+
+// Consumer: nullptr if empty, the caller owns the returned reference
+template <sz_t CAPACITY>
+SharedFrame *Pop(FrameRing<CAPACITY> &ring) {
+    SharedFrame *frame;
+    int_t head;
+
+    while (true) {
+        head = Load(&ring.head);
+        if (head == SyncAndGet(&ring.tail)) {
+            return nullptr;
+        }
+        // Read before CAS, the slot is reused right after head moves
+        frame = ring.slots[(uint_t)head % CAPACITY];
+        if (CompareAndSet(&ring.head, head, head + 1)) {
+            return frame;
+        }
+    }
+}
+
+// Producer: take the oldest frame out, nullptr if the consumer was faster
+template <sz_t CAPACITY>
+SharedFrame *DropOldest(FrameRing<CAPACITY> &ring) {
+    SharedFrame *frame;
+    int_t head = SyncAndGet(&ring.head);
+
+    if (head == SyncAndGet(&ring.tail)) {
+        return nullptr;
+    }
+    frame = ring.slots[(uint_t)head % CAPACITY];
+    if (CompareAndSet(&ring.head, head, head + 1)) {
+        return frame;
+    }
+    return nullptr;
+}
+
+// Consumer: sleep until a frame is pushed, Wake() or FRAME_RING_WAIT_US
+template <sz_t CAPACITY>
+void Sleep(FrameRing<CAPACITY> &ring) {
+    // Either the producer sees waiting = 1, or we see its frame
+    Store(&ring.waiting, 1);
+    if (Load(&ring.head) == Load(&ring.tail)) {
+        Sleep(&ring.waiting, 1, FRAME_RING_WAIT_US);
+    }
+    Store(&ring.waiting, 0);
+}
+
+// Wake the consumer, e.g. to stop
+template <sz_t CAPACITY>
+void Wake(FrameRing<CAPACITY> &ring) {
+    Store(&ring.waiting, 0);
+    Wake(&ring.waiting);
+}
+
+// Consumer side (or when no thread uses the ring): release all frames
+template <sz_t CAPACITY>
+void Drain(FrameRing<CAPACITY> &ring) {
+    SharedFrame *frame;
+    while ((frame = Pop(ring)) != nullptr) {
+        Release(frame);
+    }
+}
@@ -0,0 +1,25 @@
+#pragma once
+
+#include "utils/Platform.h"
+
+// RTP clock of one stream, on the same monotonic base as NowMicros().
+// RTP timestamps are computed from a fixed origin, never from the
+// previous frame, so rounding never accumulates.
+typedef struct {
+    tm_t origin_us;
+    uint_t rtp_origin;
+    uint_t rate;
+} MediaClock;
+
+// Origin is now, rtp_origin should be random (RFC 3550)
+void Init(MediaClock& clock, uint_t rate, uint_t rtp_origin);
+
+// RTP timestamp of a frame captured at time_us
+uint_t RtpTimestamp(const MediaClock& clock, tm_t time_us);
+
+// RTP timestamp of this instant, paired with the NTP time in Sender Reports
+uint_t RtpNow(const MediaClock& clock);
+
+// Delay until the next RTCP report (RFC 3550 6.3), we are the only sender
+// and the client the only receiver
+tm_t ReportIntervalUs(sz_t session_bit_rate, sz_t avg_report_size, bool_t initial);
@@ -0,0 +1,69 @@
+#pragma once
+
+#include "utils/Configs.h"
+#include "utils/Utils.h"
+
+// CMAF (ISO/IEC 23000-19) fragmented MP4: one init segment (ftyp + moov),
+// then moof + mdat fragments. Only box headers are written here,
+// the samples follow the mdat header in the order of the runs.
+
+#define MP4_VIDEO_TRACK 1
+#define MP4_AUDIO_TRACK 2
+#define MP4_AAC_FRAME_SAMPLES 1024
+
+// mdat box header, the samples follow it
+#define MP4_MDAT_HEADER_SIZE 8
+
+// HEVC samples: 4 bytes NAL length before each NAL instead of the start code
+#define MP4_NAL_LENGTH_SIZE 4
+
+typedef struct {
+    uint_t duration;    // Track timescale
+    uint_t size;
+    bool_t sync;
+} Mp4Sample;
+
+// Samples of one track in a fragment (one traf)
+typedef struct {
+    uint_t track_id;
+    tm_t base_time;     // Decode time of the first sample (tfdt), track timescale
+    const Mp4Sample *samples;
+    sz_t count;
+} Mp4Run;
+
+// Init segment of HEVC video ('hvc1', parameter sets only in hvcC)
+// and, if audio, AAC-LC at AUDIO_SAMPLE_RATE / AUDIO_CHANNEL_COUNT.
+// config holds the VPS, SPS and PPS with start codes, as given by the codec.
+// Return the size, -1 if a parameter set is missing or dst is too small.
+int_t WriteMp4Init(const byte_t *config,
+                   sz_t config_size,
+                   bool_t audio,
+                   byte_t *dst,
+                   sz_t size);
+
+// moof (one traf per run) + mdat header, the mdat payload is data_size
+// bytes: the samples of runs[0], then runs[1] ...
+// Return the size, -1 if dst is too small.
+int_t WriteMp4Fragment(uint_t sequence,
+                       const Mp4Run *runs,
+                       sz_t count,
+                       sz_t data_size,
+                       byte_t *dst,
+                       sz_t size);
+
+// NAL units of an Annex B access unit that go into its sample, parameter
+// sets and access unit delimiters are left out. sample_size counts a NAL
+// length for each. Return the count written to nals, max if it was cut.
+sz_t ScanMp4Sample(const byte_t *data, sz_t size, NalUnit *nals, sz_t max, uint_t &sample_size);
+
+// Video track timescale is VIDEO_SAMPLE_RATE, audio is AUDIO_SAMPLE_RATE
+static inline tm_t Mp4Time(tm_t time_us, uint_t timescale) {
+    return time_us * timescale / 1000000;
+}
+
+static inline void WriteNalLength(byte_t *dst, uint_t length) {
+    dst[0] = (length >> 24) & 0xFF;
+    dst[1] = (length >> 16) & 0xFF;
+    dst[2] = (length >> 8) & 0xFF;
+    dst[3] = length & 0xFF;
+}
@@ -0,0 +1,94 @@
+#pragma once
+
+#include "Platform.h"
+
+// One sent packet, bytes are in the history ring at pos % BYTES
+typedef struct {
+    tm_t pos;
+    sz_t size;
+    tm_t time_us;
+    ushort_t seq;
+    bool_t use;
+} PacketHistoryEntry;
+
+// Last sent packets for retransmission, indexed by sequence number.
+// Packets are copied into a fixed ring of bytes, the oldest ones are
+// overwritten, nothing is allocated after Init.
+template <sz_t SLOTS, sz_t BYTES>
+struct PacketHistory {
+    byte_t data[BYTES];
+    PacketHistoryEntry entries[SLOTS];
+    tm_t write_pos; // Total bytes written, never wraps
+    tm_t window_us;
+    lock_t lock;
+};
+
+template <sz_t SLOTS, sz_t BYTES>
+void Init(PacketHistory<SLOTS, BYTES> &history) {
+    Init(&history.lock);
+}
+
+template <sz_t SLOTS, sz_t BYTES>
+void Reset(PacketHistory<SLOTS, BYTES> &history, tm_t window_us) {
+    Lock(&history.lock);
+    Reset(history.entries, sizeof(history.entries));
+    history.write_pos = 0;
+    history.window_us = window_us;
+    Unlock(&history.lock);
+}
+
+// Space for a packet of size bytes, caller copies the packet into it.
+// Must be called with the lock held.
+template <sz_t SLOTS, sz_t BYTES>
+byte_t *Reserve(PacketHistory<SLOTS, BYTES> &history,
+                ushort_t seq,
+                sz_t size,
+                tm_t time_us) {
+
+    PacketHistoryEntry *entry;
+    sz_t offset;
+
+    if (size > BYTES) {
+        return nullptr;
+    }
+
+    // Packets are contiguous, skip the end of the ring if it doesn't fit
+    offset = history.write_pos % BYTES;
+    if (offset + size > BYTES) {
+        history.write_pos += BYTES - offset;
+        offset = 0;
+    }
+
+    entry = &history.entries[seq % SLOTS];
+    entry->pos = history.write_pos;
+    entry->size = size;
+    entry->time_us = time_us;
+    entry->seq = seq;
+    entry->use = true;
+
+    history.write_pos += size;
+    return history.data + offset;
+}
+
+// Packet seq if it is still in the window and not overwritten, nullptr otherwise.
+// Must be called with the lock held, the data is valid until Unlock.
+template <sz_t SLOTS, sz_t BYTES>
+const byte_t *Find(const PacketHistory<SLOTS, BYTES> &history,
+                   ushort_t seq,
+                   tm_t now_us,
+                   sz_t &size,
+                   tm_t &time_us) {
+
+    const PacketHistoryEntry &entry = history.entries[seq % SLOTS];
+
+    if (!entry.use ||
+        entry.seq != seq ||
+        history.write_pos - entry.pos > BYTES ||
+        now_us - entry.time_us > history.window_us) {
+        return nullptr;
+    }
+
+    size = entry.size;
+    time_us = entry.time_us;
+    return history.data + entry.pos % BYTES;
+}
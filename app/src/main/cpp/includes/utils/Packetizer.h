@@ -1,16 +1,72 @@
 #pragma once
 
 #include "utils/Configs.h"
-#include "utils/FrameBuffer.h"
+#include "utils/Fec.h"
+#include "utils/FramePool.h"
 #include "utils/Utils.h"
 
+// Video: TCP prefix (4) + RTP header (12) + H265 FU headers (3).
+// AAC headers grow with the AUs (RTP_AAC_HEADER_SIZE + 2 each, 34 for 8),
+// an audio packet is alone in its batch and can use all its header space.
+#define RTP_MAX_HEADER_SIZE 20
+
+// Aggregation Packet: TCP prefix (4) + RTP header (12) + payload header (2),
+// then NAL size (2) before each NAL (no DONL)
+#define RTP_AP_HEADER_SIZE 18
+#define RTP_AP_NAL_HEADER_SIZE 2
+
+// AAC: TCP prefix (4) + RTP header (12) + AU headers length (2),
+// then AU header (2) for each AU
+#define RTP_AAC_HEADER_SIZE 18
+#define RTP_AAC_AU_HEADER_SIZE 2
+
+// TCP prefix (4) + RTCP Sender Report (28)
+#define RTCP_REPORT_SIZE 32
+
+// TCP prefix (4) + RTP header (12)
+#define RTP_FIXED_HEADER_SIZE 16
+
+// Constant part of every RTP packet of a stream (interleave channel,
+// version, payload type, SSRC), filled once when the stream starts.
+// Only length, marker, seq and timestamp are patched per packet.
+typedef struct {
+    byte_t bytes[RTP_FIXED_HEADER_SIZE];
+} RtpHeader;
+
+void Init(RtpHeader &header, byte_t interleave, byte_t payload_type, sz_t ssrc);
+
 int_t RtpPayloadStart();
 
+// Rewrite the per-client fields (interleave channel, seq, timestamp, SSRC)
+// of a packet (with TCP prefix), so one packetized frame serves every client
+void PatchRtpHeader(byte_t *dst,
+                    byte_t interleave,
+                    ushort_t seq,
+                    sz_t timestamp,
+                    uint_t ssrc);
+
+// Header-only mode: only the headers are written to dst (RTP_MAX_HEADER_SIZE),
+// payload points to the NAL data inside src, so it can be sent without copying.
+// max_packet_size is the RTP packet size, without the TCP prefix.
+int_t PacketizeH265Header(
+        const RtpHeader &header,
+        ushort_t seq,
+        sz_t timestamp,
+
+        const byte_t *src,
+        sz_t src_size,
+        sz_t &src_offset,
+        const NalUnit& src_nal,
+        sz_t max_packet_size,
+
+        byte_t *dst,
+        const byte_t *&payload,
+        sz_t &payload_size);
+
 int_t PacketizeH265(
-        byte_t interleave,
+        const RtpHeader &header,
         ushort_t seq,
         sz_t timestamp,
-        sz_t ssrc,
 
         const byte_t *src,
         sz_t src_size,
@@ -20,18 +76,82 @@ int_t PacketizeH265(
         byte_t *dst,
         sz_t dst_size);
 
+// Number of NALs from nals[0] that fit together in one Aggregation Packet,
+// less than 2 means aggregation is not worth it.
+sz_t CountH265Aggregation(
+        const NalUnit *nals,
+        sz_t count,
+        sz_t max_packet_size);
+
+// Aggregation Packet headers (RTP_AP_HEADER_SIZE), followed by
+// PacketizeH265AggregationUnit() for each NAL.
+// Marker is set if last, the AP ends the access unit.
+int_t PacketizeH265AggregationHeader(
+        const RtpHeader &header,
+        ushort_t seq,
+        sz_t timestamp,
+
+        const byte_t *src,
+        const NalUnit *nals,
+        sz_t count,
+        bool_t last,
+
+        byte_t *dst);
+
+// NAL size (RTP_AP_NAL_HEADER_SIZE), payload points to the NAL inside src
+int_t PacketizeH265AggregationUnit(
+        const byte_t *src,
+        const NalUnit& src_nal,
+
+        byte_t *dst,
+        const byte_t *&payload,
+        sz_t &payload_size);
+
+// RTP packet size (without TCP prefix) of count AUs in one packet
+sz_t AACPacketSize(const SharedFrame *const *src, sz_t count);
+
+// Header-only mode: count AUs in one packet (RFC 3640 AAC-hbr),
+// header is RTP_AAC_HEADER_SIZE + count * RTP_AAC_AU_HEADER_SIZE,
+// payload is src[0]->data ... src[count - 1]->data in order.
+int_t PacketizeAACHeader(
+        const RtpHeader &header,
+        ushort_t seq,
+        sz_t timestamp,
+        const SharedFrame *const *src,
+        sz_t count,
+        byte_t *dst);
+
 int_t PacketizeAAC(
-        byte_t interleave,
+        const RtpHeader &header,
+        ushort_t seq,
+        sz_t timestamp,
+        const SharedFrame &src,
+        byte_t *dst,
+        sz_t dst_size);
+
+// FlexFEC: TCP prefix (4) + RTP header (12) + protected SSRC (4)
+// + FEC header (8) + SN base (2) + mask (up to 14)
+#define RTP_FEC_MAX_HEADER_SIZE 44
+
+// FlexFEC repair packet (RFC 8627, flexible mask) for the packets
+// group.base + i * step, i < group.count. Written entirely to dst.
+// Return the packet size (with TCP prefix).
+int_t PacketizeFec(
+        const RtpHeader &header,
         ushort_t seq,
         sz_t timestamp,
-        sz_t ssrc,
-        const FrameBuffer<MAX_AUDIO_FRAME_SIZE> &src,
+        uint_t media_ssrc,
+        const FecGroup &group,
+        sz_t step,
         byte_t *dst,
         sz_t dst_size);
 
+// Wall clock in NTP format, used by Sender Reports
+void NTP(uint_t *ntp_sec, uint_t *ntp_frac);
+
 int_t PacketizeReport(byte_t interleave,
                       byte_t *buf,
                       uint_t ssrc,
                       uint_t rtp_timestamp,
                       uint_t pkt_count,
-                      uint_t byte_count);
\ No newline at end of file
+                      uint_t byte_count);
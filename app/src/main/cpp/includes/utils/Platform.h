@@ -1,7 +1,9 @@
 #pragma once
 
 #include <android/log.h>
+#include <linux/futex.h>
 #include <pthread.h>
+#include <sys/syscall.h>
 #include <time.h>
 #include <stdatomic.h>
 #include <stdint.h>
@@ -40,6 +42,11 @@ static inline void Copy(void* dst, const void* src, sz_t size) {
     memcpy(dst, src, size);
 }
 
+// Copy, but dst and src can overlap
+static inline void Move(void* dst, const void* src, sz_t size) {
+    memmove(dst, src, size);
+}
+
 static inline void Reset(void* dst, sz_t size) {
     memset(dst, 0, size);
 }
@@ -68,6 +75,10 @@ static inline bool GetAndSet(a_bool_t* value, bool val) {
     return atomic_exchange(value, val);
 }
 
+static inline int_t GetAndSet(a_int_t* value, int_t val) {
+    return atomic_exchange(value, val);
+}
+
 static inline void Reset(a_int_t* value) {
     atomic_init(value, 0);
 }
@@ -76,6 +87,11 @@ static inline bool_t CompareAndSet(a_int_t* value, int old_val, int new_val) {
     return atomic_compare_exchange_strong(value, &old_val, new_val);
 }
 
+// Return the new value
+static inline int_t Add(a_int_t* value, int_t delta) {
+    return atomic_fetch_add(value, delta) + delta;
+}
+
 static inline int_t SyncAndGet(a_int_t* value) {
     return atomic_load_explicit(value, memory_order_acquire);
 }
@@ -108,10 +124,37 @@ static inline void Wait(cond_t* cond, lock_t* lock) {
     pthread_cond_wait(cond, lock);
 }
 
+// Return false on timeout, conds are on the wall clock
+static inline bool_t Wait(cond_t* cond, lock_t* lock, tm_t timeout_us) {
+    ts_t ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    timeout_us += ts.tv_nsec / 1000;
+    ts.tv_sec += (time_t)(timeout_us / 1000000);
+    ts.tv_nsec = (long)(timeout_us % 1000000) * 1000;
+    return pthread_cond_timedwait(cond, lock, &ts) == 0;
+}
+
 static inline void Signal(cond_t* cond) {
     pthread_cond_signal(cond);
 }
 
+static inline void Broadcast(cond_t* cond) {
+    pthread_cond_broadcast(cond);
+}
+
+// Futex: sleep while *value == expected, at most timeout_us
+static inline void Sleep(a_int_t* value, int_t expected, tm_t timeout_us) {
+    ts_t ts;
+    ts.tv_sec = (time_t)(timeout_us / 1000000);
+    ts.tv_nsec = (long)(timeout_us % 1000000) * 1000;
+    syscall(SYS_futex, value, FUTEX_WAIT_PRIVATE, expected, &ts, nullptr, 0);
+}
+
+// Futex: wake one thread sleeping on value
+static inline void Wake(a_int_t* value) {
+    syscall(SYS_futex, value, FUTEX_WAKE_PRIVATE, 1, nullptr, nullptr, 0);
+}
+
 static inline void Init(lock_t *lock) {
     pthread_mutex_init(lock, nullptr);
 }
@@ -124,24 +167,32 @@ static inline void Unlock(lock_t *lock) {
     pthread_mutex_unlock(lock);
 }
 
+// Monotonic, for pacing and media timestamps, never jumps with NTP
 static inline tm_t NowNanos() {
     struct timespec ts {};
-    clock_gettime(CLOCK_REALTIME, &ts);
+    clock_gettime(CLOCK_MONOTONIC, &ts);
     return ts.tv_sec * 1000000000 + ts.tv_nsec;
 }
 
 static inline tm_t NowMicros() {
     struct timespec ts {};
-    clock_gettime(CLOCK_REALTIME, &ts);
+    clock_gettime(CLOCK_MONOTONIC, &ts);
     return ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
 }
 
 static inline tm_t NowSecs() {
     struct timespec ts {};
-    clock_gettime(CLOCK_REALTIME, &ts);
+    clock_gettime(CLOCK_MONOTONIC, &ts);
     return ts.tv_sec;
 }
 
+// Wall clock, only for NTP timestamps in RTCP
+static inline tm_t WallNanos() {
+    struct timespec ts {};
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
 static inline int_t RandomInt() {
     return ((int_t)rand() << 16) ^ rand();  // 32-bit from two rand();
 }
@@ -162,6 +213,25 @@ static inline int_t WriteStream(
     return result;
 }
 
+// WriteStream() at offset, which only moves if all of it fits.
+// Return false if it was cut.
+static inline bool_t AppendStream(
+        char_t* dst,
+        sz_t size,
+        sz_t& offset,
+        const char_t* msg,
+        ...) {
+    va_list args;
+    va_start(args, msg);
+    int_t result = vsnprintf(dst + offset, size - offset, msg, args);
+    va_end(args);
+    if (result < 0 || (sz_t)result >= size - offset) {
+        return false;
+    }
+    offset += result;
+    return true;
+}
+
 static inline const char_t* FindSubString(const char_t* str, const char_t* sub_str) {
     return strstr(str, sub_str);
 }
@@ -0,0 +1,37 @@
+#pragma once
+
+#include "utils/Platform.h"
+
+#define RTCP_MAX_NACKS 64
+
+// What a client told us about one of our streams in a compound RTCP packet
+typedef struct {
+    // Report block (from RR or SR) about our SSRC
+    bool_t has_report;
+    byte_t fraction_lost;  // Fixed point, / 256
+    int_t cumulative_lost;
+    uint_t highest_seq;
+    uint_t jitter;         // RTP timestamp units
+    uint_t lsr;            // Middle 32 bits of our last SR NTP
+    uint_t dlsr;           // 1/65536 seconds
+
+    // PLI or FIR
+    bool_t key_frame;
+
+    // Generic NACK, lost sequence numbers
+    ushort_t nacks[RTCP_MAX_NACKS];
+    sz_t nack_count;
+} RtcpFeedback;
+
+void Reset(RtcpFeedback& feedback);
+
+// Parse all packets of a compound RTCP packet (without TCP prefix),
+// keep only what is about media_ssrc.
+// Return false if the packet is malformed.
+bool_t ParseRtcp(const byte_t *data,
+                 sz_t size,
+                 uint_t media_ssrc,
+                 RtcpFeedback& feedback);
+
+// Round trip time from a report block, in ms, -1 if the client has no SR yet
+double_t RoundTripMs(const RtcpFeedback& feedback);
@@ -0,0 +1,65 @@
+#pragma once
+
+#include "utils/Platform.h"
+
+#define RTSP_INTERLEAVED_PREFIX_LEN 4
+
+// Bytes inside the receive buffer, not NUL-terminated.
+// Only valid until the buffer is read into again.
+typedef struct {
+    const char_t *data;
+    sz_t len;
+} RtspSpan;
+
+typedef struct {
+    RtspSpan method;
+    RtspSpan uri;
+    int_t cseq;          // -1 if missing
+    RtspSpan transport;  // Header values, empty if missing
+    RtspSpan session;
+    RtspSpan body;       // Content-Length bytes after the headers
+} RtspRequest;
+
+enum RtspMessageType {
+    RTSP_NEED_MORE,      // Not complete yet, nothing taken
+    RTSP_REQUEST,
+    RTSP_RESPONSE,       // From the client, we send no requests: ignored
+    RTSP_INTERLEAVED,    // '$' + channel + 16 bits length + data
+    RTSP_SKIPPED,        // Piece of a '$' frame too large for the buffer, dropped
+    RTSP_INVALID         // Garbage up to the next line
+};
+
+typedef struct {
+    RtspMessageType type;
+    RtspRequest request;
+
+    byte_t channel;
+    const byte_t *data;
+    sz_t size;
+} RtspMessage;
+
+// Where the header end search stopped, so a request coming in
+// small pieces isn't searched from its start on every read
+typedef struct {
+    sz_t scanned;
+    sz_t skip;           // Bytes of a '$' frame still to drop
+} RtspParser;
+
+void Reset(RtspParser& parser);
+
+// Parse the message at the start of data, any number of messages
+// may follow it. Return the bytes it takes, 0 with RTSP_NEED_MORE.
+// A '$' frame larger than capacity (the caller's buffer) is taken
+// as it comes, in RTSP_SKIPPED pieces.
+sz_t ParseRtsp(RtspParser& parser,
+               const byte_t *data,
+               sz_t size,
+               sz_t capacity,
+               RtspMessage& message);
+
+bool_t Equals(const RtspSpan& span, const char_t *str);
+bool_t Contains(const RtspSpan& span, const char_t *str);
+// Number right after key in span, -1 if there is none
+int_t FindInt(const RtspSpan& span, const char_t *key);
+// Up to the first ';' (Session: id;timeout=60)
+RtspSpan FirstParam(const RtspSpan& span);
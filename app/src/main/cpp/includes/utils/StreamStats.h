@@ -20,12 +20,53 @@ struct StreamStats {
     // Log skipped
     sz_t receive;
     sz_t sent;
+    sz_t dropped;
     bool video;
+
+    // Log syscalls
+    sz_t syscalls;
+    double_t syscall_per_frame;
+
+    // Log RTP packets
+    sz_t packets;
+    double_t packet_per_frame;
+
+    // Log receiver reports (RTCP thread), under lock
+    double_t rtt_ms;
+    double_t jitter_ms;
+    double_t fraction_lost;
+    sz_t cumulative_lost;
+    sz_t key_frame_requests;
+    sz_t nacks;
+
+    // Log retransmissions (RTCP thread), under lock
+    sz_t retransmits;
+    double_t recovery_us;
+
+    // Log MSG_ZEROCOPY sends (RTCP thread), under lock,
+    // copied: the kernel copied anyway
+    sz_t zero_copies;
+    sz_t zero_copies_copied;
+
+    // The RTCP thread writes while the receiving thread prints
+    lock_t lock;
 };
 
 void Init(StreamStats& stats, bool_t video);
 void ReceiveFrame(StreamStats &stats);
 void SendFrame(StreamStats &stats);
+void DropFrame(StreamStats &stats);
+void SendSyscalls(StreamStats &stats, sz_t count);
+void SendPackets(StreamStats &stats, sz_t count);
+void ReceiveReport(StreamStats &stats,
+                   double_t rtt_ms,
+                   double_t jitter_ms,
+                   double_t fraction_lost,
+                   sz_t cumulative_lost);
+void ReceiveKeyFrameRequest(StreamStats &stats);
+void ReceiveNacks(StreamStats &stats, sz_t count);
+void SendRetransmit(StreamStats &stats, tm_t recovery_us);
+void CompleteZeroCopy(StreamStats &stats, sz_t count, bool_t copied);
 void StartProcess(StreamStats& stats);
 void PauseProcess(StreamStats& stats);
 void ResumeProcess(StreamStats& stats);
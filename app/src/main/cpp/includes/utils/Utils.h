@@ -4,6 +4,15 @@
 
 // NAL Unit
 #define NAL_TYPE(data, nal) ((data[nal.start + nal.codeSize] >> 1) & 0x3F)
+#define NAL_TEMPORAL_ID(data, nal) ((data[nal.start + nal.codeSize + 1] & 0x07) - 1)
+
+// HEVC VCL NAL types (Rec. H.265 table 7-1)
+#define NAL_TYPE_TSA_N 2
+#define NAL_TYPE_TSA_R 3
+#define NAL_TYPE_RSV_VCL_N14 14
+#define NAL_TYPE_BLA_W_LP 16
+#define NAL_TYPE_RSV_IRAP_23 23
+#define NAL_TYPE_VPS 32
 
 typedef struct {
         sz_t start;
@@ -29,4 +38,18 @@ void Base64(
     sz_t end,
     char_t *dst);
 
-bool_t IsNalValid(const NalUnit &nal);
\ No newline at end of file
+bool_t IsNalValid(const NalUnit &nal);
+
+// What a picture is to the ones after it, from its first slice
+typedef struct {
+    int_t nal_type;     // -1 if the frame has no slice
+    int_t temporal_id;
+    bool_t irap;        // Decoding can start here
+    bool_t reference;   // Used by later pictures of its sub-layer
+    bool_t switch_up;   // TSA: higher sub-layers can be decoded again from here
+} PictureInfo;
+
+PictureInfo GetPictureInfo(const byte_t *data, const NalUnit *nals, sz_t count);
+
+// dst ^= src, NEON / SSE2 when available
+void XorBytes(byte_t *dst, const byte_t *src, sz_t size);
\ No newline at end of file
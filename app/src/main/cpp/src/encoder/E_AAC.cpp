@@ -12,7 +12,7 @@ static void HandleEncoded(
         int_t flags);
 static void OnFrameAvailable(void *context, const byte_t* data, sz_t size);
 
-static void OnEncodedAvailable(void *context, const FrameBuffer<MAX_AUDIO_FRAME_SIZE> &frame) {
+static void OnEncodedAvailable(void *context, SharedFrame *frame) {
     auto *source = static_cast<E_AAC *>(context);
 
     Lock(&source->listener_lock);
@@ -1,7 +1,7 @@
 
 #include "encoder/E_AACFrameQueue.h"
 #include "utils/CircularDeque.h"
-#include "utils/HierarchyMemoryPool.h"
+#include "utils/FramePool.h"
 
 #define LOG_TAG "AudioFrameQueue"
 
@@ -16,6 +16,10 @@ static tm_t CalculateDelayNs(E_AACFrameQueue &queue, tm_t presentation_time_us)
 
     // Delay = expected frame time (derived from first frame time)
     //          - actual frame time
+    // Frame older than the first one, don't wait (unsigned)
+    if (presentation_time_us <= queue.first_frame_us) {
+        return 0;
+    }
     tm_t expected_ns = (presentation_time_us - queue.first_frame_us) * 1000;
     tm_t actual_ns = NowNanos() - queue.start_time_ns;
 
@@ -27,10 +31,10 @@ static tm_t CalculateDelayNs(E_AACFrameQueue &queue, tm_t presentation_time_us)
 
 static void ProcessFrame(
         E_AACFrameQueue &queue,
-        const QueueBuffer &frame,
-        FrameBuffer<MAX_AUDIO_FRAME_SIZE> &buffer) {
+        SharedFrame *frame) {
 
-    if (frame.size == 0) {
+    if (frame->size == 0) {
+        Release(frame);
         return;
     }
 
@@ -39,40 +43,33 @@ static void ProcessFrame(
 
     // Sleep if frame comes before expected
     // Also push front to process it in the next loop
-    if (frame.presentation_time_us > 0) {
-        delay = CalculateDelayNs(queue, frame.presentation_time_us);
+    if (frame->timeUs > 0) {
+        delay = CalculateDelayNs(queue, frame->timeUs);
         if (delay > 0) {
             {
                 Lock(&queue.lock);
                 PushFront(queue.queue, frame);
                 Unlock(&queue.lock);
             }
-            ts.tv_sec = 0;
-            ts.tv_nsec = delay;
+            ts.tv_sec = (time_t)(delay / 1000000000);
+            ts.tv_nsec = (long)(delay % 1000000000);
             nanosleep(&ts, nullptr);
             return;
         }
     }
 
-    Reset(buffer);
-    buffer.size = frame.size;
-    buffer.flags = frame.flags;
-    buffer.timeUs = frame.presentation_time_us;
-
-    Copy(buffer.data, BufferData(frame.data), frame.size);
-    ReleaseBuffer(queue.pool, frame.data);
-
+    // Frame goes to the listeners as is, they retain it if needed
     if (queue.callback != nullptr) {
-        queue.callback->fnc(queue.callback->context, buffer);
+        queue.callback->fnc(queue.callback->context, frame);
     }
+    Release(frame);
 }
 
 // Main loop for queue
 static void Run(E_AACFrameQueue& queue) {
     SetThreadName("AudioQueue");
 
-    QueueBuffer frame;
-    FrameBuffer<MAX_AUDIO_FRAME_SIZE> buffer;
+    SharedFrame* frame;
     bool_t stopping;
     bool_t empty;
 
@@ -96,7 +93,7 @@ static void Run(E_AACFrameQueue& queue) {
 
         if (PopFront(queue.queue, frame)) {
             Unlock(&queue.lock);
-            ProcessFrame(queue, frame, buffer);
+            ProcessFrame(queue, frame);
         } else {
             // Remember to release the lock
             Unlock(&queue.lock);
@@ -113,8 +110,13 @@ static void* StartThread(void* arg) {
     return nullptr;
 }
 
+// Frames left in the queue go back to the pool
 static void Reset(E_AACFrameQueue& queue) {
-    Reset(queue.pool);
+    SharedFrame* frame;
+
+    while (PopFront(queue.queue, frame)) {
+        Release(frame);
+    }
     Reset(queue.queue);
 
     queue.start_time_ns = 0;
@@ -129,6 +131,7 @@ void E_Init(E_AACFrameQueue& queue, E_AACQueueCb* callback) {
     Init(&queue.running);
     Init(&queue.stopping);
     Init(queue.pool);
+    Reset(queue.queue);
     queue.callback = callback;
 }
 
@@ -150,7 +153,7 @@ void E_Enqueue(
         tm_t timeUs,
         int_t flags) {
 
-    QueueBuffer buffer;
+    SharedFrame* frame;
 
     if (Load(&queue.stopping)) {
         return;
@@ -158,31 +161,27 @@ void E_Enqueue(
 
     {
         // If the queue is full, drop the oldest frame
-        // (also release its buffer to pool)
+        // (also release it to pool)
         Lock(&queue.lock);
-        if (Full(queue.queue)) {
-            PopFront(queue.queue, buffer);
-            ReleaseBuffer(queue.pool, buffer.data);
+        if (Full(queue.queue) && PopFront(queue.queue, frame)) {
+            Release(frame);
         }
         Unlock(&queue.lock);
     }
 
-    // Acquire buffer from pool
-    buffer.data = AcquireBuffer(queue.pool, size);
-    if (!buffer.data.ptr) {
-        LOGE(LOG_TAG, "Failed to acquire memory buffer for frame size %zu", size);
+    // Acquire frame from pool
+    frame = Acquire(queue.pool, size);
+    if (!frame) {
+        LOGE(LOG_TAG, "Failed to acquire frame for size %zu", size);
         return;
     }
 
-    // Copy the data
-    Copy(BufferData(buffer.data), data, size);
-    buffer.presentation_time_us = timeUs;
-    buffer.size = size;
-    buffer.flags = flags;
+    // The only copy, codec buffer is released after this
+    Fill(frame, data, size, timeUs, flags);
 
     {
         Lock(&queue.lock);
-        PushBack(queue.queue, buffer);
+        PushBack(queue.queue, frame);
         Unlock(&queue.lock);
     }
     Signal(&queue.condition);
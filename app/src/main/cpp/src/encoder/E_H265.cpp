@@ -10,9 +10,9 @@ static void HandleEncoded(E_H265 &encoder,
                           const byte_t *data,
                           sz_t size,
                           tm_t presentation_time_us,
-                          int_t flags,
-                          FrameBuffer<MAX_VIDEO_FRAME_SIZE> &frame);
+                          int_t flags);
 static void ParseParams(E_H265 &encoder, const byte_t *data, sz_t size);
+static void ParseFormat(E_H265 &encoder);
 static void MarkStopped(E_H265 &encoder);
 static void CleanUp(E_H265 &encoder);
 
@@ -48,11 +48,22 @@ static void *StartEncodingThread(void *arg) {
     return nullptr;
 }
 
+static void ClearGop(E_H265 &encoder) {
+    for (sz_t i = 0; i < encoder.gop_count; ++i) {
+        Release(encoder.gop[i]);
+    }
+    encoder.gop_count = 0;
+}
+
 static void Reset(E_H265 &encoder) {
-    Reset(encoder.vps, sizeof(encoder.vps));
-    Reset(encoder.sps, sizeof(encoder.sps));
-    Reset(encoder.pps, sizeof(encoder.pps));
+    Lock(&encoder.gop_lock);
+    ClearGop(encoder);
+    Unlock(&encoder.gop_lock);
+
+    // Strings are kept, to compare with the ones of the new codec
+    Lock(&encoder.params_lock);
     Store(&encoder.params_initialized, false);
+    Unlock(&encoder.params_lock);
 }
 
 void E_Init(E_H265 &encoder, M_VideoSource* source) {
@@ -66,14 +77,29 @@ void E_Init(E_H265 &encoder, M_VideoSource* source) {
     // Initialize synchronization primitives
     Init(&encoder.listener_lock);
 
+    // Initialize frame pools
+    Init(encoder.frames);
+    Init(encoder.keyframes);
+    Init(&encoder.gop_lock);
+    encoder.gop_count = 0;
+
     // Initialize threading
     Init(&encoder.thread);
     Init(&encoder.is_recording);
     Init(&encoder.is_stopping);
+    Init(&encoder.key_frame_requested);
+    Store(&encoder.bit_rate, VIDEO_BIT_RATE);
+    Reset(&encoder.bit_rate_requested);
 
     // Initialize param locks
     Init(&encoder.params_lock);
     Init(&encoder.params_cond);
+    Init(&encoder.params_initialized);
+    Reset(&encoder.params_version);
+    Reset(encoder.vps, sizeof(encoder.vps));
+    Reset(encoder.sps, sizeof(encoder.sps));
+    Reset(encoder.pps, sizeof(encoder.pps));
+    encoder.config_size = 0;
 
     // Initialize pointers
     encoder.codec = nullptr;
@@ -173,14 +199,20 @@ bool E_RemoveListener(E_H265 &encoder, void *ctx) {
     return success;
 }
 
-void E_GetParams(E_H265 &encoder, char *vps, char *sps, char *pps) {
-    // Lock until params are available
-    Lock(&encoder.params_lock);
-    while (!Load(&encoder.params_initialized)) {
-        Wait(&encoder.params_cond, &encoder.params_lock);
+sz_t E_GetGop(E_H265 &encoder, SharedFrame **frames, sz_t max) {
+    sz_t count;
+
+    Lock(&encoder.gop_lock);
+    count = encoder.gop_count < max ? encoder.gop_count : max;
+    for (sz_t i = 0; i < count; ++i) {
+        Retain(encoder.gop[i]);
+        frames[i] = encoder.gop[i];
     }
-    Unlock(&encoder.params_lock);
+    Unlock(&encoder.gop_lock);
+    return count;
+}
 
+static void CopyParams(E_H265 &encoder, char *vps, char *sps, char *pps) {
     if (vps)
         Copy(vps, encoder.vps, H265_PARAMS_SIZE);
     if (sps)
@@ -189,6 +221,55 @@ void E_GetParams(E_H265 &encoder, char *vps, char *sps, char *pps) {
         Copy(pps, encoder.pps, H265_PARAMS_SIZE);
 }
 
+void E_GetParams(E_H265 &encoder, char *vps, char *sps, char *pps) {
+    // Lock until params are available
+    Lock(&encoder.params_lock);
+    while (!Load(&encoder.params_initialized)) {
+        Wait(&encoder.params_cond, &encoder.params_lock);
+    }
+    CopyParams(encoder, vps, sps, pps);
+    Unlock(&encoder.params_lock);
+}
+
+int_t E_GetParams(E_H265 &encoder, char *vps, char *sps, char *pps, tm_t timeout_us) {
+    tm_t deadline_us = NowMicros() + timeout_us;
+    tm_t now;
+    int_t version = 0;
+
+    Lock(&encoder.params_lock);
+    while (!Load(&encoder.params_initialized) && (now = NowMicros()) < deadline_us) {
+        Wait(&encoder.params_cond, &encoder.params_lock, deadline_us - now);
+    }
+    if (Load(&encoder.params_initialized)) {
+        CopyParams(encoder, vps, sps, pps);
+        version = Load(&encoder.params_version);
+    }
+    Unlock(&encoder.params_lock);
+    return version;
+}
+
+int_t E_GetConfig(E_H265 &encoder, byte_t *data, sz_t size, sz_t &length) {
+    int_t version = 0;
+
+    Lock(&encoder.params_lock);
+    if (Load(&encoder.params_initialized) && encoder.config_size <= size) {
+        Copy(data, encoder.config, encoder.config_size);
+        length = encoder.config_size;
+        version = Load(&encoder.params_version);
+    }
+    Unlock(&encoder.params_lock);
+    return version;
+}
+
+int_t E_ParamsVersion(E_H265 &encoder) {
+    int_t version;
+
+    Lock(&encoder.params_lock);
+    version = Load(&encoder.params_initialized) ? Load(&encoder.params_version) : 0;
+    Unlock(&encoder.params_lock);
+    return version;
+}
+
 static bool StartCodec(E_H265 &encoder) {
     result_t result;
 
@@ -205,7 +286,7 @@ static bool StartCodec(E_H265 &encoder) {
     E_SetInt32(encoder.format, E_KEY_WIDTH, VIDEO_WIDTH);
     E_SetInt32(encoder.format, E_KEY_HEIGHT, VIDEO_HEIGHT);
     E_SetInt32(encoder.format, E_KEY_COLOR_FORMAT, E_COLOR_FORMAT_SURFACE);
-    E_SetInt32(encoder.format, E_KEY_BIT_RATE, VIDEO_BIT_RATE);
+    E_SetInt32(encoder.format, E_KEY_BIT_RATE, Load(&encoder.bit_rate));
     E_SetInt32(encoder.format, E_KEY_I_FRAME_INTERVAL, VIDEO_IFRAME_INTERVAL);
     E_SetInt32(encoder.format, E_KEY_FRAME_RATE, VIDEO_DEFAULT_FRAME_RATE);
     E_SetInt32(encoder.format, E_KEY_PROFILE, VIDEO_CODEC_PROFILE);
@@ -238,14 +319,62 @@ static bool StartCodec(E_H265 &encoder) {
     return true;
 }
 
+void E_RequestKeyFrame(E_H265 &encoder) {
+    Store(&encoder.key_frame_requested, true);
+}
+
+// Only the encoding thread touches the codec, many requests become one
+static void RequestSyncFrame(E_H265 &encoder) {
+    E_Format *params;
+
+    if (!GetAndSet(&encoder.key_frame_requested, false)) {
+        return;
+    }
+
+    params = E_NewFormat();
+    E_SetInt32(params, E_KEY_REQUEST_SYNC_FRAME, 0);
+    if (E_SetParameters(encoder.codec, params) != E_RESULT_OK) {
+        LOGE(LOG_TAG, "Failed to request sync frame");
+    }
+    E_Delete(params);
+}
+
+void E_SetBitRate(E_H265 &encoder, int_t bit_rate) {
+    Store(&encoder.bit_rate, bit_rate);
+    Store(&encoder.bit_rate_requested, bit_rate);
+}
+
+int_t E_GetBitRate(E_H265 &encoder) {
+    return Load(&encoder.bit_rate);
+}
+
+// Same as RequestSyncFrame(), only the latest rate is applied
+static void ApplyBitRate(E_H265 &encoder) {
+    E_Format *params;
+    int_t bit_rate = GetAndSet(&encoder.bit_rate_requested, 0);
+
+    if (bit_rate <= 0) {
+        return;
+    }
+
+    params = E_NewFormat();
+    E_SetInt32(params, E_KEY_VIDEO_BIT_RATE, bit_rate);
+    if (E_SetParameters(encoder.codec, params) != E_RESULT_OK) {
+        LOGE(LOG_TAG, "Failed to set bit rate %d", bit_rate);
+    }
+    E_Delete(params);
+}
+
 static void EncodingLoop(E_H265 &encoder) {
     bool finish = false;
     ssz_t output_idx;
     sz_t output_size;
     byte_t *output_buffer;
-    FrameBuffer<MAX_VIDEO_FRAME_SIZE> frame;
 
     while (!finish) {
+        RequestSyncFrame(encoder);
+        ApplyBitRate(encoder);
+
         // Wait max 100ms for encoder finish,
         // timeout 0 = busy-waiting -> cost CPU
         output_idx = E_DequeueOutput(
@@ -253,7 +382,10 @@ static void EncodingLoop(E_H265 &encoder) {
                 &encoder.buffer_info,
                 100000);
 
-        if (output_idx >= 0) {
+        if (output_idx == E_INFO_OUTPUT_FORMAT_CHANGED) {
+            ParseFormat(encoder);
+
+        } else if (output_idx >= 0) {
             output_buffer = E_OutputBuffer(
                     encoder.codec,
                     (sz_t)output_idx,
@@ -264,8 +396,7 @@ static void EncodingLoop(E_H265 &encoder) {
                               output_buffer,
                               encoder.buffer_info.size,
                               encoder.buffer_info.presentationTimeUs,
-                              static_cast<int_t>(encoder.buffer_info.flags),
-                              frame);
+                              static_cast<int_t>(encoder.buffer_info.flags));
             }
 
             E_ReleaseOutput(encoder.codec, (sz_t)output_idx, false);
@@ -277,69 +408,136 @@ static void EncodingLoop(E_H265 &encoder) {
     }
 }
 
+// A keyframe starts a new GOP, frames before the first keyframe are useless
+static void CacheFrame(E_H265 &encoder, SharedFrame *frame) {
+    bool_t keyframe = frame->flags & E_INFO_FLAG_KEY_FRAME;
+
+    Lock(&encoder.gop_lock);
+    if (keyframe) {
+        ClearGop(encoder);
+    }
+
+    if (encoder.gop_count >= GOP_CACHE_MAX_FRAMES) {
+        // GOP is too long to cache, new sessions wait for a keyframe
+        ClearGop(encoder);
+    } else if (keyframe || encoder.gop_count > 0) {
+        Retain(frame);
+        encoder.gop[encoder.gop_count++] = frame;
+    }
+    Unlock(&encoder.gop_lock);
+}
+
+// Normal frames first, large ones (keyframes) or pool exhausted use the large pool
+static SharedFrame *AcquireFrame(E_H265 &encoder, sz_t size) {
+    SharedFrame *frame = Acquire(encoder.frames, size);
+    if (!frame) {
+        frame = Acquire(encoder.keyframes, size);
+    }
+    return frame;
+}
+
 static void HandleEncoded(E_H265 &encoder,
                           const byte_t *data,
                           sz_t size,
                           tm_t presentation_time_us,
-                          int_t flags,
-                          FrameBuffer<MAX_VIDEO_FRAME_SIZE> &frame) {
+                          int_t flags) {
+    SharedFrame *frame;
 
     if (flags & E_INFO_FLAG_CODEC_CONFIG) {
         ParseParams(encoder, data, size);
         return;
     }
 
-    if (size <= MAX_VIDEO_FRAME_SIZE) {
-        Reset(frame);
-        Copy(frame.data, data, size);
-        frame.size = size;
-        frame.flags = flags;
-        frame.timeUs = presentation_time_us;
-
-        {
-            Lock(&encoder.listener_lock);
-            for (auto & listener : encoder.listeners) {
-                if (listener.callback != nullptr &&
-                    listener.context != nullptr) {
-                    listener.callback(
-                            listener.context,
-                            frame);
-                }
+    if (size > MAX_VIDEO_FRAME_SIZE) {
+        LOGE(LOG_TAG, "Frame size is too large: %zu, skipped", size);
+        return;
+    }
+
+    frame = AcquireFrame(encoder, size);
+    if (!frame) {
+        LOGE(LOG_TAG, "No free frame for size %zu, skipped", size);
+        return;
+    }
+
+    // Codec buffer is released right after, so this is the one copy
+    Fill(frame, data, size, presentation_time_us, flags);
+    CacheFrame(encoder, frame);
+
+    {
+        Lock(&encoder.listener_lock);
+        for (auto & listener : encoder.listeners) {
+            if (listener.callback != nullptr &&
+                listener.context != nullptr) {
+                listener.callback(
+                        listener.context,
+                        frame);
             }
-            Unlock(&encoder.listener_lock);
         }
+        Unlock(&encoder.listener_lock);
     }
-    else {
-        LOGE(LOG_TAG, "Frame size is too large: %zu, skipped", size);
-    }
+
+    Release(frame);
 }
 
+// Parameter sets are base64-encoded once here, readers copy the strings.
+// The version only changes when one of them does, so the SDP built
+// from them is kept across encoder restarts with the same config.
 static void ParseParams(E_H265 &encoder, const byte_t *data, sz_t size) {
+    char_t params[3][H265_PARAMS_SIZE] = {};
     NalUnit nals[3];
     NalUnit nal;
     int_t nal_type;
-    char_t *dst;
+    sz_t length;
     sz_t count = ExtractNal(data, 0, size, nals, 3);
 
     for (sz_t i = 0; i < count; ++i) {
         nal = nals[i];
         nal_type = NAL_TYPE(data, nal);
-        dst = nullptr;
-        if (nal_type == 32) {
-            dst = encoder.vps;
-        }
-        else if (nal_type == 33) {
-            dst = encoder.sps;
+        length = nal.end - nal.start - nal.codeSize;
+        if (nal_type < 32 || nal_type > 34) {
+            continue;
         }
-        else if (nal_type == 34) {
-            dst = encoder.pps;
-        }
-        if (dst != nullptr) {
-            Base64(data, nal.start + nal.codeSize, nal.end, dst);
+        if ((length + 2) / 3 * 4 >= H265_PARAMS_SIZE) {
+            LOGE(LOG_TAG, "Parameter set %d is too large: %zu", nal_type, length);
+            continue;
         }
+        Base64(data, nal.start + nal.codeSize, nal.end, params[nal_type - 32]);
+    }
+
+    Lock(&encoder.params_lock);
+    if (strcmp(params[0], encoder.vps) != 0 ||
+        strcmp(params[1], encoder.sps) != 0 ||
+        strcmp(params[2], encoder.pps) != 0) {
+        Copy(encoder.vps, params[0], H265_PARAMS_SIZE);
+        Copy(encoder.sps, params[1], H265_PARAMS_SIZE);
+        Copy(encoder.pps, params[2], H265_PARAMS_SIZE);
+        Add(&encoder.params_version, 1);
+    }
+    if (size <= H265_CONFIG_SIZE) {
+        Copy(encoder.config, data, size);
+        encoder.config_size = size;
+    } else {
+        LOGE(LOG_TAG, "Codec config is too large: %zu", size);
     }
     Store(&encoder.params_initialized, true);
-    Signal(&encoder.params_cond);
+    Broadcast(&encoder.params_cond);
+    Unlock(&encoder.params_lock);
+}
+
+// Most encoders give the parameter sets (csd-0) with the output format,
+// before the first frame is encoded
+static void ParseFormat(E_H265 &encoder) {
+    E_Format *format = E_OutputFormat(encoder.codec);
+    void *data;
+    sz_t size;
+
+    if (!format) {
+        return;
+    }
+    if (E_GetBuffer(format, E_KEY_CSD_0, &data, &size) && size > 0) {
+        ParseParams(encoder, static_cast<const byte_t *>(data), size);
+    }
+    E_Delete(format);
 }
 
 static void MarkStopped(E_H265 &encoder) {
@@ -359,5 +557,10 @@ static void CleanUp(E_H265 &encoder) {
         encoder.format = nullptr;
     }
 
+    // Cached frames go back to the pool
+    Lock(&encoder.gop_lock);
+    ClearGop(encoder);
+    Unlock(&encoder.gop_lock);
+
     LOGI("CleanUp", "gracefully clean up H265 encoder");
 }
\ No newline at end of file
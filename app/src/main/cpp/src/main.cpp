@@ -6,6 +6,8 @@
 #include "mediasource/M_AudioSource.h"
 #include "mediasource/M_VideoSource.h"
 #include "processor/P_VEmpty.h"
+#include "server/S_HttpServer.h"
+#include "server/S_Recorder.h"
 #include "server/S_RtspServer.h"
 
 E_AAC a_encoder;
@@ -14,6 +16,8 @@ P_VEmpty v_processor;
 M_AudioSource a_source;
 M_VideoSource v_source;
 S_RtspServer rtsp_server;
+S_HttpServer http_server;
+S_Recorder recorder;
 
 extern "C" jint JNI_OnLoad(JavaVM *vm, void* reserved) {
     M_Init(a_source);
@@ -22,6 +26,8 @@ extern "C" jint JNI_OnLoad(JavaVM *vm, void* reserved) {
     E_Init(v_encoder, &v_source);
     P_Init(v_processor, &v_source);
     S_Init(rtsp_server, &v_encoder, &a_encoder);
+    S_Init(http_server, &v_encoder, &a_encoder);
+    S_Init(recorder, &v_encoder, &a_encoder);
     return JNI_VERSION_1_6;
 }
 
@@ -40,6 +46,12 @@ Java_com_pntt3011_cameraserver_MainController_startNative(JNIEnv *env, jobject t
         M_Start(a_source);
     }
     S_Start(rtsp_server, video, audio);
+    if (HLS_ENABLED && video) {
+        S_Start(http_server, audio);
+    }
+    if (RECORD_ENABLED && video) {
+        S_Start(recorder, audio);
+    }
 }
 
 extern "C"
@@ -51,5 +63,7 @@ Java_com_pntt3011_cameraserver_MainController_stopNative(JNIEnv *env, jobject th
     P_Stop(v_processor);
     E_Stop(v_encoder);
     S_Stop(rtsp_server);
+    S_Stop(http_server);
+    S_Stop(recorder);
     LOGI("CleanUp", "gracefully clean up native");
 }
\ No newline at end of file
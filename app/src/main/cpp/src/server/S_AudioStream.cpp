@@ -1,48 +1,58 @@
 #include "server/S_AudioStream.h"
 #include "server/S_Platform.h"
 #include "utils/Configs.h"
-#include "utils/FrameBuffer.h"
+#include "utils/FramePool.h"
 #include "utils/Packetizer.h"
+#include "utils/RtcpParser.h"
 
 #define LOG_TAG "S_AudioStream"
 
+// Samples per AAC-LC frame
+#define AAC_FRAME_SAMPLES 1024
+
+// One packet of AAC_MAX_AUS_PER_PACKET AUs and the Sender Report share the batch headers
+static_assert(RTP_AAC_HEADER_SIZE + AAC_MAX_AUS_PER_PACKET * RTP_AAC_AU_HEADER_SIZE + RTCP_REPORT_SIZE <=
+              sizeof(PacketBatch<AAC_MAX_AUS_PER_PACKET>::headers),
+              "AAC headers don't fit in the batch");
+
 static void* StartStreamingThread(void* arg);
-static void FrameCallback(void* ctx, const FrameBuffer<MAX_AUDIO_FRAME_SIZE>& frame);
-static uint_t RtpTimestamp(const S_AACStream& stream, tm_t time_us);
+static void FrameCallback(void* ctx, SharedFrame* frame);
+
+// Pending AUs go back to the encoder
+static void ReleasePending(S_AACStream& stream) {
+    for (sz_t i = 0; i < stream.pending_count; ++i) {
+        Release(stream.pending[i]);
+    }
+    stream.pending_count = 0;
+}
 
 static void Reset(S_AACStream& stream) {
-    Reset(stream.frame_buffer[0]);
-    Reset(stream.frame_buffer[1]);
-    Reset(stream.socket_buffer);
+    ReleasePending(stream);
+    Reset(stream.batch);
+    stream.max_aus = S_MaxAUsPerPacket();
+    stream.pending_rtp_ts = 0;
 
     stream.last_time_us = 0;
     stream.ssrc = 0;
-    stream.socket = nullptr;
-    stream.last_rtp_ts = 0;
-    stream.interleave = 0;
+    S_Init(stream.transport);
 
-    stream.last_report_sec = 0;
+    stream.next_report_us = 0;
     stream.packet_count = 0;
     stream.octet_count = 0;
-
-    stream.frame_ready[0] = false;
-    stream.frame_ready[1] = false;
-    Reset(&stream.write_idx);
-    Reset(&stream.read_idx);
 }
 
 void S_Init(S_AACStream& stream, E_AAC* encoder) {
     if (!encoder) {
         return;
     }
-    Init(&stream.frame_mutex);
-    Init(&stream.frame_condition);
+    Init(stream.ring);
 
     Init(&stream.thread);
 
     Store(&stream.state, IDLE);
 
     stream.encoder = encoder;
+    stream.pending_count = 0;
 
     Init(stream.stats, false);
 }
@@ -57,19 +67,21 @@ void S_Prepare(S_AACStream& stream) {
 
 void S_Start(
         S_AACStream& stream,
-        CancellableSocket* socket,
-        byte_t interleave,
-        int_t ssrc) {
+        const S_Transport& transport,
+        const S_RtpStart& start) {
 
     if (!CompareAndSet(&stream.state, PREPARED, RECORD))  {
         return;
     }
 
     Reset(stream);
-    stream.socket = socket;
-    stream.interleave = interleave;
-    stream.ssrc = ssrc;
-    stream.last_rtp_ts = RandomInt();
+    stream.transport = transport;
+    stream.ssrc = start.ssrc;
+    stream.start = start;
+    Init(stream.rtp_header, transport.interleave, AAC_PAYLOAD_TYPE, start.ssrc);
+    Init(stream.clock, AUDIO_SAMPLE_RATE, start.rtptime);
+    stream.next_report_us = NowMicros() + ReportIntervalUs(AUDIO_BIT_RATE, RTCP_REPORT_SIZE, true);
+    Drain(stream.ring);
 
     Start(&stream.thread, StartStreamingThread, &stream);
 }
@@ -93,13 +105,17 @@ void S_Stop(S_AACStream& stream) {
 
     if (is_recording) {
         // Wait for streaming thread to stop
-        Signal(&stream.frame_condition);
+        Wake(stream.ring);
         Join(&stream.thread);
     }
 
     if (is_prepared) {
         // Remove encoder listener
         E_RemoveListener(*stream.encoder, &stream);
+
+        // No more callbacks, give the frames back to the encoder
+        Drain(stream.ring);
+        ReleasePending(stream);
     }
 
     if (is_recording || is_prepared) {
@@ -108,149 +124,226 @@ void S_Stop(S_AACStream& stream) {
     }
 }
 
-// From outside perspective, PREPARED, RECORD and STOPPED is the same as RUNNING
-bool_t S_IsRunning(const S_AACStream& stream) {
-    return Load(&stream.state) != IDLE;
+// One AU is always sent, the others add one frame duration of latency each
+sz_t S_MaxAUsPerPacket() {
+    sz_t frame_us = (sz_t)AAC_FRAME_SAMPLES * 1'000'000 / AUDIO_SAMPLE_RATE;
+    sz_t count = 1 + (sz_t)AAC_MAX_PACKET_LATENCY_MS * 1000 / frame_us;
+    return count < AAC_MAX_AUS_PER_PACKET ? count : AAC_MAX_AUS_PER_PACKET;
 }
 
-static bool_t WaitFrame(S_AACStream& stream, FrameBuffer<MAX_AUDIO_FRAME_SIZE>* &frame) {
-    Lock(&stream.frame_mutex);
-    int_t write_old;
-    int_t write_new;
-    bool_t new_frame;
-    bool_t stopping;
-
-    // First loop, wait for new frames or stopped
-    while (true) {
-        stopping = Load(&stream.state) == STOPPING;
-        write_old = SyncAndGet(&stream.write_idx);
-        new_frame = stream.frame_ready[write_old] &&
-                    stream.frame_buffer[write_old].timeUs > stream.last_time_us;
-        if (new_frame || stopping) {
-            break;
-        }
-        Wait(&stream.frame_condition, &stream.frame_mutex);
+// Packet duration advertised in the SDP (a=maxptime)
+sz_t S_MaxPacketTimeMs() {
+    return (S_MaxAUsPerPacket() * AAC_FRAME_SAMPLES * 1000 + AUDIO_SAMPLE_RATE - 1) / AUDIO_SAMPLE_RATE;
+}
+
+void S_HandleRtcp(S_AACStream& stream, const byte_t *data, sz_t size) {
+    RtcpFeedback feedback;
+
+    if (Load(&stream.state) != RECORD) {
+        return;
     }
 
-    if (stopping) {
-        Unlock(&stream.frame_mutex);
-        return true;
+    Reset(feedback);
+    if (!ParseRtcp(data, size, (uint_t)stream.ssrc, feedback)) {
+        LOGE(LOG_TAG, "Malformed RTCP packet");
+        return;
     }
 
-    // The writer we are reading write_old buffer,
-    // it should write to the other buffer.
-    SetAndSync(&stream.read_idx, write_old);
+    if (feedback.has_report) {
+        ReceiveReport(stream.stats,
+                      RoundTripMs(feedback),
+                      (double_t)feedback.jitter * 1000 / AUDIO_SAMPLE_RATE,
+                      (double_t)feedback.fraction_lost / 256,
+                      feedback.cumulative_lost > 0 ? feedback.cumulative_lost : 0);
+    }
 
-    // Second loop, wait for writer update write_idx
-    while (true) {
-        stopping = Load(&stream.state) == STOPPING;
-        write_new = SyncAndGet(&stream.write_idx);
-        if (write_old != write_new || stopping) {
-            break;
-        }
-        Wait(&stream.frame_condition, &stream.frame_mutex);
+    if (feedback.nack_count > 0) {
+        ReceiveNacks(stream.stats, feedback.nack_count);
     }
+}
 
-    // Mark read
-    frame = &stream.frame_buffer[write_old];
-    stream.frame_ready[write_old] = false;
+// From outside perspective, PREPARED, RECORD and STOPPED is the same as RUNNING
+bool_t S_IsRunning(const S_AACStream& stream) {
+    return Load(&stream.state) != IDLE;
+}
 
-    Unlock(&stream.frame_mutex);
-    return stopping;
+// Streaming thread: next frame in order, nullptr when stopping
+static SharedFrame* WaitFrame(S_AACStream& stream) {
+    SharedFrame* frame;
+
+    while (Load(&stream.state) == RECORD) {
+        frame = Pop(stream.ring);
+        if (frame) {
+            return frame;
+        }
+        Sleep(stream.ring);
+    }
+    return nullptr;
 }
 
-static void SendReport(S_AACStream &stream) {
+// RTCP Sender Report goes out with the packet in the same batch
+static void AddReport(S_AACStream &stream) {
     int_t read;
-    tm_t now = NowSecs();
+    tm_t now = NowMicros();
 
-    if (stream.packet_count >= 50 && // Any number is OK, just don't too big
-        stream.last_report_sec != now && now % 2 == 0) {
-        stream.last_report_sec = now;
+    if (stream.packet_count > 0 && now >= stream.next_report_us) {
+        stream.next_report_us = now + ReportIntervalUs(AUDIO_BIT_RATE, RTCP_REPORT_SIZE, false);
 
         // RTCP uses interleave + 1
-        read = PacketizeReport(stream.interleave + 1,
-                               stream.socket_buffer.data,
+        // RTP time of now, same instant as the NTP time inside
+        read = PacketizeReport(stream.transport.interleave + 1,
+                               NextHeader(stream.batch),
                                stream.ssrc,
-                               stream.last_rtp_ts,
+                               RtpNow(stream.clock),
                                stream.packet_count,
                                stream.octet_count);
-        Send(*stream.socket,
-             stream.socket_buffer.data,
-             read, 0);
-        Send(*stream.socket,
-             stream.socket_buffer.data,
-             read, 0);
+        AddReport(stream.batch, read);
+    }
+}
+
+// Send all pending AUs in one packet
+static bool_t SendPending(S_AACStream& stream, ushort_t& seq) {
+    ssz_t sent;
+    int_t read;
+    sz_t i;
+
+    if (stream.pending_count == 0) {
+        return true;
+    }
+
+    // Client is behind (SEND_POLICY_SKIP): the AUs are lost,
+    // the seq gap tells it so
+    sent = S_CheckBudget(stream.transport);
+    if (sent == SEND_BLOCKED) {
+        for (i = 0; i < stream.pending_count; ++i) {
+            DropFrame(stream.stats);
+        }
+        ReleasePending(stream);
+        seq = (seq + 1) % 65536;
+        return true;
+    }
+    if (sent < 0) {
+        ReleasePending(stream);
+        return false;
     }
+
+    // Only headers are written, payload stays in the pending buffers
+    StartProcess(stream.stats);
+    Reset(stream.batch);
+    stream.batch.syscalls = 0;
+    read = PacketizeAACHeader(
+        stream.rtp_header,
+        seq,
+        stream.pending_rtp_ts,
+        stream.pending,
+        stream.pending_count,
+        NextHeader(stream.batch)
+    );
+    EndProcess(stream.stats);
+
+    AddPacket(stream.batch, read, stream.pending[0]->data, stream.pending[0]->size);
+    stream.octet_count += read - RtpPayloadStart() + stream.pending[0]->size;
+    for (i = 1; i < stream.pending_count; ++i) {
+        AddFragment(stream.batch, 0, stream.pending[i]->data, stream.pending[i]->size);
+        stream.octet_count += stream.pending[i]->size;
+    }
+    stream.packet_count++;
+
+    // RTCP Sender Report
+    AddReport(stream);
+
+    // AUs are sent straight from the frames, release them after
+    sent = Flush(stream.batch, stream.transport, false);
+    ReleasePending(stream);
+    if (sent == SEND_BLOCKED) {
+        DropFrame(stream.stats);
+    } else if (sent < 0) {
+        LOGE(LOG_TAG, "Failed to send audio frame");
+        return false;
+    }
+
+    seq = (seq + 1) % 65536;
+
+    if (stream.packet_count == 1) {
+        LOGI(LOG_TAG, "Time to first audio frame: %.1f ms from connect",
+             (double_t)(NowMicros() - stream.start.connect_us) / 1000);
+    }
+
+    // Stats
+    SendSyscalls(stream.stats, stream.batch.syscalls);
+    SendPackets(stream.stats, 1);
+    return true;
 }
 
 static void StartStreaming(S_AACStream& stream) {
     SetThreadName("AudioStream");
 
-    FrameBuffer<MAX_AUDIO_FRAME_SIZE>* frame = nullptr;
-    int_t read;
+    SharedFrame* frame;
     uint_t rtp_ts;
-    ushort_t seq = RandomShort();
-    bool_t stopping = false;
+    ushort_t seq = stream.start.seq;
 
-    // Wait -> Packetize -> Send
-    while (Load(&stream.state) == RECORD) {
+    // Wait -> Group AUs -> Packetize -> Send
+    while ((frame = WaitFrame(stream)) != nullptr) {
 
-        stopping = WaitFrame(stream, frame);
-        if (stopping) {
-            break;
+        // The first AU gets the rtptime of RTP-Info
+        if (stream.last_time_us == 0) {
+            stream.clock.rtp_origin += stream.start.rtptime - RtpTimestamp(stream.clock, frame->timeUs);
         }
+        rtp_ts = RtpTimestamp(stream.clock, frame->timeUs);
+        stream.last_time_us = frame->timeUs;
 
-        StartProcess(stream.stats);
-        rtp_ts = RtpTimestamp(stream, frame->timeUs);
-        read = PacketizeAAC(
-            stream.interleave,
-            seq,
-            rtp_ts,
-            stream.ssrc,
-            *frame,
-            stream.socket_buffer.data,
-            RTP_MAX_PACKET_SIZE
-        );
-        EndProcess(stream.stats);
-
-        if (read < 0) {
+        if (AACPacketSize(&frame, 1) > stream.transport.packet_size) {
             LOGE(LOG_TAG, "Failed to packetize audio frame");
+            Release(frame);
             break;
         }
-        
-        if (Send(*stream.socket,
-                 stream.socket_buffer.data,
-                 read, 0) < 0) {
-            LOGE(LOG_TAG, "Failed to send audio frame");
+
+        // This AU doesn't fit with the pending ones, send them first
+        if (stream.pending_count > 0 &&
+            AACPacketSize(stream.pending, stream.pending_count) +
+            RTP_AAC_AU_HEADER_SIZE + frame->size > stream.transport.packet_size &&
+            !SendPending(stream, seq)) {
+            Release(frame);
             break;
         }
-        
-        stream.last_time_us = frame->timeUs;
-        stream.last_rtp_ts = rtp_ts;
-        stream.packet_count++;
-        stream.octet_count += read - RtpPayloadStart();
 
-        seq = (seq + 1) % 65536;
+        if (stream.pending_count == 0) {
+            stream.pending_rtp_ts = rtp_ts;
+        }
+        // The reference from the ring goes to pending
+        stream.pending[stream.pending_count++] = frame;
 
-        // RTCP Sender Report
-        SendReport(stream);
+        if (stream.pending_count >= stream.max_aus &&
+            !SendPending(stream, seq)) {
+            break;
+        }
 
         // Stats
         SendFrame(stream.stats);
     }
 }
 
-static void ProcessFrame(S_AACStream& stream, const FrameBuffer<MAX_AUDIO_FRAME_SIZE>& frame) {
-    int index = 1 - SyncAndGet(&stream.read_idx);
-    stream.frame_buffer[index] = frame;
-    stream.frame_ready[index] = true;
+// Encoder thread: only a reference goes to the ring, drop the oldest if full
+static void ProcessFrame(S_AACStream& stream, SharedFrame* frame) {
+    SharedFrame* dropped;
+
+    if (Load(&stream.state) != RECORD) {
+        return;
+    }
 
     // Stats
     ReceiveFrame(stream.stats);
 
-    // Ensure all data is synced when read write_idx
-    SetAndSync(&stream.write_idx, index);
-    Signal(&stream.frame_condition);
+    if (Full(stream.ring) && (dropped = DropOldest(stream.ring)) != nullptr) {
+        Release(dropped);
+        DropFrame(stream.stats);
+    }
+
+    Retain(frame);
+    if (!Push(stream.ring, frame)) {
+        Release(frame);
+        DropFrame(stream.stats);
+    }
 }
 
 static void* StartStreamingThread(void* arg) {
@@ -261,14 +354,9 @@ static void* StartStreamingThread(void* arg) {
     return nullptr;
 }
 
-static void FrameCallback(void* ctx, const FrameBuffer<MAX_AUDIO_FRAME_SIZE>& frame) {
+static void FrameCallback(void* ctx, SharedFrame* frame) {
     auto stream = static_cast<S_AACStream*>(ctx);
     if (stream) {
         ProcessFrame(*stream, frame);
     }
 }
-
-static uint_t RtpTimestamp(const S_AACStream& stream, tm_t time_us) {
-    tm_t delta = time_us - stream.last_time_us;
-    return stream.last_rtp_ts + (uint_t)(delta * AUDIO_SAMPLE_RATE / 1'000'000);
-}
\ No newline at end of file
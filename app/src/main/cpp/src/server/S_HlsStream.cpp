@@ -0,0 +1,705 @@
+#include "server/S_HlsStream.h"
+#include "utils/Configs.h"
+#include "utils/Utils.h"
+
+#define LOG_TAG "S_HlsStream"
+
+static void* StartMuxingThread(void* arg);
+static void VideoCallback(void* ctx, SharedFrame* frame);
+static void AudioCallback(void* ctx, SharedFrame* frame);
+
+static void ReleaseFrames(SharedFrame** frames, sz_t& count) {
+    for (sz_t i = 0; i < count; ++i) {
+        Release(frames[i]);
+    }
+    count = 0;
+}
+
+static S_HlsSegment& Segment(S_HlsStream& stream, int_t msn) {
+    return stream.segments[(uint_t)msn % HLS_SEGMENT_SLOTS];
+}
+
+// Under lock
+static void OpenSegment(S_HlsStream& stream, int_t msn) {
+    S_HlsSegment& segment = Segment(stream, msn);
+
+    segment.msn = msn;
+    segment.part_count = 0;
+    segment.duration_us = 0;
+    stream.last_msn = msn;
+    stream.keyframe_requested = false;
+}
+
+// Under lock: the part leaves the window, its frames go back
+// once no HTTP client sends it (see Reap)
+static void Retire(S_HlsStream& stream, S_HlsPart* part) {
+    part->state = HLS_PART_RETIRED;
+    stream.window_video -= part->video_count;
+    stream.window_audio -= part->frame_count - part->video_count;
+}
+
+// Under lock
+static void EvictSegment(S_HlsStream& stream) {
+    S_HlsSegment& segment = Segment(stream, stream.first_msn);
+
+    for (sz_t i = 0; i < segment.part_count; ++i) {
+        Retire(stream, segment.parts[i]);
+    }
+    segment.part_count = 0;
+    segment.duration_us = 0;
+    stream.first_msn++;
+}
+
+// Under lock: every segment leaves, the next one opens empty
+static void ClearWindow(S_HlsStream& stream) {
+    while (stream.first_msn <= stream.last_msn) {
+        EvictSegment(stream);
+    }
+    OpenSegment(stream, stream.first_msn);
+    stream.playlist_len = 0;
+}
+
+// Muxer thread. Retired parts can't be found by HTTP clients anymore,
+// so refs only go down.
+static void Reap(S_HlsStream& stream, bool_t force) {
+    for (auto& part: stream.parts) {
+        if (part.state == HLS_PART_RETIRED && (force || Load(&part.refs) == 0)) {
+            ReleaseFrames(part.frames, part.frame_count);
+            part.state = HLS_PART_FREE;
+        }
+    }
+}
+
+static S_HlsPart* AcquirePart(S_HlsStream& stream) {
+    Reap(stream, false);
+    for (auto& part: stream.parts) {
+        if (part.state == HLS_PART_FREE) {
+            return &part;
+        }
+    }
+    return nullptr;
+}
+
+static void Reset(S_HlsStream& stream) {
+    stream.skip_to_keyframe = false;
+    stream.video_count = 0;
+    stream.audio_count = 0;
+    stream.part_start_us = 0;
+    stream.origin_us = 0;
+    stream.origin_set = false;
+    stream.audio_dts = 0;
+    stream.audio_dts_set = false;
+    stream.wait_keyframe = true;
+    stream.fragment_seq = 0;
+    stream.window_video = 0;
+    stream.window_audio = 0;
+
+    stream.first_msn = 0;
+    stream.discontinuity = 0;
+    stream.init_size = 0;
+    stream.init_version = 0;
+    stream.playlist_len = 0;
+    OpenSegment(stream, 0);
+}
+
+void S_Init(S_HlsStream& stream, E_H265* video_encoder, E_AAC* audio_encoder) {
+    if (!video_encoder) {
+        return;
+    }
+    Init(stream.video_ring);
+    Init(stream.audio_ring);
+
+    for (auto& part: stream.parts) {
+        part.state = HLS_PART_FREE;
+        part.frame_count = 0;
+        Reset(&part.refs);
+    }
+    Reset(stream);
+
+    Init(&stream.lock);
+    Init(&stream.thread);
+    Store(&stream.state, IDLE);
+
+    stream.notify_fd = -1;
+    stream.has_audio = false;
+    stream.video_encoder = video_encoder;
+    stream.audio_encoder = audio_encoder;
+}
+
+void S_Start(S_HlsStream& stream, bool_t start_audio, int_t notify_fd) {
+    if (!stream.video_encoder || !CompareAndSet(&stream.state, IDLE, RECORD)) {
+        return;
+    }
+
+    Reset(stream);
+    stream.has_audio = start_audio && stream.audio_encoder;
+    stream.notify_fd = notify_fd;
+
+    E_AddListener(*stream.video_encoder, VideoCallback, &stream);
+    if (stream.has_audio) {
+        E_AddListener(*stream.audio_encoder, AudioCallback, &stream);
+    }
+
+    // The window starts at an IDR
+    E_RequestKeyFrame(*stream.video_encoder);
+
+    Start(&stream.thread, StartMuxingThread, &stream);
+}
+
+void S_Stop(S_HlsStream& stream) {
+    if (!CompareAndSet(&stream.state, RECORD, STOPPING)) {
+        return;
+    }
+
+    // Wait for muxing thread to stop
+    Wake(stream.video_ring);
+    Join(&stream.thread);
+
+    // Remove encoder listeners
+    E_RemoveListener(*stream.video_encoder, &stream);
+    if (stream.has_audio) {
+        E_RemoveListener(*stream.audio_encoder, &stream);
+    }
+
+    // No more callbacks, give the frames back to the encoders
+    Drain(stream.video_ring);
+    Drain(stream.audio_ring);
+    ReleaseFrames(stream.video, stream.video_count);
+    ReleaseFrames(stream.audio, stream.audio_count);
+
+    Lock(&stream.lock);
+    ClearWindow(stream);
+    Reap(stream, true);
+    stream.init_size = 0;
+    stream.init_version = 0;
+    Unlock(&stream.lock);
+
+    stream.notify_fd = -1;
+    LOGI("CleanUp", "gracefully clean up hls stream");
+    Store(&stream.state, IDLE);
+}
+
+// Append to the playlist, cut if it is full
+static void Append(S_HlsStream& stream, const char_t *format, ...) {
+    sz_t room = HLS_PLAYLIST_SIZE - stream.playlist_len;
+    va_list args;
+    int_t written;
+
+    va_start(args, format);
+    written = vsnprintf(stream.playlist + stream.playlist_len, room, format, args);
+    va_end(args);
+
+    if (written > 0) {
+        stream.playlist_len += (sz_t)written < room ? (sz_t)written : room - 1;
+    }
+}
+
+// Under lock, after each change of the window.
+// Parts are listed for the last 3 target durations (RFC 8216bis 4.4.4.9).
+static void RenderPlaylist(S_HlsStream& stream) {
+    tm_t listed_us = 0;
+    int_t parts_msn = stream.last_msn;
+    int_t msn;
+    sz_t i;
+
+    stream.playlist_len = 0;
+    if (stream.first_msn == stream.last_msn && Segment(stream, stream.last_msn).part_count == 0) {
+        return;
+    }
+
+    for (msn = stream.last_msn; msn >= stream.first_msn; --msn) {
+        parts_msn = msn;
+        listed_us += Segment(stream, msn).duration_us;
+        if (listed_us >= (tm_t)HLS_TARGET_DURATION_S * 3 * 1000000) {
+            break;
+        }
+    }
+
+    Append(stream,
+           "#EXTM3U\n"
+           "#EXT-X-VERSION:6\n"
+           "#EXT-X-TARGETDURATION:%d\n"
+           "#EXT-X-SERVER-CONTROL:CAN-BLOCK-RELOAD=YES,PART-HOLD-BACK=%.3f\n"
+           "#EXT-X-PART-INF:PART-TARGET=%.3f\n"
+           "#EXT-X-MEDIA-SEQUENCE:%d\n"
+           "#EXT-X-DISCONTINUITY-SEQUENCE:%d\n"
+           "#EXT-X-MAP:URI=\"init%d.mp4\"\n",
+           HLS_TARGET_DURATION_S,
+           (double_t)HLS_PART_TARGET_MS * 3 / 1000,
+           (double_t)HLS_PART_TARGET_MS / 1000,
+           stream.first_msn,
+           stream.discontinuity,
+           stream.init_version);
+
+    for (msn = stream.first_msn; msn <= stream.last_msn; ++msn) {
+        const S_HlsSegment& segment = Segment(stream, msn);
+
+        for (i = 0; msn >= parts_msn && i < segment.part_count; ++i) {
+            Append(stream,
+                   "#EXT-X-PART:DURATION=%.3f,URI=\"part%d.%zu.mp4\"%s\n",
+                   (double_t)segment.parts[i]->duration_us / 1000000,
+                   msn, i,
+                   segment.parts[i]->independent ? ",INDEPENDENT=YES" : "");
+        }
+        if (msn < stream.last_msn) {
+            Append(stream,
+                   "#EXTINF:%.3f,\n"
+                   "seg%d.mp4\n",
+                   (double_t)segment.duration_us / 1000000,
+                   msn);
+        }
+    }
+
+    Append(stream,
+           "#EXT-X-PRELOAD-HINT:TYPE=PART,URI=\"part%d.%zu.mp4\"\n",
+           stream.last_msn,
+           Segment(stream, stream.last_msn).part_count);
+}
+
+// The encoder may change its parameter sets (resolution, restart):
+// the window starts over with a new init segment.
+// Return false while there is no init segment.
+static bool_t UpdateInit(S_HlsStream& stream) {
+    int_t version = E_ParamsVersion(*stream.video_encoder);
+    int_t result;
+    sz_t length;
+
+    if (version == stream.init_version) {
+        return stream.init_size > 0;
+    }
+    version = E_GetConfig(*stream.video_encoder, stream.config, H265_CONFIG_SIZE, length);
+    if (version == 0) {
+        return false;
+    }
+
+    Lock(&stream.lock);
+    result = WriteMp4Init(stream.config, length, stream.has_audio, stream.init, HLS_INIT_SIZE);
+    if (result < 0) {
+        LOGE(LOG_TAG, "Failed to write init segment, version %d", version);
+    }
+    if (stream.init_version != 0) {
+        ClearWindow(stream);
+        stream.discontinuity++;
+    }
+    stream.init_size = result < 0 ? 0 : result;
+    stream.init_version = version;
+    Unlock(&stream.lock);
+
+    // Older frames belong to the previous parameter sets
+    ReleaseFrames(stream.video, stream.video_count);
+    stream.wait_keyframe = true;
+    return stream.init_size > 0;
+}
+
+// Sample durations from the times since origin, so they add up without drift
+static uint_t Duration(const S_HlsStream& stream, tm_t time_us, tm_t next_us, uint_t timescale) {
+    return (uint_t)(Mp4Time(next_us - stream.origin_us, timescale) -
+                    Mp4Time(time_us - stream.origin_us, timescale));
+}
+
+// AUs up to end_us go into the part, their decode time follows the last part
+// unless the encoder clock moved away from it
+static sz_t TakeAudio(S_HlsStream& stream, tm_t end_us, Mp4Sample *samples) {
+    tm_t actual;
+    sz_t count = 0;
+    sz_t late = 0;
+
+    while (late < stream.audio_count && stream.audio[late]->timeUs < stream.origin_us) {
+        Release(stream.audio[late++]);
+    }
+    stream.audio_count -= late;
+    Move(stream.audio, stream.audio + late, stream.audio_count * sizeof(SharedFrame*));
+
+    while (count < stream.audio_count && stream.audio[count]->timeUs < end_us) {
+        samples[count].duration = MP4_AAC_FRAME_SAMPLES;
+        samples[count].size = (uint_t)stream.audio[count]->size;
+        samples[count].sync = true;
+        count++;
+    }
+    if (count == 0) {
+        return 0;
+    }
+
+    actual = Mp4Time(stream.audio[0]->timeUs - stream.origin_us, AUDIO_SAMPLE_RATE);
+    if (!stream.audio_dts_set ||
+        actual > stream.audio_dts + 2 * MP4_AAC_FRAME_SAMPLES ||
+        actual + 2 * MP4_AAC_FRAME_SAMPLES < stream.audio_dts) {
+        stream.audio_dts = actual;
+        stream.audio_dts_set = true;
+    }
+    return count;
+}
+
+// moof + mdat header, then the samples by reference: video as
+// NAL length (in header) + NAL (in the frame), audio AUs as they are.
+// The frames move to the part.
+static bool_t MuxPart(S_HlsStream& stream, S_HlsPart& part, tm_t end_us) {
+    Mp4Sample video_samples[HLS_PART_MAX_SAMPLES];
+    Mp4Sample audio_samples[HLS_PART_MAX_SAMPLES];
+    NalUnit nals[HLS_PART_MAX_NALS];
+    sz_t frame_nals[HLS_PART_MAX_SAMPLES]; // End of each frame in nals
+    Mp4Run runs[2];
+    sz_t run_count = 1;
+    sz_t nal_count = 0;
+    sz_t data_size = 0;
+    sz_t audio_count;
+    sz_t offset;
+    sz_t count;
+    sz_t length;
+    sz_t i;
+    sz_t j;
+    int_t moof_size;
+    SharedFrame* frame;
+
+    for (i = 0; i < stream.video_count; ++i) {
+        frame = stream.video[i];
+        count = ScanMp4Sample(frame->data, frame->size, nals + nal_count,
+                              HLS_PART_MAX_NALS - nal_count, video_samples[i].size);
+        if (nal_count + count == HLS_PART_MAX_NALS) {
+            LOGE(LOG_TAG, "Too many NAL units in part, the rest is cut");
+        }
+        nal_count += count;
+        frame_nals[i] = nal_count;
+
+        video_samples[i].duration = Duration(stream,
+                                             frame->timeUs,
+                                             i + 1 < stream.video_count ? stream.video[i + 1]->timeUs : end_us,
+                                             VIDEO_SAMPLE_RATE);
+        video_samples[i].sync = frame->flags & E_INFO_FLAG_KEY_FRAME;
+        data_size += video_samples[i].size;
+    }
+    runs[0] = {MP4_VIDEO_TRACK,
+               Mp4Time(stream.video[0]->timeUs - stream.origin_us, VIDEO_SAMPLE_RATE),
+               video_samples,
+               stream.video_count};
+
+    audio_count = TakeAudio(stream, end_us, audio_samples);
+    if (audio_count > 0) {
+        runs[run_count++] = {MP4_AUDIO_TRACK, stream.audio_dts, audio_samples, audio_count};
+        for (i = 0; i < audio_count; ++i) {
+            data_size += audio_samples[i].size;
+        }
+    }
+
+    moof_size = WriteMp4Fragment(++stream.fragment_seq,
+                                 runs,
+                                 run_count,
+                                 data_size,
+                                 part.header,
+                                 HLS_PART_HEADER_SIZE);
+    if (moof_size < 0 || (sz_t)moof_size + nal_count * MP4_NAL_LENGTH_SIZE > HLS_PART_HEADER_SIZE) {
+        LOGE(LOG_TAG, "Failed to write fragment of %zu bytes", data_size);
+        return false;
+    }
+
+    part.vector_count = 0;
+    SetVector(part.vectors[part.vector_count++], part.header, moof_size);
+    offset = moof_size;
+    for (i = 0, j = 0; i < stream.video_count; ++i) {
+        frame = stream.video[i];
+        for (; j < frame_nals[i]; ++j) {
+            length = nals[j].end - nals[j].start - nals[j].codeSize;
+            WriteNalLength(part.header + offset, (uint_t)length);
+            SetVector(part.vectors[part.vector_count++], part.header + offset, MP4_NAL_LENGTH_SIZE);
+            SetVector(part.vectors[part.vector_count++], frame->data + nals[j].start + nals[j].codeSize, length);
+            offset += MP4_NAL_LENGTH_SIZE;
+        }
+    }
+    for (i = 0; i < audio_count; ++i) {
+        SetVector(part.vectors[part.vector_count++], stream.audio[i]->data, stream.audio[i]->size);
+    }
+    part.size = moof_size + data_size;
+    part.duration_us = end_us - stream.part_start_us;
+    part.independent = video_samples[0].sync;
+
+    // The references of the muxer go to the part
+    part.frame_count = 0;
+    for (i = 0; i < stream.video_count; ++i) {
+        part.frames[part.frame_count++] = stream.video[i];
+    }
+    for (i = 0; i < audio_count; ++i) {
+        part.frames[part.frame_count++] = stream.audio[i];
+    }
+    part.video_count = stream.video_count;
+    stream.video_count = 0;
+    stream.audio_count -= audio_count;
+    Move(stream.audio, stream.audio + audio_count, stream.audio_count * sizeof(SharedFrame*));
+    stream.audio_dts += audio_count * MP4_AAC_FRAME_SAMPLES;
+    return true;
+}
+
+// The pending frames become the next part of the open segment,
+// which ends with it if last. Clients waiting for it are told.
+static void PublishPart(S_HlsStream& stream, tm_t end_us, bool_t last) {
+    S_HlsPart* part = AcquirePart(stream);
+
+    if (!part || !MuxPart(stream, *part, end_us)) {
+        // A gap, the players see it in the part times
+        LOGE(LOG_TAG, "Failed to mux part, skip to the next keyframe");
+        ReleaseFrames(stream.video, stream.video_count);
+        stream.wait_keyframe = true;
+        return;
+    }
+
+    Lock(&stream.lock);
+    S_HlsSegment& segment = Segment(stream, stream.last_msn);
+    part->msn = stream.last_msn;
+    part->index = (int_t)segment.part_count;
+    part->state = HLS_PART_PUBLISHED;
+    Store(&part->refs, 0);
+    segment.parts[segment.part_count++] = part;
+    segment.duration_us += part->duration_us;
+    stream.window_video += part->video_count;
+    stream.window_audio += part->frame_count - part->video_count;
+
+    if (last || segment.part_count == HLS_MAX_PARTS) {
+        if (stream.last_msn + 1 - stream.first_msn > HLS_WINDOW_SEGMENTS) {
+            EvictSegment(stream);
+        }
+        OpenSegment(stream, stream.last_msn + 1);
+    }
+
+    // The frame pools only cover HLS_WINDOW_MS
+    while ((stream.window_video > HLS_WINDOW_VIDEO_FRAMES ||
+            stream.window_audio > HLS_WINDOW_AUDIO_FRAMES) &&
+           stream.first_msn < stream.last_msn) {
+        EvictSegment(stream);
+    }
+
+    RenderPlaylist(stream);
+    Unlock(&stream.lock);
+
+    Notify(stream.notify_fd);
+}
+
+// Muxer thread: the frame goes into the pending part, which is published
+// first if the frame would make it longer than the part target.
+// An IDR ends the part, and the segment once it is long enough.
+static void MuxFrame(S_HlsStream& stream, SharedFrame* frame) {
+    bool_t keyframe = frame->flags & E_INFO_FLAG_KEY_FRAME;
+    tm_t segment_us;
+    tm_t interval;
+
+    if (!UpdateInit(stream) ||
+        (stream.wait_keyframe && !keyframe) ||
+        (stream.video_count > 0 && frame->timeUs <= stream.video[stream.video_count - 1]->timeUs)) {
+        Release(frame);
+        return;
+    }
+    if (!stream.origin_set) {
+        stream.origin_us = frame->timeUs;
+        stream.origin_set = true;
+    }
+    stream.wait_keyframe = false;
+
+    if (stream.video_count > 0) {
+        interval = frame->timeUs - stream.video[stream.video_count - 1]->timeUs;
+        segment_us = Segment(stream, stream.last_msn).duration_us + frame->timeUs - stream.part_start_us;
+
+        if (keyframe ||
+            frame->timeUs + interval - stream.part_start_us > (tm_t)HLS_PART_TARGET_MS * 1000 ||
+            stream.video_count == HLS_PART_MAX_SAMPLES) {
+            PublishPart(stream, frame->timeUs, keyframe && segment_us >= (tm_t)HLS_SEGMENT_MIN_MS * 1000);
+        }
+        if (stream.wait_keyframe && !keyframe) {
+            Release(frame);
+            return;
+        }
+    }
+
+    // A segment can't hold more parts, so it ends on an IDR if one comes in time
+    segment_us = Segment(stream, stream.last_msn).duration_us;
+    if (!stream.keyframe_requested &&
+        segment_us >= (tm_t)(HLS_MAX_PARTS - 2) * HLS_PART_TARGET_MS * 1000) {
+        stream.keyframe_requested = true;
+        E_RequestKeyFrame(*stream.video_encoder);
+    }
+
+    if (stream.video_count == 0) {
+        stream.part_start_us = frame->timeUs;
+    }
+    // The reference from the ring goes to the pending part
+    stream.video[stream.video_count++] = frame;
+}
+
+// AUs wait for the part they fall into, the oldest is dropped if too many
+static void PopAudio(S_HlsStream& stream) {
+    SharedFrame* frame;
+
+    while ((frame = Pop(stream.audio_ring)) != nullptr) {
+        if (stream.audio_count == HLS_PART_MAX_SAMPLES) {
+            Release(stream.audio[0]);
+            stream.audio_count--;
+            Move(stream.audio, stream.audio + 1, stream.audio_count * sizeof(SharedFrame*));
+        }
+        stream.audio[stream.audio_count++] = frame;
+    }
+}
+
+static void StartMuxing(S_HlsStream& stream) {
+    SetThreadName("HlsStream");
+
+    SharedFrame* frame;
+
+    // Video paces the parts, AUs are taken along
+    while (Load(&stream.state) == RECORD) {
+        PopAudio(stream);
+
+        frame = Pop(stream.video_ring);
+        if (frame) {
+            MuxFrame(stream, frame);
+        } else {
+            Sleep(stream.video_ring);
+        }
+    }
+}
+
+int_t S_GetPlaylist(S_HlsStream& stream,
+                    int_t msn,
+                    int_t part,
+                    char_t *dst,
+                    sz_t size,
+                    sz_t &length) {
+    int_t result;
+
+    Lock(&stream.lock);
+    if (stream.playlist_len == 0) {
+        result = 0;
+    } else if (msn < 0 || msn < stream.last_msn) {
+        result = 1;
+    } else if (msn > stream.last_msn + 2) {
+        result = -1;
+    } else {
+        result = msn == stream.last_msn && part >= 0 &&
+                 (sz_t)part < Segment(stream, msn).part_count ? 1 : 0;
+    }
+
+    if (result == 1) {
+        length = stream.playlist_len < size ? stream.playlist_len : size;
+        Copy(dst, stream.playlist, length);
+    }
+    Unlock(&stream.lock);
+    return result;
+}
+
+int_t S_GetInit(S_HlsStream& stream, int_t version, byte_t *dst, sz_t size, sz_t &length) {
+    int_t result = -1;
+
+    Lock(&stream.lock);
+    if (version == stream.init_version && stream.init_size > 0 && stream.init_size <= size) {
+        Copy(dst, stream.init, stream.init_size);
+        length = stream.init_size;
+        result = 1;
+    }
+    Unlock(&stream.lock);
+    return result;
+}
+
+int_t S_GetParts(S_HlsStream& stream, int_t msn, int_t part, S_HlsPart **parts, sz_t max) {
+    int_t result = -1;
+    sz_t i;
+
+    Lock(&stream.lock);
+    S_HlsSegment& segment = Segment(stream, msn);
+
+    if (stream.playlist_len == 0 || msn < stream.first_msn || msn > stream.last_msn + 1) {
+        result = -1;
+
+    } else if (msn == stream.last_msn + 1) {
+        // Hinted right before the open segment ends
+        result = part == 0 ? 0 : -1;
+
+    } else if (part < 0) {
+        if (msn == stream.last_msn) {
+            result = 0;
+        } else if (segment.part_count <= max) {
+            for (i = 0; i < segment.part_count; ++i) {
+                parts[i] = segment.parts[i];
+                Add(&parts[i]->refs, 1);
+            }
+            result = (int_t)segment.part_count;
+        }
+
+    } else if ((sz_t)part < segment.part_count && max > 0) {
+        parts[0] = segment.parts[part];
+        Add(&parts[0]->refs, 1);
+        result = 1;
+
+    } else if (msn == stream.last_msn && (sz_t)part == segment.part_count) {
+        result = 0;
+    }
+    Unlock(&stream.lock);
+    return result;
+}
+
+void S_Release(S_HlsPart* part) {
+    if (part) {
+        Add(&part->refs, -1);
+    }
+}
+
+// Encoder thread: only a reference goes to the ring, skip to the next
+// keyframe if the muxer is behind
+static void ProcessVideo(S_HlsStream& stream, SharedFrame* frame) {
+    bool_t keyframe = frame->flags & E_INFO_FLAG_KEY_FRAME;
+
+    if (Load(&stream.state) != RECORD) {
+        return;
+    }
+
+    if (keyframe) {
+        stream.skip_to_keyframe = false;
+    } else if (!stream.skip_to_keyframe && Full(stream.video_ring)) {
+        stream.skip_to_keyframe = true;
+        E_RequestKeyFrame(*stream.video_encoder);
+    }
+
+    if (stream.skip_to_keyframe) {
+        return;
+    }
+
+    Retain(frame);
+    if (!Push(stream.video_ring, frame)) {
+        Release(frame);
+    }
+}
+
+// Encoder thread: drop the oldest AU if full
+static void ProcessAudio(S_HlsStream& stream, SharedFrame* frame) {
+    SharedFrame* dropped;
+
+    if (Load(&stream.state) != RECORD) {
+        return;
+    }
+
+    if (Full(stream.audio_ring) && (dropped = DropOldest(stream.audio_ring)) != nullptr) {
+        Release(dropped);
+    }
+
+    Retain(frame);
+    if (!Push(stream.audio_ring, frame)) {
+        Release(frame);
+    }
+}
+
+static void* StartMuxingThread(void* arg) {
+    auto stream = static_cast<S_HlsStream*>(arg);
+    if (stream) {
+        StartMuxing(*stream);
+    }
+    return nullptr;
+}
+
+static void VideoCallback(void* ctx, SharedFrame* frame) {
+    auto stream = static_cast<S_HlsStream*>(ctx);
+    if (stream) {
+        ProcessVideo(*stream, frame);
+    }
+}
+
+static void AudioCallback(void* ctx, SharedFrame* frame) {
+    auto stream = static_cast<S_HlsStream*>(ctx);
+    if (stream) {
+        ProcessAudio(*stream, frame);
+    }
+}
@@ -0,0 +1,544 @@
+#include "server/S_HttpServer.h"
+
+#define LOG_TAG "HttpServer"
+
+// Client tokens are the slot
+#define POLL_LISTEN HTTP_MAX_CONNECTIONS
+#define POLL_STOP (HTTP_MAX_CONNECTIONS + 1)
+#define POLL_NOTIFY (HTTP_MAX_CONNECTIONS + 2)
+#define POLL_TIMER (HTTP_MAX_CONNECTIONS + 3)
+
+#define MAX_POLL_EVENTS (HTTP_MAX_CONNECTIONS + 4)
+
+#define PLAYLIST_NAME "live.m3u8"
+#define MSN_KEYWORD "_HLS_msn="
+#define PART_KEYWORD "_HLS_part="
+#define MAX_NAME_LEN 64
+
+#define PLAYLIST_TYPE "application/vnd.apple.mpegurl"
+#define MP4_TYPE "video/mp4"
+#define TEXT_TYPE "text/plain"
+
+// Parts never change once published, the playlist does
+#define CACHE_NONE "no-cache"
+#define CACHE_MEDIA "max-age=60"
+
+#define BUSY_RESPONSE "HTTP/1.1 503 Service Unavailable\r\n" \
+                      "Retry-After: 5\r\n"                   \
+                      "Content-Length: 0\r\n"                \
+                      "Connection: close\r\n"                \
+                      "\r\n"
+
+static void Reset(S_HttpClient& client) {
+    client.recv_start = 0;
+    client.recv_end = 0;
+    Reset(client.parser);
+    client.head_len = 0;
+    client.part_count = 0;
+    client.sent = 0;
+    client.total = 0;
+    client.wait = HTTP_WAIT_NONE;
+}
+
+static void ReleaseParts(S_HttpClient& client) {
+    for (sz_t i = 0; i < client.part_count; ++i) {
+        S_Release(client.parts[i]);
+    }
+    client.part_count = 0;
+}
+
+static void Close(S_HttpClient& client) {
+    if (!IsConnected(client.socket)) {
+        return;
+    }
+    ReleaseParts(client);
+    Destroy(client.socket);
+    Reset(client);
+}
+
+void S_Init(S_HttpServer& server,
+            E_H265* video_encoder,
+            E_AAC* audio_encoder) {
+
+    for (auto& client: server.clients) {
+        client.socket.socket = -1;
+        Init(&client.socket.send_lock);
+        client.part_count = 0;
+        Reset(client);
+    }
+
+    S_Init(server.hls, video_encoder, audio_encoder);
+
+    // Initialize threading
+    server.poll_fd = -1;
+    server.event_fd = -1;
+    server.notify_fd = -1;
+    server.timer_fd = -1;
+    Init(&server.thread);
+    Init(&server.is_running);
+    Init(&server.is_stopping);
+}
+
+// The body is at head + HTTP_HEADER_ROOM, the headers go right before it.
+// parts_len bytes of parts follow the head.
+static void Respond(S_HttpClient& client,
+                    const char_t *status,
+                    const char_t *type,
+                    const char_t *cache,
+                    sz_t body_len,
+                    sz_t parts_len) {
+    char_t headers[HTTP_HEADER_ROOM];
+    int_t length = WriteStream(headers,
+                               HTTP_HEADER_ROOM,
+                               "HTTP/1.1 %s\r\n"
+                               "Content-Type: %s\r\n"
+                               "Content-Length: %zu\r\n"
+                               "Cache-Control: %s\r\n"
+                               "Access-Control-Allow-Origin: *\r\n"
+                               "Connection: keep-alive\r\n"
+                               "\r\n",
+                               status,
+                               type,
+                               body_len + parts_len,
+                               cache);
+
+    Move(client.head + length, client.head + HTTP_HEADER_ROOM, body_len);
+    Copy(client.head, headers, length);
+    client.head_len = length + body_len;
+    client.sent = 0;
+    client.total = client.head_len + parts_len;
+    client.wait = HTTP_WAIT_NONE;
+}
+
+static void RespondError(S_HttpClient& client, const char_t *status) {
+    ReleaseParts(client);
+    Respond(client, status, TEXT_TYPE, CACHE_NONE, 0, 0);
+}
+
+// Answer the blocked request if the stream has it now.
+// Return false if it still waits.
+static bool_t TryAnswer(S_HttpServer& server, S_HttpClient& client) {
+    sz_t length = 0;
+    int_t result;
+    sz_t i;
+
+    if (client.wait == HTTP_WAIT_PLAYLIST) {
+        result = S_GetPlaylist(server.hls,
+                               client.wait_msn,
+                               client.wait_part,
+                               client.head + HTTP_HEADER_ROOM,
+                               HLS_PLAYLIST_SIZE,
+                               length);
+        if (result > 0) {
+            Respond(client, "200 OK", PLAYLIST_TYPE, CACHE_NONE, length, 0);
+        } else if (result < 0) {
+            RespondError(client, "400 Bad Request");
+        }
+        return result != 0;
+    }
+
+    result = S_GetParts(server.hls,
+                        client.wait_msn,
+                        client.wait == HTTP_WAIT_PART ? client.wait_part : -1,
+                        client.parts,
+                        HLS_MAX_PARTS);
+    if (result > 0) {
+        client.part_count = result;
+        for (i = 0; i < client.part_count; ++i) {
+            length += client.parts[i]->size;
+        }
+        Respond(client, "200 OK", MP4_TYPE, CACHE_MEDIA, 0, length);
+    } else if (result < 0) {
+        RespondError(client, "404 Not Found");
+    }
+    return result != 0;
+}
+
+static void Block(S_HttpServer& server, S_HttpClient& client, int_t wait, int_t msn, int_t part) {
+    client.wait = wait;
+    client.wait_msn = msn;
+    client.wait_part = part;
+    client.wait_until_us = NowMicros() + (tm_t)HLS_BLOCK_TIMEOUT_MS * 1000;
+    TryAnswer(server, client);
+}
+
+// GET /live.m3u8, /initV.mp4, /segN.mp4, /partN.M.mp4, at any path
+static void HandleRequest(S_HttpServer& server,
+                          S_HttpClient& client,
+                          const RtspRequest& request) {
+    char_t name[MAX_NAME_LEN];
+    const char_t *start = request.uri.data;
+    const char_t *end = request.uri.data + request.uri.len;
+    const char_t *query = static_cast<const char_t *>(memchr(start, '?', request.uri.len));
+    int_t version;
+    int_t msn;
+    int_t part;
+    int_t read = 0;
+    sz_t length;
+    sz_t len;
+
+    if (!Equals(request.method, "GET")) {
+        RespondError(client, "405 Method Not Allowed");
+        return;
+    }
+
+    // Last path segment, without the query
+    end = query ? query : end;
+    for (const char_t *slash = start; slash < end; ++slash) {
+        if (*slash == '/') {
+            start = slash + 1;
+        }
+    }
+    len = (sz_t)(end - start) < MAX_NAME_LEN - 1 ? (sz_t)(end - start) : MAX_NAME_LEN - 1;
+    Copy(name, start, len);
+    name[len] = '\0';
+
+    if (strcmp(name, PLAYLIST_NAME) == 0) {
+        Block(server,
+              client,
+              HTTP_WAIT_PLAYLIST,
+              FindInt(request.uri, MSN_KEYWORD),
+              FindInt(request.uri, PART_KEYWORD));
+
+    } else if (sscanf(name, "init%d.mp4%n", &version, &read) == 1 && (sz_t)read == len) {
+        if (S_GetInit(server.hls,
+                      version,
+                      reinterpret_cast<byte_t *>(client.head + HTTP_HEADER_ROOM),
+                      HLS_PLAYLIST_SIZE,
+                      length) > 0) {
+            Respond(client, "200 OK", MP4_TYPE, CACHE_MEDIA, length, 0);
+        } else {
+            RespondError(client, "404 Not Found");
+        }
+
+    } else if (sscanf(name, "seg%d.mp4%n", &msn, &read) == 1 && (sz_t)read == len) {
+        Block(server, client, HTTP_WAIT_SEGMENT, msn, -1);
+
+    } else if (sscanf(name, "part%d.%d.mp4%n", &msn, &part, &read) == 2 && (sz_t)read == len) {
+        Block(server, client, HTTP_WAIT_PART, msn, part);
+
+    } else {
+        RespondError(client, "404 Not Found");
+    }
+}
+
+// Next complete request out of the receive buffer.
+// Return 1 if one was taken, 0 if more bytes are needed.
+static int_t NextRequest(S_HttpServer& server, S_HttpClient& client) {
+    RtspMessage message;
+    sz_t consumed = ParseRtsp(client.parser,
+                              client.recv_buf + client.recv_start,
+                              client.recv_end - client.recv_start,
+                              HTTP_BUFFER_LEN,
+                              message);
+
+    if (consumed == 0) {
+        return 0;
+    }
+    client.recv_start += consumed;
+    if (message.type == RTSP_REQUEST) {
+        HandleRequest(server, client, message.request);
+    }
+    return 1;
+}
+
+static bool_t AddVector(s_iovec_t *vectors,
+                        sz_t &count,
+                        sz_t &skip,
+                        const void *data,
+                        sz_t size) {
+    if (skip >= size) {
+        skip -= size;
+        return true;
+    }
+    if (count == HTTP_MAX_VECTORS) {
+        return false;
+    }
+    SetVector(vectors[count++], static_cast<const byte_t *>(data) + skip, size - skip);
+    skip = 0;
+    return true;
+}
+
+// Head and parts from the cursor, as the socket takes them.
+// Return 1 when all is out, 0 if the socket is full, -1 if the client is gone.
+static int_t SendResponse(S_HttpClient& client) {
+    s_iovec_t vectors[HTTP_MAX_VECTORS];
+    sz_t calls = 0;
+    sz_t count;
+    sz_t skip;
+    sz_t i;
+    sz_t j;
+    ssz_t sent;
+
+    while (client.sent < client.total) {
+        count = 0;
+        skip = client.sent;
+        AddVector(vectors, count, skip, client.head, client.head_len);
+        for (i = 0; i < client.part_count; ++i) {
+            const S_HlsPart& part = *client.parts[i];
+            for (j = 0; j < part.vector_count; ++j) {
+                if (!AddVector(vectors, count, skip, part.vectors[j].iov_base, part.vectors[j].iov_len)) {
+                    break;
+                }
+            }
+        }
+
+        sent = SendVector(client.socket, vectors, count, MSG_DONTWAIT, calls);
+        if (sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return 0;
+        }
+        if (sent <= 0) {
+            return -1;
+        }
+        client.sent += sent;
+    }
+
+    ReleaseParts(client);
+    client.total = 0;
+    return 1;
+}
+
+// Send what the socket takes, answer the buffered requests in order, read more.
+// Return -1 if the client is gone.
+static int_t Serve(S_HttpServer& server, S_HttpClient& client) {
+    ssz_t received;
+    int_t result;
+
+    while (true) {
+        if (client.total > 0 && (result = SendResponse(client)) <= 0) {
+            return result;
+        }
+        if (client.wait != HTTP_WAIT_NONE) {
+            return 0;
+        }
+        if (NextRequest(server, client) > 0) {
+            continue;
+        }
+
+        // Room for the rest of a request at the end
+        if (client.recv_start == client.recv_end) {
+            client.recv_start = 0;
+            client.recv_end = 0;
+        } else if (client.recv_start > 0) {
+            Move(client.recv_buf,
+                 client.recv_buf + client.recv_start,
+                 client.recv_end - client.recv_start);
+            client.recv_end -= client.recv_start;
+            client.recv_start = 0;
+        }
+        if (client.recv_end == HTTP_BUFFER_LEN) {
+            LOGE(LOG_TAG, "Request too large");
+            return -1;
+        }
+
+        received = Receive(client.socket,
+                           client.recv_buf + client.recv_end,
+                           HTTP_BUFFER_LEN - client.recv_end,
+                           MSG_DONTWAIT);
+        if (received < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return 0;
+        }
+        if (received <= 0) {
+            return -1;
+        }
+        client.recv_end += received;
+    }
+}
+
+static void HandleClient(S_HttpServer& server, s_token_t token) {
+    if (token >= HTTP_MAX_CONNECTIONS) {
+        return;
+    }
+    S_HttpClient& client = server.clients[token];
+    if (IsConnected(client.socket) && Serve(server, client) < 0) {
+        Close(client);
+    }
+}
+
+// A part was published, or the timer ticked: blocked requests
+// are answered or time out
+static void AnswerBlocked(S_HttpServer& server, bool_t timeout) {
+    tm_t now = NowMicros();
+
+    for (auto& client: server.clients) {
+        if (!IsConnected(client.socket) || client.wait == HTTP_WAIT_NONE) {
+            continue;
+        }
+        if (!TryAnswer(server, client)) {
+            if (!timeout || now < client.wait_until_us) {
+                continue;
+            }
+            RespondError(client, "503 Service Unavailable");
+        }
+        if (Serve(server, client) < 0) {
+            Close(client);
+        }
+    }
+}
+
+static int_t AvailableSlot(const S_HttpServer& server) {
+    for (int_t i = 0; i < HTTP_MAX_CONNECTIONS; i++) {
+        if (!IsConnected(server.clients[i].socket)) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// Edge-triggered, accept until the backlog is empty.
+// No free slot: 503 right away, the player retries.
+static void AcceptClients(S_HttpServer& server) {
+    CancellableSocket socket;
+    int_t slot;
+
+    while (true) {
+        slot = AvailableSlot(server);
+        if (Accept(slot < 0 ? socket : server.clients[slot].socket, server.server_socket) < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                LOGE(LOG_TAG, "Failed to accept client, error %d", errno);
+            }
+            break;
+        }
+
+        if (slot < 0) {
+            LOGE(LOG_TAG, "No available client slots");
+            Send(socket, BUSY_RESPONSE, Len(BUSY_RESPONSE), MSG_DONTWAIT | MSG_NOSIGNAL);
+            Destroy(socket);
+            continue;
+        }
+
+        S_HttpClient& client = server.clients[slot];
+        Reset(client);
+        if (AddPollWritable(server.poll_fd, client.socket.socket, slot) < 0) {
+            LOGE(LOG_TAG, "Failed to poll client, error %d", errno);
+            Close(client);
+        }
+    }
+}
+
+static void StartListen(S_HttpServer& server) {
+    s_event_t events[MAX_POLL_EVENTS];
+    s_token_t token;
+    int_t count;
+    int_t i;
+    bool_t stopping = false;
+    int_t result = InitServer(
+            server.server_socket,
+            HTTP_PORT,
+            HTTP_MAX_CONNECTIONS);
+
+    if (result < 0) {
+        LOGE(LOG_TAG, "Failed to setup server, error code %d", result);
+        return;
+    }
+
+    server.poll_fd = InitPoll();
+    server.timer_fd = InitTimer(HTTP_TIMER_MS);
+    if (server.poll_fd < 0 ||
+        server.timer_fd < 0 ||
+        AddPoll(server.poll_fd, server.server_socket.socket, POLL_LISTEN) < 0 ||
+        AddPoll(server.poll_fd, server.event_fd, POLL_STOP) < 0 ||
+        AddPoll(server.poll_fd, server.notify_fd, POLL_NOTIFY) < 0 ||
+        AddPoll(server.poll_fd, server.timer_fd, POLL_TIMER) < 0) {
+        LOGE(LOG_TAG, "Failed to setup poll, error %d", errno);
+        stopping = true;
+    }
+
+    LOGI(LOG_TAG, "HTTP server listening on port %d", HTTP_PORT);
+    while (!stopping) {
+
+        count = WaitPoll(server.poll_fd, events, MAX_POLL_EVENTS);
+        if (count < 0) {
+            LOGE(LOG_TAG, "Failed to poll, error %d", errno);
+            break;
+        }
+
+        for (i = 0; i < count; ++i) {
+            token = Token(events[i]);
+            if (token == POLL_STOP) {
+                stopping = true;
+            } else if (token == POLL_LISTEN) {
+                AcceptClients(server);
+            } else if (token == POLL_NOTIFY) {
+                ReadEvent(server.notify_fd);
+                AnswerBlocked(server, false);
+            } else if (token == POLL_TIMER) {
+                ReadTimer(server.timer_fd);
+                AnswerBlocked(server, true);
+            } else {
+                HandleClient(server, token);
+            }
+        }
+
+        // Stopped by flag
+        if (Load(&server.is_stopping)) {
+            break;
+        }
+    }
+
+    // Parts go back to the stream before it stops
+    for (auto& client: server.clients) {
+        Close(client);
+    }
+    if (server.timer_fd >= 0) {
+        close(server.timer_fd);
+        server.timer_fd = -1;
+    }
+    if (server.poll_fd >= 0) {
+        close(server.poll_fd);
+        server.poll_fd = -1;
+    }
+    Destroy(server.server_socket);
+    LOGI("CleanUp", "gracefully clean up http server");
+}
+
+static void* StartServerThread(void* arg) {
+    S_HttpServer* server = static_cast<S_HttpServer*>(arg);
+    if (server) {
+        StartListen(*server);
+    }
+    return nullptr;
+}
+
+void S_Start(S_HttpServer& server, bool_t start_audio) {
+    if (Load(&server.is_stopping)) {
+        return;
+    }
+
+    if (GetAndSet(&server.is_running, true)) {
+        return; // Already running
+    }
+
+    // Created here, S_Stop() may come before the thread polls them
+    server.event_fd = InitEvent();
+    server.notify_fd = InitEvent();
+
+    S_Start(server.hls, start_audio, server.notify_fd);
+    Start(&server.thread, StartServerThread, &server);
+}
+
+void S_Stop(S_HttpServer& server) {
+    if (!Load(&server.is_running)) {
+        return;
+    }
+    if (GetAndSet(&server.is_stopping, true)) {
+        return;
+    }
+
+    // The reactor closes the clients on its way out,
+    // then no part is sent anymore
+    Notify(server.event_fd);
+    Join(&server.thread);
+    S_Stop(server.hls);
+
+    close(server.event_fd);
+    close(server.notify_fd);
+    server.event_fd = -1;
+    server.notify_fd = -1;
+
+    Store(&server.is_running, false);
+    Store(&server.is_stopping, false);
+}
@@ -0,0 +1,118 @@
+#include "server/S_RateControl.h"
+
+#define LOG_TAG "S_RateControl"
+
+void S_SampleSocket(S_SendQueue& queue, int_t fd, bool_t tcp, S_RateSample& sample) {
+    s_tcp_info_t info;
+    sz_t bytes;
+
+    sample.delivery_rate = -1;
+    sample.rtt_growth_ms = -1;
+    sample.loss_percent = -1;
+
+    // Right after a keyframe the queue is deep by itself,
+    // only what the keyframe doesn't explain is congestion
+    if (!tcp || GetTcpInfo(fd, info) < 0) {
+        sample.queue_ms = S_BacklogMs(queue, S_UpdateDepth(queue, fd));
+        return;
+    }
+
+    // Unacked bytes are in flight, not queued
+    bytes = info.notsent_bytes + S_PendingBytes(queue);
+    sample.queue_ms = S_BacklogMs(queue, S_BytesToMs(queue, bytes));
+    if (info.delivery_rate > 0) {
+        sample.delivery_rate = info.delivery_rate * 8 < INT32_MAX ? (int_t)(info.delivery_rate * 8) : INT32_MAX;
+    }
+    if (info.min_rtt > 0 && info.rtt >= info.min_rtt) {
+        sample.rtt_growth_ms = (int_t)((info.rtt - info.min_rtt) / 1000);
+    }
+}
+
+void S_Init(S_RateControl& control, E_H265* encoder) {
+    control.encoder = encoder;
+    S_Reset(control);
+}
+
+void S_Reset(S_RateControl& control) {
+    control.bit_rate = RATE_MAX_BIT_RATE;
+    control.clear_samples = 0;
+}
+
+static bool_t IsCongested(const S_RateSample& sample) {
+    return sample.queue_ms > RATE_CONGESTED_MS ||
+           sample.rtt_growth_ms > RATE_CONGESTED_MS ||
+           sample.loss_percent > RATE_LOSS_HIGH;
+}
+
+static bool_t IsClear(const S_RateSample& sample) {
+    return sample.queue_ms <= RATE_CLEAR_MS &&
+           sample.rtt_growth_ms <= RATE_CLEAR_MS &&
+           sample.loss_percent <= RATE_LOSS_LOW;
+}
+
+static int_t Clamp(int_t bit_rate) {
+    if (bit_rate < RATE_MIN_BIT_RATE) {
+        return RATE_MIN_BIT_RATE;
+    }
+    if (bit_rate > RATE_MAX_BIT_RATE) {
+        return RATE_MAX_BIT_RATE;
+    }
+    return bit_rate;
+}
+
+int_t S_NextBitRate(S_RateControl& control,
+                    const S_RateSample *samples,
+                    sz_t count) {
+    int_t bit_rate = control.bit_rate;
+    int_t delivered = -1;
+    bool_t congested = false;
+    bool_t clear = true;
+    sz_t i;
+
+    for (i = 0; i < count; ++i) {
+        if (IsCongested(samples[i])) {
+            congested = true;
+            // What the path took while it was full is what it can take
+            if (samples[i].delivery_rate > 0 &&
+                (delivered < 0 || samples[i].delivery_rate < delivered)) {
+                delivered = samples[i].delivery_rate;
+            }
+        }
+        clear = clear && IsClear(samples[i]);
+    }
+
+    if (congested) {
+        control.clear_samples = 0;
+        bit_rate = (int_t)((long_t)bit_rate * RATE_DECREASE / 100);
+        // Audio shares the path
+        if (delivered > 0 && delivered - AUDIO_BIT_RATE < bit_rate) {
+            bit_rate = delivered - AUDIO_BIT_RATE;
+        }
+        return Clamp(bit_rate);
+    }
+
+    // Between clear and congested: hold
+    if (!clear || count == 0) {
+        control.clear_samples = 0;
+        return bit_rate;
+    }
+
+    if (++control.clear_samples < RATE_INCREASE_SAMPLES) {
+        return bit_rate;
+    }
+    control.clear_samples = 0;
+    return Clamp(bit_rate + bit_rate * RATE_INCREASE / 100);
+}
+
+int_t S_Update(S_RateControl& control,
+               const S_RateSample *samples,
+               sz_t count) {
+    int_t bit_rate = S_NextBitRate(control, samples, count);
+
+    if (bit_rate != control.bit_rate) {
+        LOGI(LOG_TAG, "Video bit rate %d -> %d", control.bit_rate, bit_rate);
+        control.bit_rate = bit_rate;
+        E_SetBitRate(*control.encoder, bit_rate);
+    }
+    return bit_rate;
+}
@@ -0,0 +1,864 @@
+#include "server/S_Recorder.h"
+#include "utils/Configs.h"
+#include "utils/Utils.h"
+
+#define LOG_TAG "S_Recorder"
+
+static void* StartMuxingThread(void* arg);
+static void* StartWritingThread(void* arg);
+static void VideoCallback(void* ctx, SharedFrame* frame);
+static void AudioCallback(void* ctx, SharedFrame* frame);
+
+static void ReleaseFrames(SharedFrame** frames, sz_t& count) {
+    for (sz_t i = 0; i < count; ++i) {
+        Release(frames[i]);
+    }
+    count = 0;
+}
+
+// Release the first count frames, the rest moves to the front
+static void DropFrames(SharedFrame** frames, sz_t& total, sz_t count) {
+    for (sz_t i = 0; i < count; ++i) {
+        Release(frames[i]);
+    }
+    total -= count;
+    Move(frames, frames + count, total * sizeof(SharedFrame*));
+}
+
+static bool_t IsKeyFrame(const SharedFrame* frame) {
+    return frame->flags & E_INFO_FLAG_KEY_FRAME;
+}
+
+static void FilePath(int_t file, char_t *path) {
+    WriteStream(path, RECORD_PATH_SIZE, "%s/record_%02d.mp4", RECORD_DIR, file);
+}
+
+// The ring goes on after the newest file, so a restart overwrites the oldest
+static int_t OldestFile() {
+    char_t path[RECORD_PATH_SIZE];
+    tm_t oldest_secs = 0;
+    tm_t secs;
+    int_t oldest = 0;
+
+    for (int_t i = 0; i < RECORD_FILE_COUNT; ++i) {
+        FilePath(i, path);
+        secs = ModifiedSecs(path);
+        if (secs == 0) {
+            return i;
+        }
+        if (i == 0 || secs < oldest_secs) {
+            oldest_secs = secs;
+            oldest = i;
+        }
+    }
+    return oldest;
+}
+
+static void Reset(S_Recorder& recorder) {
+    recorder.skip_to_keyframe = false;
+    recorder.video_count = 0;
+    recorder.audio_count = 0;
+    recorder.wait_keyframe = true;
+    recorder.config_version = 0;
+    recorder.init_size = 0;
+
+    recorder.file = -1;
+    recorder.file_size = 0;
+    recorder.file_start_us = 0;
+    recorder.origin_us = 0;
+    recorder.audio_dts = 0;
+    recorder.audio_dts_set = false;
+    recorder.fragment_seq = 0;
+    recorder.keyframe_requested = false;
+    recorder.gap = false;
+    recorder.batch_start_us = 0;
+
+    for (auto& batch: recorder.batches) {
+        batch.size = 0;
+        batch.file = -1;
+        batch.first = false;
+        batch.last = false;
+    }
+    Reset(&recorder.queued);
+    Reset(&recorder.written);
+
+    recorder.fd = -1;
+    recorder.fd_offset = 0;
+    recorder.fd_failed = false;
+    recorder.synced_us = 0;
+    recorder.dirty = false;
+
+    Reset(&recorder.stats, sizeof(recorder.stats));
+    recorder.write_ms_sum = 0;
+    recorder.writes = 0;
+    recorder.sync_ms_sum = 0;
+    recorder.syncs = 0;
+    recorder.log_us = NowMicros();
+}
+
+void S_Init(S_Recorder& recorder, E_H265* video_encoder, E_AAC* audio_encoder) {
+    if (!video_encoder) {
+        return;
+    }
+    Init(recorder.video_ring);
+    Init(recorder.audio_ring);
+    Reset(recorder);
+
+    Init(&recorder.stats_lock);
+    Init(&recorder.mux_thread);
+    Init(&recorder.write_thread);
+    Init(&recorder.writer_running);
+    Init(&recorder.recording);
+    Store(&recorder.state, IDLE);
+
+    recorder.next_file = 0;
+    recorder.has_audio = false;
+    recorder.video_encoder = video_encoder;
+    recorder.audio_encoder = audio_encoder;
+}
+
+void S_Start(S_Recorder& recorder, bool_t start_audio) {
+    if (!recorder.video_encoder || !CompareAndSet(&recorder.state, IDLE, RECORD)) {
+        return;
+    }
+
+    Reset(recorder);
+    recorder.has_audio = start_audio && recorder.audio_encoder;
+    if (MakeDir(RECORD_DIR) < 0) {
+        LOGE(LOG_TAG, "Failed to create %s, errno %d", RECORD_DIR, errno);
+    }
+    recorder.next_file = OldestFile();
+    Store(&recorder.recording, RECORD_CONTINUOUS);
+
+    Store(&recorder.writer_running, true);
+    Start(&recorder.write_thread, StartWritingThread, &recorder);
+
+    E_AddListener(*recorder.video_encoder, VideoCallback, &recorder);
+    if (recorder.has_audio) {
+        E_AddListener(*recorder.audio_encoder, AudioCallback, &recorder);
+    }
+
+    Start(&recorder.mux_thread, StartMuxingThread, &recorder);
+}
+
+void S_Stop(S_Recorder& recorder) {
+    if (!CompareAndSet(&recorder.state, RECORD, STOPPING)) {
+        return;
+    }
+
+    // The muxer closes the open file on its way out
+    Wake(recorder.video_ring);
+    Join(&recorder.mux_thread);
+
+    // Then the writer takes what is queued
+    Store(&recorder.writer_running, false);
+    Wake(&recorder.queued);
+    Join(&recorder.write_thread);
+
+    // Remove encoder listeners
+    E_RemoveListener(*recorder.video_encoder, &recorder);
+    if (recorder.has_audio) {
+        E_RemoveListener(*recorder.audio_encoder, &recorder);
+    }
+
+    // No more callbacks, give the frames back to the encoders
+    Drain(recorder.video_ring);
+    Drain(recorder.audio_ring);
+    ReleaseFrames(recorder.video, recorder.video_count);
+    ReleaseFrames(recorder.audio, recorder.audio_count);
+
+    LOGI("CleanUp", "gracefully clean up recorder");
+    Store(&recorder.state, IDLE);
+}
+
+void S_SetRecording(S_Recorder& recorder, bool_t recording) {
+    Store(&recorder.recording, recording);
+}
+
+void S_GetStats(S_Recorder& recorder, S_RecordStats& stats) {
+    Lock(&recorder.stats_lock);
+    stats = recorder.stats;
+    Unlock(&recorder.stats_lock);
+    stats.queue_depth = (uint_t)Load(&recorder.queued) - (uint_t)Load(&recorder.written);
+}
+
+// Muxer thread: the batch being filled, nullptr while the writer
+// hasn't given it back
+static S_RecordBatch* FillBatch(S_Recorder& recorder) {
+    uint_t queued = Load(&recorder.queued);
+
+    if (queued - (uint_t)Load(&recorder.written) >= RECORD_BATCHES) {
+        return nullptr;
+    }
+    return &recorder.batches[queued % RECORD_BATCHES];
+}
+
+// Bytes the muxer can copy before the writer queue is full
+static sz_t Room(S_Recorder& recorder) {
+    uint_t pending = (uint_t)Load(&recorder.queued) - (uint_t)Load(&recorder.written);
+    S_RecordBatch* batch = FillBatch(recorder);
+
+    if (!batch) {
+        return 0;
+    }
+    return (RECORD_BATCHES - pending) * RECORD_BATCH_SIZE - batch->size;
+}
+
+// The batch goes to the writer, the next one is filled
+static void QueueBatch(S_Recorder& recorder, bool_t last) {
+    S_RecordBatch* batch = FillBatch(recorder);
+
+    if (!batch || (batch->size == 0 && !last)) {
+        return;
+    }
+    batch->last = last;
+    Store(&recorder.queued, Load(&recorder.queued) + 1);
+    Wake(&recorder.queued);
+}
+
+// Within Room(), a full batch is queued
+static void Append(S_Recorder& recorder, const void *data, sz_t size) {
+    auto bytes = static_cast<const byte_t*>(data);
+    S_RecordBatch* batch;
+    sz_t length;
+
+    while (size > 0 && (batch = FillBatch(recorder)) != nullptr) {
+        if (batch->size == 0) {
+            batch->file = recorder.file;
+            recorder.batch_start_us = NowMicros();
+        }
+        length = RECORD_BATCH_SIZE - batch->size;
+        length = size < length ? size : length;
+        Copy(batch->data + batch->size, bytes, length);
+        batch->size += length;
+        bytes += length;
+        size -= length;
+
+        if (batch->size == RECORD_BATCH_SIZE) {
+            QueueBatch(recorder, false);
+        }
+    }
+}
+
+// A batch that waited RECORD_SYNC_MS goes out early. It is padded with a
+// free box, so the next one is written from an aligned offset too.
+static void FlushBatch(S_Recorder& recorder) {
+    S_RecordBatch* batch = FillBatch(recorder);
+    byte_t box[RECORD_FREE_BOX_MIN] = {0, 0, 0, 0, 'f', 'r', 'e', 'e'};
+    sz_t padding;
+
+    if (!batch || batch->size == 0 ||
+        NowMicros() - recorder.batch_start_us < (tm_t)RECORD_SYNC_MS * 1000) {
+        return;
+    }
+
+    padding = (RECORD_ALIGN - batch->size % RECORD_ALIGN) % RECORD_ALIGN;
+    if (padding > 0 && padding < RECORD_FREE_BOX_MIN) {
+        padding += RECORD_ALIGN;
+    }
+    if (padding > 0 && batch->size + padding <= RECORD_BATCH_SIZE) {
+        WriteNalLength(box, (uint_t)padding); // Box size, big endian like a NAL length
+        Copy(batch->data + batch->size, box, sizeof(box));
+        Reset(batch->data + batch->size + sizeof(box), padding - sizeof(box));
+        batch->size += padding;
+        recorder.file_size += padding;
+    }
+    QueueBatch(recorder, false);
+}
+
+static void CloseRecordFile(S_Recorder& recorder) {
+    if (recorder.file < 0) {
+        return;
+    }
+    QueueBatch(recorder, true);
+    LOGI(LOG_TAG, "Recorded file %d, %zu bytes", recorder.file, recorder.file_size);
+    recorder.file = -1;
+}
+
+// A file starts with the init segment, in a batch of its own
+static bool_t OpenRecordFile(S_Recorder& recorder, tm_t start_us) {
+    S_RecordBatch* batch = FillBatch(recorder);
+
+    if (!batch || Room(recorder) < recorder.init_size + RECORD_HEADER_SIZE) {
+        return false;
+    }
+
+    recorder.file = recorder.next_file;
+    recorder.next_file = (recorder.next_file + 1) % RECORD_FILE_COUNT;
+    batch->first = true;
+
+    recorder.file_size = recorder.init_size;
+    recorder.file_start_us = start_us;
+    recorder.origin_us = start_us;
+    recorder.audio_dts_set = false;
+    recorder.fragment_seq = 0;
+    recorder.keyframe_requested = false;
+    recorder.gap = false;
+    Append(recorder, recorder.init, recorder.init_size);
+    return true;
+}
+
+// The encoder may change its parameter sets (resolution, restart):
+// the open file ends, the next one has the new init segment.
+// Return false while there is no init segment.
+static bool_t UpdateInit(S_Recorder& recorder) {
+    int_t version = E_ParamsVersion(*recorder.video_encoder);
+    int_t result;
+    sz_t length;
+
+    if (version == recorder.config_version) {
+        return recorder.init_size > 0;
+    }
+    version = E_GetConfig(*recorder.video_encoder, recorder.config, H265_CONFIG_SIZE, length);
+    if (version == 0) {
+        return false;
+    }
+
+    result = WriteMp4Init(recorder.config, length, recorder.has_audio, recorder.init, RECORD_INIT_SIZE);
+    if (result < 0) {
+        LOGE(LOG_TAG, "Failed to write init segment, version %d", version);
+    }
+    CloseRecordFile(recorder);
+    recorder.init_size = result < 0 ? 0 : result;
+    recorder.config_version = version;
+
+    // Older frames belong to the previous parameter sets
+    ReleaseFrames(recorder.video, recorder.video_count);
+    recorder.wait_keyframe = true;
+    return recorder.init_size > 0;
+}
+
+// Sample durations from the times since origin, so they add up without drift
+static uint_t Duration(const S_Recorder& recorder, tm_t time_us, tm_t next_us, uint_t timescale) {
+    return (uint_t)(Mp4Time(next_us - recorder.origin_us, timescale) -
+                    Mp4Time(time_us - recorder.origin_us, timescale));
+}
+
+// AUs up to end_us go into the fragment, their decode time follows the
+// last fragment unless the encoder clock moved away from it
+static sz_t TakeAudio(S_Recorder& recorder, tm_t end_us, Mp4Sample *samples) {
+    tm_t actual;
+    sz_t count = 0;
+    sz_t late = 0;
+
+    while (late < recorder.audio_count && recorder.audio[late]->timeUs < recorder.origin_us) {
+        late++;
+    }
+    DropFrames(recorder.audio, recorder.audio_count, late);
+
+    while (count < recorder.audio_count && count < RECORD_FRAGMENT_MAX_SAMPLES &&
+           recorder.audio[count]->timeUs < end_us) {
+        samples[count].duration = MP4_AAC_FRAME_SAMPLES;
+        samples[count].size = (uint_t)recorder.audio[count]->size;
+        samples[count].sync = true;
+        count++;
+    }
+    if (count == 0) {
+        return 0;
+    }
+
+    actual = Mp4Time(recorder.audio[0]->timeUs - recorder.origin_us, AUDIO_SAMPLE_RATE);
+    if (!recorder.audio_dts_set ||
+        actual > recorder.audio_dts + 2 * MP4_AAC_FRAME_SAMPLES ||
+        actual + 2 * MP4_AAC_FRAME_SAMPLES < recorder.audio_dts) {
+        recorder.audio_dts = actual;
+        recorder.audio_dts_set = true;
+    }
+    return count;
+}
+
+// The first count video frames and the AUs before end_us as moof + mdat,
+// copied into the batches. A fragment starting with an IDR may start a
+// new file. If the writer queue is full, the fragment is dropped and the
+// file goes on at the next IDR. The frames go back to the encoders.
+static void WriteFragment(S_Recorder& recorder, sz_t count, tm_t end_us) {
+    Mp4Sample video_samples[RECORD_FRAGMENT_MAX_SAMPLES];
+    Mp4Sample audio_samples[RECORD_FRAGMENT_MAX_SAMPLES];
+    sz_t frame_nals[RECORD_FRAGMENT_MAX_SAMPLES]; // End of each frame in nals
+    byte_t length[MP4_NAL_LENGTH_SIZE];
+    bool_t keyframe = IsKeyFrame(recorder.video[0]);
+    Mp4Run runs[2];
+    sz_t run_count = 1;
+    sz_t nal_count = 0;
+    sz_t data_size = 0;
+    sz_t audio_count;
+    sz_t nals;
+    sz_t i;
+    sz_t j;
+    int_t moof_size;
+    SharedFrame* frame;
+
+    // Files end on an IDR, past RECORD_SEGMENT_S or 3/4 of the preallocation
+    if (keyframe && recorder.file >= 0 &&
+        (recorder.video[0]->timeUs - recorder.file_start_us >= (tm_t)RECORD_SEGMENT_S * 1000000 ||
+         recorder.file_size >= (sz_t)RECORD_FILE_SIZE / 4 * 3)) {
+        CloseRecordFile(recorder);
+    }
+    if (keyframe && recorder.file < 0 && !OpenRecordFile(recorder, recorder.video[0]->timeUs)) {
+        LOGE(LOG_TAG, "Writer queue is full, no file is opened");
+    }
+    if (recorder.file < 0 || (recorder.gap && !keyframe)) {
+        DropFrames(recorder.video, recorder.video_count, count);
+        return;
+    }
+
+    for (i = 0; i < count; ++i) {
+        frame = recorder.video[i];
+        nals = ScanMp4Sample(frame->data, frame->size, recorder.nals + nal_count,
+                             RECORD_FRAGMENT_MAX_NALS - nal_count, video_samples[i].size);
+        if (nal_count + nals == RECORD_FRAGMENT_MAX_NALS) {
+            LOGE(LOG_TAG, "Too many NAL units in fragment, the rest is cut");
+        }
+        nal_count += nals;
+        frame_nals[i] = nal_count;
+
+        video_samples[i].duration = Duration(recorder,
+                                             frame->timeUs,
+                                             i + 1 < count ? recorder.video[i + 1]->timeUs : end_us,
+                                             VIDEO_SAMPLE_RATE);
+        video_samples[i].sync = IsKeyFrame(frame);
+        data_size += video_samples[i].size;
+    }
+    runs[0] = {MP4_VIDEO_TRACK,
+               Mp4Time(recorder.video[0]->timeUs - recorder.origin_us, VIDEO_SAMPLE_RATE),
+               video_samples,
+               count};
+
+    audio_count = TakeAudio(recorder, end_us, audio_samples);
+    if (audio_count > 0) {
+        runs[run_count++] = {MP4_AUDIO_TRACK, recorder.audio_dts, audio_samples, audio_count};
+        for (i = 0; i < audio_count; ++i) {
+            data_size += audio_samples[i].size;
+        }
+    }
+
+    moof_size = WriteMp4Fragment(recorder.fragment_seq + 1,
+                                 runs,
+                                 run_count,
+                                 data_size,
+                                 recorder.header,
+                                 RECORD_HEADER_SIZE);
+    if (moof_size < 0 || (sz_t)moof_size + data_size > Room(recorder)) {
+        if (moof_size < 0) {
+            LOGE(LOG_TAG, "Failed to write fragment of %zu bytes", data_size);
+        }
+        Lock(&recorder.stats_lock);
+        recorder.stats.dropped_fragments++;
+        Unlock(&recorder.stats_lock);
+        recorder.gap = true;
+        DropFrames(recorder.video, recorder.video_count, count);
+        DropFrames(recorder.audio, recorder.audio_count, audio_count);
+        return;
+    }
+
+    // Video as NAL length + NAL, audio AUs as they are
+    Append(recorder, recorder.header, moof_size);
+    for (i = 0, j = 0; i < count; ++i) {
+        frame = recorder.video[i];
+        for (; j < frame_nals[i]; ++j) {
+            const NalUnit& nal = recorder.nals[j];
+            WriteNalLength(length, (uint_t)(nal.end - nal.start - nal.codeSize));
+            Append(recorder, length, MP4_NAL_LENGTH_SIZE);
+            Append(recorder, frame->data + nal.start + nal.codeSize, nal.end - nal.start - nal.codeSize);
+        }
+    }
+    for (i = 0; i < audio_count; ++i) {
+        Append(recorder, recorder.audio[i]->data, recorder.audio[i]->size);
+    }
+
+    recorder.fragment_seq++;
+    recorder.file_size += moof_size + data_size;
+    recorder.gap = false;
+    recorder.audio_dts += audio_count * MP4_AAC_FRAME_SAMPLES;
+    DropFrames(recorder.video, recorder.video_count, count);
+    DropFrames(recorder.audio, recorder.audio_count, audio_count);
+
+    // Past the preallocation the file would grow in small extents
+    if (!recorder.keyframe_requested && recorder.file_size >= (sz_t)RECORD_FILE_SIZE / 4 * 3) {
+        recorder.keyframe_requested = true;
+        E_RequestKeyFrame(*recorder.video_encoder);
+    }
+}
+
+// Pending frames become fragments: they end at an IDR or after
+// RECORD_FRAGMENT_MS. The last one is held for more frames unless
+// the next frame (at end_us) ends it, or cut.
+static void WriteFragments(S_Recorder& recorder, tm_t end_us, bool_t cut) {
+    sz_t count;
+
+    while (recorder.video_count > 0) {
+        tm_t start_us = recorder.video[0]->timeUs;
+
+        for (count = 1; count < recorder.video_count; ++count) {
+            if (IsKeyFrame(recorder.video[count]) ||
+                recorder.video[count]->timeUs - start_us >= (tm_t)RECORD_FRAGMENT_MS * 1000 ||
+                count == RECORD_FRAGMENT_MAX_SAMPLES) {
+                break;
+            }
+        }
+
+        if (count < recorder.video_count) {
+            WriteFragment(recorder, count, recorder.video[count]->timeUs);
+        } else if (cut || end_us - start_us >= (tm_t)RECORD_FRAGMENT_MS * 1000 ||
+                   count == RECORD_FRAGMENT_MAX_SAMPLES) {
+            WriteFragment(recorder, count, end_us);
+        } else {
+            break;
+        }
+    }
+}
+
+// Not recording: the pre-roll starts at the last IDR that is
+// RECORD_PREROLL_MS before now, or the oldest one. AUs before it go.
+static void TrimPreroll(S_Recorder& recorder, tm_t now_us) {
+    sz_t start = 0;
+    sz_t late = 0;
+
+    while (start < recorder.video_count && !IsKeyFrame(recorder.video[start])) {
+        start++;
+    }
+    for (sz_t i = start + 1; i < recorder.video_count; ++i) {
+        if (IsKeyFrame(recorder.video[i]) &&
+            recorder.video[i]->timeUs + (tm_t)RECORD_PREROLL_MS * 1000 <= now_us) {
+            start = i;
+        }
+    }
+    DropFrames(recorder.video, recorder.video_count, start);
+
+    now_us = recorder.video_count > 0 ? recorder.video[0]->timeUs : now_us;
+    while (late < recorder.audio_count && recorder.audio[late]->timeUs < now_us) {
+        late++;
+    }
+    DropFrames(recorder.audio, recorder.audio_count, late);
+}
+
+// Full pre-roll (a long GOP): the oldest GOP goes
+static void DropGop(S_Recorder& recorder) {
+    sz_t count = 1;
+
+    while (count < recorder.video_count && !IsKeyFrame(recorder.video[count])) {
+        count++;
+    }
+    DropFrames(recorder.video, recorder.video_count, count);
+    if (recorder.video_count == 0) {
+        recorder.wait_keyframe = true;
+    }
+}
+
+// Muxer thread: the frame ends the pending fragment when recording,
+// else it goes into the pre-roll
+static void MuxFrame(S_Recorder& recorder, SharedFrame* frame) {
+    bool_t keyframe = IsKeyFrame(frame);
+
+    if (!UpdateInit(recorder) ||
+        (recorder.video_count > 0 && frame->timeUs <= recorder.video[recorder.video_count - 1]->timeUs)) {
+        Release(frame);
+        return;
+    }
+
+    if (Load(&recorder.recording)) {
+        WriteFragments(recorder, frame->timeUs, keyframe);
+        FlushBatch(recorder);
+    } else {
+        if (recorder.file >= 0) {
+            WriteFragments(recorder, frame->timeUs, true);
+            CloseRecordFile(recorder);
+        }
+        if (keyframe) {
+            TrimPreroll(recorder, frame->timeUs);
+        }
+    }
+
+    if (keyframe) {
+        recorder.wait_keyframe = false;
+    }
+    if (recorder.wait_keyframe) {
+        Release(frame);
+        return;
+    }
+    if (recorder.video_count == RECORD_PREROLL_VIDEO_FRAMES) {
+        DropGop(recorder);
+        if (recorder.wait_keyframe && !keyframe) {
+            Release(frame);
+            return;
+        }
+        recorder.wait_keyframe = false;
+    }
+    // The reference from the ring goes to the pending frames
+    recorder.video[recorder.video_count++] = frame;
+}
+
+// AUs wait for the fragment they fall into, the oldest is dropped if too many
+static void PopAudio(S_Recorder& recorder) {
+    SharedFrame* frame;
+
+    while ((frame = Pop(recorder.audio_ring)) != nullptr) {
+        if (recorder.audio_count == RECORD_PREROLL_AUDIO_FRAMES) {
+            DropFrames(recorder.audio, recorder.audio_count, 1);
+        }
+        recorder.audio[recorder.audio_count++] = frame;
+    }
+}
+
+static void StartMuxing(S_Recorder& recorder) {
+    SetThreadName("Recorder");
+
+    SharedFrame* frame;
+
+    // Video paces the fragments, AUs are taken along
+    while (Load(&recorder.state) == RECORD) {
+        PopAudio(recorder);
+
+        frame = Pop(recorder.video_ring);
+        if (frame) {
+            MuxFrame(recorder, frame);
+        } else {
+            Sleep(recorder.video_ring);
+        }
+    }
+
+    // The last fragment lasts one more frame interval. It may be the
+    // first one, the file isn't open yet then.
+    if ((recorder.file >= 0 || Load(&recorder.recording)) && recorder.video_count > 0) {
+        WriteFragments(recorder,
+                       recorder.video[recorder.video_count - 1]->timeUs + 1000000 / VIDEO_DEFAULT_FRAME_RATE,
+                       true);
+    }
+    CloseRecordFile(recorder);
+}
+
+// Writer thread
+static void CountError(S_Recorder& recorder) {
+    Lock(&recorder.stats_lock);
+    recorder.stats.errors++;
+    Unlock(&recorder.stats_lock);
+}
+
+// Writer thread: dirty data is synced at most every RECORD_SYNC_MS
+static void SyncFile(S_Recorder& recorder, bool_t force) {
+    tm_t now = NowMicros();
+
+    if (recorder.fd < 0 || !recorder.dirty ||
+        (!force && now - recorder.synced_us < (tm_t)RECORD_SYNC_MS * 1000)) {
+        return;
+    }
+    if (SyncData(recorder.fd) < 0) {
+        LOGE(LOG_TAG, "Failed to sync, errno %d", errno);
+        CountError(recorder);
+    }
+    recorder.synced_us = NowMicros();
+    recorder.dirty = false;
+
+    Lock(&recorder.stats_lock);
+    recorder.sync_ms_sum += (double_t)(recorder.synced_us - now) / 1000;
+    recorder.syncs++;
+    Unlock(&recorder.stats_lock);
+}
+
+static void CloseWrittenFile(S_Recorder& recorder) {
+    if (recorder.fd < 0) {
+        return;
+    }
+    SyncFile(recorder, true);
+    CloseFile(recorder.fd, recorder.fd_offset);
+    recorder.fd = -1;
+}
+
+static void OpenWrittenFile(S_Recorder& recorder, int_t file) {
+    char_t path[RECORD_PATH_SIZE];
+
+    CloseWrittenFile(recorder);
+    FilePath(file, path);
+    recorder.fd = CreateFile(path);
+    recorder.fd_offset = 0;
+    recorder.fd_failed = recorder.fd < 0;
+    recorder.synced_us = NowMicros();
+    recorder.dirty = false;
+
+    if (recorder.fd < 0) {
+        LOGE(LOG_TAG, "Failed to open %s, errno %d", path, errno);
+        CountError(recorder);
+        return;
+    }
+    // Contiguous extents, no allocation on the write path. Not every
+    // file system has it, writing works without.
+    if (Preallocate(recorder.fd, RECORD_FILE_SIZE) < 0) {
+        LOGE(LOG_TAG, "Failed to preallocate %s, errno %d", path, errno);
+    }
+}
+
+// Writer thread, the batch is empty again for the muxer
+static void WriteBatch(S_Recorder& recorder, S_RecordBatch& batch) {
+    tm_t start_us;
+    double_t write_ms;
+
+    if (batch.first) {
+        OpenWrittenFile(recorder, batch.file);
+    }
+
+    if (recorder.fd >= 0 && !recorder.fd_failed && batch.size > 0) {
+        start_us = NowMicros();
+        if (!WriteAt(recorder.fd, batch.data, batch.size, recorder.fd_offset)) {
+            // No space or I/O error, the file ends here
+            LOGE(LOG_TAG, "Failed to write file %d, errno %d", batch.file, errno);
+            CountError(recorder);
+            recorder.fd_failed = true;
+        } else {
+            write_ms = (double_t)(NowMicros() - start_us) / 1000;
+            recorder.fd_offset += batch.size;
+            recorder.dirty = true;
+
+            Lock(&recorder.stats_lock);
+            recorder.write_ms_sum += write_ms;
+            recorder.writes++;
+            if (write_ms > recorder.stats.max_write_ms) {
+                recorder.stats.max_write_ms = write_ms;
+            }
+            recorder.stats.written_bytes += batch.size;
+            Unlock(&recorder.stats_lock);
+        }
+    }
+
+    if (batch.last) {
+        CloseWrittenFile(recorder);
+    } else {
+        SyncFile(recorder, false);
+    }
+    batch.size = 0;
+    batch.first = false;
+    batch.last = false;
+}
+
+static void LogStats(S_Recorder& recorder, sz_t depth) {
+    tm_t now = NowMicros();
+
+    Lock(&recorder.stats_lock);
+    recorder.stats.queue_depth = depth;
+    if (depth > recorder.stats.max_queue_depth) {
+        recorder.stats.max_queue_depth = depth;
+    }
+    if (now - recorder.log_us < (tm_t)STATS_LOG_INTERVAL * 1000) {
+        Unlock(&recorder.stats_lock);
+        return;
+    }
+
+    recorder.stats.write_ms = recorder.writes > 0 ? recorder.write_ms_sum / recorder.writes : 0;
+    recorder.stats.sync_ms = recorder.syncs > 0 ? recorder.sync_ms_sum / recorder.syncs : 0;
+    LOGI(LOG_TAG,
+         "queue %zu/%d (max %zu), write avg %.2f ms (max %.2f ms), sync avg %.2f ms, "
+         "written %zu bytes, dropped %zu fragments, errors %zu",
+         recorder.stats.queue_depth, RECORD_BATCHES, recorder.stats.max_queue_depth,
+         recorder.stats.write_ms, recorder.stats.max_write_ms, recorder.stats.sync_ms,
+         recorder.stats.written_bytes, recorder.stats.dropped_fragments, recorder.stats.errors);
+
+    recorder.stats.max_queue_depth = depth;
+    recorder.stats.max_write_ms = 0;
+    recorder.write_ms_sum = 0;
+    recorder.writes = 0;
+    recorder.sync_ms_sum = 0;
+    recorder.syncs = 0;
+    recorder.log_us = now;
+    Unlock(&recorder.stats_lock);
+}
+
+static void StartWriting(S_Recorder& recorder) {
+    SetThreadName("RecordWriter");
+
+    int_t queued;
+    int_t written;
+
+    // Queued batches are written before it stops
+    while (true) {
+        queued = Load(&recorder.queued);
+        written = Load(&recorder.written);
+        LogStats(recorder, (uint_t)queued - (uint_t)written);
+
+        if (queued == written) {
+            if (!Load(&recorder.writer_running)) {
+                break;
+            }
+            // Recording may pause with data not synced yet
+            SyncFile(recorder, false);
+            Sleep(&recorder.queued, queued, FRAME_RING_WAIT_US);
+            continue;
+        }
+
+        WriteBatch(recorder, recorder.batches[(uint_t)written % RECORD_BATCHES]);
+        Store(&recorder.written, written + 1);
+    }
+    CloseWrittenFile(recorder);
+}
+
+// Encoder thread: only a reference goes to the ring, skip to the next
+// keyframe if the muxer is behind
+static void ProcessVideo(S_Recorder& recorder, SharedFrame* frame) {
+    bool_t keyframe = IsKeyFrame(frame);
+
+    if (Load(&recorder.state) != RECORD) {
+        return;
+    }
+
+    if (keyframe) {
+        recorder.skip_to_keyframe = false;
+    } else if (!recorder.skip_to_keyframe && Full(recorder.video_ring)) {
+        recorder.skip_to_keyframe = true;
+        E_RequestKeyFrame(*recorder.video_encoder);
+    }
+
+    if (recorder.skip_to_keyframe) {
+        return;
+    }
+
+    Retain(frame);
+    if (!Push(recorder.video_ring, frame)) {
+        Release(frame);
+    }
+}
+
+// Encoder thread: drop the oldest AU if full
+static void ProcessAudio(S_Recorder& recorder, SharedFrame* frame) {
+    SharedFrame* dropped;
+
+    if (Load(&recorder.state) != RECORD) {
+        return;
+    }
+
+    if (Full(recorder.audio_ring) && (dropped = DropOldest(recorder.audio_ring)) != nullptr) {
+        Release(dropped);
+    }
+
+    Retain(frame);
+    if (!Push(recorder.audio_ring, frame)) {
+        Release(frame);
+    }
+}
+
+static void* StartMuxingThread(void* arg) {
+    auto recorder = static_cast<S_Recorder*>(arg);
+    if (recorder) {
+        StartMuxing(*recorder);
+    }
+    return nullptr;
+}
+
+static void* StartWritingThread(void* arg) {
+    auto recorder = static_cast<S_Recorder*>(arg);
+    if (recorder) {
+        StartWriting(*recorder);
+    }
+    return nullptr;
+}
+
+static void VideoCallback(void* ctx, SharedFrame* frame) {
+    auto recorder = static_cast<S_Recorder*>(ctx);
+    if (recorder) {
+        ProcessVideo(*recorder, frame);
+    }
+}
+
+static void AudioCallback(void* ctx, SharedFrame* frame) {
+    auto recorder = static_cast<S_Recorder*>(ctx);
+    if (recorder) {
+        ProcessAudio(*recorder, frame);
+    }
+}
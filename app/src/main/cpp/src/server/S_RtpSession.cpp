@@ -2,28 +2,35 @@
 #include "utils/Platform.h"
 
 void S_Init(S_RtpSession& session,
-            E_H265* video_encoder,
+            S_VideoStream* video_stream,
             E_AAC* audio_encoder) {
     S_Init(session.audio_stream, audio_encoder);
-    S_Init(session.video_stream, video_encoder);
+    S_Init(session.video_viewer, video_stream);
+}
+
+void S_Init(S_RtpStart& start, tm_t connect_us) {
+    start.ssrc = RandomInt();
+    start.seq = RandomShort();
+    start.rtptime = RandomInt();
+    start.connect_us = connect_us;
 }
 
 void S_Start(S_RtpSession& session,
-             CancellableSocket* socket,
-             int_t video_interleave,
-             int_t audio_interleave) {
-
-    if (video_interleave >= 0) {
-        S_Start(session.video_stream,
-                socket,
-                video_interleave,
-                RandomInt());
+             const S_Transport& video_transport,
+             const S_Transport& audio_transport,
+             const S_RtpStart& video_start,
+             const S_RtpStart& audio_start) {
+
+    // Only start tracks which are SETUP
+    if (video_transport.type != TRANSPORT_NONE) {
+        S_Start(session.video_viewer,
+                video_transport,
+                video_start);
     }
-    if (audio_interleave >= 0) {
+    if (audio_transport.type != TRANSPORT_NONE) {
         S_Start(session.audio_stream,
-                socket,
-                audio_interleave,
-                RandomInt());
+                audio_transport,
+                audio_start);
     }
 }
 
@@ -31,7 +38,7 @@ void S_Prepare(S_RtpSession& session,
                bool_t video,
                bool_t audio) {
     if (video) {
-        S_Prepare(session.video_stream);
+        S_Prepare(session.video_viewer);
     }
     if (audio) {
         S_Prepare(session.audio_stream);
@@ -39,12 +46,34 @@ void S_Prepare(S_RtpSession& session,
 }
 
 void S_Stop(S_RtpSession& session) {
-    S_Stop(session.video_stream);
+    S_Stop(session.video_viewer);
     S_Stop(session.audio_stream);
 }
 
+bool_t S_ReapZeroCopy(S_RtpSession& session) {
+    return S_ReapZeroCopy(session.video_viewer);
+}
+
 bool_t S_IsRunning(const S_RtpSession& session) {
-    bool_t video_running = S_IsRunning(session.video_stream);
+    bool_t video_running = S_IsRunning(session.video_viewer);
     bool_t audio_running = S_IsRunning(session.audio_stream);
     return video_running && audio_running;
 }
+
+bool_t S_IsPlaying(const S_RtpSession& session, bool_t video) {
+    if (video) {
+        return Load(&session.video_viewer.state) == RECORD;
+    }
+    return Load(&session.audio_stream.state) == RECORD;
+}
+
+void S_HandleRtcp(S_RtpSession& session,
+                  bool_t video,
+                  const byte_t *data,
+                  sz_t size) {
+    if (video) {
+        S_HandleRtcp(session.video_viewer, data, size);
+    } else {
+        S_HandleRtcp(session.audio_stream, data, size);
+    }
+}
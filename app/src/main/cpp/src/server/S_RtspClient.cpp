@@ -1,324 +1,680 @@
 #include "server/S_RtspClient.h"
 
-#define MAX_BUFFER_LEN 2048
-#define CLIENT_ID_LEN 10
-#define MAX_SDP_LEN 1024
+#define SDP_SESSION_LEN 256
+#define SDP_AUDIO_ONLY_VERSION 1 // No parameter sets to wait for
 
-#define SEQ_KEYWORD "CSeq:"
+#define CLIENT_PORT_KEYWORD "client_port="
 #define TRACK_ID_KEYWORD "trackID="
 #define LOG_TAG "RTSPClient"
 
+#define CLOSE_REAP_INTERVAL_US 10000
+
 void S_Init(S_RtspClient& client,
             S_RtspMedia* media,
-            E_H265* video_encoder,
+            S_VideoStream* video_stream,
             E_AAC* audio_encoder) {
     static int_t i = 0;
-    S_Init(client.rtp_session, video_encoder, audio_encoder);
+    S_Init(client.rtp_session, video_stream, audio_encoder);
 
     client.media = media;
     client.id = i++;
-
-    Init(&client.thread);
-    Init(&client.thread_start);
+    client.recv_start = 0;
+    client.recv_end = 0;
+    client.send_len = 0;
+    Reset(client.parser);
+    client.poll_fd = -1;
+    client.slot = -1;
+    client.closing = false;
+
+    client.socket.socket = -1;
+    Init(&client.socket.send_lock);
+    S_Init(client.send_queue, &client.socket);
+
+    S_Init(client.video_transport);
+    S_Init(client.audio_transport);
 }
 
 int_t S_Accept(S_RtspClient& client, const CancellableSocket& server_socket) {
     return Accept(client.socket, server_socket);
 }
 
+static int_t HandleReceive(S_RtspClient &client,
+                           char_t *res_buf,
+                           sz_t res_size);
 static int_t HandleRequest(S_RtspClient &client,
                            char_t *res_buf,
                            sz_t res_size,
-                           char_t *recv_buf,
-                           sz_t recv_size,
-                           char_t *client_ip,
-                           char_t *client_id_str);
-static int_t FindTrackId(const char_t* request);
-static int_t FindCSeq(const char_t* request);
-static sz_t PrepareSdp(const S_RtspMedia* media,
-                       const char_t* client_ip,
-                       char_t* sdp,
-                       sz_t size);
-
-static void StartListen(S_RtspClient& client) {
-    char_t recv_buf[MAX_BUFFER_LEN];
-    char_t res_buf[MAX_BUFFER_LEN];
-    char_t client_ip[SOCKET_ADDR_LEN];
-    char_t client_id_str[CLIENT_ID_LEN];
-
-    GetSocketAddr(client.socket, client_ip, SOCKET_ADDR_LEN);
-    WriteStream(client_id_str, CLIENT_ID_LEN, "client_%d", client.id);
-
-    LOGI(LOG_TAG, "Client %s connected", client_ip);
+                           const RtspRequest &request);
+static int_t RenderSdp(S_RtspMedia& media);
+static bool_t WriteRtpInfo(const S_RtspClient& client,
+                           const RtspSpan& uri,
+                           const S_RtpStart& video_start,
+                           const S_RtpStart& audio_start,
+                           char_t* dst,
+                           sz_t size,
+                           sz_t& offset);
+
+void S_Open(S_RtspClient& client, int_t poll_fd, int_t slot) {
+    client.poll_fd = poll_fd;
+    client.slot = slot;
+    client.connect_us = NowMicros();
+    client.closing = false;
+    client.recv_start = 0;
+    client.recv_end = 0;
+    client.send_len = 0;
+    Reset(client.parser);
+    S_Reset(client.send_queue);
+
+    // Nothing blocks on this socket, what it doesn't take waits in the
+    // send queue, drained from the reactor (EPOLLOUT)
+    SetSendLowWater(client.socket.socket, RTSP_NOTSENT_LOWAT);
+    if (RTP_ZEROCOPY && EnableZeroCopy(client.socket.socket) < 0) {
+        LOGI(LOG_TAG, "MSG_ZEROCOPY not supported, error %d", errno);
+    }
+
+    GetSocketAddr(client.socket, client.ip, SOCKET_ADDR_LEN);
+    WriteStream(client.session_id, RTSP_CLIENT_ID_LEN, "client_%d", client.id);
+
+    if (AddPollWritable(poll_fd, client.socket.socket, RTSP_POLL_TOKEN(slot, RTSP_SOURCE_CONTROL)) < 0) {
+        LOGE(LOG_TAG, "Failed to poll client %s", client.ip);
+    }
+
+    LOGI(LOG_TAG, "Client %s connected", client.ip);
 
     // This function will prepare the metadata for sdp
     S_Prepare(client.rtp_session,
               client.media->video_idx >= 0,
               client.media->audio_idx >= 0);
+}
 
-    while (true) {
-        if (Wait(client.socket) < 0) {
-            break;
-        }
+// UDP tracks get their RTCP socket in SETUP, it joins the poll from there
+static void PollRtcp(S_RtspClient& client, const S_Transport& transport, int_t source) {
+    if (AddPoll(client.poll_fd,
+                transport.rtcp_socket,
+                RTSP_POLL_TOKEN(client.slot, source)) < 0) {
+        LOGE(LOG_TAG, "Failed to poll RTCP socket of %s", client.ip);
+    }
+}
+
+static void HandleUdpRtcp(S_RtspClient &client, int_t source) {
+    byte_t buffer[RTSP_BUFFER_LEN];
+    bool_t video = source == RTSP_SOURCE_VIDEO_RTCP;
+    const S_Transport& transport = video ? client.video_transport : client.audio_transport;
+    ssz_t received;
+
+    if (transport.type != TRANSPORT_UDP) {
+        return;
+    }
 
-        if (HandleRequest(
-                client,
-                res_buf,
-                MAX_BUFFER_LEN,
-                recv_buf,
-                MAX_BUFFER_LEN,
-                client_ip,
-                client_id_str) < 0) {
-            break;
+    // Edge-triggered, read all datagrams
+    while ((received = recv(transport.rtcp_socket, buffer, sizeof(buffer), MSG_DONTWAIT)) >= 0) {
+        if (received > 0) {
+            S_HandleRtcp(client.rtp_session, video, buffer, received);
         }
     }
+}
+
+int_t S_HandleEvent(S_RtspClient& client, int_t source) {
+    char_t res_buf[RTSP_SEND_BUFFER_LEN];
+    int_t result;
+
+    if (!IsConnected(client.socket)) {
+        return 0;
+    }
+
+    // Completions wake the reactor as EPOLLERR
+    if (client.closing) {
+        return S_ReapZeroCopy(client.rtp_session) ? 0 : -1;
+    }
+
+    if (source != RTSP_SOURCE_CONTROL) {
+        HandleUdpRtcp(client, source);
+        return 0;
+    }
+
+    // Writable: the socket took what was pending. Edge-triggered, the event
+    // only comes after a send found the socket full, so it's rarely empty.
+    if (S_Drain(client.send_queue) < 0) {
+        return -1;
+    }
+
+    // Readable: read until nothing is left
+    while ((result = HandleReceive(client, res_buf, RTSP_SEND_BUFFER_LEN)) > 0);
+    return result;
+}
+
+bool_t S_IsConnected(const S_RtspClient& client) {
+    return IsConnected(client.socket);
+}
+
+int_t S_QueueDepthMs(const S_RtspClient& client) {
+    return S_DepthMs(client.send_queue);
+}
+
+bool_t S_Sample(S_RtspClient& client, S_RateSample& sample) {
+    const S_Transport& transport = client.video_transport;
+
+    if (Load(&client.rtp_session.video_viewer.state) != RECORD) {
+        return false;
+    }
+
+    if (transport.type == TRANSPORT_UDP) {
+        S_SampleSocket(client.send_queue, transport.rtp_socket, false, sample);
+        sample.loss_percent = client.rtp_session.video_viewer.loss_percent;
+        return true;
+    }
+    S_SampleSocket(client.send_queue, client.socket.socket, true, sample);
+    return true;
+}
+
+// Nothing more is read or sent, the kernel still sends what it has.
+// A peer that doesn't ack it is reset, the completions come then.
+static void Linger(S_RtspClient& client) {
+    if (client.closing) {
+        return;
+    }
+    client.closing = true;
+    shutdown(client.socket.socket, SHUT_RDWR);
+    if (SetUserTimeout(client.socket.socket, ZEROCOPY_CLOSE_TIMEOUT_MS) < 0) {
+        LOGE(LOG_TAG, "Failed to set user timeout of %s, error %d", client.ip, errno);
+    }
+}
+
+void S_Close(S_RtspClient& client) {
+    if (!IsConnected(client.socket)) {
+        return;
+    }
+
+    if (!client.closing) {
+        S_Stop(client.rtp_session);
+        // Closed fds leave the poll
+        S_Close(client.video_transport);
+        S_Close(client.audio_transport);
+    }
+    if (S_ReapZeroCopy(client.rtp_session)) {
+        Linger(client);
+        return;
+    }
 
-    S_Stop(client.rtp_session);
     Destroy(client.socket);
-    LOGI(LOG_TAG, "Client %s disconnected, exiting listening loop.", client_ip);
+    client.closing = false;
+    LOGI(LOG_TAG, "Client %s disconnected", client.ip);
 }
 
-static void* StartClientThread(void* arg) {
-    S_RtspClient* client = static_cast<S_RtspClient*>(arg);
-    if (client) {
-        StartListen(*client);
+void S_CloseNow(S_RtspClient& client) {
+    tm_t deadline_us = NowMicros() + (tm_t)ZEROCOPY_CLOSE_TIMEOUT_MS * 1000;
+
+    S_Close(client);
+    while (client.closing && NowMicros() < deadline_us) {
+        usleep(CLOSE_REAP_INTERVAL_US);
+        S_Close(client);
+    }
+    if (client.closing) {
+        // Their frames are never released, the kernel may still read them
+        LOGE(LOG_TAG, "Client %s closed with zerocopy sends in flight", client.ip);
+        Destroy(client.socket);
+        client.closing = false;
     }
-    return nullptr;
 }
 
-void S_Start(S_RtspClient& client) {
-    if (GetAndSet(&client.thread_start, true)) {
-        Join(&client.thread); // Wait for previous thread to exit (if any)
+// RTCP from the client comes on odd channels (interleave + 1)
+static void HandleInterleaved(S_RtspClient &client, const RtspMessage &message) {
+    const S_RtspMedia* media = client.media;
+
+    if (media->video_idx >= 0 && message.channel == media->video_interleave + 1) {
+        S_HandleRtcp(client.rtp_session, true, message.data, message.size);
+    } else if (media->audio_idx >= 0 && message.channel == media->audio_interleave + 1) {
+        S_HandleRtcp(client.rtp_session, false, message.data, message.size);
     }
-    Start(&client.thread, StartClientThread, &client);
 }
 
-bool_t S_IsConnected(const S_RtspClient& client) {
-    return IsConnected(client.socket) && S_IsRunning(client.rtp_session);
+// Send the coalesced responses, return -1 if the client is gone
+static int_t Flush(S_RtspClient &client) {
+    ssz_t sent;
+
+    if (client.send_len == 0) {
+        return 0;
+    }
+
+    // Don't cut into a frame being sent by the streams,
+    // the rest of a partly sent one goes first
+    Lock(&client.socket.send_lock);
+    sent = S_SendControl(client.send_queue, client.send_buf, client.send_len);
+    Unlock(&client.socket.send_lock);
+
+    client.send_len = 0;
+    return sent < 0 ? -1 : 0;
+}
+
+// Queue a response behind the ones of the same read
+static int_t Reply(S_RtspClient &client, const char_t *response, sz_t size) {
+    if (client.send_len + size > RTSP_SEND_BUFFER_LEN && Flush(client) < 0) {
+        return -1;
+    }
+    size = size < RTSP_SEND_BUFFER_LEN ? size : RTSP_SEND_BUFFER_LEN;
+    Copy(client.send_buf + client.send_len, response, size);
+    client.send_len += size;
+    return 0;
 }
 
-void S_Stop(S_RtspClient& client) {
-    if (S_IsConnected(client)) {
-        Interrupt(client.socket);
+// The socket carries RTSP requests and interleaved frames (TCP transport),
+// a single recv() can end in the middle of either, keep the rest for later.
+// All complete messages are handled, pipelined requests get their
+// responses in one send.
+// Return 1 if something was read, 0 if nothing is left, -1 if the client is gone
+static int_t HandleReceive(S_RtspClient &client,
+                           char_t *res_buf,
+                           sz_t res_size) {
+    byte_t *recv_buf = client.recv_buf;
+    sz_t &start = client.recv_start;
+    sz_t &end = client.recv_end;
+    RtspMessage message;
+    ssz_t received;
+    sz_t consumed;
+
+    // Room for the rest of a message at the end
+    if (end == RTSP_BUFFER_LEN && start > 0) {
+        Move(recv_buf, recv_buf + start, end - start);
+        end -= start;
+        start = 0;
+    }
+
+    // Read what is available
+    received = Receive(client.socket,
+                       recv_buf + end,
+                       RTSP_BUFFER_LEN - end,
+                       MSG_DONTWAIT);
+    if (received < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        return 0;
+    }
+    if (received <= 0) {
+        return -1;
+    }
+    end += received;
+
+    while ((consumed = ParseRtsp(client.parser, recv_buf + start, end - start, RTSP_BUFFER_LEN, message)) > 0) {
+        if (message.type == RTSP_INTERLEAVED) {
+            HandleInterleaved(client, message);
+
+        } else if (message.type == RTSP_REQUEST &&
+                   HandleRequest(client, res_buf, res_size, message.request) < 0) {
+            return -1;
+        }
+        start += consumed;
+    }
+
+    if (start == end) {
+        start = 0;
+        end = 0;
     }
-    if (GetAndSet(&client.thread_start, false)) {
-        Join(&client.thread);
+
+    // Nothing we understand fills the whole buffer, drop it
+    if (start == 0 && end == RTSP_BUFFER_LEN) {
+        LOGE(LOG_TAG, "Drop %zu unknown bytes", end);
+        end = 0;
+        Reset(client.parser);
     }
+
+    return Flush(client) < 0 ? -1 : 1;
+}
+
+// Given session of PLAY / TEARDOWN, a missing one is taken as ours:
+// a pipelining player sends PLAY before it has seen the SETUP reply
+static bool_t IsOurSession(const S_RtspClient &client, const RtspRequest &request) {
+    return request.session.len == 0 ||
+           Equals(FirstParam(request.session), client.session_id);
 }
 
 static int_t HandleRequest(S_RtspClient &client,
                            char_t *res_buf,
                            sz_t res_size,
-                           char_t *recv_buf,
-                           sz_t recv_size,
-                           char_t *client_ip,
-                           char_t *client_id_str) {
-    ssz_t received;
-    char_t sdp_buffer[MAX_SDP_LEN];
-    sz_t sdp_length;
+                           const RtspRequest &request) {
+    char_t sdp_session[SDP_SESSION_LEN];
+    int_t sdp_length;
+    S_RtpStart video_start;
+    S_RtpStart audio_start;
+    int_t res_length;
+    sz_t res_offset;
+    int_t sdp_result;
     int_t track_id;
     int_t interleave;
+    int_t client_port;
     int_t cseq;
-    const char_t* transport;
+    S_Transport* transport;
     S_RtspMedia* media;
-
-    // Read the request
-    received = Receive(client.socket,
-                       recv_buf,
-                       recv_size - 1, // -1 is for "\0"
-                       0);
-    if (received <= 0) {
-        return -1;
-    }
-    recv_buf[received] = '\0';
+    const RtspSpan& method = request.method;
 
     // Parse request
     media = client.media;
-    track_id = FindTrackId(recv_buf);
+    track_id = FindInt(request.uri, TRACK_ID_KEYWORD);
 
-    cseq = FindCSeq(recv_buf);
+    cseq = request.cseq;
     if (cseq < 0) {
-        // Can be RTCP/TCP request while streaming
-        // But we don't handle it for now
         LOGI(LOG_TAG, "Encounter non RTSP request");
         return 0;
     }
 
-    if (FindSubString(recv_buf, "OPTIONS")) {
-        WriteStream(res_buf,
-                    res_size,
-                    "RTSP/1.0 200 OK\r\n"
-                    "CSeq: %d\r\n"
-                    "Public: OPTIONS, DESCRIBE, SETUP, PLAY, TEARDOWN\r\n"
-                    "\r\n",
-                    cseq);
-
-    } else if (FindSubString(recv_buf, "DESCRIBE")) {
-        sdp_length = PrepareSdp(
-                client.media,
-                client_ip,
-                sdp_buffer,
-                MAX_SDP_LEN);
-        WriteStream(res_buf,
-                    res_size,
-                    "RTSP/1.0 200 OK\r\n"
-                    "CSeq: %d\r\n"
-                    "Content-Type: application/sdp\r\n"
-                    "Content-Length: %zu\r\n"
-                    "\r\n"
-                    "%s",
-                    cseq,
-                    sdp_length,
-                    sdp_buffer);
-
-    } else if (FindSubString(recv_buf, "SETUP") && track_id >= 0) {
-        transport = FindSubString(recv_buf, "Transport: RTP/AVP/TCP");
+    if ((Equals(method, "PLAY") || Equals(method, "TEARDOWN")) &&
+        !IsOurSession(client, request)) {
+        res_length = WriteStream(res_buf,
+                                 res_size,
+                                 "RTSP/1.0 454 Session Not Found\r\n"
+                                 "CSeq: %d\r\n"
+                                 "\r\n",
+                                 cseq);
+
+    } else if (Equals(method, "OPTIONS")) {
+        res_length = WriteStream(res_buf,
+                                 res_size,
+                                 "RTSP/1.0 200 OK\r\n"
+                                 "CSeq: %d\r\n"
+                                 "Public: OPTIONS, DESCRIBE, SETUP, PLAY, TEARDOWN\r\n"
+                                 "\r\n",
+                                 cseq);
+
+    } else if (Equals(method, "DESCRIBE")) {
+        sdp_result = RenderSdp(*media);
+        if (sdp_result == 0) {
+            res_length = WriteStream(res_buf,
+                                     res_size,
+                                     "RTSP/1.0 503 Service Unavailable\r\n"
+                                     "CSeq: %d\r\n"
+                                     "Retry-After: 1\r\n"
+                                     "\r\n",
+                                     cseq);
+        } else if (sdp_result < 0) {
+            res_length = -1;
+        } else {
+            // Only the session part has the client address
+            sdp_length = WriteStream(sdp_session,
+                                     SDP_SESSION_LEN,
+                                     "v=0\r\n"
+                                     "o=- 0 0 IN IP4 127.0.0.1\r\n"
+                                     "s=Camera Stream\r\n"
+                                     "c=IN IP4 %s\r\n"
+                                     "t=0 0\r\n"
+                                     "a=control:*\r\n",
+                                     client.ip);
+            if (sdp_length < 0 || sdp_length >= SDP_SESSION_LEN) {
+                res_length = -1;
+            } else {
+                res_length = WriteStream(res_buf,
+                                         res_size,
+                                         "RTSP/1.0 200 OK\r\n"
+                                         "CSeq: %d\r\n"
+                                         "Content-Type: application/sdp\r\n"
+                                         "Content-Length: %zu\r\n"
+                                         "\r\n"
+                                         "%s%s",
+                                         cseq,
+                                         sdp_length + media->sdp_len,
+                                         sdp_session,
+                                         media->sdp);
+            }
+        }
+
+    } else if (Equals(method, "SETUP") && track_id >= 0) {
         interleave = track_id == media->audio_idx ? media->audio_interleave :
                      track_id == media->video_idx ? media->video_interleave : -1;
-
-        // Only support TCP
-        if (transport) {
-            WriteStream(res_buf,
-                        res_size,
-                        "RTSP/1.0 200 OK\r\n"
-                        "CSeq: %d\r\n"
-                        "Transport: RTP/AVP/TCP;unicast;interleaved=%d-%d\r\n"
-                        "Session: %s\r\n"
-                        "\r\n",
-                        cseq,
-                        interleave, interleave + 1,
-                        client_id_str);
+        transport = track_id == media->audio_idx ? &client.audio_transport :
+                    track_id == media->video_idx ? &client.video_transport : nullptr;
+        client_port = FindInt(request.transport, CLIENT_PORT_KEYWORD);
+
+        // Its sockets are in use until TEARDOWN
+        if (transport && S_IsPlaying(client.rtp_session, transport == &client.video_transport)) {
+            res_length = WriteStream(res_buf,
+                                     res_size,
+                                     "RTSP/1.0 455 Method Not Valid in This State\r\n"
+                                     "CSeq: %d\r\n"
+                                     "Allow: OPTIONS, DESCRIBE, PLAY, TEARDOWN\r\n"
+                                     "\r\n",
+                                     cseq);
+
+        } else if (transport && Contains(request.transport, "RTP/AVP/TCP")) {
+            S_SetupTcp(*transport, &client.send_queue, interleave);
+            res_length = WriteStream(res_buf,
+                                     res_size,
+                                     "RTSP/1.0 200 OK\r\n"
+                                     "CSeq: %d\r\n"
+                                     "Transport: RTP/AVP/TCP;unicast;interleaved=%d-%d\r\n"
+                                     "Session: %s\r\n"
+                                     "\r\n",
+                                     cseq,
+                                     interleave, interleave + 1,
+                                     client.session_id);
+
+        } else if (transport && client_port > 0 &&
+                   S_SetupUdp(*transport, &client.send_queue, client_port)) {
+            PollRtcp(client,
+                     *transport,
+                     transport == &client.video_transport ?
+                     RTSP_SOURCE_VIDEO_RTCP : RTSP_SOURCE_AUDIO_RTCP);
+            res_length = WriteStream(res_buf,
+                                     res_size,
+                                     "RTSP/1.0 200 OK\r\n"
+                                     "CSeq: %d\r\n"
+                                     "Transport: RTP/AVP;unicast;client_port=%d-%d;server_port=%d-%d\r\n"
+                                     "Session: %s\r\n"
+                                     "\r\n",
+                                     cseq,
+                                     client_port, client_port + 1,
+                                     transport->server_port, transport->server_port + 1,
+                                     client.session_id);
 
         } else {
-            WriteStream(res_buf,
-                        res_size,
-                        "RTSP/1.0 461 Unsupported Transport\r\n"
-                        "CSeq: %d\r\n"
-                        "Public: OPTIONS, DESCRIBE, SETUP, PLAY, TEARDOWN\r\n"
-                        "Supported: Transport: RTP/AVP/TCP;unicast;interleaved=%d-%d\r\n"
-                        "\r\n",
-                        cseq,
-                        interleave, interleave + 1);
+            res_length = WriteStream(res_buf,
+                                     res_size,
+                                     "RTSP/1.0 461 Unsupported Transport\r\n"
+                                     "CSeq: %d\r\n"
+                                     "Public: OPTIONS, DESCRIBE, SETUP, PLAY, TEARDOWN\r\n"
+                                     "Supported: Transport: RTP/AVP/TCP;unicast;interleaved=%d-%d, RTP/AVP;unicast\r\n"
+                                     "\r\n",
+                                     cseq,
+                                     interleave, interleave + 1);
+        }
+
+    } else if (Equals(method, "PLAY")) {
+        // First seq / rtptime of each track are chosen now, the streams use them
+        S_Init(video_start, client.connect_us);
+        S_Init(audio_start, client.connect_us);
+
+        res_offset = 0;
+        if (AppendStream(res_buf,
+                         res_size,
+                         res_offset,
+                         "RTSP/1.0 200 OK\r\n"
+                         "CSeq: %d\r\n"
+                         "Session: %s\r\n"
+                         "Range: npt=now-\r\n",
+                         cseq,
+                         client.session_id) &&
+            WriteRtpInfo(client,
+                         request.uri,
+                         video_start,
+                         audio_start,
+                         res_buf,
+                         res_size,
+                         res_offset) &&
+            AppendStream(res_buf, res_size, res_offset, "\r\n")) {
+
+            // The responses so far (SETUP ...) and this one go before any media
+            if (Reply(client, res_buf, res_offset) < 0 || Flush(client) < 0) {
+                return -1;
+            }
+            S_Start(client.rtp_session,
+                    client.video_transport,
+                    client.audio_transport,
+                    video_start,
+                    audio_start);
+            return 0;
         }
+        res_length = -1;
 
-    } else if (FindSubString(recv_buf, "PLAY")) {
-        S_Start(client.rtp_session,
-                &client.socket,
-                media->video_interleave,
-                media->audio_interleave);
-
-        WriteStream(res_buf,
-                    res_size,
-                    "RTSP/1.0 200 OK\r\n"
-                    "CSeq: %d\r\n"
-                    "Session: %s\r\n"
-                    "\r\n",
-                    cseq,
-                    client_id_str);
-
-    } else if (FindSubString(recv_buf, "TEARDOWN")) {
+    } else if (Equals(method, "TEARDOWN")) {
         S_Stop(client.rtp_session);
+        S_Close(client.video_transport);
+        S_Close(client.audio_transport);
 
-        WriteStream(res_buf,
-                    res_size,
-                    "RTSP/1.0 200 OK\r\n"
-                    "CSeq: %d\r\n"
-                    "\r\n",
-                    cseq);
+        res_length = WriteStream(res_buf,
+                                 res_size,
+                                 "RTSP/1.0 200 OK\r\n"
+                                 "CSeq: %d\r\n"
+                                 "\r\n",
+                                 cseq);
 
     } else {
-        WriteStream(res_buf,
-                    res_size,
-                    "RTSP/1.0 501 Not Implemented\r\n"
-                    "CSeq: %d\r\n"
-                    "\r\n",
-                    cseq);
-    }
-
-    return Send(
-            client.socket,
-            res_buf,
-            Len(res_buf),
-            0);
-}
-
-// Find first number after TRACK_ID_KEYWORD
-static int_t FindTrackId(const char_t* request) {
-    const char_t* pos = FindSubString(request, TRACK_ID_KEYWORD);
-    if (!pos) {
-        return -1;
+        res_length = WriteStream(res_buf,
+                                 res_size,
+                                 "RTSP/1.0 501 Not Implemented\r\n"
+                                 "CSeq: %d\r\n"
+                                 "\r\n",
+                                 cseq);
     }
 
-    pos += Len(TRACK_ID_KEYWORD);
-    while (*pos == ' ' || *pos == '\t') {
-        pos++;
+    // A cut response would be taken for a whole one
+    if (res_length < 0 || (sz_t)res_length >= res_size) {
+        LOGE(LOG_TAG, "Response to %.*s doesn't fit", (int_t)method.len, method.data);
+        res_length = WriteStream(res_buf,
+                                 res_size,
+                                 "RTSP/1.0 500 Internal Server Error\r\n"
+                                 "CSeq: %d\r\n"
+                                 "\r\n",
+                                 cseq);
     }
-    return Int(pos);
+    return Reply(client, res_buf, res_length);
 }
 
-// Find first number after SEQ_KEYWORD
-static int_t FindCSeq(const char_t* request) {
-    const char_t* pos = FindSubString(request, SEQ_KEYWORD);
-    if (!pos) {
-        return -1;
-    }
+// Media sections of the SDP, rendered only when the parameter sets
+// change. The reactor never waits for the encoder: return 0 if it has
+// no parameter sets yet (the client retries), -1 if the SDP doesn't fit.
+static int_t RenderSdp(S_RtspMedia& media) {
+    char_t* sdp = media.sdp;
+    sz_t size = MAX_SDP_LEN;
+    sz_t offset = 0;
+    char_t vps[H265_PARAMS_SIZE], sps[H265_PARAMS_SIZE], pps[H265_PARAMS_SIZE];
+    int_t version = SDP_AUDIO_ONLY_VERSION;
+    bool_t fits = true;
 
-    pos += Len(SEQ_KEYWORD);
-    while (*pos == ' ' || *pos == '\t') {
-        pos++;
+    if (media.video_idx >= 0) {
+        version = E_ParamsVersion(*media.video_encoder);
+    }
+    if (version != 0 && version == media.sdp_version) {
+        return 1;
     }
 
-    return Int(pos);
-}
+    if (media.video_idx >= 0) {
+        version = E_GetParams(*media.video_encoder, vps, sps, pps, 0);
+        if (version == 0) {
+            LOGI(LOG_TAG, "No parameter sets yet");
+            return 0;
+        }
 
-static sz_t PrepareSdp(const S_RtspMedia* media,
-                       const char_t* client_ip,
-                       char_t* sdp,
-                       sz_t size) {
-    sz_t offset = 0;
-    char_t vps[256], sps[256], pps[256];
+        fits = fits && AppendStream(sdp, size, offset,
+                                    "\r\n"
+                                    "m=video 0 RTP/AVP %d %d",
+                                    H265_PAYLOAD_TYPE, RTX_PAYLOAD_TYPE);
+        if (FEC_ENABLED) {
+            fits = fits && AppendStream(sdp, size, offset, " %d", FEC_PAYLOAD_TYPE);
+        }
+        fits = fits && AppendStream(sdp, size, offset,
+                                    "\r\n"
+                                    "a=rtpmap:%d H265/%d\r\n"
+                                    "a=fmtp:%d sprop-vps=%s;sprop-sps=%s;sprop-pps=%s\r\n"
+                                    "a=rtpmap:%d rtx/%d\r\n"
+                                    "a=fmtp:%d apt=%d;rtx-time=%d\r\n"
+                                    "a=rtcp-fb:%d nack\r\n"
+                                    "a=rtcp-fb:%d nack pli\r\n"
+                                    "a=rtcp-fb:%d ccm fir\r\n",
+                                    H265_PAYLOAD_TYPE, VIDEO_SAMPLE_RATE,
+                                    H265_PAYLOAD_TYPE, vps, sps, pps,
+                                    RTX_PAYLOAD_TYPE, VIDEO_SAMPLE_RATE,
+                                    RTX_PAYLOAD_TYPE, H265_PAYLOAD_TYPE, RTX_HISTORY_MS,
+                                    H265_PAYLOAD_TYPE,
+                                    H265_PAYLOAD_TYPE,
+                                    H265_PAYLOAD_TYPE);
+
+        // FlexFEC repair packets, repair window in microseconds
+        if (FEC_ENABLED) {
+            fits = fits && AppendStream(sdp, size, offset,
+                                        "a=rtpmap:%d flexfec/%d\r\n"
+                                        "a=fmtp:%d repair-window=%d\r\n",
+                                        FEC_PAYLOAD_TYPE, VIDEO_SAMPLE_RATE,
+                                        FEC_PAYLOAD_TYPE, FEC_REPAIR_WINDOW_MS * 1000);
+        }
+        fits = fits && AppendStream(sdp, size, offset,
+                                    "a=control:trackID=%d\r\n",
+                                    media.video_idx);
+    }
 
-    if (!media) {
-        return 0;
+    if (media.audio_idx >= 0) {
+        fits = fits && AppendStream(sdp, size, offset,
+                                    "\r\n"
+                                    "m=audio 0 RTP/AVP %d\r\n"
+                                    "a=rtpmap:%d MPEG4-GENERIC/%d/%d\r\n"
+                                    "a=fmtp:%d streamtype=5; profile-level-id=15; mode=AAC-hbr; config=1208; SizeLength=13; IndexLength=3; IndexDeltaLength=3;\r\n"
+                                    "a=maxptime:%zu\r\n"
+                                    "a=control:trackID=%d\r\n",
+                                    AAC_PAYLOAD_TYPE,
+                                    AAC_PAYLOAD_TYPE, AUDIO_SAMPLE_RATE, AUDIO_CHANNEL_COUNT,
+                                    AAC_PAYLOAD_TYPE,
+                                    S_MaxPacketTimeMs(),
+                                    media.audio_idx);
     }
 
-    offset += WriteStream(sdp + offset, size - offset,
-                          "v=0\r\n"
-                          "o=- 0 0 IN IP4 127.0.0.1\r\n"
-                          "s=Camera Stream\r\n"
-                          "c=IN IP4 %s\r\n"
-                          "t=0 0\r\n"
-                          "a=control:*\r\n",
-                          client_ip);
-
-    if (media->video_idx >= 0) {
-
-        E_GetParams(*media->video_encoder, vps, sps, pps);
-        offset += WriteStream(sdp + offset, size - offset,
-                              "\r\n"
-                              "m=video 0 RTP/AVP %d\r\n"
-                              "a=rtpmap:%d H265/%d\r\n"
-                              "a=fmtp:%d sprop-vps=%s;sprop-sps=%s;sprop-pps=%s\r\n"
-                              "a=control:trackID=%d\r\n",
-                              H265_PAYLOAD_TYPE,
-                              H265_PAYLOAD_TYPE, VIDEO_SAMPLE_RATE,
-                              H265_PAYLOAD_TYPE, vps, sps, pps,
-                              media->video_idx);
-    }
-
-    if (media->audio_idx >= 0) {
-        offset += WriteStream(sdp + offset, size - offset,
-                              "\r\n"
-                              "m=audio 0 RTP/AVP %d\r\n"
-                              "a=rtpmap:%d MPEG4-GENERIC/%d/%d\r\n"
-                              "a=fmtp:%d streamtype=5; profile-level-id=15; mode=AAC-hbr; config=1208; SizeLength=13; IndexLength=3; IndexDeltaLength=3;\r\n"
-                              "a=control:trackID=%d\r\n",
-                              AAC_PAYLOAD_TYPE,
-                              AAC_PAYLOAD_TYPE, AUDIO_SAMPLE_RATE, AUDIO_CHANNEL_COUNT,
-                              AAC_PAYLOAD_TYPE,
-                              media->audio_idx);
+    // Rendered again by the next DESCRIBE
+    if (!fits) {
+        LOGE(LOG_TAG, "SDP is larger than %d bytes", MAX_SDP_LEN);
+        media.sdp_version = 0;
+        return -1;
     }
 
     sdp[offset] = '\0';
-    return offset;
+    media.sdp_len = offset;
+    media.sdp_version = version;
+    LOGI(LOG_TAG, "SDP rendered for parameter sets %d", version);
+    return 1;
+}
+
+// Tracks that are SETUP, the url of each is its SDP control under the PLAY url.
+// Return false if it doesn't fit.
+static bool_t WriteRtpInfo(const S_RtspClient& client,
+                           const RtspSpan& uri,
+                           const S_RtpStart& video_start,
+                           const S_RtpStart& audio_start,
+                           char_t* dst,
+                           sz_t size,
+                           sz_t& offset) {
+    const S_RtspMedia* media = client.media;
+    int_t base_len = uri.len > 0 && uri.data[uri.len - 1] == '/' ? uri.len - 1 : uri.len;
+    const char_t* separator = "RTP-Info: ";
+    sz_t start = offset;
+
+    if (client.video_transport.type != TRANSPORT_NONE) {
+        if (!AppendStream(dst, size, offset,
+                          "%surl=%.*s/" TRACK_ID_KEYWORD "%d;seq=%u;rtptime=%u",
+                          separator,
+                          base_len, uri.data,
+                          media->video_idx,
+                          video_start.seq,
+                          video_start.rtptime)) {
+            return false;
+        }
+        separator = ",";
+    }
+    if (client.audio_transport.type != TRANSPORT_NONE) {
+        if (!AppendStream(dst, size, offset,
+                          "%surl=%.*s/" TRACK_ID_KEYWORD "%d;seq=%u;rtptime=%u",
+                          separator,
+                          base_len, uri.data,
+                          media->audio_idx,
+                          audio_start.seq,
+                          audio_start.rtptime)) {
+            return false;
+        }
+        separator = ",";
+    }
+    if (offset > start) {
+        return AppendStream(dst, size, offset, "\r\n");
+    }
+    return true;
 }
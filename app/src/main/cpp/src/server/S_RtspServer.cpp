@@ -2,27 +2,49 @@
 
 #define LOG_TAG "RtspServer"
 
+// Tokens of the server fds, client tokens are RTSP_POLL_TOKEN(slot, source)
+#define POLL_LISTEN RTSP_POLL_TOKEN(RTSP_MAX_CONNECTIONS, 0)
+#define POLL_STOP RTSP_POLL_TOKEN(RTSP_MAX_CONNECTIONS + 1, 0)
+#define POLL_RATE RTSP_POLL_TOKEN(RTSP_MAX_CONNECTIONS + 2, 0)
+
+// RTSP socket + 2 RTCP sockets per client, listen socket, event fd, timer fd
+#define MAX_POLL_EVENTS (RTSP_MAX_CONNECTIONS * 3 + 3)
+
+#define BUSY_RESPONSE "RTSP/1.0 503 Service Unavailable\r\n" \
+                      "Retry-After: 5\r\n"                  \
+                      "\r\n"
+
 static void Reset(S_RtspServer& server) {
     server.media.video_idx = -1;
     server.media.video_interleave = -1;
     server.media.audio_idx = -1;
     server.media.audio_interleave = -1;
+
+    // Tracks may differ, the SDP is rendered again
+    server.media.sdp_len = 0;
+    server.media.sdp_version = 0;
 }
 
 void S_Init(S_RtspServer& server,
             E_H265* video_encoder,
             E_AAC* audio_encoder) {
 
-    // Initialize clients
+    // Initialize clients, video is shared
+    S_Init(server.video_stream, video_encoder);
     for (auto& client: server.clients) {
-        S_Init(client, &server.media, video_encoder, audio_encoder);
+        S_Init(client, &server.media, &server.video_stream, audio_encoder);
     }
 
     // Initialzie media
     server.media.video_encoder = video_encoder;
     server.media.audio_encoder = audio_encoder;
 
+    S_Init(server.rate_control, video_encoder);
+
     // Initialize threading
+    server.poll_fd = -1;
+    server.event_fd = -1;
+    server.timer_fd = -1;
     Init(&server.thread);
     Init(&server.is_running);
     Init(&server.is_stopping);
@@ -42,8 +64,106 @@ static void MarkStopped(S_RtspServer& server) {
     Store(&server.is_stopping, false);
 }
 
-static void StartListen(S_RtspServer& server) {
+// No free slot: answer 503 right away instead of leaving the
+// connection in the backlog, the client can retry later.
+// Return false if there is nothing to accept.
+static bool_t Reject(S_RtspServer& server) {
+    CancellableSocket socket;
+    char_t ip[SOCKET_ADDR_LEN];
+
+    if (Accept(socket, server.server_socket) < 0) {
+        return false;
+    }
+    GetSocketAddr(socket, ip, SOCKET_ADDR_LEN);
+    LOGE(LOG_TAG, "No available client slots, reject %s", ip);
+
+    Send(socket, BUSY_RESPONSE, Len(BUSY_RESPONSE), MSG_DONTWAIT | MSG_NOSIGNAL);
+    Destroy(socket);
+    return true;
+}
+
+// Edge-triggered, accept until the backlog is empty
+static void AcceptClients(S_RtspServer& server) {
     int_t client_idx;
+    bool_t accepted;
+
+    while (true) {
+        client_idx = AvailableSession(server);
+        if (client_idx < 0) {
+            accepted = Reject(server);
+        } else {
+            accepted = S_Accept(server.clients[client_idx], server.server_socket) == 0;
+            if (accepted) {
+                S_Open(server.clients[client_idx], server.poll_fd, client_idx);
+            }
+        }
+
+        if (accepted || errno == EINTR || errno == ECONNABORTED) {
+            continue;
+        }
+        if (errno != EAGAIN && errno != EWOULDBLOCK) {
+            LOGE(LOG_TAG, "Failed to accept client, error %d", errno);
+        }
+        break;
+    }
+}
+
+static void HandleClient(S_RtspServer& server, s_token_t token) {
+    int_t slot = RTSP_POLL_SLOT(token);
+
+    if (slot < 0 || slot >= RTSP_MAX_CONNECTIONS) {
+        return;
+    }
+    if (S_HandleEvent(server.clients[slot], RTSP_POLL_SOURCE(token)) < 0) {
+        S_Close(server.clients[slot]);
+    }
+}
+
+// Every RATE_CONTROL_INTERVAL_MS: the encoder follows the slowest client,
+// send queues measure depth at the new rate
+static void ControlRate(S_RtspServer& server) {
+    S_RateSample samples[RTSP_MAX_CONNECTIONS];
+    sz_t count = 0;
+    int_t bit_rate;
+
+    ReadTimer(server.timer_fd);
+    for (auto& client: server.clients) {
+        if (S_IsConnected(client) && S_Sample(client, samples[count])) {
+            ++count;
+        }
+    }
+    if (count == 0) {
+        return;
+    }
+
+    bit_rate = S_Update(server.rate_control, samples, count);
+    for (auto& client: server.clients) {
+        S_SetBitRate(client.send_queue, bit_rate + AUDIO_BIT_RATE);
+    }
+}
+
+// Sampling only runs with video
+static void StartRateControl(S_RtspServer& server) {
+    S_Reset(server.rate_control);
+    if (!RATE_CONTROL_ENABLED || server.media.video_idx < 0) {
+        return;
+    }
+    if (E_GetBitRate(*server.media.video_encoder) != server.rate_control.bit_rate) {
+        E_SetBitRate(*server.media.video_encoder, server.rate_control.bit_rate);
+    }
+
+    server.timer_fd = InitTimer(RATE_CONTROL_INTERVAL_MS);
+    if (server.timer_fd < 0 || AddPoll(server.poll_fd, server.timer_fd, POLL_RATE) < 0) {
+        LOGE(LOG_TAG, "Failed to start rate control, error %d", errno);
+    }
+}
+
+static void StartListen(S_RtspServer& server) {
+    s_event_t events[MAX_POLL_EVENTS];
+    s_token_t token;
+    int_t count;
+    int_t i;
+    bool_t stopping = false;
     int_t result = InitServer(
             server.server_socket,
             RTSP_PORT,
@@ -54,37 +174,56 @@ static void StartListen(S_RtspServer& server) {
         return;
     }
 
-    LOGI(LOG_TAG, "RTSP server listening on port %d", RTSP_PORT);
-    while (true) {
+    server.poll_fd = InitPoll();
+    if (server.poll_fd < 0 ||
+        AddPoll(server.poll_fd, server.server_socket.socket, POLL_LISTEN) < 0 ||
+        AddPoll(server.poll_fd, server.event_fd, POLL_STOP) < 0) {
+        LOGE(LOG_TAG, "Failed to setup poll, error %d", errno);
+        stopping = true;
+    } else {
+        StartRateControl(server);
+    }
 
-        // Stopped by flag
-        if (Load(&server.is_stopping)) {
-            break;
-        }
+    LOGI(LOG_TAG, "RTSP server listening on port %d", RTSP_PORT);
+    while (!stopping) {
 
-        // Stopped by interrupted
-        if (Wait(server.server_socket) < 0) {
+        // Idle clients cost nothing, the thread sleeps until an fd is ready
+        count = WaitPoll(server.poll_fd, events, MAX_POLL_EVENTS);
+        if (count < 0) {
+            LOGE(LOG_TAG, "Failed to poll, error %d", errno);
             break;
         }
 
-        // Due to limited resources, we only open maximum 2 connections.
-        // In reality, I only connect to 1 client anyway.
-        client_idx = AvailableSession(server);
-        if (client_idx < 0) {
-            // I believe there will be bug in this case, but don't bother trying that.
-            LOGE(LOG_TAG, "No available client slots, please wait for client disconnected");
-            continue;
+        for (i = 0; i < count; ++i) {
+            token = Token(events[i]);
+            if (token == POLL_STOP) {
+                stopping = true;
+            } else if (token == POLL_LISTEN) {
+                AcceptClients(server);
+            } else if (token == POLL_RATE) {
+                ControlRate(server);
+            } else {
+                HandleClient(server, token);
+            }
         }
 
-        result = S_Accept(server.clients[client_idx], server.server_socket);
-        if (result < 0) {
-            LOGE(LOG_TAG, "Failed to accept client, error code %d", result);
-            continue;
+        // Stopped by flag
+        if (Load(&server.is_stopping)) {
+            break;
         }
-
-        S_Start(server.clients[client_idx]);
     }
 
+    for (auto& client: server.clients) {
+        S_CloseNow(client);
+    }
+    if (server.timer_fd >= 0) {
+        close(server.timer_fd);
+        server.timer_fd = -1;
+    }
+    if (server.poll_fd >= 0) {
+        close(server.poll_fd);
+        server.poll_fd = -1;
+    }
     Destroy(server.server_socket);
     LOGI("CleanUp", "gracefully clean up rtsp server");
 }
@@ -118,12 +257,17 @@ void S_Start(S_RtspServer& server, bool_t start_video, bool_t start_audio) {
         server.media.audio_interleave = RTSP_AUDIO_INTERLEAVE;
     }
 
+    // Created here, S_Stop() may come before the thread polls it
+    server.event_fd = InitEvent();
+
     Start(&server.thread, StartServerThread, &server);
 }
 
 static void Join(S_RtspServer& server) {
-    Interrupt(server.server_socket);
+    Notify(server.event_fd);
     Join(&server.thread);
+    close(server.event_fd);
+    server.event_fd = -1;
 }
 
 void S_Stop(S_RtspServer& server) {
@@ -134,9 +278,7 @@ void S_Stop(S_RtspServer& server) {
         return;
     }
 
-    for (auto& client: server.clients) {
-        S_Stop(client);
-    }
+    // The reactor closes the clients on its way out
     Join(server);
     MarkStopped(server);
 }
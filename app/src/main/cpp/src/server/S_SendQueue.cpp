@@ -0,0 +1,231 @@
+#include "server/S_SendQueue.h"
+
+#define LOG_TAG "S_SendQueue"
+
+static bool_t SendPending(S_SendQueue& queue, int_t flags, sz_t &calls);
+static sz_t BurstBytes(const S_SendQueue& queue, tm_t now);
+
+void S_Init(S_SendQueue& queue, CancellableSocket* socket) {
+    queue.socket = socket;
+    Store(&queue.bit_rate, VIDEO_BIT_RATE + AUDIO_BIT_RATE);
+    S_Reset(queue);
+}
+
+void S_Reset(S_SendQueue& queue) {
+    queue.start = 0;
+    queue.end = 0;
+    queue.zerocopy_id = 0;
+    queue.burst_bytes = 0;
+    queue.burst_us = 0;
+    Store(&queue.depth_ms, 0);
+    Store(&queue.behind, 0);
+}
+
+void S_SetBitRate(S_SendQueue& queue, int_t bit_rate) {
+    Store(&queue.bit_rate, bit_rate);
+}
+
+int_t S_BytesToMs(const S_SendQueue& queue, sz_t bytes) {
+    return (int_t)((tm_t)bytes * 8000 / (tm_t)Load(&queue.bit_rate));
+}
+
+int_t S_UpdateDepth(S_SendQueue& queue, int_t fd) {
+    int_t depth_ms = S_BytesToMs(queue, (sz_t)QueuedBytes(fd) + queue.end - queue.start);
+
+    Store(&queue.depth_ms, depth_ms);
+    return depth_ms;
+}
+
+int_t S_DepthMs(const S_SendQueue& queue) {
+    return Load(&queue.depth_ms);
+}
+
+sz_t S_PendingBytes(S_SendQueue& queue) {
+    sz_t bytes;
+
+    Lock(&queue.socket->send_lock);
+    bytes = queue.end - queue.start;
+    Unlock(&queue.socket->send_lock);
+    return bytes;
+}
+
+// What is left of the burst if the path sends at the session bit rate
+static sz_t BurstBytes(const S_SendQueue& queue, tm_t now) {
+    tm_t sent = (now - queue.burst_us) * Load(&queue.bit_rate) / 8000000;
+
+    return (tm_t)queue.burst_bytes > sent ? queue.burst_bytes - (sz_t)sent : 0;
+}
+
+void S_AddBurst(S_SendQueue& queue, sz_t bytes) {
+    tm_t now = NowMicros();
+
+    // A keyframe is sent in several batches, they add up
+    Lock(&queue.socket->send_lock);
+    queue.burst_bytes = BurstBytes(queue, now) + bytes;
+    queue.burst_us = now;
+    Unlock(&queue.socket->send_lock);
+}
+
+int_t S_BacklogMs(S_SendQueue& queue, int_t depth_ms) {
+    int_t burst_ms;
+
+    Lock(&queue.socket->send_lock);
+    burst_ms = S_BytesToMs(queue, BurstBytes(queue, NowMicros()));
+    Unlock(&queue.socket->send_lock);
+    return depth_ms > burst_ms ? depth_ms - burst_ms : 0;
+}
+
+int_t S_CheckBudget(S_SendQueue& queue, int_t fd) {
+    sz_t calls = 0;
+    int_t depth_ms;
+
+    // Move what the kernel takes now, nothing else drains it while skipping
+    Lock(&queue.socket->send_lock);
+    SendPending(queue, MSG_DONTWAIT, calls);
+    depth_ms = S_UpdateDepth(queue, fd);
+    Unlock(&queue.socket->send_lock);
+
+    if (depth_ms <= SEND_BUDGET_MS) {
+        Store(&queue.behind, 0);
+        return 0;
+    }
+
+    if (GetAndSet(&queue.behind, 1) == 0) {
+        LOGE(LOG_TAG, "Client is %d ms behind", depth_ms);
+    }
+
+    if (SEND_POLICY == SEND_POLICY_DISCONNECT) {
+        // The reactor sees the hang up and closes the client
+        Shutdown(*queue.socket);
+        return -1;
+    }
+    return SEND_BLOCKED;
+}
+
+// Send what a previous call left, return true if nothing is left
+static bool_t SendPending(S_SendQueue& queue, int_t flags, sz_t &calls) {
+    ssz_t sent;
+
+    while (queue.start < queue.end) {
+        sent = send(queue.socket->socket,
+                    queue.data + queue.start,
+                    queue.end - queue.start,
+                    flags | MSG_NOSIGNAL);
+        ++calls;
+        if (sent <= 0) {
+            return false;
+        }
+        queue.start += sent;
+    }
+    queue.start = 0;
+    queue.end = 0;
+    return true;
+}
+
+// Copy the vectors from byte offset on to the queue, all or nothing
+static bool_t Enqueue(S_SendQueue& queue,
+                      const s_iovec_t *vec,
+                      sz_t count,
+                      sz_t offset,
+                      sz_t total) {
+    sz_t i;
+    sz_t size;
+    const byte_t *src;
+
+    if (queue.end + total - offset > SEND_QUEUE_SIZE) {
+        if (queue.end - queue.start + total - offset > SEND_QUEUE_SIZE) {
+            return false;
+        }
+        Move(queue.data, queue.data + queue.start, queue.end - queue.start);
+        queue.end -= queue.start;
+        queue.start = 0;
+    }
+
+    for (i = 0; i < count; ++i) {
+        if (offset >= vec[i].iov_len) {
+            offset -= vec[i].iov_len;
+            continue;
+        }
+        src = static_cast<const byte_t *>(vec[i].iov_base) + offset;
+        size = vec[i].iov_len - offset;
+        offset = 0;
+
+        Copy(queue.data + queue.end, src, size);
+        queue.end += size;
+    }
+    return true;
+}
+
+ssz_t S_SendMedia(S_SendQueue& queue,
+                  const s_iovec_t *vec,
+                  sz_t count,
+                  int_t flags,
+                  sz_t &calls) {
+    ssz_t sent = 0;
+    sz_t total = 0;
+    sz_t i;
+
+    for (i = 0; i < count; ++i) {
+        total += vec[i].iov_len;
+    }
+
+    // A packet can't start in the middle of another one,
+    // wait behind the pending bytes
+    if (!SendPending(queue, MSG_DONTWAIT, calls)) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK) {
+            return -1;
+        }
+    } else {
+        sent = SendVector(*queue.socket, vec, count, flags | MSG_DONTWAIT, calls);
+        if (sent < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+            return -1;
+        }
+        if (sent < 0) {
+            sent = 0;
+        }
+        // The kernel counts every MSG_ZEROCOPY send that took something
+        if (sent > 0 && (flags & MSG_ZEROCOPY)) {
+            queue.zerocopy_id++;
+        }
+    }
+
+    // Frame data is released after this call, keep a copy of the rest.
+    // A whole batch can still be dropped, a cut one can't.
+    if ((sz_t)sent < total && !Enqueue(queue, vec, count, (sz_t)sent, total)) {
+        if (sent == 0) {
+            return SEND_BLOCKED;
+        }
+        LOGE(LOG_TAG, "Send queue overflow");
+        return -1;
+    }
+    return (ssz_t)total;
+}
+
+ssz_t S_SendControl(S_SendQueue& queue, const void *data, sz_t size) {
+    s_iovec_t vec;
+    sz_t calls = 0;
+    ssz_t sent;
+
+    SetVector(vec, data, size);
+    sent = S_SendMedia(queue, &vec, 1, 0, calls);
+
+    // A response can't be skipped like a frame
+    if (sent == SEND_BLOCKED) {
+        LOGE(LOG_TAG, "Send queue overflow");
+        return -1;
+    }
+    return sent;
+}
+
+int_t S_Drain(S_SendQueue& queue) {
+    sz_t calls = 0;
+    int_t result = 0;
+
+    Lock(&queue.socket->send_lock);
+    if (!SendPending(queue, MSG_DONTWAIT, calls) &&
+        errno != EAGAIN && errno != EWOULDBLOCK) {
+        result = -1;
+    }
+    Unlock(&queue.socket->send_lock);
+    return result;
+}
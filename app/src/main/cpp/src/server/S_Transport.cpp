@@ -0,0 +1,118 @@
+#include "server/S_Transport.h"
+
+#define LOG_TAG "S_Transport"
+
+// IPv4 (20) + UDP (8)
+#define UDP_OVERHEAD 28
+
+static_assert(RTP_TCP_PACKET_SIZE <= 65535, "Interleaved length is 16 bits");
+
+static sz_t UdpPacketSize(int_t fd) {
+    int_t mtu = -1;
+
+#if RTP_UDP_MTU_DISCOVERY
+    mtu = GetPathMtu(fd);
+#endif
+    if (mtu < RTP_UDP_MIN_MTU) {
+        mtu = RTP_UDP_DEFAULT_MTU;
+    }
+    return (sz_t)(mtu - UDP_OVERHEAD);
+}
+
+void S_Init(S_Transport& transport) {
+    transport.type = TRANSPORT_NONE;
+    transport.socket = nullptr;
+    transport.interleave = 0;
+    transport.packet_size = 0;
+    transport.rtp_socket = -1;
+    transport.rtcp_socket = -1;
+    transport.server_port = -1;
+    transport.client_port = -1;
+    transport.segmentation = false;
+    transport.queue = nullptr;
+    transport.uring = nullptr;
+}
+
+void S_SetupTcp(S_Transport& transport,
+                S_SendQueue* queue,
+                byte_t interleave) {
+    S_Close(transport);
+    transport.type = TRANSPORT_TCP;
+    transport.socket = queue->socket;
+    transport.queue = queue;
+    transport.interleave = interleave;
+    transport.packet_size = RTP_TCP_PACKET_SIZE;
+}
+
+bool_t S_SetupUdp(S_Transport& transport,
+                  S_SendQueue* queue,
+                  int_t client_port) {
+    const CancellableSocket& client = *queue->socket;
+    int_t fds[2];
+    int_t server_port;
+
+    S_Close(transport);
+
+    server_port = BindUdpPair(fds, RTP_UDP_PORT_BASE, RTP_UDP_PORT_RANGE);
+    if (server_port < 0) {
+        LOGE(LOG_TAG, "No free UDP port pair");
+        return false;
+    }
+
+    if (ConnectUdp(fds[0], client, client_port) < 0 ||
+        ConnectUdp(fds[1], client, client_port + 1) < 0) {
+        LOGE(LOG_TAG, "Failed to connect UDP port %d", client_port);
+        close(fds[0]);
+        close(fds[1]);
+        return false;
+    }
+
+    transport.type = TRANSPORT_UDP;
+    transport.rtp_socket = fds[0];
+    transport.rtcp_socket = fds[1];
+    transport.server_port = server_port;
+    transport.client_port = client_port;
+    transport.queue = queue;
+    transport.segmentation = SupportSegmentation(fds[0]);
+#if RTP_UDP_MTU_DISCOVERY
+    SetMtuDiscovery(fds[0]);
+#endif
+    transport.packet_size = UdpPacketSize(fds[0]);
+    LOGI(LOG_TAG, "UDP packet size %zu", transport.packet_size);
+    return true;
+}
+
+int_t S_CheckBudget(S_Transport& transport) {
+    if (transport.queue == nullptr) {
+        return 0;
+    }
+    if (transport.type == TRANSPORT_TCP) {
+        return S_CheckBudget(*transport.queue, transport.socket->socket);
+    }
+    return S_CheckBudget(*transport.queue, transport.rtp_socket);
+}
+
+bool_t S_RefreshMtu(S_Transport& transport) {
+    sz_t packet_size;
+
+    if (transport.type != TRANSPORT_UDP) {
+        return false;
+    }
+    packet_size = UdpPacketSize(transport.rtp_socket);
+    if (packet_size == transport.packet_size) {
+        return false;
+    }
+    LOGI(LOG_TAG, "UDP packet size %zu -> %zu", transport.packet_size, packet_size);
+    transport.packet_size = packet_size;
+    return true;
+}
+
+void S_Close(S_Transport& transport) {
+    if (transport.rtp_socket >= 0) {
+        close(transport.rtp_socket);
+    }
+    if (transport.rtcp_socket >= 0) {
+        close(transport.rtcp_socket);
+    }
+    S_Init(transport);
+}
@@ -0,0 +1,268 @@
+#include "server/S_Uring.h"
+
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+
+#define LOG_TAG "S_Uring"
+
+void S_Init(S_Uring& uring) {
+    sz_t i;
+
+    uring.fd = -1;
+    uring.entries = 0;
+    uring.sq_ring = MAP_FAILED;
+    uring.cq_ring = MAP_FAILED;
+    uring.sqes = MAP_FAILED;
+    uring.fixed_files = false;
+    for (i = 0; i < URING_MAX_FILES; ++i) {
+        uring.files[i] = -1;
+    }
+}
+
+bool_t S_IsOpen(const S_Uring& uring) {
+    return uring.fd >= 0;
+}
+
+#ifdef __NR_io_uring_setup
+
+static int_t FindFile(const S_Uring& uring, int_t fd) {
+    sz_t i;
+
+    for (i = 0; i < URING_MAX_FILES; ++i) {
+        if (uring.files[i] == fd) {
+            return (int_t)i;
+        }
+    }
+    return -1;
+}
+
+static int_t Setup(uint_t entries, io_uring_params *params) {
+    return (int_t)syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int_t Enter(int_t fd, uint_t to_submit, uint_t min_complete, uint_t flags) {
+    return (int_t)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, nullptr, 0);
+}
+
+static int_t Register(int_t fd, uint_t opcode, void *arg, uint_t count) {
+    return (int_t)syscall(__NR_io_uring_register, fd, opcode, arg, count);
+}
+
+// Slot of the file table to fd, -1 to free it
+static bool_t UpdateFile(S_Uring& uring, int_t slot, int_t fd) {
+    io_uring_files_update update {};
+
+    update.offset = (uint_t)slot;
+    update.fds = (uint64_t)(uintptr_t)&fd;
+    if (Register(uring.fd, IORING_REGISTER_FILES_UPDATE, &update, 1) < 1) {
+        LOGE(LOG_TAG, "Failed to update registered file %d, error %d", slot, errno);
+        return false;
+    }
+    uring.files[slot] = fd;
+    return true;
+}
+
+static void *Map(int_t fd, sz_t size, off_t offset) {
+    return mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, offset);
+}
+
+static uint_t *At(void *ring, uint_t offset) {
+    return reinterpret_cast<uint_t *>(static_cast<byte_t *>(ring) + offset);
+}
+
+bool_t S_Open(S_Uring& uring, uint_t entries) {
+    io_uring_params params {};
+
+    S_Init(uring);
+    uring.fd = Setup(entries, &params);
+    if (uring.fd < 0) {
+        LOGI(LOG_TAG, "io_uring not available, error %d", errno);
+        return false;
+    }
+    uring.entries = params.sq_entries;
+
+    uring.sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(uint_t);
+    uring.cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+    uring.sqes_size = params.sq_entries * sizeof(io_uring_sqe);
+
+    uring.sq_ring = Map(uring.fd, uring.sq_ring_size, IORING_OFF_SQ_RING);
+    uring.cq_ring = Map(uring.fd, uring.cq_ring_size, IORING_OFF_CQ_RING);
+    uring.sqes = Map(uring.fd, uring.sqes_size, IORING_OFF_SQES);
+    if (uring.sq_ring == MAP_FAILED || uring.cq_ring == MAP_FAILED || uring.sqes == MAP_FAILED) {
+        LOGE(LOG_TAG, "Failed to map io_uring, error %d", errno);
+        S_Close(uring);
+        return false;
+    }
+
+    uring.sq_head = At(uring.sq_ring, params.sq_off.head);
+    uring.sq_tail = At(uring.sq_ring, params.sq_off.tail);
+    uring.sq_mask = At(uring.sq_ring, params.sq_off.ring_mask);
+    uring.sq_array = At(uring.sq_ring, params.sq_off.array);
+    uring.cq_head = At(uring.cq_ring, params.cq_off.head);
+    uring.cq_tail = At(uring.cq_ring, params.cq_off.tail);
+    uring.cq_mask = At(uring.cq_ring, params.cq_off.ring_mask);
+    uring.cqes = At(uring.cq_ring, params.cq_off.cqes);
+
+    // An empty table, sockets come and go with the viewers
+    uring.fixed_files = Register(uring.fd, IORING_REGISTER_FILES, uring.files, URING_MAX_FILES) == 0;
+    if (!uring.fixed_files) {
+        LOGI(LOG_TAG, "No registered files, error %d", errno);
+    }
+    return true;
+}
+
+bool_t S_Register(S_Uring& uring, int_t fd) {
+    int_t slot;
+
+    if (!uring.fixed_files || fd < 0) {
+        return false;
+    }
+    if (FindFile(uring, fd) >= 0) {
+        return true;
+    }
+    slot = FindFile(uring, -1);
+    return slot >= 0 && UpdateFile(uring, slot, fd);
+}
+
+void S_Unregister(S_Uring& uring, int_t fd) {
+    int_t slot = fd >= 0 ? FindFile(uring, fd) : -1;
+
+    if (slot >= 0) {
+        UpdateFile(uring, slot, -1);
+    }
+}
+
+// Completions of the last submit, messages are done in order,
+// the ones after a failed message are cancelled
+static sz_t Reap(S_Uring& uring, sz_t count, sz_t &calls) {
+    auto *cqes = static_cast<io_uring_cqe *>(uring.cqes);
+    uint_t head = *uring.cq_head;
+    sz_t sent = count;
+    sz_t reaped = 0;
+    int_t error = 0;
+
+    while (reaped < count) {
+        if (head == __atomic_load_n(uring.cq_tail, __ATOMIC_ACQUIRE)) {
+            // Not all done inline, wait for the rest
+            ++calls;
+            if (Enter(uring.fd, 0, (uint_t)(count - reaped), IORING_ENTER_GETEVENTS) < 0 &&
+                errno != EINTR) {
+                break;
+            }
+            continue;
+        }
+        const io_uring_cqe &cqe = cqes[head & *uring.cq_mask];
+        if (cqe.res < 0 && (sz_t)cqe.user_data < sent) {
+            sent = (sz_t)cqe.user_data;
+            error = -cqe.res;
+        }
+        ++head;
+        ++reaped;
+    }
+    __atomic_store_n(uring.cq_head, head, __ATOMIC_RELEASE);
+
+    if (error != 0) {
+        errno = error;
+    }
+    return sent;
+}
+
+sz_t S_SendMessages(S_Uring& uring,
+                    int_t fd,
+                    s_mmsghdr_t *messages,
+                    sz_t count,
+                    sz_t &calls) {
+    auto *sqes = static_cast<io_uring_sqe *>(uring.sqes);
+    uint_t tail = *uring.sq_tail;
+    uint_t idx;
+    io_uring_sqe *sqe;
+    int_t submitted;
+    int_t slot;
+    sz_t i;
+
+    if (count == 0) {
+        return 0;
+    }
+    if (count > uring.entries) {
+        return SendMessages(fd, messages, count, calls);
+    }
+
+    slot = uring.fixed_files ? FindFile(uring, fd) : -1;
+
+    // Linked: in order, and nothing more once one fails
+    for (i = 0; i < count; ++i) {
+        idx = tail & *uring.sq_mask;
+        sqe = &sqes[idx];
+        Reset(sqe, sizeof(io_uring_sqe));
+        sqe->opcode = IORING_OP_SENDMSG;
+        sqe->fd = slot >= 0 ? slot : fd;
+        if (slot >= 0) {
+            sqe->flags |= IOSQE_FIXED_FILE;
+        }
+        sqe->addr = (uint64_t)(uintptr_t)&messages[i].msg_hdr;
+        sqe->len = 1;
+        sqe->msg_flags = MSG_DONTWAIT;
+        sqe->user_data = i;
+        if (i + 1 < count) {
+            sqe->flags |= IOSQE_IO_LINK;
+        }
+        uring.sq_array[idx] = idx;
+        ++tail;
+    }
+    __atomic_store_n(uring.sq_tail, tail, __ATOMIC_RELEASE);
+
+    // UDP sends complete inline, usually nothing is left to wait for
+    submitted = Enter(uring.fd, (uint_t)count, (uint_t)count, IORING_ENTER_GETEVENTS);
+    ++calls;
+    if (submitted < (int_t)count) {
+        // Entries the kernel didn't take are still ours, take them back
+        __atomic_store_n(uring.sq_tail,
+                         tail - (uint_t)(count - (submitted > 0 ? submitted : 0)),
+                         __ATOMIC_RELEASE);
+        if (submitted <= 0) {
+            return 0;
+        }
+        return Reap(uring, (sz_t)submitted, calls);
+    }
+    return Reap(uring, count, calls);
+}
+
+#else
+
+bool_t S_Open(S_Uring& uring, uint_t entries) {
+    S_Init(uring);
+    return false;
+}
+
+bool_t S_Register(S_Uring& uring, int_t fd) {
+    return false;
+}
+
+void S_Unregister(S_Uring& uring, int_t fd) {
+}
+
+sz_t S_SendMessages(S_Uring& uring,
+                    int_t fd,
+                    s_mmsghdr_t *messages,
+                    sz_t count,
+                    sz_t &calls) {
+    return SendMessages(fd, messages, count, calls);
+}
+
+#endif
+
+void S_Close(S_Uring& uring) {
+    if (uring.sqes != MAP_FAILED) {
+        munmap(uring.sqes, uring.sqes_size);
+    }
+    if (uring.cq_ring != MAP_FAILED) {
+        munmap(uring.cq_ring, uring.cq_ring_size);
+    }
+    if (uring.sq_ring != MAP_FAILED) {
+        munmap(uring.sq_ring, uring.sq_ring_size);
+    }
+    if (uring.fd >= 0) {
+        close(uring.fd);
+    }
+    S_Init(uring);
+}
@@ -1,53 +1,73 @@
 #include "server/S_Platform.h"
 #include "server/S_VideoStream.h"
 #include "utils/Configs.h"
-#include "utils/FrameBuffer.h"
+#include "utils/FramePool.h"
 #include "utils/Packetizer.h"
+#include "utils/RtcpParser.h"
 
 #define LOG_TAG "S_VideoStream"
 
-// Frame types
-#define NO_FRAME 0
-#define IFRAME 1
-#define NON_IFRAME 2
+#define RTP_HEADER_LEN 12
+#define RTX_OSN_LEN 2
+#define THIN_ALL_LAYERS 6    // Highest TemporalId
+
+// The flexible mask covers 109 packets after the SN base
+static_assert((FEC_ROWS > 1 ? FEC_ROWS - 1 : 0) * FEC_COLUMNS < 109 && FEC_COLUMNS <= 109,
+              "FEC block is too large");
 
 static void* StartStreamingThread(void* arg);
-static void FrameCallback(void* ctx, const FrameBuffer<MAX_VIDEO_FRAME_SIZE>& frame);
+static void FrameCallback(void* ctx, SharedFrame* frame);
 static bool_t SendAndAdvance(
         S_VideoStream &stream,
+        S_VideoViewer *target,
         ushort_t &seq,
-        tm_t frame_time_us,
-        const byte_t *data,
-        sz_t size);
+        SharedFrame *frame);
 static int_t PacketizeAndSend(S_VideoStream& stream,
+                              S_VideoViewer* target,
                               ushort_t& seq,
                               uint_t rtp_ts,
                               const byte_t *data,
                               sz_t size);
-static uint_t RtpTimestamp(const S_VideoStream& stream, tm_t time_us);
+static void EndThin(S_VideoStream& stream, ushort_t first_seq);
+static bool_t InFlight(const S_VideoViewer& viewer);
 
 // Attributes that are initialized every new session.
-static void Reset(S_VideoStream& stream) {
-    Reset(stream.frame_buffer[0]);
-    Reset(stream.frame_buffer[1]);
-    Reset(stream.keyframe_buffer[0]);
-    Reset(stream.keyframe_buffer[1]);
-    Reset(stream.socket_buffer);
-
-    stream.last_time_us = 0;
-    stream.ssrc = 0;
-    stream.socket = nullptr;
-    stream.last_rtp_ts = 0;
-    stream.interleave = 0;
-
-    stream.last_report_sec = 0;
-    stream.packet_count = 0;
-    stream.octet_count = 0;
-
-    stream.frame_ready[0] = NO_FRAME;
-    stream.frame_ready[1] = NO_FRAME;
-    Reset(&stream.write_idx);
-    Reset(&stream.read_idx);
+static void Reset(S_VideoViewer& viewer) {
+    Reset(viewer.report);
+    viewer.report.syscalls = 0;
+    Reset(viewer.fec_batch);
+    viewer.fec_batch.syscalls = 0;
+    Reset(viewer.fec_row);
+    for (sz_t i = 0; i < FEC_VIEWER_COLUMNS; ++i) {
+        Reset(viewer.fec_columns[i]);
+    }
+    viewer.fec_index = 0;
+
+    viewer.ssrc = 0;
+    viewer.failed = false;
+    S_Init(viewer.transport);
+
+    viewer.seq_offset = 0;
+    viewer.ts_offset = 0;
+    viewer.start_rtp_ts = 0;
+    viewer.ts_set = false;
+    viewer.next_seq = 0;
+    viewer.live_seq = 0;
+    viewer.live = false;
+    viewer.behind = false;
+    viewer.thinned = false;
+    viewer.max_temporal_id = THIN_ALL_LAYERS;
+
+    viewer.wait_start = true;
+    viewer.wait_keyframe = true;
+    viewer.last_time_us = 0;
+    viewer.play_us = 0;
+    viewer.connect_us = 0;
+
+    viewer.next_report_us = 0;
+    viewer.packet_count = 0;
+    viewer.octet_count = 0;
+    viewer.loss_percent = -1;
 }
 
 // Attributes that are only initialized once per app cycle.
@@ -56,226 +76,539 @@ void S_Init(S_VideoStream& stream, E_H265* encoder) {
         return;
     }
 
-    Init(&stream.frame_mutex);
-    Init(&stream.frame_condition);
+    Init(stream.ring);
+    stream.skip_to_keyframe = false;
+    stream.frame = nullptr;
 
     Init(&stream.thread);
+    Init(&stream.lock);
+    Init(&stream.viewers_lock);
+    stream.viewer_count = 0;
+    stream.prepared = 0;
+    stream.recording = 0;
 
     Store(&stream.state, IDLE);
 
     stream.encoder = encoder;
 
     Init(stream.stats, true);
+    Init(stream.history);
+
+    // Kept for the whole process, like the stream
+    S_Init(stream.uring);
+    if (RTP_IO_URING && S_Open(stream.uring, RTP_BATCH_MAX_PACKETS + 1)) {
+        LOGI(LOG_TAG, "Sending UDP through io_uring");
+    }
 }
 
-void S_Prepare(S_VideoStream& stream) {
+void S_Init(S_VideoViewer& viewer, S_VideoStream* stream) {
+    viewer.stream = stream;
+    Store(&viewer.state, IDLE);
+
+    for (auto& send: viewer.zc_sends) {
+        send.frame = nullptr;
+    }
+
+    Init(viewer.fec_row);
+    for (sz_t i = 0; i < FEC_VIEWER_COLUMNS; ++i) {
+        Init(viewer.fec_columns[i]);
+    }
+}
+
+// First viewer: start receiving frames
+static void AddListener(S_VideoStream& stream) {
     if (!CompareAndSet(&stream.state, IDLE, PREPARED))  {
         return;
     }
-    // Add encoder listener
     E_AddListener(*stream.encoder, FrameCallback, &stream);
 }
 
-void S_Start(
-        S_VideoStream& stream,
-        CancellableSocket* socket,
-        byte_t interleave,
-        int_t ssrc) {
-
+// First viewer in RECORD: start the streaming thread
+static void StartThread(S_VideoStream& stream) {
     if (!CompareAndSet(&stream.state, PREPARED, RECORD))  {
         return;
     }
 
-    Reset(stream);
-    stream.socket = socket;
-    stream.interleave = interleave;
-    stream.ssrc = ssrc;
-    stream.last_rtp_ts = RandomInt();
-    
+    Reset(stream.batch);
+    stream.last_time_us = 0;
+    for (auto& lane: stream.lanes) {
+        lane.seq = RandomShort();
+        lane.packet_size = 0;
+    }
+    stream.lane = VIDEO_LANE_TCP;
+    // Interleave channel and SSRC are patched per viewer
+    Init(stream.rtp_header, 0, H265_PAYLOAD_TYPE, 0);
+    Init(stream.clock, VIDEO_SAMPLE_RATE, RandomInt());
+    Reset(stream.history, RTX_HISTORY_MS * 1000);
+
+    // Stale frames are dropped, viewers get the cached GOP instead
+    Drain(stream.ring);
+
     Start(&stream.thread, StartStreamingThread, &stream);
 }
 
-static void MarkIdle(S_VideoStream& stream) {
+// Last viewer left RECORD
+static void StopThread(S_VideoStream& stream) {
+    if (!CompareAndSet(&stream.state, RECORD, STOPPING)) {
+        return;
+    }
+
+    // Wait for streaming thread to stop
+    Wake(stream.ring);
+    Join(&stream.thread);
+    Drain(stream.ring);
+    Store(&stream.state, PREPARED);
+}
+
+// Last viewer left
+static void RemoveListener(S_VideoStream& stream) {
+    if (!CompareAndSet(&stream.state, PREPARED, STOPPING)) {
+        return;
+    }
+
+    E_RemoveListener(*stream.encoder, &stream);
+
+    // No more callbacks, give the frames back to the encoder
+    Drain(stream.ring);
+
+    LOGI("CleanUp", "gracefully clean up video stream");
     Store(&stream.state, IDLE);
 }
 
-void S_Stop(S_VideoStream& stream) {
+void S_Prepare(S_VideoViewer& viewer) {
+    S_VideoStream& stream = *viewer.stream;
+
+    if (!CompareAndSet(&viewer.state, IDLE, PREPARED))  {
+        return;
+    }
+
+    Lock(&stream.lock);
+    if (stream.prepared++ == 0) {
+        AddListener(stream);
+    }
+    Unlock(&stream.lock);
+}
+
+void S_Start(
+        S_VideoViewer& viewer,
+        const S_Transport& transport,
+        const S_RtpStart& start) {
+
+    S_VideoStream& stream = *viewer.stream;
+
+    if (!CompareAndSet(&viewer.state, PREPARED, RECORD))  {
+        return;
+    }
+
+    Reset(viewer);
+    viewer.transport = transport;
+    if (S_IsOpen(stream.uring) && transport.type == TRANSPORT_UDP) {
+        viewer.transport.uring = &stream.uring;
+    }
+    viewer.ssrc = start.ssrc;
+    viewer.next_seq = start.seq;
+    viewer.start_rtp_ts = start.rtptime;
+    viewer.rtx_ssrc = RandomInt();
+    viewer.rtx_seq = RandomShort();
+    viewer.fec_ssrc = RandomInt();
+    viewer.fec_seq = RandomShort();
+    Init(viewer.fec_header, transport.interleave, FEC_PAYLOAD_TYPE, viewer.fec_ssrc);
+    viewer.next_report_us = NowMicros() + ReportIntervalUs(VIDEO_BIT_RATE, RTCP_REPORT_SIZE, true);
+    viewer.play_us = NowMicros();
+    viewer.connect_us = start.connect_us;
+
+    Lock(&stream.lock);
+    Lock(&stream.viewers_lock);
+    stream.viewers[stream.viewer_count++] = &viewer;
+    if (viewer.transport.uring) {
+        S_Register(stream.uring, viewer.transport.rtp_socket);
+    }
+    Unlock(&stream.viewers_lock);
+
+    if (stream.recording++ == 0) {
+        StartThread(stream);
+    }
+    Unlock(&stream.lock);
+
+    // The cached GOP goes out now, not at the next frame
+    Wake(stream.ring);
+}
+
+static void RemoveViewer(S_VideoStream& stream, S_VideoViewer& viewer) {
+    sz_t i;
+
+    Lock(&stream.viewers_lock);
+    for (i = 0; i < stream.viewer_count; ++i) {
+        if (stream.viewers[i] == &viewer) {
+            stream.viewers[i] = stream.viewers[--stream.viewer_count];
+            break;
+        }
+    }
+    // Before the transport closes the socket, the ring would keep it
+    if (viewer.transport.uring) {
+        S_Unregister(stream.uring, viewer.transport.rtp_socket);
+    }
+    Unlock(&stream.viewers_lock);
+}
+
+void S_Stop(S_VideoViewer& viewer) {
+    S_VideoStream& stream = *viewer.stream;
     bool_t is_prepared = false;
     bool_t is_recording = false;
 
-    if (CompareAndSet(&stream.state, RECORD, STOPPING)) {
+    if (CompareAndSet(&viewer.state, RECORD, STOPPING)) {
         is_recording = true;
         is_prepared = true;
     }
 
-    if (CompareAndSet(&stream.state, PREPARED, STOPPING)) {
+    if (CompareAndSet(&viewer.state, PREPARED, STOPPING)) {
         is_prepared = true;
     }
 
+    if (!is_prepared) {
+        return;
+    }
+
+    Lock(&stream.lock);
     if (is_recording) {
-        // Wait for streaming thread to stop
-        Signal(&stream.frame_condition);
-        Join(&stream.thread);
+        // The streaming thread doesn't use the viewer after this
+        RemoveViewer(stream, viewer);
+        if (--stream.recording == 0) {
+            StopThread(stream);
+        }
     }
+    if (--stream.prepared == 0) {
+        RemoveListener(stream);
+    }
+    Unlock(&stream.lock);
+
+    // The kernel may still send from some frames, they stay retained
+    // until the RTSP client reaps them, before it closes the socket
+    S_ReapZeroCopy(viewer);
+
+    LOGI("CleanUp", "gracefully clean up video viewer");
+    Store(&viewer.state, IDLE);
+}
+
+static uint_t ReadUInt(const byte_t *src) {
+    return ((uint_t)src[0] << 24) | ((uint_t)src[1] << 16) | ((uint_t)src[2] << 8) | src[3];
+}
 
-    if (is_prepared) {
-        // Remove encoder listener
-        E_RemoveListener(*stream.encoder, &stream);
+// RFC 4588: same timestamp and marker, RTX payload type, SSRC and seq,
+// original seq (OSN) in front of the original payload.
+// The history is in UDP lane seq, NACKs are in viewer seq.
+static void Retransmit(S_VideoViewer& viewer, const RtcpFeedback& feedback) {
+    S_VideoStream& stream = *viewer.stream;
+    byte_t header[RTP_HEADER_LEN + RTX_OSN_LEN];
+    s_iovec_t vectors[2];
+    const byte_t *packet;
+    sz_t size;
+    tm_t time_us;
+    tm_t now = NowMicros();
+    uint_t timestamp;
+    ushort_t seq;
+    sz_t i;
+
+    // TCP doesn't lose packets
+    if (viewer.transport.type != TRANSPORT_UDP) {
+        return;
     }
 
-    if (is_recording || is_prepared) {
-        LOGI("CleanUp", "gracefully clean up video stream");
-        MarkIdle(stream);
+    // Offsets are set by the streaming thread when the viewer goes live
+    Lock(&stream.viewers_lock);
+    Lock(&stream.history.lock);
+    for (i = 0; viewer.live && i < feedback.nack_count; ++i) {
+        // Packets before live_seq are from the GOP burst, they are not kept
+        seq = (ushort_t)(feedback.nacks[i] - viewer.seq_offset);
+        if ((short_t)(seq - viewer.live_seq) < 0) {
+            continue;
+        }
+
+        packet = Find(stream.history, seq, now, size, time_us);
+        if (!packet) {
+            continue;
+        }
+
+        timestamp = ReadUInt(packet + 4) + viewer.ts_offset;
+
+        Copy(header, packet, RTP_HEADER_LEN);
+        header[1] = (packet[1] & 0x80) | RTX_PAYLOAD_TYPE;
+        header[2] = (viewer.rtx_seq >> 8) & 0xFF;
+        header[3] = viewer.rtx_seq & 0xFF;
+        header[4] = (timestamp >> 24) & 0xFF;
+        header[5] = (timestamp >> 16) & 0xFF;
+        header[6] = (timestamp >> 8) & 0xFF;
+        header[7] = timestamp & 0xFF;
+        header[8] = (viewer.rtx_ssrc >> 24) & 0xFF;
+        header[9] = (viewer.rtx_ssrc >> 16) & 0xFF;
+        header[10] = (viewer.rtx_ssrc >> 8) & 0xFF;
+        header[11] = viewer.rtx_ssrc & 0xFF;
+        header[12] = (feedback.nacks[i] >> 8) & 0xFF;
+        header[13] = feedback.nacks[i] & 0xFF;
+
+        SetVector(vectors[0], header, sizeof(header));
+        SetVector(vectors[1], packet + RTP_HEADER_LEN, size - RTP_HEADER_LEN);
+        // Runs on the reactor with both locks held: a full socket buffer
+        // drops the rest of the NACK, the viewer asks again
+        if (SendDatagram(viewer.transport.rtp_socket, vectors, 2) < 0) {
+            break;
+        }
+        viewer.rtx_seq++;
+        SendRetransmit(stream.stats, now - time_us);
     }
+    Unlock(&stream.history.lock);
+    Unlock(&stream.viewers_lock);
 }
 
-// From outside perspective, PREPARED, RECORD and STOPPED is the same as RUNNING
-bool_t S_IsRunning(const S_VideoStream& stream) {
-    return Load(&stream.state) != IDLE;
-}
+void S_HandleRtcp(S_VideoViewer& viewer, const byte_t *data, sz_t size) {
+    S_VideoStream& stream = *viewer.stream;
+    RtcpFeedback feedback;
 
-static void ProcessFrame(S_VideoStream& stream, const FrameBuffer<MAX_VIDEO_FRAME_SIZE>& frame) {
+    if (Load(&viewer.state) != RECORD) {
+        return;
+    }
 
-    int index = 1 - SyncAndGet(&stream.read_idx);
-    
-    if (frame.flags & E_INFO_FLAG_KEY_FRAME) {
-        stream.keyframe_buffer[index] = frame;
-        stream.frame_ready[index] = IFRAME;
+    Reset(feedback);
+    if (!ParseRtcp(data, size, (uint_t)viewer.ssrc, feedback)) {
+        LOGE(LOG_TAG, "Malformed RTCP packet");
+        return;
+    }
 
-    } else if (frame.size <= NORMAL_VIDEO_FRAME_SIZE) {
-        auto non_key = &stream.frame_buffer[index];
-        Copy(non_key->data, frame.data, frame.size);
-        non_key->timeUs = frame.timeUs;
-        non_key->size = frame.size;
-        non_key->flags = frame.flags;
-        stream.frame_ready[index] = NON_IFRAME;
+    if (feedback.has_report) {
+        viewer.loss_percent = feedback.fraction_lost * 100 / 256;
+        ReceiveReport(stream.stats,
+                      RoundTripMs(feedback),
+                      (double_t)feedback.jitter * 1000 / VIDEO_SAMPLE_RATE,
+                      (double_t)feedback.fraction_lost / 256,
+                      feedback.cumulative_lost > 0 ? feedback.cumulative_lost : 0);
+    }
 
-    } else {
-        LOGE(LOG_TAG, "Invalid non-key frame size %zu", frame.size);
+    // PLI / FIR: the client can't decode until the next sync frame
+    if (feedback.key_frame) {
+        ReceiveKeyFrameRequest(stream.stats);
+        E_RequestKeyFrame(*stream.encoder);
+    }
+
+    if (feedback.nack_count > 0) {
+        ReceiveNacks(stream.stats, feedback.nack_count);
+        Retransmit(viewer, feedback);
+    }
+}
+
+// From outside perspective, PREPARED, RECORD and STOPPED is the same as RUNNING
+bool_t S_IsRunning(const S_VideoViewer& viewer) {
+    return Load(&viewer.state) != IDLE;
+}
+
+// Encoder thread: only a reference goes to the ring.
+// A dropped frame breaks decoding until the next keyframe,
+// so the following frames are dropped too and a keyframe is requested.
+static void ProcessFrame(S_VideoStream& stream, SharedFrame* frame) {
+    bool_t keyframe = frame->flags & E_INFO_FLAG_KEY_FRAME;
+    SharedFrame* dropped;
+
+    if (Load(&stream.state) != RECORD) {
         return;
     }
 
     // Stats
     ReceiveFrame(stream.stats);
 
-    // Ensure all data is synced when read write_idx
-    SetAndSync(&stream.write_idx, index);
-    Signal(&stream.frame_condition);
-}
+    if (keyframe) {
+        stream.skip_to_keyframe = false;
 
-static bool_t Wait(
-        S_VideoStream& stream,
-        int_t &type,
-        FrameBuffer<MAX_VIDEO_FRAME_SIZE>* &keyframe,
-        FrameBuffer<NORMAL_VIDEO_FRAME_SIZE>* &frame) {
-    Lock(&stream.frame_mutex);
-
-    tm_t buffer_time;
-    int_t write_old;
-    int_t write_new;
-    bool_t stopping;
-    bool_t new_frame;
-
-    // First loop: Wait for frames or stopped
-    while (true) {
-        write_old = SyncAndGet(&stream.write_idx);
-        type = stream.frame_ready[write_old];
-        buffer_time =
-                type == IFRAME ? stream.keyframe_buffer[write_old].timeUs :
-                type == NON_IFRAME ? stream.frame_buffer[write_old].timeUs :
-                0;
-
-        new_frame = stream.last_time_us < buffer_time &&
-                    stream.keyframe_buffer[write_old].size > 0;
-        stopping = Load(&stream.state) == STOPPING;
-        if (new_frame || stopping) {
-            break;
+        // Behind: the keyframe replaces everything queued, the client
+        // can decode from it without the frames in between
+        if (Full(stream.ring)) {
+            while ((dropped = DropOldest(stream.ring)) != nullptr) {
+                Release(dropped);
+                DropFrame(stream.stats);
+            }
         }
+    } else if (!stream.skip_to_keyframe && Full(stream.ring)) {
+        stream.skip_to_keyframe = true;
+        E_RequestKeyFrame(*stream.encoder);
+    }
 
-        Wait(&stream.frame_condition, &stream.frame_mutex);
+    if (stream.skip_to_keyframe) {
+        DropFrame(stream.stats);
+        return;
     }
 
-    if (stopping) {
-        Unlock(&stream.frame_mutex);
-        return true;
+    Retain(frame);
+    if (!Push(stream.ring, frame)) {
+        Release(frame);
+        DropFrame(stream.stats);
+    }
+}
+
+static sz_t Lane(const S_VideoViewer& viewer) {
+    return viewer.transport.type == TRANSPORT_UDP ? VIDEO_LANE_UDP : VIDEO_LANE_TCP;
+}
+
+static bool_t InLane(const S_VideoStream& stream, const S_VideoViewer& viewer) {
+    return Lane(viewer) == stream.lane;
+}
+
+// From PLAY / connect to the first keyframe sent, once per session
+static void ReportFirstPicture(S_VideoViewer& viewer, sz_t cached) {
+    tm_t now = NowMicros();
+
+    viewer.wait_keyframe = false;
+    if (viewer.play_us == 0) {
+        return;
     }
+    LOGI(LOG_TAG, "Time to first picture: %.1f ms from PLAY, %.1f ms from connect (%zu cached frames)",
+         (double_t)(now - viewer.play_us) / 1000,
+         (double_t)(now - viewer.connect_us) / 1000,
+         cached);
+    viewer.play_us = 0;
+}
 
-    // The writer we are reading write_old buffer,
-    // it should write to the other buffer.
-    SetAndSync(&stream.read_idx, write_old);
+// The first frame sent to the viewer gets the rtptime of RTP-Info
+static void SetTimestampOffset(S_VideoStream& stream, S_VideoViewer& viewer, const SharedFrame* frame) {
+    if (viewer.ts_set) {
+        return;
+    }
+    viewer.ts_offset = viewer.start_rtp_ts - RtpTimestamp(stream.clock, frame->timeUs);
+    viewer.ts_set = true;
+}
 
-    // Second loop, wait for writer update write_idx
-    while (true) {
-        stopping = Load(&stream.state) == STOPPING;
-        write_new = SyncAndGet(&stream.write_idx);
-        if (write_old != write_new || stopping) {
-            break;
+// Fast start: the cached GOP (keyframe + frames since) is sent at once
+// to the new viewer only, so it decodes now instead of at the next keyframe
+static void SendGop(S_VideoStream& stream, S_VideoViewer& viewer) {
+    SharedFrame* gop[GOP_CACHE_MAX_FRAMES];
+    ushort_t seq;
+    sz_t count;
+    sz_t i;
+    bool_t success = true;
+
+    count = E_GetGop(*stream.encoder, gop, GOP_CACHE_MAX_FRAMES);
+    if (count == 0) {
+        // Nothing cached yet, ask for a keyframe
+        E_RequestKeyFrame(*stream.encoder);
+        return;
+    }
+
+    SetTimestampOffset(stream, viewer, gop[0]);
+    for (i = 0; i < count; ++i) {
+        // Cut by Skip(): next_seq stays at the first packet not sent
+        if (success) {
+            seq = viewer.next_seq;
+            success = SendAndAdvance(stream, &viewer, seq, gop[i]) &&
+                      !viewer.failed && !viewer.behind;
+            if (!viewer.behind) {
+                viewer.next_seq = seq;
+            }
+        }
+        if (success && i == 0) {
+            ReportFirstPicture(viewer, count);
         }
-        Wait(&stream.frame_condition, &stream.frame_mutex);
+        Release(gop[i]);
     }
+}
 
-    // Read data
-    type = stream.frame_ready[write_old];
-    keyframe = &stream.keyframe_buffer[write_old];
-    frame = &stream.frame_buffer[write_old];
+// A viewer goes live at the first frame it can decode,
+// its seq goes on from the GOP burst without a gap
+static void Join(S_VideoStream& stream, S_VideoViewer& viewer, const SharedFrame* frame) {
+    bool_t keyframe = frame->flags & E_INFO_FLAG_KEY_FRAME;
 
-    // Mark as read
-    stream.frame_ready[write_old] = NO_FRAME;
-    Unlock(&stream.frame_mutex);
-    return stopping;
+    // Frames queued while the GOP was sent are already out
+    if ((!keyframe && viewer.wait_keyframe) || frame->timeUs <= viewer.last_time_us) {
+        return;
+    }
+
+    SetTimestampOffset(stream, viewer, frame);
+    viewer.seq_offset = (ushort_t)(viewer.next_seq - stream.lanes[Lane(viewer)].seq);
+    viewer.live_seq = stream.lanes[Lane(viewer)].seq;
+    viewer.live = true;
+    viewer.behind = false;
+
+    if (viewer.wait_keyframe) {
+        ReportFirstPicture(viewer, 0);
+    }
 }
 
-static void StartStreaming(S_VideoStream& stream) {
-    SetThreadName("VideoStream");
+// Media packets leave room for the FEC header, so repair packets fit the MTU too
+static sz_t PacketSize(const S_VideoViewer& viewer) {
+    sz_t size = viewer.transport.packet_size;
 
-    E_AddListener(*stream.encoder, FrameCallback, &stream);
+    if (!FEC_ENABLED || viewer.transport.type != TRANSPORT_UDP) {
+        return size;
+    }
+    size -= RTP_FEC_MAX_HEADER_SIZE - RTP_FIXED_HEADER_SIZE;
+    return size < RTP_HEADER_LEN + FEC_MAX_PAYLOAD ? size : RTP_HEADER_LEN + FEC_MAX_PAYLOAD;
+}
 
-    FrameBuffer<MAX_VIDEO_FRAME_SIZE>* keyframe;
-    FrameBuffer<NORMAL_VIDEO_FRAME_SIZE>* frame;
-    int_t type;
-    ushort_t seq = RandomShort();
-    bool_t stopping = false;
-    bool_t success = true;
+// New viewers first get the cached GOP, then the frame is packetized once
+// per lane of live viewers, at the packet size that fits all of them.
+// Called with viewers_lock held.
+static void Broadcast(S_VideoStream& stream, SharedFrame* frame) {
+    sz_t live[VIDEO_LANES] = {};
+    bool_t sent = false;
+    sz_t size;
+    sz_t lane;
+    sz_t i;
 
-    // Wait -> SendAndAdvance -> PacketizeAndSend
-    while (Load(&stream.state) == RECORD) {
-        
-        stopping = Wait(stream, type, keyframe, frame);
-        if (stopping) {
-            break;
+    for (i = 0; i < stream.viewer_count; ++i) {
+        S_VideoViewer& viewer = *stream.viewers[i];
+        if (viewer.wait_start) {
+            viewer.wait_start = false;
+            SendGop(stream, viewer);
         }
+    }
 
-        if (type == IFRAME) {
-            success = SendAndAdvance(
-                    stream,
-                    seq,
-                    keyframe->timeUs,
-                    keyframe->data,
-                    keyframe->size);
-
-        } else if (type == NON_IFRAME) {
-            // Re-send keyframe if missed
-            if (stream.last_time_us < keyframe->timeUs) {
-                success = SendAndAdvance(
-                        stream,
-                        seq,
-                        keyframe->timeUs,
-                        keyframe->data,
-                        keyframe->size);
-            }
+    if (!frame || frame->timeUs <= stream.last_time_us) {
+        return;
+    }
 
-            if (success) {
-                success = SendAndAdvance(
-                        stream,
-                        seq,
-                        frame->timeUs,
-                        frame->data,
-                        frame->size);
+    for (i = 0; i < stream.viewer_count; ++i) {
+        S_VideoViewer& viewer = *stream.viewers[i];
+        if (viewer.failed) {
+            continue;
+        }
+        if (!viewer.live) {
+            Join(stream, viewer, frame);
+        }
+        if (viewer.live) {
+            lane = Lane(viewer);
+            size = PacketSize(viewer);
+            if (live[lane] == 0 || size < stream.lanes[lane].packet_size) {
+                stream.lanes[lane].packet_size = size;
             }
+            live[lane]++;
         }
+    }
 
-        if (!success) {
-            break;
+    for (lane = 0; lane < VIDEO_LANES; ++lane) {
+        if (live[lane] > 0) {
+            stream.lane = lane;
+            sent = SendAndAdvance(stream, nullptr, stream.lanes[lane].seq, frame) || sent;
+        }
+    }
+    if (sent) {
+        stream.last_time_us = frame->timeUs;
+        SendFrame(stream.stats);
+    }
+}
+
+static void StartStreaming(S_VideoStream& stream) {
+    SetThreadName("VideoStream");
+
+    SharedFrame* frame;
+
+    // Pop -> Broadcast -> SendAndAdvance -> PacketizeAndSend -> Deliver
+    while (Load(&stream.state) == RECORD) {
+        frame = Pop(stream.ring);
+
+        Lock(&stream.viewers_lock);
+        Broadcast(stream, frame);
+        Unlock(&stream.viewers_lock);
+
+        if (frame) {
+            Release(frame);
+        } else {
+            Sleep(stream.ring);
         }
     }
 }
@@ -288,126 +621,626 @@ static void* StartStreamingThread(void* arg) {
     return nullptr;
 }
 
-static void FrameCallback(void* ctx, const FrameBuffer<MAX_VIDEO_FRAME_SIZE>& frame) {
+static void FrameCallback(void* ctx, SharedFrame* frame) {
     auto stream = static_cast<S_VideoStream*>(ctx);
     if (stream) {
         ProcessFrame(*stream, frame);
     }
 }
 
-static uint_t RtpTimestamp(const S_VideoStream& stream, tm_t time_us) {
-    tm_t delta = time_us - stream.last_time_us;
-    return stream.last_rtp_ts + (uint_t)(delta * VIDEO_SAMPLE_RATE / 1000000);
-}
 
-static void SendReport(S_VideoStream & stream) {
+// RTCP Sender Report of the viewer, after its frame
+static void SendReport(S_VideoStream& stream, S_VideoViewer& viewer) {
     int_t read;
-    tm_t now = NowSecs();
+    tm_t now = NowMicros();
 
-    if (stream.packet_count >= 50 && // Any number is OK, just don't too big
-        stream.last_report_sec != now && now % 2 == 0) {
-        stream.last_report_sec = now;
+    if (viewer.packet_count > 0 && now >= viewer.next_report_us) {
+        viewer.next_report_us = now + ReportIntervalUs(VIDEO_BIT_RATE, RTCP_REPORT_SIZE, false);
 
         // RTCP uses interleave + 1
-        read = PacketizeReport(stream.interleave + 1,
-                               stream.socket_buffer.data,
-                               stream.ssrc,
-                               stream.last_rtp_ts,
-                               stream.packet_count,
-                               stream.octet_count);
-        Send(*stream.socket,
-             stream.socket_buffer.data,
-             read, 0);
+        // RTP time of now, same instant as the NTP time inside
+        read = PacketizeReport(viewer.transport.interleave + 1,
+                               NextHeader(viewer.report),
+                               viewer.ssrc,
+                               RtpNow(stream.clock) + viewer.ts_offset,
+                               viewer.packet_count,
+                               viewer.octet_count);
+        AddReport(viewer.report, read);
+        Flush(viewer.report, viewer.transport, false);
+        SendSyscalls(stream.stats, viewer.report.syscalls);
+        viewer.report.syscalls = 0;
     }
 }
 
 static bool_t SendAndAdvance(
         S_VideoStream &stream,
+        S_VideoViewer *target,
         ushort_t &seq,
-        tm_t frame_time_us,
-        const byte_t *data,
-        sz_t size) {
+        SharedFrame *frame) {
+
+    uint_t key_rtp_ts = RtpTimestamp(stream.clock, frame->timeUs);
+    ushort_t first_seq = seq;
+    int_t result;
+
+    stream.frame = frame;
+    result = PacketizeAndSend(stream,
+                              target,
+                              seq,
+                              key_rtp_ts,
+                              frame->data,
+                              frame->size);
+    stream.frame = nullptr;
+    if (result < 0) {
+        return false;
+    }
+
+    if (target) {
+        target->last_time_us = frame->timeUs;
+        return true;
+    }
+    EndThin(stream, first_seq);
+    return true;
+}
+
+// Repair packet of a complete row (step 1) or column (step FEC_COLUMNS)
+static void AddRepair(S_VideoStream& stream, S_VideoViewer& viewer, FecGroup& group, sz_t step) {
+    byte_t *dst;
+    int_t read;
+
+    if (Full(viewer.fec_batch) &&
+        Flush(viewer.fec_batch, viewer.transport, false) < 0) {
+        LOGE(LOG_TAG, "Failed to send FEC packets");
+    }
+
+    dst = viewer.fec_packets[viewer.fec_batch.packet_count];
+    read = PacketizeFec(viewer.fec_header,
+                        viewer.fec_seq,
+                        RtpNow(stream.clock) + viewer.ts_offset,
+                        (uint_t)viewer.ssrc,
+                        group,
+                        step,
+                        dst,
+                        sizeof(viewer.fec_packets[0]));
+    Reset(group);
+    if (read < 0) {
+        return;
+    }
+
+    // Only the TCP prefix goes to the batch headers, the rest is sent from dst
+    Copy(NextHeader(viewer.fec_batch), dst, TCP_PREFIX_LEN);
+    AddPacket(viewer.fec_batch, TCP_PREFIX_LEN, dst + TCP_PREFIX_LEN, read - TCP_PREFIX_LEN);
+    viewer.fec_seq++;
+}
+
+// Packets are numbered row by row in a block:
+// index = row * FEC_COLUMNS + column.
+// Packet i of the batch, already patched for the viewer, is gathered first.
+static void Protect(S_VideoStream& stream, S_VideoViewer& viewer, sz_t i) {
+    const s_iovec_t *vectors;
+    sz_t count;
+    sz_t size;
+    sz_t j;
+    byte_t *dst = stream.fec_packet;
+    sz_t column = viewer.fec_index % FEC_COLUMNS;
+    sz_t row = viewer.fec_index / FEC_COLUMNS;
+
+    count = PacketVectors(stream.batch, i, vectors);
+    size = stream.batch.packet_sizes[i] - TCP_PREFIX_LEN;
+    if (size > sizeof(stream.fec_packet)) {
+        return;
+    }
+
+    Copy(dst,
+         static_cast<const byte_t *>(vectors[0].iov_base) + TCP_PREFIX_LEN,
+         vectors[0].iov_len - TCP_PREFIX_LEN);
+    dst += vectors[0].iov_len - TCP_PREFIX_LEN;
+    for (j = 1; j < count; ++j) {
+        Copy(dst, vectors[j].iov_base, vectors[j].iov_len);
+        dst += vectors[j].iov_len;
+    }
+
+    Protect(viewer.fec_row, stream.fec_packet, size);
+    if (FEC_ROWS > 1) {
+        Protect(viewer.fec_columns[column], stream.fec_packet, size);
+    }
+
+    if (column == FEC_COLUMNS - 1) {
+        AddRepair(stream, viewer, viewer.fec_row, 1);
+    }
+    if (FEC_ROWS > 1 && row == FEC_ROWS - 1) {
+        AddRepair(stream, viewer, viewer.fec_columns[column], FEC_COLUMNS);
+    }
+
+    viewer.fec_index = (viewer.fec_index + 1) % (FEC_COLUMNS * (FEC_ROWS > 1 ? FEC_ROWS : 1));
+}
+
+// Copy the batch packets (without TCP prefix) to the history, in lane seq,
+// before they are patched for the viewers
+static void Remember(S_VideoStream& stream) {
+    const s_iovec_t *vectors;
+    sz_t count;
+    sz_t size;
+    sz_t i;
+    sz_t j;
+    byte_t *dst;
+    tm_t now = NowMicros();
+
+    Lock(&stream.history.lock);
+    for (i = 0; i < stream.batch.packet_count; ++i) {
+        count = PacketVectors(stream.batch, i, vectors);
+        size = stream.batch.packet_sizes[i] - TCP_PREFIX_LEN;
+
+        // Sequence number is at byte 2 of the RTP header
+        const byte_t *rtp = static_cast<const byte_t *>(vectors[0].iov_base) + TCP_PREFIX_LEN;
+        dst = Reserve(stream.history, (ushort_t)((rtp[2] << 8) | rtp[3]), size, now);
+        if (!dst) {
+            continue;
+        }
+
+        Copy(dst, rtp, vectors[0].iov_len - TCP_PREFIX_LEN);
+        dst += vectors[0].iov_len - TCP_PREFIX_LEN;
+        for (j = 1; j < count; ++j) {
+            Copy(dst, vectors[j].iov_base, vectors[j].iov_len);
+            dst += vectors[j].iov_len;
+        }
+    }
+    Unlock(&stream.history.lock);
+}
+
+// Pick the viewers that don't get this picture, by their queue depth.
+// Only pictures no kept picture depends on are dropped, the rest of
+// the stream still decodes, at a lower frame rate.
+static void Thin(S_VideoStream& stream, const PictureInfo& picture) {
+    int_t depth_ms;
+    sz_t i;
+
+    for (i = 0; i < stream.viewer_count; ++i) {
+        S_VideoViewer& viewer = *stream.viewers[i];
+        viewer.thinned = false;
+        if (!viewer.live || viewer.failed || !InLane(stream, viewer)) {
+            continue;
+        }
+        depth_ms = viewer.transport.queue ? S_DepthMs(*viewer.transport.queue) : 0;
+
+        // Dropped sub-layers come back where they decode again:
+        // IRAP, or TSA with all layers below it kept
+        if (depth_ms <= THIN_TEMPORAL_MS &&
+            (picture.irap ||
+             (picture.switch_up && picture.temporal_id <= viewer.max_temporal_id + 1))) {
+            viewer.max_temporal_id = THIN_ALL_LAYERS;
+        }
+        if (depth_ms > THIN_TEMPORAL_MS && picture.temporal_id > 0) {
+            viewer.max_temporal_id = 0;
+        }
+
+        viewer.thinned = picture.temporal_id > viewer.max_temporal_id ||
+                         (!picture.reference && depth_ms > THIN_NON_REFERENCE_MS);
+        if (viewer.thinned) {
+            DropFrame(stream.stats);
+        }
+    }
+}
+
+// Thinned viewers go on from the next frame without a seq gap,
+// so they don't NACK what was left out on purpose.
+// Older packets can't be mapped anymore and are not sent again.
+static void EndThin(S_VideoStream& stream, ushort_t first_seq) {
+    ushort_t seq = stream.lanes[stream.lane].seq;
+    sz_t i;
+
+    for (i = 0; i < stream.viewer_count; ++i) {
+        S_VideoViewer& viewer = *stream.viewers[i];
+        if (viewer.thinned) {
+            viewer.seq_offset = (ushort_t)(viewer.seq_offset - (ushort_t)(seq - first_seq));
+            viewer.live_seq = seq;
+            viewer.thinned = false;
+        }
+    }
+}
+
+// Client didn't take the last frames in time (SEND_POLICY_SKIP):
+// it gets nothing until the next keyframe, then joins again.
+// Like thinned viewers it goes on without a seq gap: the skipped
+// packets were never sent and can't be asked again.
+// A GOP burst (seq_offset 0) is cut the same way.
+static void Skip(S_VideoStream& stream,
+                 S_VideoViewer& viewer,
+                 ushort_t first_seq,
+                 ushort_t seq_offset) {
+    viewer.next_seq = (ushort_t)(first_seq + seq_offset);
+    viewer.live = false;
+    viewer.behind = true;
+    viewer.wait_keyframe = true;
+
+    DropFrame(stream.stats);
+    if (THIN_REQUEST_IRAP) {
+        E_RequestKeyFrame(*stream.encoder);
+    }
+}
+
+// Sends lo..hi are done, their slots are free
+static void CompleteSends(S_VideoViewer& viewer, uint_t lo, uint_t hi) {
+    for (auto& send: viewer.zc_sends) {
+        if (send.frame && send.id - lo <= hi - lo) {
+            Release(send.frame);
+            send.frame = nullptr;
+        }
+    }
+}
+
+// Free the batches the kernel is done with
+static void ReapZeroCopy(S_VideoStream& stream, S_VideoViewer& viewer) {
+    uint_t lo;
+    uint_t hi;
+    bool_t copied;
+
+    while (ReadZeroCopy(viewer.transport.socket->socket, lo, hi, copied)) {
+        CompleteZeroCopy(stream.stats, hi - lo + 1, copied);
+        CompleteSends(viewer, lo, hi);
+    }
+}
+
+// The streaming thread is done with the viewer, the stats are still its own
+bool_t S_ReapZeroCopy(S_VideoViewer& viewer) {
+    uint_t lo;
+    uint_t hi;
+    bool_t copied;
+
+    while (InFlight(viewer) && ReadZeroCopy(viewer.transport.socket->socket, lo, hi, copied)) {
+        CompleteSends(viewer, lo, hi);
+    }
+    return InFlight(viewer);
+}
 
-    uint_t key_rtp_ts = RtpTimestamp(stream, frame_time_us);
-    if (PacketizeAndSend(stream,
-                         seq,
-                         key_rtp_ts,
-                         data,
-                         size) < 0) {
+static bool_t InFlight(const S_VideoViewer& viewer) {
+    for (const auto& send: viewer.zc_sends) {
+        if (send.frame) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Large TCP batches of a frame: the kernel sends from the frame and
+// from a copy of the headers, both are kept until its completion
+static bool_t CanZeroCopy(const S_VideoStream& stream, const S_VideoViewer& viewer) {
+    const PacketBatch<RTP_BATCH_MAX_PACKETS>& batch = stream.batch;
+    sz_t size = 0;
+
+    if (!RTP_ZEROCOPY || !stream.frame ||
+        viewer.transport.type != TRANSPORT_TCP ||
+        batch.vector_count > ZEROCOPY_MAX_VECTORS ||
+        batch.header_size > sizeof(viewer.zc_sends[0].headers)) {
         return false;
     }
-    stream.last_time_us = frame_time_us;
-    stream.last_rtp_ts = key_rtp_ts;
+    for (sz_t i = 0; i < batch.packet_count; ++i) {
+        size += batch.packet_sizes[i];
+    }
+    return size >= ZEROCOPY_MIN_BYTES;
+}
 
-    // RTCP Sender Report
-    SendReport(stream);
+static bool_t IsKeyFrame(const SharedFrame* frame) {
+    return frame && (frame->flags & E_INFO_FLAG_KEY_FRAME);
+}
 
-    // Stats
-    SendFrame(stream.stats);
-    return true;
+// Same as Send(), a copy if every slot is still in flight
+static ssz_t SendZeroCopy(S_VideoStream& stream, S_VideoViewer& viewer, bool_t more) {
+    PacketBatch<RTP_BATCH_MAX_PACKETS>& batch = stream.batch;
+    CancellableSocket& socket = *viewer.transport.socket;
+    S_SendQueue& queue = *viewer.transport.queue;
+    S_ZeroCopySend* send = nullptr;
+    const byte_t *base;
+    uint_t id;
+    ssz_t sent;
+    sz_t i;
+
+    for (auto& slot: viewer.zc_sends) {
+        if (!slot.frame) {
+            send = &slot;
+            break;
+        }
+    }
+    if (!send) {
+        return Send(batch, viewer.transport, more);
+    }
+
+    Copy(send->headers, batch.headers, batch.header_size);
+    for (i = 0; i < batch.vector_count; ++i) {
+        send->vectors[i] = batch.vectors[i];
+        base = static_cast<const byte_t *>(batch.vectors[i].iov_base);
+        if (base >= batch.headers && base < batch.headers + batch.header_size) {
+            send->vectors[i].iov_base = send->headers + (base - batch.headers);
+        }
+    }
+
+    Lock(&socket.send_lock);
+    id = queue.zerocopy_id;
+    sent = S_SendMedia(queue,
+                       send->vectors,
+                       batch.vector_count,
+                       (more ? MSG_MORE : 0) | MSG_ZEROCOPY,
+                       batch.syscalls);
+    // Queued or refused sends were copied or not sent at all
+    if (queue.zerocopy_id != id) {
+        send->id = id;
+        send->frame = stream.frame;
+        Retain(send->frame);
+    }
+    Unlock(&socket.send_lock);
+    return sent;
+}
+
+// Patch the batch for one viewer and send it.
+// Packet i gets seq first_seq + i + seq_offset.
+static void Deliver(S_VideoStream& stream,
+                    S_VideoViewer& viewer,
+                    ushort_t first_seq,
+                    uint_t rtp_ts,
+                    ushort_t seq_offset,
+                    bool_t more) {
+    PacketBatch<RTP_BATCH_MAX_PACKETS>& batch = stream.batch;
+    bool_t protect = FEC_ENABLED && viewer.transport.type == TRANSPORT_UDP;
+    byte_t *header;
+    ssz_t sent;
+    sz_t size;
+    sz_t i;
+
+    sent = S_CheckBudget(viewer.transport);
+    if (sent == SEND_BLOCKED) {
+        Skip(stream, viewer, first_seq, seq_offset);
+        return;
+    }
+    if (sent < 0) {
+        viewer.failed = true;
+        return;
+    }
+
+    for (i = 0; i < batch.packet_count; ++i) {
+        header = static_cast<byte_t *>(batch.vectors[batch.packet_vectors[i]].iov_base);
+        PatchRtpHeader(header,
+                       viewer.transport.interleave,
+                       (ushort_t)(first_seq + i + seq_offset),
+                       rtp_ts + viewer.ts_offset,
+                       (uint_t)viewer.ssrc);
+
+        viewer.packet_count++;
+        viewer.octet_count += batch.packet_sizes[i] - RtpPayloadStart();
+
+        if (protect) {
+            Protect(stream, viewer, i);
+        }
+    }
+
+    if (RTP_ZEROCOPY && viewer.transport.type == TRANSPORT_TCP && InFlight(viewer)) {
+        ReapZeroCopy(stream, viewer);
+    }
+
+    // Others still get the frame, this viewer is dropped by its RTSP thread
+    if (CanZeroCopy(stream, viewer)) {
+        sent = SendZeroCopy(stream, viewer, more);
+    } else {
+        sent = Send(batch, viewer.transport, more);
+    }
+    if (sent == SEND_BLOCKED) {
+        Skip(stream, viewer, first_seq, seq_offset);
+        return;
+    }
+    if (sent < 0) {
+        LOGE(LOG_TAG, "Failed to send video frame");
+        viewer.failed = true;
+        return;
+    }
+
+    // The rate control doesn't take the queue this leaves for congestion
+    if (viewer.transport.queue && (!viewer.live || IsKeyFrame(stream.frame))) {
+        for (i = 0, size = 0; i < batch.packet_count; ++i) {
+            size += batch.packet_sizes[i];
+        }
+        S_AddBurst(*viewer.transport.queue, size);
+    }
+
+    // Repair packets follow the packets they protect
+    if (!Empty(viewer.fec_batch)) {
+        if (Flush(viewer.fec_batch, viewer.transport, false) < 0) {
+            LOGE(LOG_TAG, "Failed to send FEC packets");
+        }
+        SendSyscalls(stream.stats, viewer.fec_batch.syscalls);
+        viewer.fec_batch.syscalls = 0;
+    }
+
+    if (!more) {
+        SendReport(stream, viewer);
+    }
 }
 
+// Send the batch to the target (GOP burst) or to every live viewer.
+// Only UDP packets can be lost and asked again.
+static void FlushBatch(S_VideoStream& stream, S_VideoViewer* target, bool_t more) {
+    const byte_t *rtp;
+    ushort_t first_seq;
+    uint_t rtp_ts;
+    sz_t i;
+
+    if (Empty(stream.batch)) {
+        return;
+    }
+
+    // Seq and timestamp as packetized, before any viewer patches them
+    rtp = static_cast<const byte_t *>(stream.batch.vectors[0].iov_base) + TCP_PREFIX_LEN;
+    first_seq = (ushort_t)((rtp[2] << 8) | rtp[3]);
+    rtp_ts = ReadUInt(rtp + 4);
+
+    // The rest of a GOP burst the viewer couldn't take is dropped
+    if (target) {
+        if (!target->behind) {
+            Deliver(stream, *target, first_seq, rtp_ts, 0, more);
+        }
+        Reset(stream.batch);
+        return;
+    }
+
+    // Only UDP viewers lose packets and NACK them
+    if (stream.lane == VIDEO_LANE_UDP) {
+        Remember(stream);
+    }
+    for (i = 0; i < stream.viewer_count; ++i) {
+        S_VideoViewer& viewer = *stream.viewers[i];
+        if (viewer.live && !viewer.failed && !viewer.thinned && InLane(stream, viewer)) {
+            Deliver(stream, viewer, first_seq, rtp_ts, viewer.seq_offset, more);
+        }
+    }
+    Reset(stream.batch);
+}
+
+// Small NALs in a row (VPS, SPS, PPS, SEI...) share one Aggregation Packet
+// Return the number of NALs packetized, 0 if they don't fit together
+static int_t PacketizeAggregation(
+        S_VideoStream& stream,
+        S_VideoViewer* target,
+        ushort_t& seq,
+        uint_t rtp_ts,
+        const byte_t* data,
+        const NalUnit* nals,
+        sz_t count,
+        sz_t packet_size) {
+
+    const byte_t *payload;
+    sz_t payload_size;
+    sz_t nal_count;
+    sz_t i;
+    int_t read;
+
+    nal_count = CountH265Aggregation(nals, count, packet_size);
+    if (nal_count < 2) {
+        return 0;
+    }
+
+    if (!Fits(stream.batch,
+              1 + nal_count * 2,
+              RTP_AP_HEADER_SIZE + nal_count * RTP_AP_NAL_HEADER_SIZE)) {
+        FlushBatch(stream, target, true);
+    }
+
+    ResumeProcess(stream.stats);
+    read = PacketizeH265AggregationHeader(
+        stream.rtp_header,
+        seq,
+        rtp_ts,
+        data,
+        nals,
+        nal_count,
+        nal_count == count, // Nothing after the AP in this frame
+        NextHeader(stream.batch)
+    );
+    AddPacket(stream.batch, read, nullptr, 0);
+
+    for (i = 0; i < nal_count; ++i) {
+        read = PacketizeH265AggregationUnit(
+            data,
+            nals[i],
+            NextHeader(stream.batch),
+            payload,
+            payload_size
+        );
+        AddFragment(stream.batch, read, payload, payload_size);
+    }
+    PauseProcess(stream.stats);
+
+    seq = (seq + 1) % 65536;
+    SendPackets(stream.stats, 1);
+    return (int_t)nal_count;
+}
+
+// Packetize the whole frame into the batch once, then flush it
+// with one sendmsg() per viewer
 static int_t PacketizeAndSend(
         S_VideoStream& stream,
+        S_VideoViewer* target,
         ushort_t& seq,
         uint_t rtp_ts,
         const byte_t* data,
         sz_t size) {
 
     NalUnit nals[16];
+    const byte_t *payload;
+    sz_t payload_size;
+    sz_t packet_size;
     sz_t count;
     sz_t i;
     sz_t offset;
     int_t read;
-    bool_t stopping;
+    int_t aggregated;
+    bool_t stopping = false;
 
     StartProcess(stream.stats);
     count = ExtractNal(data, 0, size, nals, 16);
     PauseProcess(stream.stats);
 
-    for (i = 0; i < count; ++i) {
+    // GOP bursts are never thinned, the viewer needs every picture to start
+    if (!target) {
+        Thin(stream, GetPictureInfo(data, nals, count));
+    }
+
+    Reset(stream.batch);
+    stream.batch.syscalls = 0;
+    packet_size = target ? PacketSize(*target) : stream.lanes[stream.lane].packet_size;
+
+    for (i = 0; i < count && !stopping; ++i) {
         const NalUnit& nal = nals[i];
 
+        aggregated = PacketizeAggregation(stream, target, seq, rtp_ts, data, nals + i, count - i, packet_size);
+        if (aggregated > 0) {
+            i += aggregated - 1;
+            continue;
+        }
+
         offset = nal.start;
         stopping = Load(&stream.state) == STOPPING;
         while (!stopping && offset < nal.end) {
 
+            // Frame is larger than the batch, flush what we have.
+            // MSG_MORE keeps TCP segments full for the rest of the frame.
+            if (Full(stream.batch)) {
+                FlushBatch(stream, target, true);
+            }
+
             ResumeProcess(stream.stats);
             // This function also updates offset
-            read = PacketizeH265(
-                stream.interleave,
+            // Only headers are written, payload stays in the frame buffer
+            read = PacketizeH265Header(
+                stream.rtp_header,
                 seq,
                 rtp_ts,
-                stream.ssrc,
                 data,
                 size,
                 offset,
                 nal,
-                stream.socket_buffer.data,
-                RTP_MAX_PACKET_SIZE
+                packet_size,
+                NextHeader(stream.batch),
+                payload,
+                payload_size
             );
             PauseProcess(stream.stats);
-            
+
             if (read < 0) {
                 LOGE(LOG_TAG, "Failed to packetize video frame");
                 return -1;
             }
-            
-            if (Send(*stream.socket,
-                     stream.socket_buffer.data, read,
-                     0) < 0) {
-                LOGE(LOG_TAG, "Failed to send video frame"); 
-                return -1;
-            }
+            AddPacket(stream.batch, read, payload, payload_size);
+            SendPackets(stream.stats, 1);
 
-            stream.packet_count++;
-            stream.octet_count += read - RtpPayloadStart();
-            
             seq = (seq + 1) % 65536;
         }
     }
 
     EndProcess(stream.stats);
 
+    if (stopping) {
+        return 0;
+    }
+
+    FlushBatch(stream, target, false);
+    SendSyscalls(stream.stats, stream.batch.syscalls);
+
     return 0;
 }
@@ -0,0 +1,47 @@
+#include "utils/Fec.h"
+#include "utils/Utils.h"
+
+#define RTP_HEADER_SIZE 12
+
+void Init(FecGroup& group) {
+    Reset(&group, sizeof(group));
+}
+
+// Only clear what was used
+void Reset(FecGroup& group) {
+    Reset(group.recovery, FEC_RECOVERY_SIZE);
+    Reset(group.payload, group.size);
+    group.size = 0;
+    group.count = 0;
+    group.base = 0;
+}
+
+bool_t Protect(FecGroup& group, const byte_t *packet, sz_t size) {
+    byte_t recovery[FEC_RECOVERY_SIZE];
+    sz_t payload_size;
+
+    if (size < RTP_HEADER_SIZE || size - RTP_HEADER_SIZE > FEC_MAX_PAYLOAD) {
+        return false;
+    }
+    payload_size = size - RTP_HEADER_SIZE;
+
+    if (group.count == 0) {
+        group.base = (ushort_t)((packet[2] << 8) | packet[3]);
+    }
+
+    // V/P/X/CC, M/PT, length (instead of seq), timestamp
+    recovery[0] = packet[0];
+    recovery[1] = packet[1];
+    recovery[2] = (payload_size >> 8) & 0xFF;
+    recovery[3] = payload_size & 0xFF;
+    Copy(recovery + 4, packet + 4, 4);
+    XorBytes(group.recovery, recovery, FEC_RECOVERY_SIZE);
+
+    // Shorter payloads are padded with zeros, which XOR leaves as is
+    XorBytes(group.payload, packet + RTP_HEADER_SIZE, payload_size);
+    if (payload_size > group.size) {
+        group.size = payload_size;
+    }
+    group.count++;
+    return true;
+}
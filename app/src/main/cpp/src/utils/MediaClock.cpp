@@ -0,0 +1,40 @@
+#include "utils/MediaClock.h"
+
+#define RTCP_BANDWIDTH_FRACTION 0.05
+#define RTCP_MIN_INTERVAL_US 5000000
+#define RTCP_MEMBERS 2
+#define RTCP_COMPENSATION 1.21828 // e - 3/2
+
+void Init(MediaClock& clock, uint_t rate, uint_t rtp_origin) {
+    clock.origin_us = NowMicros();
+    clock.rtp_origin = rtp_origin;
+    clock.rate = rate;
+}
+
+uint_t RtpTimestamp(const MediaClock& clock, tm_t time_us) {
+    // Frames can be a little older than the origin
+    long_t delta_us = (long_t)(time_us - clock.origin_us);
+    long_t ticks = delta_us * (long_t)clock.rate / 1000000;
+
+    // Wrap around 32 bits
+    return clock.rtp_origin + (uint_t)ticks;
+}
+
+uint_t RtpNow(const MediaClock& clock) {
+    return RtpTimestamp(clock, NowMicros());
+}
+
+tm_t ReportIntervalUs(sz_t session_bit_rate, sz_t avg_report_size, bool_t initial) {
+    double_t rtcp_bytes_per_sec = session_bit_rate * RTCP_BANDWIDTH_FRACTION / 8;
+    double_t min_us = initial ? RTCP_MIN_INTERVAL_US / 2 : RTCP_MIN_INTERVAL_US;
+    double_t interval_us = RTCP_MEMBERS * avg_report_size / rtcp_bytes_per_sec * 1000000;
+    double_t random;
+
+    if (interval_us < min_us) {
+        interval_us = min_us;
+    }
+
+    // Randomize in [0.5, 1.5] to avoid synchronized reports
+    random = 0.5 + (double_t)(rand() % 1000) / 1000;
+    return (tm_t)(interval_us * random / RTCP_COMPENSATION);
+}
@@ -0,0 +1,666 @@
+#include "utils/Mp4Writer.h"
+
+#define MP4_TIMESCALE 1000
+#define MP4_SPS_MAX_SIZE 128
+
+// Parameter sets are in hvcC, access unit delimiters aren't needed
+#define NAL_TYPE_AUD 35
+
+// Sample flags (ISO/IEC 14496-12 8.8.3.1)
+#define MP4_SAMPLE_SYNC 0x02000000     // depends on no other sample
+#define MP4_SAMPLE_NON_SYNC 0x01010000 // depends on others, not a sync sample
+
+// tfhd / trun flags
+#define TFHD_DEFAULT_FLAGS 0x000020
+#define TFHD_BASE_IS_MOOF 0x020000
+#define TRUN_DATA_OFFSET 0x000001
+#define TRUN_DURATION 0x000100
+#define TRUN_SIZE 0x000200
+#define TRUN_FLAGS 0x000400
+
+// MPEG-4 descriptors inside esds
+#define ES_DESCRIPTOR_TAG 3
+#define DECODER_CONFIG_TAG 4
+#define DECODER_SPECIFIC_TAG 5
+#define SL_CONFIG_TAG 6
+#define AAC_OBJECT_TYPE_INDICATION 0x40
+#define AAC_STREAM_TYPE 0x15  // Audio stream (5) << 2 | 1
+#define AAC_LC 2
+
+// Boxes are written front to back, sizes are patched when a box ends.
+// On overflow nothing more is written and the result is -1.
+typedef struct {
+    byte_t *data;
+    sz_t size;
+    sz_t offset;
+    bool_t overflow;
+} Mp4Buffer;
+
+// What hvcC and the sample entry need from the SPS
+typedef struct {
+    byte_t ptl[12];     // general profile / tier / level, as in the SPS
+    int_t sub_layers;
+    int_t temporal_id_nesting;
+    int_t chroma_format_idc;
+    int_t bit_depth_luma;
+    int_t bit_depth_chroma;
+    uint_t width;
+    uint_t height;
+} SpsInfo;
+
+typedef struct {
+    const byte_t *data;
+    sz_t size;
+    sz_t bit;
+} BitReader;
+
+static const uint_t kSampleRates[] = {
+    96000, 88200, 64000, 48000, 44100, 32000,
+    24000, 22050, 16000, 12000, 11025, 8000, 7350
+};
+
+static const uint_t kMatrix[] = {
+    0x00010000, 0, 0,
+    0, 0x00010000, 0,
+    0, 0, 0x40000000
+};
+
+static bool_t Reserve(Mp4Buffer &buffer, sz_t size) {
+    if (buffer.overflow || buffer.offset + size > buffer.size) {
+        buffer.overflow = true;
+        return false;
+    }
+    return true;
+}
+
+static void Put8(Mp4Buffer &buffer, uint_t value) {
+    if (Reserve(buffer, 1)) {
+        buffer.data[buffer.offset++] = value & 0xFF;
+    }
+}
+
+static void Put16(Mp4Buffer &buffer, uint_t value) {
+    Put8(buffer, value >> 8);
+    Put8(buffer, value);
+}
+
+static void Put24(Mp4Buffer &buffer, uint_t value) {
+    Put8(buffer, value >> 16);
+    Put16(buffer, value);
+}
+
+static void Put32(Mp4Buffer &buffer, uint_t value) {
+    Put16(buffer, value >> 16);
+    Put16(buffer, value);
+}
+
+static void Put64(Mp4Buffer &buffer, tm_t value) {
+    Put32(buffer, (uint_t)(value >> 32));
+    Put32(buffer, (uint_t)value);
+}
+
+static void PutBytes(Mp4Buffer &buffer, const void *data, sz_t size) {
+    if (Reserve(buffer, size)) {
+        Copy(buffer.data + buffer.offset, data, size);
+        buffer.offset += size;
+    }
+}
+
+static void PutZeros(Mp4Buffer &buffer, sz_t size) {
+    if (Reserve(buffer, size)) {
+        Reset(buffer.data + buffer.offset, size);
+        buffer.offset += size;
+    }
+}
+
+static void PutType(Mp4Buffer &buffer, const char_t *type) {
+    PutBytes(buffer, type, 4);
+}
+
+static void Patch32(Mp4Buffer &buffer, sz_t offset, uint_t value) {
+    if (buffer.overflow) {
+        return;
+    }
+    buffer.data[offset] = (value >> 24) & 0xFF;
+    buffer.data[offset + 1] = (value >> 16) & 0xFF;
+    buffer.data[offset + 2] = (value >> 8) & 0xFF;
+    buffer.data[offset + 3] = value & 0xFF;
+}
+
+// Return the box start, for EndBox()
+static sz_t StartBox(Mp4Buffer &buffer, const char_t *type) {
+    sz_t start = buffer.offset;
+    Put32(buffer, 0);
+    PutType(buffer, type);
+    return start;
+}
+
+static sz_t StartFullBox(Mp4Buffer &buffer, const char_t *type, uint_t version, uint_t flags) {
+    sz_t start = StartBox(buffer, type);
+    Put8(buffer, version);
+    Put24(buffer, flags);
+    return start;
+}
+
+static void EndBox(Mp4Buffer &buffer, sz_t start) {
+    Patch32(buffer, start, (uint_t)(buffer.offset - start));
+}
+
+static void PutMatrix(Mp4Buffer &buffer) {
+    for (uint_t value : kMatrix) {
+        Put32(buffer, value);
+    }
+}
+
+static uint_t ReadBits(BitReader &reader, int_t count) {
+    uint_t value = 0;
+
+    for (int_t i = 0; i < count; ++i) {
+        value <<= 1;
+        if (reader.bit / 8 < reader.size) {
+            value |= (reader.data[reader.bit / 8] >> (7 - reader.bit % 8)) & 1;
+        }
+        reader.bit++;
+    }
+    return value;
+}
+
+// Exp-Golomb ue(v)
+static uint_t ReadUe(BitReader &reader) {
+    int_t zeros = 0;
+
+    while (ReadBits(reader, 1) == 0 && zeros < 32) {
+        zeros++;
+    }
+    return ((1u << zeros) - 1) + ReadBits(reader, zeros);
+}
+
+// NAL payload without emulation prevention bytes (00 00 03)
+static sz_t ToRbsp(const byte_t *src, sz_t size, byte_t *dst, sz_t max) {
+    sz_t length = 0;
+    int_t zeros = 0;
+
+    for (sz_t i = 0; i < size && length < max; ++i) {
+        if (zeros >= 2 && src[i] == 3) {
+            zeros = 0;
+            continue;
+        }
+        zeros = src[i] == 0 ? zeros + 1 : 0;
+        dst[length++] = src[i];
+    }
+    return length;
+}
+
+// Rec. H.265 7.3.2.2, up to the bit depths
+static bool_t ParseSps(const byte_t *sps, sz_t size, SpsInfo &info) {
+    byte_t rbsp[MP4_SPS_MAX_SIZE];
+    BitReader reader;
+    bool_t profile_present[8];
+    bool_t level_present[8];
+    uint_t conf_left = 0, conf_right = 0, conf_top = 0, conf_bottom = 0;
+    uint_t sub_width;
+    uint_t sub_height;
+    int_t max_sub_layers_minus1;
+    int_t i;
+
+    // NAL header (2 bytes) is not part of it
+    reader.size = ToRbsp(sps, size, rbsp, MP4_SPS_MAX_SIZE);
+    reader.data = rbsp;
+    reader.bit = 16;
+    if (reader.size < 2 + 1 + sizeof(info.ptl)) {
+        return false;
+    }
+
+    ReadBits(reader, 4); // sps_video_parameter_set_id
+    max_sub_layers_minus1 = (int_t)ReadBits(reader, 3);
+    info.sub_layers = max_sub_layers_minus1 + 1;
+    info.temporal_id_nesting = (int_t)ReadBits(reader, 1);
+
+    // General profile_tier_level, byte aligned here
+    Copy(info.ptl, rbsp + reader.bit / 8, sizeof(info.ptl));
+    reader.bit += sizeof(info.ptl) * 8;
+
+    for (i = 0; i < max_sub_layers_minus1; ++i) {
+        profile_present[i] = ReadBits(reader, 1);
+        level_present[i] = ReadBits(reader, 1);
+    }
+    if (max_sub_layers_minus1 > 0) {
+        for (i = max_sub_layers_minus1; i < 8; ++i) {
+            ReadBits(reader, 2);
+        }
+    }
+    for (i = 0; i < max_sub_layers_minus1; ++i) {
+        reader.bit += profile_present[i] ? 88 : 0;
+        reader.bit += level_present[i] ? 8 : 0;
+    }
+
+    ReadUe(reader); // sps_seq_parameter_set_id
+    info.chroma_format_idc = (int_t)ReadUe(reader);
+    if (info.chroma_format_idc == 3) {
+        ReadBits(reader, 1); // separate_colour_plane_flag
+    }
+    info.width = ReadUe(reader);
+    info.height = ReadUe(reader);
+    if (ReadBits(reader, 1)) {
+        conf_left = ReadUe(reader);
+        conf_right = ReadUe(reader);
+        conf_top = ReadUe(reader);
+        conf_bottom = ReadUe(reader);
+    }
+    info.bit_depth_luma = (int_t)ReadUe(reader) + 8;
+    info.bit_depth_chroma = (int_t)ReadUe(reader) + 8;
+
+    // Conformance window is in chroma samples
+    sub_width = info.chroma_format_idc == 1 || info.chroma_format_idc == 2 ? 2 : 1;
+    sub_height = info.chroma_format_idc == 1 ? 2 : 1;
+    info.width -= (conf_left + conf_right) * sub_width;
+    info.height -= (conf_top + conf_bottom) * sub_height;
+
+    return reader.bit / 8 <= reader.size;
+}
+
+// HEVCDecoderConfigurationRecord (ISO/IEC 14496-15 8.3.3), one array per parameter set
+static void PutHvcC(Mp4Buffer &buffer,
+                    const SpsInfo &info,
+                    const byte_t *const *params,
+                    const sz_t *sizes) {
+    sz_t box = StartBox(buffer, "hvcC");
+
+    Put8(buffer, 1); // configurationVersion
+    PutBytes(buffer, info.ptl, 1 + 4 + 6);     // profile, compatibility, constraints
+    Put8(buffer, info.ptl[11]);                // general_level_idc
+    Put16(buffer, 0xF000);                     // min_spatial_segmentation_idc
+    Put8(buffer, 0xFC);                        // parallelismType
+    Put8(buffer, 0xFC | info.chroma_format_idc);
+    Put8(buffer, 0xF8 | (info.bit_depth_luma - 8));
+    Put8(buffer, 0xF8 | (info.bit_depth_chroma - 8));
+    Put16(buffer, 0);                          // avgFrameRate
+    Put8(buffer, (info.sub_layers << 3) |
+                 (info.temporal_id_nesting << 2) |
+                 (MP4_NAL_LENGTH_SIZE - 1));
+
+    Put8(buffer, 3);
+    for (sz_t i = 0; i < 3; ++i) {
+        Put8(buffer, 0x80 | (NAL_TYPE_VPS + i)); // array_completeness
+        Put16(buffer, 1);
+        Put16(buffer, (uint_t)sizes[i]);
+        PutBytes(buffer, params[i], sizes[i]);
+    }
+    EndBox(buffer, box);
+}
+
+static void PutDescriptor(Mp4Buffer &buffer, uint_t tag, uint_t size) {
+    Put8(buffer, tag);
+    Put8(buffer, size);
+}
+
+// AudioSpecificConfig: AAC-LC, sample rate index, channels
+static uint_t AudioSpecificConfig() {
+    uint_t index = 0;
+
+    while (index < sizeof(kSampleRates) / sizeof(kSampleRates[0]) - 1 &&
+           kSampleRates[index] != AUDIO_SAMPLE_RATE) {
+        index++;
+    }
+    return (AAC_LC << 11) | (index << 7) | (AUDIO_CHANNEL_COUNT << 3);
+}
+
+static void PutEsds(Mp4Buffer &buffer) {
+    sz_t box = StartFullBox(buffer, "esds", 0, 0);
+
+    PutDescriptor(buffer, ES_DESCRIPTOR_TAG, 3 + 2 + 13 + 2 + 2 + 2 + 1);
+    Put16(buffer, 0); // ES_ID
+    Put8(buffer, 0);  // Flags
+
+    PutDescriptor(buffer, DECODER_CONFIG_TAG, 13 + 2 + 2);
+    Put8(buffer, AAC_OBJECT_TYPE_INDICATION);
+    Put8(buffer, AAC_STREAM_TYPE);
+    Put24(buffer, MAX_AUDIO_FRAME_SIZE); // bufferSizeDB
+    Put32(buffer, AUDIO_BIT_RATE);      // maxBitrate
+    Put32(buffer, AUDIO_BIT_RATE);      // avgBitrate
+
+    PutDescriptor(buffer, DECODER_SPECIFIC_TAG, 2);
+    Put16(buffer, AudioSpecificConfig());
+
+    PutDescriptor(buffer, SL_CONFIG_TAG, 1);
+    Put8(buffer, 2); // Predefined MP4
+
+    EndBox(buffer, box);
+}
+
+static void PutTrackHeader(Mp4Buffer &buffer, uint_t track_id, bool_t audio, const SpsInfo *info) {
+    sz_t box = StartFullBox(buffer, "tkhd", 0, 3); // Enabled, in movie
+
+    Put32(buffer, 0); // Creation time
+    Put32(buffer, 0); // Modification time
+    Put32(buffer, track_id);
+    Put32(buffer, 0);
+    Put32(buffer, 0); // Duration, fragmented
+    PutZeros(buffer, 8);
+    Put16(buffer, 0); // Layer
+    Put16(buffer, 0); // Alternate group
+    Put16(buffer, audio ? 0x0100 : 0);
+    Put16(buffer, 0);
+    PutMatrix(buffer);
+    Put32(buffer, info ? info->width << 16 : 0);
+    Put32(buffer, info ? info->height << 16 : 0);
+    EndBox(buffer, box);
+}
+
+static void PutMediaHeader(Mp4Buffer &buffer, uint_t timescale, bool_t audio) {
+    sz_t box = StartFullBox(buffer, "mdhd", 0, 0);
+
+    Put32(buffer, 0);
+    Put32(buffer, 0);
+    Put32(buffer, timescale);
+    Put32(buffer, 0);
+    Put16(buffer, 0x55C4); // "und"
+    Put16(buffer, 0);
+    EndBox(buffer, box);
+
+    box = StartFullBox(buffer, "hdlr", 0, 0);
+    Put32(buffer, 0);
+    PutType(buffer, audio ? "soun" : "vide");
+    PutZeros(buffer, 12);
+    PutBytes(buffer, audio ? "SoundHandler" : "VideoHandler", 13);
+    EndBox(buffer, box);
+}
+
+// Empty sample tables, the samples are in the fragments
+static void PutSampleTables(Mp4Buffer &buffer) {
+    sz_t box;
+
+    box = StartFullBox(buffer, "stts", 0, 0);
+    Put32(buffer, 0);
+    EndBox(buffer, box);
+
+    box = StartFullBox(buffer, "stsc", 0, 0);
+    Put32(buffer, 0);
+    EndBox(buffer, box);
+
+    box = StartFullBox(buffer, "stsz", 0, 0);
+    Put32(buffer, 0);
+    Put32(buffer, 0);
+    EndBox(buffer, box);
+
+    box = StartFullBox(buffer, "stco", 0, 0);
+    Put32(buffer, 0);
+    EndBox(buffer, box);
+}
+
+static void PutDataInformation(Mp4Buffer &buffer) {
+    sz_t dinf = StartBox(buffer, "dinf");
+    sz_t dref = StartFullBox(buffer, "dref", 0, 0);
+    sz_t url;
+
+    Put32(buffer, 1);
+    url = StartFullBox(buffer, "url ", 0, 1); // Data in this file
+    EndBox(buffer, url);
+    EndBox(buffer, dref);
+    EndBox(buffer, dinf);
+}
+
+static void PutVideoTrack(Mp4Buffer &buffer,
+                          const SpsInfo &info,
+                          const byte_t *const *params,
+                          const sz_t *sizes) {
+    sz_t trak = StartBox(buffer, "trak");
+    sz_t mdia;
+    sz_t minf;
+    sz_t stbl;
+    sz_t stsd;
+    sz_t entry;
+    sz_t box;
+
+    PutTrackHeader(buffer, MP4_VIDEO_TRACK, false, &info);
+    mdia = StartBox(buffer, "mdia");
+    PutMediaHeader(buffer, VIDEO_SAMPLE_RATE, false);
+
+    minf = StartBox(buffer, "minf");
+    box = StartFullBox(buffer, "vmhd", 0, 1);
+    PutZeros(buffer, 8); // Graphics mode, opcolor
+    EndBox(buffer, box);
+    PutDataInformation(buffer);
+
+    stbl = StartBox(buffer, "stbl");
+    stsd = StartFullBox(buffer, "stsd", 0, 0);
+    Put32(buffer, 1);
+
+    entry = StartBox(buffer, "hvc1");
+    PutZeros(buffer, 6);
+    Put16(buffer, 1);       // data_reference_index
+    PutZeros(buffer, 16);
+    Put16(buffer, info.width);
+    Put16(buffer, info.height);
+    Put32(buffer, 0x00480000); // 72 dpi
+    Put32(buffer, 0x00480000);
+    Put32(buffer, 0);
+    Put16(buffer, 1);       // frame_count
+    PutZeros(buffer, 32);   // compressorname
+    Put16(buffer, 0x0018);  // depth
+    Put16(buffer, 0xFFFF);
+    PutHvcC(buffer, info, params, sizes);
+    EndBox(buffer, entry);
+
+    EndBox(buffer, stsd);
+    PutSampleTables(buffer);
+    EndBox(buffer, stbl);
+    EndBox(buffer, minf);
+    EndBox(buffer, mdia);
+    EndBox(buffer, trak);
+}
+
+static void PutAudioTrack(Mp4Buffer &buffer) {
+    sz_t trak = StartBox(buffer, "trak");
+    sz_t mdia;
+    sz_t minf;
+    sz_t stbl;
+    sz_t stsd;
+    sz_t entry;
+    sz_t box;
+
+    PutTrackHeader(buffer, MP4_AUDIO_TRACK, true, nullptr);
+    mdia = StartBox(buffer, "mdia");
+    PutMediaHeader(buffer, AUDIO_SAMPLE_RATE, true);
+
+    minf = StartBox(buffer, "minf");
+    box = StartFullBox(buffer, "smhd", 0, 0);
+    Put32(buffer, 0); // Balance, reserved
+    EndBox(buffer, box);
+    PutDataInformation(buffer);
+
+    stbl = StartBox(buffer, "stbl");
+    stsd = StartFullBox(buffer, "stsd", 0, 0);
+    Put32(buffer, 1);
+
+    entry = StartBox(buffer, "mp4a");
+    PutZeros(buffer, 6);
+    Put16(buffer, 1);       // data_reference_index
+    PutZeros(buffer, 8);
+    Put16(buffer, AUDIO_CHANNEL_COUNT);
+    Put16(buffer, 16);      // samplesize
+    Put32(buffer, 0);
+    Put32(buffer, AUDIO_SAMPLE_RATE << 16);
+    PutEsds(buffer);
+    EndBox(buffer, entry);
+
+    EndBox(buffer, stsd);
+    PutSampleTables(buffer);
+    EndBox(buffer, stbl);
+    EndBox(buffer, minf);
+    EndBox(buffer, mdia);
+    EndBox(buffer, trak);
+}
+
+static void PutTrackExtends(Mp4Buffer &buffer, uint_t track_id) {
+    sz_t box = StartFullBox(buffer, "trex", 0, 0);
+
+    Put32(buffer, track_id);
+    Put32(buffer, 1); // default_sample_description_index
+    Put32(buffer, 0);
+    Put32(buffer, 0);
+    Put32(buffer, 0);
+    EndBox(buffer, box);
+}
+
+int_t WriteMp4Init(const byte_t *config,
+                   sz_t config_size,
+                   bool_t audio,
+                   byte_t *dst,
+                   sz_t size) {
+    Mp4Buffer buffer = {dst, size, 0, false};
+    NalUnit nals[8];
+    const byte_t *params[3] = {};
+    sz_t sizes[3] = {};
+    SpsInfo info;
+    sz_t count = ExtractNal(config, 0, config_size, nals, 8);
+    sz_t moov;
+    sz_t mvex;
+    sz_t box;
+    int_t type;
+
+    // VPS, SPS, PPS without their start codes
+    for (sz_t i = 0; i < count; ++i) {
+        type = NAL_TYPE(config, nals[i]);
+        if (type >= NAL_TYPE_VPS && type < NAL_TYPE_VPS + 3) {
+            params[type - NAL_TYPE_VPS] = config + nals[i].start + nals[i].codeSize;
+            sizes[type - NAL_TYPE_VPS] = nals[i].end - nals[i].start - nals[i].codeSize;
+        }
+    }
+    if (!params[0] || !params[1] || !params[2] || !ParseSps(params[1], sizes[1], info)) {
+        return -1;
+    }
+
+    box = StartBox(buffer, "ftyp");
+    PutType(buffer, "iso6");
+    Put32(buffer, 0);
+    PutType(buffer, "iso6");
+    PutType(buffer, "cmfc");
+    EndBox(buffer, box);
+
+    moov = StartBox(buffer, "moov");
+    box = StartFullBox(buffer, "mvhd", 0, 0);
+    Put32(buffer, 0);
+    Put32(buffer, 0);
+    Put32(buffer, MP4_TIMESCALE);
+    Put32(buffer, 0);
+    Put32(buffer, 0x00010000); // Rate
+    Put16(buffer, 0x0100);     // Volume
+    PutZeros(buffer, 10);
+    PutMatrix(buffer);
+    PutZeros(buffer, 24);
+    Put32(buffer, audio ? MP4_AUDIO_TRACK + 1 : MP4_VIDEO_TRACK + 1);
+    EndBox(buffer, box);
+
+    PutVideoTrack(buffer, info, params, sizes);
+    if (audio) {
+        PutAudioTrack(buffer);
+    }
+
+    mvex = StartBox(buffer, "mvex");
+    PutTrackExtends(buffer, MP4_VIDEO_TRACK);
+    if (audio) {
+        PutTrackExtends(buffer, MP4_AUDIO_TRACK);
+    }
+    EndBox(buffer, mvex);
+    EndBox(buffer, moov);
+
+    return buffer.overflow ? -1 : (int_t)buffer.offset;
+}
+
+int_t WriteMp4Fragment(uint_t sequence,
+                       const Mp4Run *runs,
+                       sz_t count,
+                       sz_t data_size,
+                       byte_t *dst,
+                       sz_t size) {
+    Mp4Buffer buffer = {dst, size, 0, false};
+    sz_t data_offsets[2];
+    sz_t run_offset = 0;
+    sz_t moof;
+    sz_t traf;
+    sz_t box;
+    sz_t i;
+    sz_t j;
+    uint_t flags;
+    bool_t all_sync;
+
+    if (count > sizeof(data_offsets) / sizeof(data_offsets[0])) {
+        return -1;
+    }
+
+    moof = StartBox(buffer, "moof");
+    box = StartFullBox(buffer, "mfhd", 0, 0);
+    Put32(buffer, sequence);
+    EndBox(buffer, box);
+
+    for (i = 0; i < count; ++i) {
+        const Mp4Run &run = runs[i];
+
+        // Only sync samples (audio): flags once in tfhd
+        all_sync = true;
+        for (j = 0; j < run.count; ++j) {
+            all_sync = all_sync && run.samples[j].sync;
+        }
+
+        traf = StartBox(buffer, "traf");
+        box = StartFullBox(buffer, "tfhd", 0, TFHD_BASE_IS_MOOF | TFHD_DEFAULT_FLAGS);
+        Put32(buffer, run.track_id);
+        Put32(buffer, all_sync ? MP4_SAMPLE_SYNC : MP4_SAMPLE_NON_SYNC);
+        EndBox(buffer, box);
+
+        box = StartFullBox(buffer, "tfdt", 1, 0);
+        Put64(buffer, run.base_time);
+        EndBox(buffer, box);
+
+        flags = TRUN_DATA_OFFSET | TRUN_DURATION | TRUN_SIZE | (all_sync ? 0 : TRUN_FLAGS);
+        box = StartFullBox(buffer, "trun", 0, flags);
+        Put32(buffer, (uint_t)run.count);
+        data_offsets[i] = buffer.offset;
+        Put32(buffer, 0); // Patched below
+        for (j = 0; j < run.count; ++j) {
+            Put32(buffer, run.samples[j].duration);
+            Put32(buffer, run.samples[j].size);
+            if (!all_sync) {
+                Put32(buffer, run.samples[j].sync ? MP4_SAMPLE_SYNC : MP4_SAMPLE_NON_SYNC);
+            }
+        }
+        EndBox(buffer, box);
+        EndBox(buffer, traf);
+    }
+    EndBox(buffer, moof);
+
+    // Data offsets are from the start of moof (default-base-is-moof)
+    for (i = 0; i < count; ++i) {
+        Patch32(buffer, data_offsets[i], (uint_t)(buffer.offset - moof + MP4_MDAT_HEADER_SIZE + run_offset));
+        for (j = 0; j < runs[i].count; ++j) {
+            run_offset += runs[i].samples[j].size;
+        }
+    }
+
+    Put32(buffer, (uint_t)(MP4_MDAT_HEADER_SIZE + data_size));
+    PutType(buffer, "mdat");
+
+    return buffer.overflow ? -1 : (int_t)buffer.offset;
+}
+
+sz_t ScanMp4Sample(const byte_t *data, sz_t size, NalUnit *nals, sz_t max, uint_t &sample_size) {
+    sz_t count = ExtractNal(data, 0, size, nals, max);
+    sz_t kept = 0;
+    sz_t i;
+    int_t type;
+
+    sample_size = 0;
+    for (i = 0; i < count; ++i) {
+        if (nals[i].end <= nals[i].start + nals[i].codeSize) {
+            continue;
+        }
+        type = NAL_TYPE(data, nals[i]);
+        if (type >= NAL_TYPE_VPS && type <= NAL_TYPE_AUD) {
+            continue;
+        }
+        nals[kept++] = nals[i];
+        sample_size += MP4_NAL_LENGTH_SIZE + nals[i].end - nals[i].start - nals[i].codeSize;
+    }
+    return kept;
+}
@@ -1,4 +1,3 @@
-
 #include "utils/Packetizer.h"
 
 #define RTP_HEADER_SIZE 12
@@ -11,6 +10,13 @@
 #define H265_PAYLOAD_HEADER_SIZE 2
 #define H265_FU_HEADER_SIZE 1
 #define H265_FU_PAYLOAD_TYPE 49
+#define H265_AP_PAYLOAD_TYPE 48
+#define H265_AP_NAL_SIZE 2
+
+#define FEC_CSRC_SIZE 4
+#define FEC_SN_BASE_SIZE 2
+#define FEC_MAX_MASK_SIZE 14
+#define FEC_MAX_MASK_BITS 109
 
 #define NTP_UNIX_OFFSET 2208988800UL
 #define RTCP_SR_TYPE 200
@@ -21,21 +27,96 @@ int_t RtpPayloadStart() {
     return TCP_PREFIX_SIZE + RTP_HEADER_SIZE;
 }
 
-// Return the packet size
+void Init(RtpHeader &header, byte_t interleave, byte_t payload_type, sz_t ssrc) {
+    byte_t *dst = header.bytes;
+    sz_t i = 0;
+
+    // TCP prefix, length is patched per packet
+    dst[i++] = '$';
+    dst[i++] = interleave;
+    dst[i++] = 0;
+    dst[i++] = 0;
+
+    // RTP Header, marker, seq and timestamp are patched per packet
+    dst[i++] = RTP_VERSION;
+    dst[i++] = payload_type & 0x7F;
+    dst[i++] = 0;
+    dst[i++] = 0;
+
+    dst[i++] = 0;
+    dst[i++] = 0;
+    dst[i++] = 0;
+    dst[i++] = 0;
+
+    dst[i++] = (ssrc >> 24) & 0xFF;
+    dst[i++] = (ssrc >> 16) & 0xFF;
+    dst[i++] = (ssrc >> 8) & 0xFF;
+    dst[i++] = ssrc & 0xFF;
+}
+
+void PatchRtpHeader(byte_t *dst,
+                    byte_t interleave,
+                    ushort_t seq,
+                    sz_t timestamp,
+                    uint_t ssrc) {
+    dst[1] = interleave;
+
+    dst[6] = (seq >> 8) & 0xFF;
+    dst[7] = (seq & 0xFF);
+
+    dst[8] = (timestamp >> 24) & 0xFF;
+    dst[9] = (timestamp >> 16) & 0xFF;
+    dst[10] = (timestamp >> 8) & 0xFF;
+    dst[11] = timestamp & 0xFF;
+
+    dst[12] = (ssrc >> 24) & 0xFF;
+    dst[13] = (ssrc >> 16) & 0xFF;
+    dst[14] = (ssrc >> 8) & 0xFF;
+    dst[15] = ssrc & 0xFF;
+}
+
+// TCP prefix + RTP header from the stream template, return the written size
+static inline sz_t WriteRtpHeader(
+        byte_t *dst,
+        const RtpHeader &header,
+        sz_t packet_size,
+        bool_t marker,
+        ushort_t seq,
+        sz_t timestamp) {
+
+    Copy(dst, header.bytes, RTP_FIXED_HEADER_SIZE);
+
+    dst[2] = (packet_size >> 8) & 0xFF;
+    dst[3] = (packet_size & 0xFF);
+
+    dst[5] |= marker ? 0x80 : 0x00;
+    dst[6] = (seq >> 8) & 0xFF;
+    dst[7] = (seq & 0xFF);
+
+    dst[8] = (timestamp >> 24) & 0xFF;
+    dst[9] = (timestamp >> 16) & 0xFF;
+    dst[10] = (timestamp >> 8) & 0xFF;
+    dst[11] = timestamp & 0xFF;
+
+    return RTP_FIXED_HEADER_SIZE;
+}
+
+// Return the header size
 // Also move source offset to end of read position
-int_t PacketizeH265(
-        byte_t interleave,
+int_t PacketizeH265Header(
+        const RtpHeader &header,
         ushort_t seq,
         sz_t timestamp,
-        sz_t ssrc,
 
         const byte_t *src,
         sz_t src_size,
         sz_t &src_offset,
         const NalUnit& src_nal,
+        sz_t max_packet_size,
 
         byte_t *dst,
-        sz_t dst_size) {
+        const byte_t *&payload,
+        sz_t &payload_size) {
 
     sz_t header_size;
     sz_t nal_size;
@@ -46,7 +127,7 @@ int_t PacketizeH265(
     bool_t is_segment_end;
     bool_t is_single_mode;
     byte_t fu_header;
-    
+
     // Don't include TCP_PREFIX_SIZE in packet size
     header_size = RTP_HEADER_SIZE + H265_PAYLOAD_HEADER_SIZE;
 
@@ -54,63 +135,46 @@ int_t PacketizeH265(
     if (src_offset < src_nal.start ||
         src_offset >= src_nal.end ||
         src_nal.end > src_size ||
-        TCP_PREFIX_SIZE + header_size >= dst_size) {
+        header_size + H265_FU_HEADER_SIZE >= max_packet_size) {
         return -1;
     }
 
     is_segment_start = src_offset == src_nal.start;
 
     // All data in one packet (Single mode)
+    // The NAL header doubles as the payload header
     nal_size = src_nal.end - src_nal.start - src_nal.codeSize;
     is_single_mode =
             is_segment_start &&
-            TCP_PREFIX_SIZE + header_size + nal_size <= dst_size;
+            RTP_HEADER_SIZE + nal_size <= max_packet_size;
+
+    if (is_single_mode) {
+        packet_size = RTP_HEADER_SIZE + nal_size;
+        i = WriteRtpHeader(dst, header, packet_size, true, seq, timestamp);
+
+        // Payload: All NAL data (except 00 00 .. 01 code)
+        payload = src + src_nal.start + src_nal.codeSize;
+        payload_size = nal_size;
+        src_offset = src_nal.end;
+        return static_cast<int_t>(i);
+    }
+
+    // Skip the NAL header
+    // FU Header already contains the NAL Header
+    if (is_segment_start) {
+        src_offset += src_nal.codeSize + H265_PAYLOAD_HEADER_SIZE;
+    }
 
     // H265_FU_HEADER_SIZE only appears in fragmented mode
-    // If is_single_mode is true, is_segment_end is always false
     nal_remain = src_nal.end - src_offset;
     is_segment_end =
-            TCP_PREFIX_SIZE + header_size + H265_FU_HEADER_SIZE + nal_remain <= dst_size;
+            header_size + H265_FU_HEADER_SIZE + nal_remain <= max_packet_size;
 
     packet_size =
-            is_single_mode ? header_size + nal_size :
             is_segment_end ? header_size + H265_FU_HEADER_SIZE + nal_remain :
-            dst_size - TCP_PREFIX_SIZE; // Just use all available space
+            max_packet_size; // Just use all available space
 
-    i = 0;
-    dst[i++] = '$';
-    dst[i++] = interleave;
-    dst[i++] = (packet_size >> 8) & 0xFF;
-    dst[i++] = (packet_size & 0xFF);
-
-    // RTP Header
-    dst[i++] = RTP_VERSION;
-    dst[i++] = ((is_single_mode || is_segment_end) ? 0x80 : 0x00) | H265_PAYLOAD_TYPE;
-    dst[i++] = (seq >> 8) & 0xFF;
-    dst[i++] = (seq & 0xFF);
-
-    dst[i++] = (timestamp >> 24) & 0xFF;
-    dst[i++] = (timestamp >> 16) & 0xFF;
-    dst[i++] = (timestamp >> 8) & 0xFF;
-    dst[i++] = timestamp & 0xFF;
-
-    dst[i++] = (ssrc >> 24) & 0xFF;
-    dst[i++] = (ssrc >> 16) & 0xFF;
-    dst[i++] = (ssrc >> 8) & 0xFF;
-    dst[i++] = ssrc & 0xFF;
-
-    if (is_single_mode) {
-        // Payload header: NAL header (2 bytes after 00 00 .. 01 code)
-        src_offset += src_nal.codeSize;
-        dst[i++] = src[src_offset];
-        dst[i++] = src[src_offset + 1];
-
-        // Payload: All NAL data (except 00 00 .. 01 code)
-        // PS: Duplicate NAL header unit
-        Copy(dst + i, src + src_offset, src_nal.end - src_offset);
-        src_offset = src_nal.end;
-        return TCP_PREFIX_SIZE + packet_size;
-    }
+    i = WriteRtpHeader(dst, header, packet_size, is_segment_end, seq, timestamp);
 
     // Payload header: NAL header (2 bytes after 00 00 .. 01 code) but with FU type
     dst[i++] = FU_TYPE(src, src_nal);
@@ -126,74 +190,265 @@ int_t PacketizeH265(
     dst[i++] = fu_header;
 
     // Payload
-    if (is_segment_start) {
-        // Skip the NAL header
-        // FU Header already contains the NAL Header
-        src_offset += src_nal.codeSize + H265_PAYLOAD_HEADER_SIZE;
+    payload = src + src_offset;
+    payload_size = packet_size - header_size - H265_FU_HEADER_SIZE;
+    src_offset += payload_size;
+    return static_cast<int_t>(i);
+}
+
+// Return the packet size
+// Also move source offset to end of read position
+int_t PacketizeH265(
+        const RtpHeader &header,
+        ushort_t seq,
+        sz_t timestamp,
+
+        const byte_t *src,
+        sz_t src_size,
+        sz_t &src_offset,
+        const NalUnit& src_nal,
+
+        byte_t *dst,
+        sz_t dst_size) {
+
+    const byte_t *payload;
+    sz_t payload_size;
+    int_t header_size;
+
+    header_size = PacketizeH265Header(
+            header, seq, timestamp,
+            src, src_size, src_offset, src_nal, dst_size - TCP_PREFIX_SIZE,
+            dst, payload, payload_size);
+    if (header_size < 0) {
+        return -1;
     }
-    Copy(dst + i, src + src_offset, packet_size - header_size - H265_FU_HEADER_SIZE);
-    src_offset = src_offset + packet_size - header_size - H265_FU_HEADER_SIZE;
-    return TCP_PREFIX_SIZE + packet_size;
+
+    Copy(dst + header_size, payload, payload_size);
+    return static_cast<int_t>(header_size + payload_size);
+}
+
+static sz_t NalSize(const NalUnit& nal) {
+    return nal.end - nal.start - nal.codeSize;
+}
+
+sz_t CountH265Aggregation(
+        const NalUnit *nals,
+        sz_t count,
+        sz_t max_packet_size) {
+
+    sz_t packet_size = RTP_HEADER_SIZE + H265_PAYLOAD_HEADER_SIZE;
+    sz_t i;
+
+    for (i = 0; i < count; ++i) {
+        packet_size += H265_AP_NAL_SIZE + NalSize(nals[i]);
+        if (packet_size > max_packet_size) {
+            break;
+        }
+    }
+    return i;
+}
+
+// Return the header size
+int_t PacketizeH265AggregationHeader(
+        const RtpHeader &header,
+        ushort_t seq,
+        sz_t timestamp,
+
+        const byte_t *src,
+        const NalUnit *nals,
+        sz_t count,
+        bool_t last,
+
+        byte_t *dst) {
+
+    sz_t packet_size;
+    sz_t i;
+    byte_t forbidden = 0;
+    byte_t layer_id = 0x3F;
+    byte_t tid = 0x07;
+    byte_t nal_layer_id;
+    byte_t nal_tid;
+
+    if (count == 0) {
+        return -1;
+    }
+
+    packet_size = RTP_HEADER_SIZE + H265_PAYLOAD_HEADER_SIZE;
+    for (i = 0; i < count; ++i) {
+        const byte_t *nal_header = src + nals[i].start + nals[i].codeSize;
+        packet_size += H265_AP_NAL_SIZE + NalSize(nals[i]);
+
+        // Payload header: F is OR of all F bits, LayerId and TID are the lowest
+        forbidden |= nal_header[0] & 0x80;
+        nal_layer_id = ((nal_header[0] & 0x01) << 5) | (nal_header[1] >> 3);
+        nal_tid = nal_header[1] & 0x07;
+        if (nal_layer_id < layer_id) {
+            layer_id = nal_layer_id;
+        }
+        if (nal_tid < tid) {
+            tid = nal_tid;
+        }
+    }
+
+    i = WriteRtpHeader(dst, header, packet_size, last, seq, timestamp);
+
+    dst[i++] = forbidden | (H265_AP_PAYLOAD_TYPE << 1) | (layer_id >> 5);
+    dst[i++] = ((layer_id & 0x1F) << 3) | tid;
+    return static_cast<int_t>(i);
+}
+
+// Return the header size
+int_t PacketizeH265AggregationUnit(
+        const byte_t *src,
+        const NalUnit& src_nal,
+
+        byte_t *dst,
+        const byte_t *&payload,
+        sz_t &payload_size) {
+
+    payload = src + src_nal.start + src_nal.codeSize;
+    payload_size = NalSize(src_nal);
+
+    dst[0] = (payload_size >> 8) & 0xFF;
+    dst[1] = payload_size & 0xFF;
+    return H265_AP_NAL_SIZE;
+}
+
+sz_t AACPacketSize(const SharedFrame *const *src, sz_t count) {
+    sz_t packet_size = RTP_HEADER_SIZE + AAC_AU_HEADER_SIZE;
+    for (sz_t i = 0; i < count; ++i) {
+        packet_size += AAC_AU_SIZE + src[i]->size;
+    }
+    return packet_size;
+}
+
+// Return the header size
+int_t PacketizeAACHeader(
+        const RtpHeader &header,
+        ushort_t seq,
+        sz_t timestamp,
+        const SharedFrame *const *src,
+        sz_t count,
+        byte_t *dst) {
+
+    sz_t packet_size;
+    sz_t au_headers_bits;
+    sz_t i;
+    sz_t j;
+
+    packet_size = AACPacketSize(src, count);
+    i = WriteRtpHeader(dst, header, packet_size, true, seq, timestamp);
+
+    // AU headers length in bits (2 bytes)
+    au_headers_bits = count * AAC_AU_SIZE * 8;
+    dst[i++] = (au_headers_bits >> 8) & 0xFF;
+    dst[i++] = au_headers_bits & 0xFF;
+
+    // AU: 13 bits for frame size, 3 bits for AU index (= 0) or index delta (= 0)
+    for (j = 0; j < count; ++j) {
+        dst[i++] = src[j]->size >> 5;
+        dst[i++] = (src[j]->size << 3) & 0xF8;
+    }
+
+    return static_cast<int_t>(i);
 }
 
 int_t PacketizeAAC(
-        byte_t interleave,
+        const RtpHeader &header,
         ushort_t seq,
         sz_t timestamp,
-        sz_t ssrc,
-        const FrameBuffer<MAX_AUDIO_FRAME_SIZE> &src,
+        const SharedFrame &src,
         byte_t *dst,
         sz_t dst_size) {
 
-    size_t packet_size;
-    size_t i;
+    const SharedFrame *frames[1] = { &src };
+    int_t header_size;
 
-    packet_size = RTP_HEADER_SIZE + AAC_AU_HEADER_SIZE + AAC_AU_SIZE + src.size;
-    if (TCP_PREFIX_SIZE + packet_size > dst_size) {
+    if (TCP_PREFIX_SIZE + RTP_HEADER_SIZE + AAC_AU_HEADER_SIZE + AAC_AU_SIZE + src.size > dst_size) {
         return -1;
     }
 
-    // TCP prefix
-    i = 0;
-    dst[i++] = '$';
-    dst[i++] = interleave;
-    dst[i++] = (packet_size >> 8) & 0xFF;
-    dst[i++] = (packet_size & 0xFF);
+    header_size = PacketizeAACHeader(header, seq, timestamp, frames, 1, dst);
 
-    // RTP Header
-    dst[i++] = RTP_VERSION;
-    dst[i++] = 0x80 | AAC_PAYLOAD_TYPE;
-    dst[i++] = (seq >> 8) & 0xFF;
-    dst[i++] = (seq & 0xFF);
+    // Payload
+    Copy(dst + header_size, src.data, src.size);
+    return static_cast<int_t>(header_size + src.size);
+}
 
-    dst[i++] = (timestamp >> 24) & 0xFF;
-    dst[i++] = (timestamp >> 16) & 0xFF;
-    dst[i++] = (timestamp >> 8) & 0xFF;
-    dst[i++] = timestamp & 0xFF;
+// Flexible mask: k bit + 15 bits, k bit + 31 bits, 64 bits
+// k = 1 marks the last part. Return the mask size.
+static sz_t WriteFecMask(byte_t *dst, sz_t step, sz_t count) {
+    sz_t last = (count - 1) * step;
+    sz_t size = last < 15 ? 2 : last < 46 ? 6 : FEC_MAX_MASK_SIZE;
+    sz_t bit;
+    sz_t i;
 
-    dst[i++] = (ssrc >> 24) & 0xFF;
-    dst[i++] = (ssrc >> 16) & 0xFF;
-    dst[i++] = (ssrc >> 8) & 0xFF;
-    dst[i++] = ssrc & 0xFF;
+    Reset(dst, size);
+    for (i = 0; i < count; ++i) {
+        bit = i * step;
+        bit = bit < 15 ? bit + 1 : bit + 2; // Skip the k bits
+        dst[bit / 8] |= 0x80 >> (bit % 8);
+    }
 
-    // AU header: AU length (2 bytes)
-    dst[i++] = 0x00;
-    dst[i++] = 0x10;
+    if (size == 2) {
+        dst[0] |= 0x80;
+    } else if (size == 6) {
+        dst[2] |= 0x80;
+    }
+    return size;
+}
+
+int_t PacketizeFec(
+        const RtpHeader &header,
+        ushort_t seq,
+        sz_t timestamp,
+        uint_t media_ssrc,
+        const FecGroup &group,
+        sz_t step,
+        byte_t *dst,
+        sz_t dst_size) {
 
-    // AU: 13 bits for frame size, 3 bits for AU index (= 0)
-    dst[i++] = src.size >> 5;
-    dst[i++] = (src.size << 3) & 0xF8;
+    sz_t i;
+    sz_t packet_size;
 
-    // Payload
-    Copy(dst + i, src.data, src.size);
-    return static_cast<int32_t>(TCP_PREFIX_SIZE + packet_size);
+    if (group.count == 0 ||
+        (group.count - 1) * step >= FEC_MAX_MASK_BITS ||
+        RTP_FEC_MAX_HEADER_SIZE + group.size > dst_size) {
+        return -1;
+    }
+
+    // Header is written first, the size is patched at the end
+    i = WriteRtpHeader(dst, header, 0, false, seq, timestamp);
+
+    // The protected SSRC is the only CSRC
+    dst[TCP_PREFIX_SIZE] |= 1;
+    dst[i++] = (media_ssrc >> 24) & 0xFF;
+    dst[i++] = (media_ssrc >> 16) & 0xFF;
+    dst[i++] = (media_ssrc >> 8) & 0xFF;
+    dst[i++] = media_ssrc & 0xFF;
+
+    // R = 0, F = 0 (flexible mask), then P, X, CC, M, PT, length, TS recovery
+    Copy(dst + i, group.recovery, FEC_RECOVERY_SIZE);
+    dst[i] &= 0x3F;
+    i += FEC_RECOVERY_SIZE;
+
+    dst[i++] = (group.base >> 8) & 0xFF;
+    dst[i++] = group.base & 0xFF;
+    i += WriteFecMask(dst + i, step, group.count);
+
+    Copy(dst + i, group.payload, group.size);
+    i += group.size;
+
+    packet_size = i - TCP_PREFIX_SIZE;
+    dst[2] = (packet_size >> 8) & 0xFF;
+    dst[3] = packet_size & 0xFF;
+    return static_cast<int_t>(i);
 }
 
-static void NTP(uint_t *ntp_sec, uint_t *ntp_frac) {
-    ts_t ts{};
-    clock_gettime(CLOCK_REALTIME, &ts);
-    *ntp_sec = (uint_t)(ts.tv_sec + NTP_UNIX_OFFSET);
-    *ntp_frac = (uint_t)(((double)ts.tv_nsec / 1.0e9) * (double)(1ULL << 32));
+void NTP(uint_t *ntp_sec, uint_t *ntp_frac) {
+    tm_t now_ns = WallNanos();
+    *ntp_sec = (uint_t)(now_ns / 1000000000 + NTP_UNIX_OFFSET);
+    *ntp_frac = (uint_t)(((double)(now_ns % 1000000000) / 1.0e9) * (double)(1ULL << 32));
 }
 
 int_t PacketizeReport(byte_t interleave,
@@ -266,4 +521,4 @@ int_t PacketizeReport(byte_t interleave,
     buf[i++] = byte_count & 0xFF;
 
     return i;
-}
\ No newline at end of file
+}
@@ -0,0 +1,176 @@
+#include "utils/RtcpParser.h"
+#include "utils/Packetizer.h"
+
+#define RTCP_HEADER_SIZE 4
+#define RTCP_REPORT_BLOCK_SIZE 24
+#define RTCP_SENDER_INFO_SIZE 20
+
+#define RTCP_SR 200
+#define RTCP_RR 201
+#define RTCP_RTPFB 205
+#define RTCP_PSFB 206
+
+#define RTPFB_NACK 1
+#define PSFB_PLI 1
+#define PSFB_FIR 4
+
+static uint_t Read32(const byte_t *data) {
+    return ((uint_t)data[0] << 24) | ((uint_t)data[1] << 16) |
+           ((uint_t)data[2] << 8) | (uint_t)data[3];
+}
+
+static ushort_t Read16(const byte_t *data) {
+    return (ushort_t)((data[0] << 8) | data[1]);
+}
+
+void Reset(RtcpFeedback& feedback) {
+    feedback.has_report = false;
+    feedback.fraction_lost = 0;
+    feedback.cumulative_lost = 0;
+    feedback.highest_seq = 0;
+    feedback.jitter = 0;
+    feedback.lsr = 0;
+    feedback.dlsr = 0;
+    feedback.key_frame = false;
+    feedback.nack_count = 0;
+}
+
+static void ParseReportBlocks(const byte_t *data,
+                              sz_t size,
+                              sz_t count,
+                              uint_t media_ssrc,
+                              RtcpFeedback& feedback) {
+    sz_t i;
+    int_t lost;
+
+    for (i = 0; i < count && (i + 1) * RTCP_REPORT_BLOCK_SIZE <= size; ++i) {
+        const byte_t *block = data + i * RTCP_REPORT_BLOCK_SIZE;
+        if (Read32(block) != media_ssrc) {
+            continue;
+        }
+
+        // 24 bits signed
+        lost = (int_t)((block[5] << 16) | (block[6] << 8) | block[7]);
+        if (lost & 0x800000) {
+            lost -= 0x1000000;
+        }
+
+        feedback.has_report = true;
+        feedback.fraction_lost = block[4];
+        feedback.cumulative_lost = lost;
+        feedback.highest_seq = Read32(block + 8);
+        feedback.jitter = Read32(block + 12);
+        feedback.lsr = Read32(block + 16);
+        feedback.dlsr = Read32(block + 20);
+    }
+}
+
+static void ParseNack(const byte_t *fci,
+                      sz_t size,
+                      RtcpFeedback& feedback) {
+    sz_t i;
+    ushort_t pid;
+    ushort_t blp;
+
+    // Each FCI: lost packet id + bitmask of the 16 following ones
+    for (i = 0; i + 4 <= size; i += 4) {
+        pid = Read16(fci + i);
+        blp = Read16(fci + i + 2);
+
+        if (feedback.nack_count < RTCP_MAX_NACKS) {
+            feedback.nacks[feedback.nack_count++] = pid;
+        }
+        for (int_t bit = 0; bit < 16; ++bit) {
+            if ((blp & (1 << bit)) && feedback.nack_count < RTCP_MAX_NACKS) {
+                feedback.nacks[feedback.nack_count++] = (ushort_t)(pid + bit + 1);
+            }
+        }
+    }
+}
+
+bool_t ParseRtcp(const byte_t *data,
+                 sz_t size,
+                 uint_t media_ssrc,
+                 RtcpFeedback& feedback) {
+    sz_t offset = 0;
+    sz_t packet_size;
+    sz_t count;
+    byte_t type;
+    const byte_t *packet;
+
+    while (offset + RTCP_HEADER_SIZE <= size) {
+        packet = data + offset;
+
+        // Version 2
+        if ((packet[0] >> 6) != 2) {
+            return false;
+        }
+        count = packet[0] & 0x1F;
+        type = packet[1];
+        packet_size = ((sz_t)Read16(packet + 2) + 1) * 4;
+        if (offset + packet_size > size) {
+            return false;
+        }
+
+        switch (type) {
+            case RTCP_SR:
+                if (packet_size >= 8 + RTCP_SENDER_INFO_SIZE) {
+                    ParseReportBlocks(packet + 8 + RTCP_SENDER_INFO_SIZE,
+                                      packet_size - 8 - RTCP_SENDER_INFO_SIZE,
+                                      count, media_ssrc, feedback);
+                }
+                break;
+
+            case RTCP_RR:
+                if (packet_size >= 8) {
+                    ParseReportBlocks(packet + 8, packet_size - 8,
+                                      count, media_ssrc, feedback);
+                }
+                break;
+
+            // Feedback: count is FMT, media SSRC at 8
+            case RTCP_RTPFB:
+                if (count == RTPFB_NACK && packet_size >= 12 &&
+                    Read32(packet + 8) == media_ssrc) {
+                    ParseNack(packet + 12, packet_size - 12, feedback);
+                }
+                break;
+
+            case RTCP_PSFB:
+                // FIR has media SSRC 0, the target is in the FCI
+                if ((count == PSFB_PLI && packet_size >= 12 && Read32(packet + 8) == media_ssrc) ||
+                    (count == PSFB_FIR && packet_size >= 20 && Read32(packet + 12) == media_ssrc)) {
+                    feedback.key_frame = true;
+                }
+                break;
+
+            default:
+                // SDES, BYE, APP... not interesting
+                break;
+        }
+        offset += packet_size;
+    }
+    return true;
+}
+
+double_t RoundTripMs(const RtcpFeedback& feedback) {
+    uint_t ntp_sec;
+    uint_t ntp_frac;
+    uint_t now;
+    uint_t rtt;
+
+    if (!feedback.has_report || feedback.lsr == 0) {
+        return -1;
+    }
+
+    // Middle 32 bits of NTP, 1/65536 seconds
+    NTP(&ntp_sec, &ntp_frac);
+    now = (ntp_sec << 16) | (ntp_frac >> 16);
+    rtt = now - feedback.lsr - feedback.dlsr;
+
+    // Clock went backward or the report is broken
+    if (rtt & 0x80000000) {
+        return -1;
+    }
+    return (double_t)rtt * 1000.0 / 65536.0;
+}
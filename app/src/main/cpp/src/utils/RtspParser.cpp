@@ -0,0 +1,231 @@
+#include "utils/RtspParser.h"
+
+#include <strings.h>
+
+#define CSEQ_HEADER "CSeq"
+#define TRANSPORT_HEADER "Transport"
+#define SESSION_HEADER "Session"
+#define CONTENT_LENGTH_HEADER "Content-Length"
+#define RTSP_VERSION "RTSP/"
+
+void Reset(RtspParser& parser) {
+    parser.scanned = 0;
+    parser.skip = 0;
+}
+
+static sz_t Skip(RtspParser& parser, sz_t size, RtspMessage& message) {
+    message.type = RTSP_SKIPPED;
+    message.size = size < parser.skip ? size : parser.skip;
+    parser.skip -= message.size;
+    return message.size;
+}
+
+static const char_t *FindByte(const char_t *data, sz_t size, char_t value) {
+    return static_cast<const char_t *>(memchr(data, value, size));
+}
+
+// End of the header block (after the empty line), 0 if not there yet.
+// Lines end with CRLF, a bare LF is taken too.
+static sz_t FindHeaderEnd(RtspParser& parser, const char_t *data, sz_t size) {
+    sz_t i = parser.scanned;
+
+    for (; i < size; ++i) {
+        if (data[i] != '\n') {
+            continue;
+        }
+        if (i + 1 < size && data[i + 1] == '\n') {
+            return i + 2;
+        }
+        if (i + 2 < size && data[i + 1] == '\r' && data[i + 2] == '\n') {
+            return i + 3;
+        }
+    }
+    // The last 2 bytes may be the start of the empty line
+    parser.scanned = size > 2 ? size - 2 : 0;
+    return 0;
+}
+
+static RtspSpan Trim(const char_t *start, const char_t *end) {
+    while (start < end && (*start == ' ' || *start == '\t')) {
+        ++start;
+    }
+    while (end > start && (end[-1] == ' ' || end[-1] == '\t' || end[-1] == '\r')) {
+        --end;
+    }
+    return {start, (sz_t)(end - start)};
+}
+
+static bool_t IsHeader(const char_t *line, sz_t name_len, const char_t *name) {
+    return name_len == (sz_t)Len(name) && strncasecmp(line, name, name_len) == 0;
+}
+
+static int_t ToInt(const RtspSpan& span) {
+    int_t value = 0;
+    sz_t i;
+
+    if (span.len == 0) {
+        return -1;
+    }
+    for (i = 0; i < span.len && span.data[i] >= '0' && span.data[i] <= '9'; ++i) {
+        value = value * 10 + (span.data[i] - '0');
+    }
+    return i > 0 ? value : -1;
+}
+
+// METHOD SP URI SP RTSP/1.0, or RTSP/1.0 SP code SP reason for a response
+static bool_t ParseFirstLine(const char_t *line, const char_t *end, RtspRequest& request) {
+    const char_t *space = FindByte(line, end - line, ' ');
+    const char_t *uri;
+
+    if (!space || space == line) {
+        return false;
+    }
+    request.method = {line, (sz_t)(space - line)};
+
+    uri = space + 1;
+    space = FindByte(uri, end - uri, ' ');
+    if (!space) {
+        return false;
+    }
+    request.uri = {uri, (sz_t)(space - uri)};
+    return true;
+}
+
+static sz_t ParseHeaders(const char_t *data, sz_t header_end, RtspRequest& request) {
+    const char_t *line = data;
+    const char_t *end = data + header_end;
+    const char_t *eol;
+    const char_t *colon;
+    sz_t content_length = 0;
+    sz_t name_len;
+    RtspSpan value;
+
+    // First line is done
+    line = FindByte(line, end - line, '\n') + 1;
+
+    while (line < end) {
+        eol = FindByte(line, end - line, '\n');
+        colon = FindByte(line, eol - line, ':');
+        if (colon) {
+            name_len = Trim(line, colon).len;
+            value = Trim(colon + 1, eol);
+
+            if (IsHeader(line, name_len, CSEQ_HEADER)) {
+                request.cseq = ToInt(value);
+            } else if (IsHeader(line, name_len, TRANSPORT_HEADER)) {
+                request.transport = value;
+            } else if (IsHeader(line, name_len, SESSION_HEADER)) {
+                request.session = value;
+            } else if (IsHeader(line, name_len, CONTENT_LENGTH_HEADER) && ToInt(value) > 0) {
+                content_length = (sz_t)ToInt(value);
+            }
+        }
+        line = eol + 1;
+    }
+    return content_length;
+}
+
+sz_t ParseRtsp(RtspParser& parser,
+               const byte_t *data,
+               sz_t size,
+               sz_t capacity,
+               RtspMessage& message) {
+    const char_t *text = reinterpret_cast<const char_t *>(data);
+    const char_t *eol;
+    sz_t header_end;
+    sz_t content_length;
+    RtspRequest& request = message.request;
+
+    message.type = RTSP_NEED_MORE;
+    if (size == 0) {
+        return 0;
+    }
+    if (parser.skip > 0) {
+        return Skip(parser, size, message);
+    }
+
+    if (data[0] == '$') {
+        if (size < RTSP_INTERLEAVED_PREFIX_LEN) {
+            return 0;
+        }
+        message.channel = data[1];
+        message.size = (data[2] << 8) | data[3];
+        if (size < RTSP_INTERLEAVED_PREFIX_LEN + message.size) {
+            // It would never be whole, the next message is found after it
+            if (RTSP_INTERLEAVED_PREFIX_LEN + message.size > capacity) {
+                parser.skip = RTSP_INTERLEAVED_PREFIX_LEN + message.size;
+                return Skip(parser, size, message);
+            }
+            return 0;
+        }
+        message.data = data + RTSP_INTERLEAVED_PREFIX_LEN;
+        message.type = RTSP_INTERLEAVED;
+        return RTSP_INTERLEAVED_PREFIX_LEN + message.size;
+    }
+
+    // A line that can't start a message is dropped at once,
+    // so the '$' frames after it aren't held back
+    eol = FindByte(text, size, '\n');
+    request = {};
+    request.cseq = -1;
+    if (eol && !ParseFirstLine(text, eol, request)) {
+        message.type = RTSP_INVALID;
+        Reset(parser);
+        return (sz_t)(eol - text) + 1;
+    }
+
+    header_end = FindHeaderEnd(parser, text, size);
+    if (header_end == 0) {
+        return 0;
+    }
+
+    content_length = ParseHeaders(text, header_end, request);
+    if (size < header_end + content_length) {
+        // Headers are parsed again with the body, they are short.
+        // The empty line is found again from here.
+        parser.scanned = header_end > 3 ? header_end - 3 : 0;
+        return 0;
+    }
+    request.body = {text + header_end, content_length};
+
+    Reset(parser);
+    message.type = request.method.len >= (sz_t)Len(RTSP_VERSION) &&
+                   strncmp(request.method.data, RTSP_VERSION, Len(RTSP_VERSION)) == 0 ?
+                   RTSP_RESPONSE : RTSP_REQUEST;
+    return header_end + content_length;
+}
+
+bool_t Equals(const RtspSpan& span, const char_t *str) {
+    return span.len == (sz_t)Len(str) && strncmp(span.data, str, span.len) == 0;
+}
+
+static const char_t *Find(const RtspSpan& span, const char_t *str) {
+    sz_t len = Len(str);
+
+    for (sz_t i = 0; i + len <= span.len; ++i) {
+        if (strncmp(span.data + i, str, len) == 0) {
+            return span.data + i;
+        }
+    }
+    return nullptr;
+}
+
+bool_t Contains(const RtspSpan& span, const char_t *str) {
+    return Find(span, str) != nullptr;
+}
+
+int_t FindInt(const RtspSpan& span, const char_t *key) {
+    const char_t *pos = Find(span, key);
+    RtspSpan rest;
+
+    if (!pos) {
+        return -1;
+    }
+    rest = Trim(pos + Len(key), span.data + span.len);
+    return ToInt(rest);
+}
+
+RtspSpan FirstParam(const RtspSpan& span) {
+    const char_t *semicolon = FindByte(span.data, span.len, ';');
+    return semicolon ? Trim(span.data, semicolon) : span;
+}
@@ -17,22 +17,71 @@ void Init(StreamStats& stats, bool_t video) {
 
     stats.receive = 0;
     stats.sent = 0;
+    stats.dropped = 0;
     stats.video = video;
+
+    stats.syscalls = 0;
+    stats.syscall_per_frame = 0;
+
+    stats.packets = 0;
+    stats.packet_per_frame = 0;
+
+    stats.rtt_ms = -1;
+    stats.jitter_ms = 0;
+    stats.fraction_lost = 0;
+    stats.cumulative_lost = 0;
+    stats.key_frame_requests = 0;
+    stats.nacks = 0;
+
+    stats.retransmits = 0;
+    stats.recovery_us = 0;
+
+    stats.zero_copies = 0;
+    stats.zero_copies_copied = 0;
+
+    Init(&stats.lock);
 }
 
-static void Print(const StreamStats& stats) {
+static void Print(StreamStats& stats) {
     const char_t* name = stats.video ? "video" : "audio";
+
+    Lock(&stats.lock);
     LOGI("StreamStats",
          "Track %s: "
          "Sent (%zu), "
          "Skipped (%zu), "
+         "Dropped on overflow (%zu), "
          "Avg process: (%.2f) us, "
-         "Avg frame variances: (%.2f) us",
+         "Avg frame variances: (%.2f) us, "
+         "Avg syscalls: (%.2f) per frame, "
+         "Avg packets: (%.2f) per frame, "
+         "RTT: (%.1f) ms, "
+         "Jitter: (%.1f) ms, "
+         "Lost: (%.1f%%, %zu total), "
+         "Key frame requests: (%zu), "
+         "NACKs: (%zu), "
+         "Retransmits: (%zu), "
+         "Avg recovery: (%.1f) ms, "
+         "Zero copy: (%zu, %zu copied)",
          name,
          stats.sent,
          stats.receive - stats.sent,
+         stats.dropped,
          stats.process_us,
-         stats.var_us);
+         stats.var_us,
+         stats.syscall_per_frame,
+         stats.packet_per_frame,
+         stats.rtt_ms,
+         stats.jitter_ms,
+         stats.fraction_lost * 100,
+         stats.cumulative_lost,
+         stats.key_frame_requests,
+         stats.nacks,
+         stats.retransmits,
+         stats.recovery_us / 1000,
+         stats.zero_copies,
+         stats.zero_copies_copied);
+    Unlock(&stats.lock);
 }
 
 void ReceiveFrame(StreamStats &stats) {
@@ -58,6 +107,12 @@ void SendFrame(StreamStats &stats) {
 
     stats.sent++;
 
+    // Same average formula as EndProcess
+    stats.syscall_per_frame += (stats.syscalls - stats.syscall_per_frame) / stats.sent;
+    stats.syscalls = 0;
+    stats.packet_per_frame += (stats.packets - stats.packet_per_frame) / stats.sent;
+    stats.packets = 0;
+
     if (stats.send_us != 0) {
         stats.delta_send_us = now - stats.send_us;
     }
@@ -70,6 +125,66 @@ void SendFrame(StreamStats &stats) {
     }
 }
 
+// Frame ring was full, counted by the receiving thread
+void DropFrame(StreamStats &stats) {
+    stats.dropped++;
+}
+
+// Count syscalls of the current frame, collected in SendFrame
+void SendSyscalls(StreamStats &stats, sz_t count) {
+    stats.syscalls += count;
+}
+
+// Count RTP packets of the current frame, collected in SendFrame
+void SendPackets(StreamStats &stats, sz_t count) {
+    stats.packets += count;
+}
+
+// Latest receiver report, the client already smooths jitter and loss
+void ReceiveReport(StreamStats &stats,
+                   double_t rtt_ms,
+                   double_t jitter_ms,
+                   double_t fraction_lost,
+                   sz_t cumulative_lost) {
+    Lock(&stats.lock);
+    if (rtt_ms >= 0) {
+        stats.rtt_ms = rtt_ms;
+    }
+    stats.jitter_ms = jitter_ms;
+    stats.fraction_lost = fraction_lost;
+    stats.cumulative_lost = cumulative_lost;
+    Unlock(&stats.lock);
+}
+
+void ReceiveKeyFrameRequest(StreamStats &stats) {
+    Lock(&stats.lock);
+    stats.key_frame_requests++;
+    Unlock(&stats.lock);
+}
+
+void ReceiveNacks(StreamStats &stats, sz_t count) {
+    Lock(&stats.lock);
+    stats.nacks += count;
+    Unlock(&stats.lock);
+}
+
+// Recovery = time between the original packet and its retransmission
+void SendRetransmit(StreamStats &stats, tm_t recovery_us) {
+    Lock(&stats.lock);
+    stats.retransmits++;
+    stats.recovery_us += ((double_t)recovery_us - stats.recovery_us) / stats.retransmits;
+    Unlock(&stats.lock);
+}
+
+void CompleteZeroCopy(StreamStats &stats, sz_t count, bool_t copied) {
+    Lock(&stats.lock);
+    stats.zero_copies += count;
+    if (copied) {
+        stats.zero_copies_copied += count;
+    }
+    Unlock(&stats.lock);
+}
+
 void StartProcess(StreamStats& stats) {
     stats.start_us = NowMicros();
     stats.elapsed_us = 0;
@@ -1,5 +1,11 @@
 #include "utils/Utils.h"
 
+#if defined(__ARM_NEON)
+#include <arm_neon.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
 static const char kBase64Table[] =
     "ABCDEFGHIJKLMNOPQRSTUVWXYZ"
     "abcdefghijklmnopqrstuvwxyz"
@@ -120,4 +126,66 @@ sz_t ExtractNal(
 
 bool_t IsNalValid(const NalUnit &nal) {
     return nal.start < nal.end && nal.codeSize > 0;
-}
\ No newline at end of file
+}
+
+PictureInfo GetPictureInfo(const byte_t *data, const NalUnit *nals, sz_t count) {
+    PictureInfo info = {-1, 0, false, true, false};
+    int_t nal_type;
+
+    for (sz_t i = 0; i < count; ++i) {
+        if (nals[i].end < nals[i].start + nals[i].codeSize + 2) {
+            continue;
+        }
+        nal_type = NAL_TYPE(data, nals[i]);
+        if (nal_type >= NAL_TYPE_VPS) {
+            continue;
+        }
+
+        info.nal_type = nal_type;
+        info.temporal_id = NAL_TEMPORAL_ID(data, nals[i]);
+        info.irap = nal_type >= NAL_TYPE_BLA_W_LP && nal_type <= NAL_TYPE_RSV_IRAP_23;
+        // Sub-layer non-reference pictures have even types up to 14
+        info.reference = nal_type > NAL_TYPE_RSV_VCL_N14 || (nal_type & 1) == 1;
+        info.switch_up = nal_type == NAL_TYPE_TSA_N || nal_type == NAL_TYPE_TSA_R;
+        break;
+    }
+    return info;
+}
+
+void XorBytes(byte_t *dst, const byte_t *src, sz_t size) {
+    sz_t i = 0;
+
+#if defined(__ARM_NEON)
+    for (; i + 64 <= size; i += 64) {
+        uint8x16x4_t a = vld1q_u8_x4(dst + i);
+        uint8x16x4_t b = vld1q_u8_x4(src + i);
+        a.val[0] = veorq_u8(a.val[0], b.val[0]);
+        a.val[1] = veorq_u8(a.val[1], b.val[1]);
+        a.val[2] = veorq_u8(a.val[2], b.val[2]);
+        a.val[3] = veorq_u8(a.val[3], b.val[3]);
+        vst1q_u8_x4(dst + i, a);
+    }
+    for (; i + 16 <= size; i += 16) {
+        vst1q_u8(dst + i, veorq_u8(vld1q_u8(dst + i), vld1q_u8(src + i)));
+    }
+#elif defined(__SSE2__)
+    for (; i + 16 <= size; i += 16) {
+        __m128i a = _mm_loadu_si128((const __m128i *)(dst + i));
+        __m128i b = _mm_loadu_si128((const __m128i *)(src + i));
+        _mm_storeu_si128((__m128i *)(dst + i), _mm_xor_si128(a, b));
+    }
+#endif
+
+    // Tail, or everything without SIMD
+    for (; i + 8 <= size; i += 8) {
+        uint64_t a;
+        uint64_t b;
+        Copy(&a, dst + i, 8);
+        Copy(&b, src + i, 8);
+        a ^= b;
+        Copy(dst + i, &a, 8);
+    }
+    for (; i < size; ++i) {
+        dst[i] ^= src[i];
+    }
+}
@@ -0,0 +1,165 @@
+#include "utils/Fec.h"
+#include "utils/Utils.h"
+
+// FlexFEC parity throughput, and residual loss of a block of L x D
+// packets under random loss with one repair packet per row (and per
+// column if D > 1), decoded the way a receiver would (rows and columns
+// until nothing changes). Not a test, run it by hand:
+//   ./FecBench [L] [D] [loss %]
+
+#define BENCH_PACKET_SIZE 1400
+#define BENCH_PACKETS 1000
+#define BENCH_BLOCKS 200000
+#define MAX_L 32
+#define MAX_D 32
+
+static byte_t packets[BENCH_PACKETS][BENCH_PACKET_SIZE];
+
+// What the compiler makes of a plain loop, for comparison
+__attribute__((noinline))
+static void XorPlain(byte_t *dst, const byte_t *src, sz_t size) {
+    for (sz_t i = 0; i < size; ++i) {
+        dst[i] ^= src[i];
+    }
+}
+
+static void XorRate(const char *name, void (*xor_bytes)(byte_t *, const byte_t *, sz_t)) {
+    static byte_t parity[BENCH_PACKET_SIZE];
+    sz_t bytes = 0;
+    tm_t start;
+    tm_t elapsed;
+    sz_t i;
+
+    start = NowMicros();
+    do {
+        for (i = 0; i < BENCH_PACKETS; ++i) {
+            xor_bytes(parity, packets[i], BENCH_PACKET_SIZE);
+        }
+        bytes += BENCH_PACKETS * BENCH_PACKET_SIZE;
+        elapsed = NowMicros() - start;
+    } while (elapsed < 1000000);
+    printf("%-14s %6.2f GB/s\n", name, (double)bytes / (double)elapsed / 1000.0);
+}
+
+static void Throughput() {
+    FecGroup group;
+    sz_t bytes = 0;
+    tm_t start;
+    tm_t elapsed;
+    sz_t i;
+
+    // Rows of 10 like the stream, Reset() included
+    Init(group);
+    start = NowMicros();
+    do {
+        for (i = 0; i < BENCH_PACKETS; ++i) {
+            if (group.count == 10) {
+                Reset(group);
+            }
+            Protect(group, packets[i], BENCH_PACKET_SIZE);
+        }
+        bytes += BENCH_PACKETS * BENCH_PACKET_SIZE;
+        elapsed = NowMicros() - start;
+    } while (elapsed < 1000000);
+    printf("%-14s %6.2f GB/s\n", "Protect()", (double)bytes / (double)elapsed / 1000.0);
+
+    XorRate("XorBytes()", XorBytes);
+    XorRate("byte loop", XorPlain);
+}
+
+static bool_t Lost(double_t loss) {
+    return (double_t)rand() / RAND_MAX < loss;
+}
+
+static void ResidualLoss(sz_t l, sz_t d, double_t loss) {
+    bool_t media[MAX_D][MAX_L];
+    bool_t row_repair[MAX_D];
+    bool_t column_repair[MAX_L];
+    sz_t lost = 0;
+    sz_t unrecovered = 0;
+    sz_t missing;
+    sz_t at;
+    sz_t b;
+    sz_t r;
+    sz_t c;
+    bool_t progress;
+
+    for (b = 0; b < BENCH_BLOCKS; ++b) {
+        for (r = 0; r < d; ++r) {
+            row_repair[r] = !Lost(loss);
+            for (c = 0; c < l; ++c) {
+                media[r][c] = !Lost(loss);
+                lost += !media[r][c];
+            }
+        }
+        for (c = 0; c < l; ++c) {
+            column_repair[c] = d > 1 && !Lost(loss);
+        }
+
+        // A group with one missing packet and its repair gives it back
+        do {
+            progress = false;
+            for (r = 0; r < d; ++r) {
+                missing = 0;
+                for (c = 0; c < l; ++c) {
+                    if (!media[r][c]) {
+                        missing++;
+                        at = c;
+                    }
+                }
+                if (missing == 1 && row_repair[r]) {
+                    media[r][at] = true;
+                    progress = true;
+                }
+            }
+            for (c = 0; c < l; ++c) {
+                missing = 0;
+                for (r = 0; r < d; ++r) {
+                    if (!media[r][c]) {
+                        missing++;
+                        at = r;
+                    }
+                }
+                if (missing == 1 && column_repair[c]) {
+                    media[at][c] = true;
+                    progress = true;
+                }
+            }
+        } while (progress);
+
+        for (r = 0; r < d; ++r) {
+            for (c = 0; c < l; ++c) {
+                unrecovered += !media[r][c];
+            }
+        }
+    }
+
+    printf("L=%zu D=%zu loss %.2f%%: residual %.3f%%, overhead %.1f%%\n",
+           l, d, loss * 100,
+           100.0 * (double_t)unrecovered / (double_t)(BENCH_BLOCKS * l * d),
+           100.0 * (double_t)(d + (d > 1 ? l : 0)) / (double_t)(l * d));
+    (void)lost;
+}
+
+int main(int argc, char **argv) {
+    sz_t l = argc > 1 ? atoi(argv[1]) : FEC_COLUMNS;
+    sz_t d = argc > 2 ? atoi(argv[2]) : (FEC_ROWS > 1 ? FEC_ROWS : 1);
+    double_t loss = (argc > 3 ? atof(argv[3]) : 2.0) / 100.0;
+    sz_t i;
+
+    if (l < 1 || l > MAX_L || d < 1 || d > MAX_D) {
+        fprintf(stderr, "L and D are 1..32\n");
+        return 1;
+    }
+
+    for (i = 0; i < BENCH_PACKETS; ++i) {
+        for (sz_t j = 0; j < BENCH_PACKET_SIZE; ++j) {
+            packets[i][j] = (byte_t)(i * 7 + j);
+        }
+    }
+    srand(1);
+
+    Throughput();
+    ResidualLoss(l, d, loss);
+    return 0;
+}
@@ -0,0 +1,169 @@
+#include "utils/Fec.h"
+#include "utils/Packetizer.h"
+#include "Test.h"
+
+#define TEST_SSRC 0x11223344
+#define TEST_PACKETS 10
+
+static byte_t packets[TEST_PACKETS][RTP_FIXED_HEADER_SIZE + 1400];
+static sz_t packet_sizes[TEST_PACKETS];
+
+// RTP packets (no TCP prefix) of different sizes and content
+static void MakePackets() {
+    sz_t i;
+    sz_t j;
+
+    for (i = 0; i < TEST_PACKETS; ++i) {
+        byte_t *p = packets[i];
+        packet_sizes[i] = 12 + 100 + i * 131;
+        p[0] = 0x80;
+        p[1] = 96 | (i == TEST_PACKETS - 1 ? 0x80 : 0);
+        p[2] = (byte_t)((1000 + i) >> 8);
+        p[3] = (byte_t)(1000 + i);
+        p[4] = 0x00;
+        p[5] = 0x01;
+        p[6] = 0x02;
+        p[7] = (byte_t)(i / 4);
+        for (j = 12; j < packet_sizes[i]; ++j) {
+            p[j] = (byte_t)(j * 7 + i * 13);
+        }
+    }
+}
+
+// XOR of the others gives back a lost packet, its length and header fields
+static void TestRecovery() {
+    FecGroup group;
+    FecGroup others;
+    sz_t lost = 3;
+    sz_t payload_size;
+    sz_t i;
+
+    Init(group);
+    Init(others);
+    for (i = 0; i < TEST_PACKETS; ++i) {
+        CHECK(Protect(group, packets[i], packet_sizes[i]));
+        if (i != lost) {
+            Protect(others, packets[i], packet_sizes[i]);
+        }
+    }
+    CHECK_EQ(group.count, TEST_PACKETS);
+    CHECK_EQ(group.base, 1000);
+    CHECK_EQ(group.size, packet_sizes[TEST_PACKETS - 1] - 12);
+
+    XorBytes(others.recovery, group.recovery, FEC_RECOVERY_SIZE);
+    XorBytes(others.payload, group.payload, group.size);
+
+    payload_size = (others.recovery[2] << 8) | others.recovery[3];
+    CHECK_EQ(payload_size, packet_sizes[lost] - 12);
+    CHECK_EQ(others.recovery[1], packets[lost][1]);
+    CHECK_EQ(others.recovery[7], packets[lost][7]);
+    CHECK(memcmp(others.payload, packets[lost] + 12, payload_size) == 0);
+
+    // Too large for a repair packet
+    CHECK(!Protect(group, packets[0], 12 + FEC_MAX_PAYLOAD + 1));
+
+    // Reset only clears what was used, the next group starts clean
+    Reset(group);
+    for (i = 0; i < FEC_MAX_PAYLOAD; ++i) {
+        if (group.payload[i] != 0) {
+            break;
+        }
+    }
+    CHECK_EQ(i, FEC_MAX_PAYLOAD);
+}
+
+// SIMD and tail paths give the same result as a byte loop
+static void TestXorBytes() {
+    byte_t a[300];
+    byte_t b[300];
+    byte_t expected[300];
+    sz_t size;
+    sz_t i;
+
+    for (size = 0; size < 200; ++size) {
+        for (i = 0; i < size + 1; ++i) {
+            a[i] = (byte_t)(i * 31 + size);
+            b[i] = (byte_t)(i * 17 + 5);
+            expected[i] = a[i] ^ b[i];
+        }
+        expected[size] = a[size];
+
+        // Unaligned on purpose
+        XorBytes(a + 1, b + 1, size > 0 ? size - 1 : 0);
+        XorBytes(a, b, size > 0 ? 1 : 0);
+        CHECK(memcmp(a, expected, size + 1) == 0);
+    }
+}
+
+static bool_t MaskBit(const byte_t *mask, sz_t bit) {
+    return (mask[bit / 8] & (0x80 >> (bit % 8))) != 0;
+}
+
+static sz_t Repair(const FecGroup& group, sz_t step, byte_t *dst, sz_t dst_size) {
+    RtpHeader header;
+
+    Init(header, 0, FEC_PAYLOAD_TYPE, 0x55667788);
+    return PacketizeFec(header, 7, 9000, TEST_SSRC, group, step, dst, dst_size);
+}
+
+// Flexible mask sizes, bit positions past the k bits, and header fields
+static void TestRepairPacket() {
+    static byte_t dst[RTP_FEC_MAX_HEADER_SIZE + FEC_MAX_PAYLOAD];
+    FecGroup group;
+    const byte_t *fec;
+    int_t size;
+    sz_t i;
+
+    // A row of 10: 2 bytes of mask
+    Init(group);
+    for (i = 0; i < TEST_PACKETS; ++i) {
+        Protect(group, packets[i], packet_sizes[i]);
+    }
+    size = Repair(group, 1, dst, sizeof(dst));
+    CHECK_EQ(size, 4 + 12 + 4 + 8 + 2 + 2 + group.size);
+    CHECK_EQ((dst[2] << 8) | dst[3], size - 4);
+    CHECK_EQ(dst[4], 0x81);         // One CSRC
+    CHECK_EQ(dst[5], FEC_PAYLOAD_TYPE);
+    CHECK_EQ(dst[16], 0x11);        // Protected SSRC
+    CHECK_EQ(dst[19], 0x44);
+
+    fec = dst + 20;
+    CHECK_EQ(fec[0] & 0xC0, 0);     // R = 0, F = 0
+    CHECK_EQ((fec[8] << 8) | fec[9], 1000);
+    CHECK(MaskBit(fec + 10, 0));    // k
+    for (i = 0; i < 15; ++i) {
+        CHECK_EQ(MaskBit(fec + 10, i + 1), i < TEST_PACKETS);
+    }
+    CHECK(memcmp(dst + size - group.size, group.payload, group.size) == 0);
+
+    // A column of 5 packets 10 apart: 6 bytes, first k = 0
+    group.count = 5;
+    size = Repair(group, 10, dst, sizeof(dst));
+    CHECK_EQ(size, 4 + 12 + 4 + 8 + 2 + 6 + group.size);
+    CHECK(!MaskBit(fec + 10, 0));
+    CHECK(MaskBit(fec + 10, 1));
+    CHECK(MaskBit(fec + 10, 11));
+    CHECK(MaskBit(fec + 10, 16));   // k
+    CHECK(MaskBit(fec + 10, 32));   // 30th packet, after the first k bit
+    CHECK(MaskBit(fec + 10, 42));   // 40th
+
+    // Up to 109 packets: 14 bytes, no k bit set
+    group.count = 2;
+    size = Repair(group, 100, dst, sizeof(dst));
+    CHECK_EQ(size, 4 + 12 + 4 + 8 + 2 + 14 + group.size);
+    CHECK(!MaskBit(fec + 10, 0));
+    CHECK(!MaskBit(fec + 10, 16));
+    CHECK(MaskBit(fec + 10, 102));
+
+    // Out of the mask, or not enough room
+    CHECK_EQ(Repair(group, 109, dst, sizeof(dst)), -1);
+    CHECK_EQ(Repair(group, 1, dst, 100), -1);
+}
+
+int main() {
+    MakePackets();
+    TestRecovery();
+    TestXorBytes();
+    TestRepairPacket();
+    return TestResult("FecTest");
+}
@@ -0,0 +1,198 @@
+#include "utils/FramePool.h"
+#include "utils/FrameRing.h"
+#include "Test.h"
+
+#define TEST_POOL_SIZE 8
+#define TEST_FRAME_SIZE 1024
+#define TEST_LISTENERS 3
+#define TEST_THREAD_FRAMES 100000
+
+typedef FramePool<TEST_POOL_SIZE, TEST_FRAME_SIZE> TestPool;
+
+static TestPool pool;
+static byte_t encoded[TEST_FRAME_SIZE];
+
+static sz_t FreeFrames() {
+    sz_t count = 0;
+    for (sz_t i = 0; i < TEST_POOL_SIZE; ++i) {
+        count += Load(&pool.frames[i].refs) == 0;
+    }
+    return count;
+}
+
+static void TestPoolAcquire() {
+    SharedFrame *frames[TEST_POOL_SIZE];
+    SharedFrame *frame;
+    sz_t i;
+
+    Init(pool);
+    CHECK(Acquire(pool, TEST_FRAME_SIZE + 1) == nullptr);
+
+    for (i = 0; i < TEST_POOL_SIZE; ++i) {
+        frames[i] = Acquire(pool, TEST_FRAME_SIZE);
+        CHECK(frames[i] != nullptr);
+        CHECK_EQ(Load(&frames[i]->refs), 1);
+    }
+    CHECK(Acquire(pool, 1) == nullptr);
+
+    // Back to the pool at 0 refs only
+    Retain(frames[2]);
+    Release(frames[2]);
+    CHECK(Acquire(pool, 1) == nullptr);
+    Release(frames[2]);
+    frame = Acquire(pool, 1);
+    CHECK(frame == frames[2]);
+
+    for (i = 0; i < TEST_POOL_SIZE; ++i) {
+        Release(frames[i]);
+    }
+    CHECK_EQ(FreeFrames(), TEST_POOL_SIZE);
+}
+
+// One frame from the encoder to every listener: one copy, one ref each
+static void TestFanOut() {
+    static FrameRing<4> rings[TEST_LISTENERS];
+    SharedFrame *frame;
+    SharedFrame *popped;
+    sz_t i;
+
+    Init(pool);
+    for (i = 0; i < TEST_LISTENERS; ++i) {
+        Init(rings[i]);
+    }
+
+    frame = Acquire(pool, sizeof(encoded));
+    Fill(frame, encoded, sizeof(encoded), 1000, 1);
+
+    // What the encoder does for each listener, then drops its own ref
+    for (i = 0; i < TEST_LISTENERS; ++i) {
+        Retain(frame);
+        CHECK(Push(rings[i], frame));
+    }
+    Release(frame);
+    CHECK_EQ(Load(&frame->refs), TEST_LISTENERS);
+
+    for (i = 0; i < TEST_LISTENERS; ++i) {
+        popped = Pop(rings[i]);
+        CHECK(popped == frame);
+        CHECK(popped->data == frame->data);
+        Release(popped);
+    }
+    CHECK_EQ(Load(&frame->copies), 1);
+    CHECK_EQ(FreeFrames(), TEST_POOL_SIZE);
+
+    // Reused frames count from 0 again
+    frame = Acquire(pool, 1);
+    CHECK(frame != nullptr);
+    if (frame) {
+        CHECK_EQ(Load(&frame->copies), 0);
+        Release(frame);
+    }
+}
+
+static void TestRing() {
+    static FrameRing<4> ring;
+    SharedFrame *frames[TEST_POOL_SIZE];
+    sz_t i;
+
+    Init(pool);
+    Init(ring);
+    for (i = 0; i < TEST_POOL_SIZE; ++i) {
+        frames[i] = Acquire(pool, 1);
+    }
+
+    // Wraps around a few times, in order
+    for (i = 0; i < 3 * 4; ++i) {
+        CHECK(Push(ring, frames[i % TEST_POOL_SIZE]));
+        CHECK(Pop(ring) == frames[i % TEST_POOL_SIZE]);
+    }
+    CHECK(Pop(ring) == nullptr);
+
+    for (i = 0; i < 4; ++i) {
+        CHECK(Push(ring, frames[i]));
+    }
+    CHECK(Full(ring));
+    CHECK(!Push(ring, frames[4]));
+
+    // The producer makes room by dropping the oldest
+    CHECK(DropOldest(ring) == frames[0]);
+    CHECK(Push(ring, frames[4]));
+    CHECK_EQ(Count(ring), 4);
+    CHECK(Pop(ring) == frames[1]);
+
+    // Drain releases what is left: frames 2, 3, 4
+    Drain(ring);
+    CHECK(Empty(ring));
+    CHECK_EQ(FreeFrames(), 3);
+
+    // Popped or never pushed, the pool is whole again
+    Release(frames[0]);
+    Release(frames[1]);
+    for (i = 5; i < TEST_POOL_SIZE; ++i) {
+        Release(frames[i]);
+    }
+    CHECK_EQ(FreeFrames(), TEST_POOL_SIZE);
+}
+
+static FrameRing<16> thread_ring;
+static a_bool_t producing;
+
+static void *Consume(void *arg) {
+    sz_t *received = (sz_t *)arg;
+    SharedFrame *frame;
+    tm_t expected = 0;
+
+    while (Load(&producing) || !Empty(thread_ring)) {
+        frame = Pop(thread_ring);
+        if (!frame) {
+            Sleep(thread_ring);
+            continue;
+        }
+        // Out of order frames are not counted
+        if (frame->timeUs == expected) {
+            (*received)++;
+        }
+        expected = frame->timeUs + 1;
+        Release(frame);
+    }
+    return nullptr;
+}
+
+// Encoder and stream threads: every frame arrives once, in order,
+// and goes back to the pool
+static void TestThreads() {
+    thread_t consumer;
+    SharedFrame *frame;
+    sz_t received = 0;
+    tm_t i;
+
+    Init(pool);
+    Init(thread_ring);
+    Store(&producing, true);
+    Init(&consumer);
+    Start(&consumer, Consume, &received);
+
+    for (i = 0; i < TEST_THREAD_FRAMES; ++i) {
+        while ((frame = Acquire(pool, sizeof(i))) == nullptr) {
+            sched_yield();
+        }
+        Fill(frame, (const byte_t *)&i, sizeof(i), i, 0);
+        while (!Push(thread_ring, frame)) {
+            sched_yield();
+        }
+    }
+    Store(&producing, false);
+    Wake(thread_ring);
+    Join(&consumer);
+
+    CHECK_EQ(received, TEST_THREAD_FRAMES);
+    CHECK_EQ(FreeFrames(), TEST_POOL_SIZE);
+}
+
+int main() {
+    TestPoolAcquire();
+    TestFanOut();
+    TestRing();
+    TestThreads();
+    return TestResult("FrameRingTest");
+}
@@ -0,0 +1,337 @@
+#include <poll.h>
+#include <signal.h>
+
+#include "server/S_HttpServer.h"
+#include "Mp4Test.h"
+#include "Test.h"
+
+// LL-HLS end to end: frames go in through the encoder listeners,
+// a player fetches the playlist and the parts over HTTP on HTTP_PORT.
+// 30 fps with an IDR every second: 6 frames per part, 5 parts per segment.
+
+#define TEST_FRAME_US 33333
+#define TEST_GOP_FRAMES 30
+#define TEST_PART_FRAMES 6
+#define TEST_VIDEO_SIZE 120
+#define TEST_AUDIO_SIZE 32
+#define TEST_VIDEO_POOL 256     // > window + ring + pending part
+#define TEST_AUDIO_POOL 320
+#define TEST_RESPONSE_SIZE 65536
+#define TEST_WAIT_MS 200        // A blocked request isn't answered in this time
+#define TEST_ANSWER_MS 2000     // < HLS_BLOCK_TIMEOUT_MS
+
+typedef struct {
+    int_t fd;
+    char_t data[TEST_RESPONSE_SIZE + 1];
+    sz_t size;
+    int_t status;
+    const byte_t *body;
+    sz_t body_size;
+} TestPlayer;
+
+static E_H265 video_encoder;
+static E_AAC audio_encoder;
+static S_HttpServer server;
+static FramePool<TEST_VIDEO_POOL, H265_CONFIG_SIZE + TEST_VIDEO_SIZE> video_pool;
+static FramePool<TEST_AUDIO_POOL, TEST_AUDIO_SIZE> audio_pool;
+static TestPlayer player;
+static TestPlayer waiter;
+static sz_t video_frames = 0;
+static sz_t audio_frames = 0;
+
+static tm_t AudioTime(sz_t index) {
+    return (tm_t)index * MP4_AAC_FRAME_SAMPLES * 1000000 / AUDIO_SAMPLE_RATE;
+}
+
+// AUs up to the frame, then the frame: parameter sets + IDR every
+// TEST_GOP_FRAMES, else one TRAIL_R. Returns once the muxer took it.
+static void FeedFrame() {
+    const byte_t idr[] = {0x00, 0x00, 0x00, 0x01, 0x26, 0x01, 0xAF};
+    const byte_t trail[] = {0x00, 0x00, 0x00, 0x01, 0x02, 0x01, 0xD0};
+    byte_t au[H265_CONFIG_SIZE + TEST_VIDEO_SIZE];
+    byte_t aac[TEST_AUDIO_SIZE];
+    tm_t time = (tm_t)video_frames * TEST_FRAME_US;
+    bool_t keyframe = video_frames % TEST_GOP_FRAMES == 0;
+    SharedFrame* frame;
+    sz_t size = 0;
+    sz_t i;
+
+    while (AudioTime(audio_frames) <= time) {
+        Reset(aac, sizeof(aac));
+        aac[0] = (byte_t)audio_frames;
+        frame = Acquire(audio_pool, sizeof(aac));
+        CHECK(frame != nullptr);
+        if (!frame) {
+            return;
+        }
+        Fill(frame, aac, sizeof(aac), AudioTime(audio_frames), 0);
+        audio_encoder.callback(audio_encoder.context, frame);
+        Release(frame);
+        audio_frames++;
+    }
+
+    if (keyframe) {
+        Copy(au, kTestConfig, sizeof(kTestConfig));
+        size = sizeof(kTestConfig);
+    }
+    Copy(au + size, keyframe ? idr : trail, sizeof(idr));
+    size += sizeof(idr);
+    for (i = 0; i < TEST_VIDEO_SIZE - sizeof(idr); ++i) {
+        au[size++] = (byte_t)(video_frames + i) | 0x10; // No start code in it
+    }
+
+    frame = Acquire(video_pool, size);
+    CHECK(frame != nullptr);
+    if (!frame) {
+        return;
+    }
+    Fill(frame, au, size, time, keyframe ? E_INFO_FLAG_KEY_FRAME : 0);
+    video_encoder.callback(video_encoder.context, frame);
+    Release(frame);
+    video_frames++;
+
+    while (!Empty(server.hls.video_ring)) {
+        usleep(1000);
+    }
+}
+
+static void FeedFrames(sz_t count) {
+    for (sz_t i = 0; i < count; ++i) {
+        FeedFrame();
+    }
+}
+
+// The reactor may not listen yet
+static bool_t Connect(TestPlayer& test_player) {
+    sockaddr_in addr {};
+    sz_t tries;
+
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(HTTP_PORT);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    for (tries = 0; tries < 100; ++tries) {
+        test_player.fd = socket(AF_INET, SOCK_STREAM, 0);
+        if (connect(test_player.fd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) == 0) {
+            return true;
+        }
+        close(test_player.fd);
+        usleep(20000);
+    }
+    test_player.fd = -1;
+    return false;
+}
+
+static void Request(TestPlayer& test_player, const char_t *uri) {
+    char_t request[256];
+    int_t length = WriteStream(request, sizeof(request),
+                               "GET %s HTTP/1.1\r\n"
+                               "Host: 127.0.0.1\r\n"
+                               "\r\n",
+                               uri);
+
+    test_player.size = 0;
+    test_player.status = 0;
+    CHECK_EQ(send(test_player.fd, request, length, 0), length);
+}
+
+// Wait up to timeout_ms for the whole response.
+// Return its status, 0 if it didn't come.
+static int_t Response(TestPlayer& test_player, int_t timeout_ms) {
+    tm_t until = NowMicros() + (tm_t)timeout_ms * 1000;
+    pollfd pfd = {test_player.fd, POLLIN, 0};
+    const char_t *end;
+    const char_t *length;
+    sz_t header_size;
+    ssz_t received;
+    tm_t left;
+
+    while (true) {
+        test_player.data[test_player.size] = '\0';
+        end = strstr(test_player.data, "\r\n\r\n");
+        length = strstr(test_player.data, "Content-Length: ");
+        if (end && length && length < end) {
+            header_size = end + 4 - test_player.data;
+            test_player.body_size = (sz_t)atoi(length + Len("Content-Length: "));
+            if (test_player.size >= header_size + test_player.body_size) {
+                test_player.body = reinterpret_cast<const byte_t *>(test_player.data + header_size);
+                sscanf(test_player.data, "HTTP/1.1 %d", &test_player.status);
+                return test_player.status;
+            }
+        }
+
+        left = until - NowMicros();
+        if (left <= 0 || poll(&pfd, 1, (int_t)(left / 1000)) <= 0) {
+            return 0;
+        }
+        received = recv(test_player.fd,
+                        test_player.data + test_player.size,
+                        TEST_RESPONSE_SIZE - test_player.size,
+                        0);
+        if (received <= 0) {
+            return 0;
+        }
+        test_player.size += received;
+    }
+}
+
+static const char_t* Text(const TestPlayer& test_player) {
+    return reinterpret_cast<const char_t *>(test_player.body);
+}
+
+static int_t Get(TestPlayer& test_player, const char_t *uri) {
+    Request(test_player, uri);
+    return Response(test_player, TEST_ANSWER_MS);
+}
+
+static sz_t CountLines(const char_t *playlist, const char_t *prefix) {
+    sz_t count = 0;
+
+    for (const char_t *line = strstr(playlist, prefix); line; line = strstr(line + 1, prefix)) {
+        count++;
+    }
+    return count;
+}
+
+// Parts close before 200 ms, only the first of each segment is
+// independent, segments are one GOP. The hint is the next part.
+static void CheckPlaylist(const char_t *playlist, int_t last_msn, int_t next_part) {
+    char_t hint[64];
+    const char_t *line;
+    double_t duration;
+    int_t msn;
+    int_t part;
+    sz_t segments = 0;
+
+    for (line = strstr(playlist, "#EXT-X-PART:"); line; line = strstr(line + 1, "#EXT-X-PART:")) {
+        CHECK_EQ(sscanf(line, "#EXT-X-PART:DURATION=%lf,URI=\"part%d.%d.mp4\"", &duration, &msn, &part), 3);
+        CHECK(duration > 0.19 && duration <= (double_t)HLS_PART_TARGET_MS / 1000);
+        CHECK_EQ(strncmp(strchr(line, '\n') - Len(",INDEPENDENT=YES"), ",INDEPENDENT=YES", Len(",INDEPENDENT=YES")) == 0,
+                 part == 0);
+    }
+    for (line = strstr(playlist, "#EXTINF:"); line; line = strstr(line + 1, "#EXTINF:")) {
+        CHECK_EQ(sscanf(line, "#EXTINF:%lf,\nseg%d.mp4", &duration, &msn), 2);
+        CHECK_EQ(msn, segments);
+        CHECK(duration > 0.99 && duration < 1.01);
+        segments++;
+    }
+    CHECK_EQ(segments, last_msn);
+    CHECK_EQ(CountLines(playlist, "#EXT-X-PART:"), last_msn * TEST_GOP_FRAMES / TEST_PART_FRAMES + next_part);
+
+    WriteStream(hint, sizeof(hint), "#EXT-X-PRELOAD-HINT:TYPE=PART,URI=\"part%d.%d.mp4\"\n", last_msn, next_part);
+    CHECK(strstr(playlist, hint) != nullptr);
+    CHECK(strstr(playlist, "CAN-BLOCK-RELOAD=YES") != nullptr);
+    CHECK(strstr(playlist, "#EXT-X-MAP:URI=\"init1.mp4\"") != nullptr);
+}
+
+// moof + mdat, the video run first, NAL lengths instead of start codes
+static void CheckPart(const byte_t *data, sz_t size, sz_t video_samples, bool_t independent) {
+    char_t types[4][5];
+    TestBox moof;
+    TestBox trun;
+    TestBox audio;
+    TestBox mdat;
+
+    CHECK_EQ(ListBoxes(data, size, types, 4), 2);
+    CHECK(FindBox(data, size, "moof", 0, moof));
+    CHECK(FindBox(data, size, "mdat", 0, mdat));
+    CHECK(FindPath(moof.data, moof.size, "traf/trun", trun));
+    CHECK_EQ(ReadBox32(trun.data + 4), video_samples);
+    CHECK(FindBox(moof.data, moof.size, "traf", 1, audio));
+
+    CHECK_EQ(ReadBox32(mdat.data), TEST_VIDEO_SIZE - 4);
+    CHECK_EQ(mdat.data[4], independent ? 0x26 : 0x02);
+}
+
+static void TestPartsAndSegments() {
+    CHECK(Connect(player));
+    CHECK(Connect(waiter));
+
+    // IDRs at 0, 30, 60, 90: segments 0..2, then 3.0 is published by frame 96
+    FeedFrames(3 * TEST_GOP_FRAMES + TEST_PART_FRAMES + 1);
+
+    CHECK_EQ(Get(player, "/live.m3u8"), 200);
+    CheckPlaylist(Text(player), 3, 1);
+    CHECK(strstr(Text(player), "#EXT-X-MEDIA-SEQUENCE:0\n") != nullptr);
+
+    CHECK_EQ(Get(player, "/part1.0.mp4"), 200);
+    CheckPart(player.body, player.body_size, TEST_PART_FRAMES, true);
+    CHECK_EQ(Get(player, "/part1.1.mp4"), 200);
+    CheckPart(player.body, player.body_size, TEST_PART_FRAMES, false);
+
+    // A whole segment is its parts back to back
+    CHECK_EQ(Get(player, "/seg1.mp4"), 200);
+    CHECK_EQ(ListBoxes(player.body, player.body_size, nullptr, 0), 2 * TEST_GOP_FRAMES / TEST_PART_FRAMES);
+
+    CHECK_EQ(Get(player, "/part9.0.mp4"), 404);
+}
+
+// _HLS_msn / _HLS_part and the preload hint wait for the part
+static void TestBlockingReload() {
+    Request(waiter, "/live.m3u8?_HLS_msn=3&_HLS_part=1");
+    Request(player, "/part3.1.mp4");
+    CHECK_EQ(Response(waiter, TEST_WAIT_MS), 0);
+    CHECK_EQ(Response(player, TEST_WAIT_MS), 0);
+
+    FeedFrames(TEST_PART_FRAMES);
+
+    CHECK_EQ(Response(waiter, TEST_ANSWER_MS), 200);
+    CheckPlaylist(Text(waiter), 3, 2);
+    CHECK_EQ(Response(player, TEST_ANSWER_MS), 200);
+    CheckPart(player.body, player.body_size, TEST_PART_FRAMES, false);
+
+    // Already there: right away
+    CHECK_EQ(Get(player, "/live.m3u8?_HLS_msn=2&_HLS_part=0"), 200);
+    // Too far ahead to wait for
+    CHECK_EQ(Get(player, "/live.m3u8?_HLS_msn=6&_HLS_part=0"), 400);
+}
+
+static void TestInit() {
+    TestBox box;
+
+    CHECK_EQ(Get(player, "/init1.mp4"), 200);
+    CHECK(FindPath(player.body, player.body_size, "moov/trak/tkhd", box));
+    CHECK_EQ(ReadBox32(box.data + box.size - 8) >> 16, TEST_WIDTH);
+    CHECK_EQ(ReadBox32(box.data + box.size - 4) >> 16, TEST_HEIGHT);
+    CHECK(FindBox(player.body, player.body_size, "moov", 0, box));
+    CHECK(FindBox(box.data, box.size, "trak", 1, box));
+
+    CHECK_EQ(Get(player, "/init2.mp4"), 404);
+}
+
+// Every frame goes back to the encoders
+static void TestStop() {
+    sz_t i;
+
+    close(player.fd);
+    close(waiter.fd);
+    S_Stop(server);
+
+    CHECK(video_encoder.callback == nullptr);
+    CHECK(audio_encoder.callback == nullptr);
+    for (i = 0; i < TEST_VIDEO_POOL; ++i) {
+        CHECK_EQ(Load(&video_pool.frames[i].refs), 0);
+    }
+    for (i = 0; i < TEST_AUDIO_POOL; ++i) {
+        CHECK_EQ(Load(&audio_pool.frames[i].refs), 0);
+    }
+}
+
+int main() {
+    signal(SIGPIPE, SIG_IGN);
+    Init(video_pool);
+    Init(audio_pool);
+    Copy(video_encoder.config, kTestConfig, sizeof(kTestConfig));
+    video_encoder.config_size = sizeof(kTestConfig);
+    video_encoder.params_version = 1;
+
+    S_Init(server, &video_encoder, &audio_encoder);
+    S_Start(server, true);
+    CHECK(video_encoder.callback != nullptr);
+    CHECK(audio_encoder.callback != nullptr);
+
+    TestPartsAndSegments();
+    TestBlockingReload();
+    TestInit();
+    TestStop();
+    return TestResult("HlsStreamTest");
+}
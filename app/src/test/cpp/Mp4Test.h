@@ -0,0 +1,93 @@
+#pragma once
+
+#include <string.h>
+
+#include "utils/Platform.h"
+
+// What the fMP4 tests share: parameter sets of a 1920x1080 Main profile
+// stream and a reader for the boxes written
+
+#define TEST_WIDTH 1920
+#define TEST_HEIGHT 1080
+
+// VPS, SPS, PPS with start codes, as MediaCodec gives them (csd-0)
+static const byte_t kTestConfig[] = {
+    0x00, 0x00, 0x00, 0x01, 0x40, 0x01, 0x0C, 0x01, 0xFF, 0xFF, 0x01, 0x60,
+    0x00, 0x00, 0x03, 0x00, 0x90, 0x00, 0x00, 0x03, 0x00, 0x00, 0x03, 0x00,
+    0x78, 0x95, 0x98, 0x09,
+    0x00, 0x00, 0x00, 0x01, 0x42, 0x01, 0x01, 0x01, 0x60, 0x00, 0x00, 0x03,
+    0x00, 0x90, 0x00, 0x00, 0x03, 0x00, 0x00, 0x03, 0x00, 0x78, 0xA0, 0x03,
+    0xC0, 0x80, 0x10, 0xE5, 0x96, 0x56, 0x69, 0x24, 0xCA, 0xF0, 0x10, 0x10,
+    0x00, 0x00, 0x03, 0x00, 0x10, 0x00, 0x00, 0x03, 0x01, 0xE0, 0x80,
+    0x00, 0x00, 0x00, 0x01, 0x44, 0x01, 0xC1, 0x72, 0xB4, 0x62, 0x40
+};
+
+// Payload of a box, after its size and type
+typedef struct {
+    const byte_t *data;
+    sz_t size;
+} TestBox;
+
+static inline uint_t ReadBox32(const byte_t *data) {
+    return ((uint_t)data[0] << 24) | ((uint_t)data[1] << 16) |
+           ((uint_t)data[2] << 8) | (uint_t)data[3];
+}
+
+// Boxes at the top level of data, in order. Return their count,
+// types of the first max ones, 0 if a size runs past the end.
+static inline sz_t ListBoxes(const byte_t *data, sz_t size, char_t (*types)[5], sz_t max) {
+    sz_t offset = 0;
+    sz_t count = 0;
+    uint_t box_size;
+
+    while (offset + 8 <= size) {
+        box_size = ReadBox32(data + offset);
+        if (box_size < 8 || offset + box_size > size) {
+            return 0;
+        }
+        if (count < max) {
+            Copy(types[count], data + offset + 4, 4);
+            types[count][4] = '\0';
+        }
+        ++count;
+        offset += box_size;
+    }
+    return offset == size ? count : 0;
+}
+
+// index-th box of type at the top level of data
+static inline bool_t FindBox(const byte_t *data, sz_t size, const char_t *type, sz_t index, TestBox &box) {
+    sz_t offset = 0;
+    uint_t box_size;
+
+    while (offset + 8 <= size) {
+        box_size = ReadBox32(data + offset);
+        if (box_size < 8 || offset + box_size > size) {
+            return false;
+        }
+        if (memcmp(data + offset + 4, type, 4) == 0 && index-- == 0) {
+            box.data = data + offset + 8;
+            box.size = box_size - 8;
+            return true;
+        }
+        offset += box_size;
+    }
+    return false;
+}
+
+// First box on a path of containers, "moov/trak/tkhd"
+static inline bool_t FindPath(const byte_t *data, sz_t size, const char_t *path, TestBox &box) {
+    char_t type[5];
+
+    box.data = data;
+    box.size = size;
+    while (*path) {
+        Copy(type, path, 4);
+        type[4] = '\0';
+        if (!FindBox(box.data, box.size, type, 0, box)) {
+            return false;
+        }
+        path += path[4] == '/' ? 5 : 4;
+    }
+    return true;
+}
@@ -0,0 +1,140 @@
+#include "utils/Mp4Writer.h"
+#include "Mp4Test.h"
+#include "Test.h"
+
+#define TEST_BUFFER_SIZE 4096
+
+// Init segment: ftyp, then moov with both tracks and their trex
+static void TestInit() {
+    static byte_t init[TEST_BUFFER_SIZE];
+    char_t types[8][5];
+    TestBox moov;
+    TestBox box;
+    int_t size;
+
+    size = WriteMp4Init(kTestConfig, sizeof(kTestConfig), true, init, sizeof(init));
+    CHECK(size > 0);
+    CHECK_EQ(ListBoxes(init, size, types, 8), 2);
+    CHECK(strcmp(types[0], "ftyp") == 0);
+    CHECK(strcmp(types[1], "moov") == 0);
+
+    CHECK(FindBox(init, size, "moov", 0, moov));
+    CHECK_EQ(ListBoxes(moov.data, moov.size, types, 8), 4);
+    CHECK(strcmp(types[0], "mvhd") == 0);
+    CHECK(strcmp(types[1], "trak") == 0);
+    CHECK(strcmp(types[2], "trak") == 0);
+    CHECK(strcmp(types[3], "mvex") == 0);
+
+    // Video first, its size from the SPS (16.16 at the end of tkhd)
+    CHECK(FindPath(moov.data, moov.size, "trak/tkhd", box));
+    CHECK_EQ(ReadBox32(box.data + 12), MP4_VIDEO_TRACK);
+    CHECK_EQ(ReadBox32(box.data + box.size - 8) >> 16, TEST_WIDTH);
+    CHECK_EQ(ReadBox32(box.data + box.size - 4) >> 16, TEST_HEIGHT);
+
+    // One sample entry, the parameter sets only in hvcC
+    CHECK(FindPath(moov.data, moov.size, "trak/mdia/minf/stbl/stsd", box));
+    CHECK_EQ(ReadBox32(box.data + 4), 1);
+    CHECK(memcmp(box.data + 12, "hvc1", 4) == 0);
+
+    CHECK(FindPath(moov.data, moov.size, "mvex", box));
+    CHECK_EQ(ListBoxes(box.data, box.size, types, 8), 2);
+    CHECK(strcmp(types[0], "trex") == 0 && strcmp(types[1], "trex") == 0);
+
+    // No audio: one track
+    size = WriteMp4Init(kTestConfig, sizeof(kTestConfig), false, init, sizeof(init));
+    CHECK(FindBox(init, size, "moov", 0, moov));
+    CHECK_EQ(ListBoxes(moov.data, moov.size, types, 8), 3);
+
+    // Missing PPS, or no room
+    CHECK_EQ(WriteMp4Init(kTestConfig, sizeof(kTestConfig) - 11, false, init, sizeof(init)), -1);
+    CHECK_EQ(WriteMp4Init(kTestConfig, sizeof(kTestConfig), true, init, 100), -1);
+}
+
+// moof with one traf per run, then the mdat header. Each trun
+// points to its samples from the start of moof.
+static void TestFragment() {
+    static byte_t fragment[TEST_BUFFER_SIZE];
+    Mp4Sample video[3] = {{3000, 1000, true}, {3000, 200, false}, {3000, 300, false}};
+    Mp4Sample audio[2] = {{MP4_AAC_FRAME_SAMPLES, 50, true}, {MP4_AAC_FRAME_SAMPLES, 60, true}};
+    Mp4Run runs[2] = {{MP4_VIDEO_TRACK, 9000, video, 3},
+                      {MP4_AUDIO_TRACK, 4096, audio, 2}};
+    sz_t data_size = 1000 + 200 + 300 + 50 + 60;
+    char_t types[8][5];
+    TestBox moof;
+    TestBox traf;
+    TestBox box;
+    int_t size;
+    sz_t moof_size;
+
+    size = WriteMp4Fragment(7, runs, 2, data_size, fragment, sizeof(fragment));
+    CHECK(size > 0);
+
+    // The mdat header is last, its payload follows
+    CHECK(FindBox(fragment, size, "moof", 0, moof));
+    moof_size = moof.size + 8;
+    CHECK_EQ(moof_size + MP4_MDAT_HEADER_SIZE, size);
+    CHECK_EQ(ReadBox32(fragment + moof_size), MP4_MDAT_HEADER_SIZE + data_size);
+    CHECK(memcmp(fragment + moof_size + 4, "mdat", 4) == 0);
+
+    CHECK_EQ(ListBoxes(moof.data, moof.size, types, 8), 3);
+    CHECK(strcmp(types[0], "mfhd") == 0);
+    CHECK(strcmp(types[1], "traf") == 0 && strcmp(types[2], "traf") == 0);
+    CHECK(FindBox(moof.data, moof.size, "mfhd", 0, box));
+    CHECK_EQ(ReadBox32(box.data + 4), 7);
+
+    // Video: tfhd, tfdt (version 1), trun with per sample flags
+    CHECK(FindBox(moof.data, moof.size, "traf", 0, traf));
+    CHECK_EQ(ListBoxes(traf.data, traf.size, types, 8), 3);
+    CHECK(strcmp(types[0], "tfhd") == 0 && strcmp(types[1], "tfdt") == 0 && strcmp(types[2], "trun") == 0);
+    CHECK(FindBox(traf.data, traf.size, "tfhd", 0, box));
+    CHECK_EQ(ReadBox32(box.data + 4), MP4_VIDEO_TRACK);
+    CHECK(FindBox(traf.data, traf.size, "tfdt", 0, box));
+    CHECK_EQ(box.data[0], 1);
+    CHECK_EQ(ReadBox32(box.data + 8), 9000);
+    CHECK(FindBox(traf.data, traf.size, "trun", 0, box));
+    CHECK_EQ(ReadBox32(box.data + 4), 3);
+    CHECK_EQ(ReadBox32(box.data + 8), moof_size + MP4_MDAT_HEADER_SIZE);
+    CHECK_EQ(box.size, 12 + 3 * 12);
+    CHECK_EQ(ReadBox32(box.data + 16), 1000);
+
+    // Audio: all sync, no per sample flags, data after the video
+    CHECK(FindBox(moof.data, moof.size, "traf", 1, traf));
+    CHECK(FindBox(traf.data, traf.size, "tfhd", 0, box));
+    CHECK_EQ(ReadBox32(box.data + 4), MP4_AUDIO_TRACK);
+    CHECK(FindBox(traf.data, traf.size, "trun", 0, box));
+    CHECK_EQ(ReadBox32(box.data + 4), 2);
+    CHECK_EQ(ReadBox32(box.data + 8), moof_size + MP4_MDAT_HEADER_SIZE + 1500);
+    CHECK_EQ(box.size, 12 + 2 * 8);
+
+    CHECK_EQ(WriteMp4Fragment(8, runs, 2, data_size, fragment, 64), -1);
+}
+
+// Parameter sets and delimiters stay out of the sample
+static void TestScanSample() {
+    byte_t au[128];
+    NalUnit nals[8];
+    uint_t sample_size;
+    sz_t size = 0;
+    sz_t count;
+    const byte_t aud[] = {0x00, 0x00, 0x00, 0x01, 0x46, 0x01, 0x50};
+    const byte_t idr[] = {0x00, 0x00, 0x01, 0x26, 0x01, 0xAF, 0x11, 0x22};
+
+    Copy(au + size, aud, sizeof(aud));
+    size += sizeof(aud);
+    Copy(au + size, kTestConfig, sizeof(kTestConfig));
+    size += sizeof(kTestConfig);
+    Copy(au + size, idr, sizeof(idr));
+    size += sizeof(idr);
+
+    count = ScanMp4Sample(au, size, nals, 8, sample_size);
+    CHECK_EQ(count, 1);
+    CHECK_EQ(sample_size, MP4_NAL_LENGTH_SIZE + sizeof(idr) - 3);
+    CHECK_EQ(au[nals[0].start + nals[0].codeSize], 0x26);
+}
+
+int main() {
+    TestInit();
+    TestFragment();
+    TestScanSample();
+    return TestResult("Mp4WriterTest");
+}
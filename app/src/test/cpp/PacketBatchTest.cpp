@@ -0,0 +1,136 @@
+#include "server/S_PacketBatch.h"
+#include "Test.h"
+
+#define TEST_CAPACITY 128
+#define TEST_HEADER_SIZE (TCP_PREFIX_LEN + 12)
+
+static byte_t payload[2000];
+
+static void AddPackets(PacketBatch<TEST_CAPACITY>& batch, sz_t count, sz_t payload_size) {
+    sz_t i;
+
+    for (i = 0; i < count; ++i) {
+        AddPacket(batch, TEST_HEADER_SIZE, payload, payload_size);
+    }
+}
+
+// What FlushUdp() does before grouping
+static sz_t Build(PacketBatch<TEST_CAPACITY>& batch, bool_t segmentation) {
+    batch.packet_vectors[batch.packet_count] = batch.vector_count;
+    return BuildMessages(batch, 0, segmentation);
+}
+
+static ushort_t SegmentSize(const s_mmsghdr_t& message) {
+    ushort_t size = 0;
+    cmsghdr *cmsg;
+
+    if (message.msg_hdr.msg_control == nullptr) {
+        return 0;
+    }
+    cmsg = CMSG_FIRSTHDR(&message.msg_hdr);
+    Copy(&size, CMSG_DATA(cmsg), sizeof(size));
+    return size;
+}
+
+// A frame of equal packets and a smaller tail is one message with GSO
+static void TestRun() {
+    static PacketBatch<TEST_CAPACITY> batch;
+    sz_t count;
+
+    Reset(batch);
+    AddPackets(batch, 5, 1000);
+    AddPackets(batch, 1, 300);
+
+    count = Build(batch, true);
+    CHECK_EQ(count, 1);
+    CHECK_EQ(batch.messages[0].msg_hdr.msg_iovlen, 12);
+    CHECK_EQ(SegmentSize(batch.messages[0]), 1012);
+    CHECK_EQ(batch.message_packets[0], 0);
+
+    // No GSO: one datagram per packet, no control
+    count = Build(batch, false);
+    CHECK_EQ(count, 6);
+    CHECK_EQ(batch.messages[5].msg_hdr.msg_iovlen, 2);
+    CHECK_EQ(batch.message_packets[5], 5);
+    CHECK_EQ(SegmentSize(batch.messages[5]), 0);
+}
+
+// A smaller packet ends the run, a larger one starts a new one
+static void TestRunEnds() {
+    static PacketBatch<TEST_CAPACITY> batch;
+    sz_t count;
+
+    Reset(batch);
+    AddPackets(batch, 2, 1000);
+    AddPackets(batch, 1, 500);
+    AddPackets(batch, 3, 1000);
+
+    count = Build(batch, true);
+    CHECK_EQ(count, 2);
+    CHECK_EQ(batch.message_packets[0], 0);
+    CHECK_EQ(batch.messages[0].msg_hdr.msg_iovlen, 6);
+    CHECK_EQ(batch.message_packets[1], 3);
+    CHECK_EQ(batch.messages[1].msg_hdr.msg_iovlen, 6);
+    CHECK_EQ(SegmentSize(batch.messages[1]), 1012);
+}
+
+// The RTCP report goes to its own port and splits the run
+static void TestReport() {
+    static PacketBatch<TEST_CAPACITY> batch;
+    sz_t count;
+
+    Reset(batch);
+    AddPackets(batch, 2, 1000);
+    AddReport(batch, TEST_HEADER_SIZE + 28);
+    AddPackets(batch, 2, 1000);
+
+    count = Build(batch, true);
+    CHECK_EQ(count, 2);
+    CHECK_EQ(batch.message_packets[0], 0);
+    CHECK_EQ(batch.messages[0].msg_hdr.msg_iovlen, 4);
+    CHECK_EQ(batch.message_packets[1], 3);
+    CHECK_EQ(batch.messages[1].msg_hdr.msg_iovlen, 4);
+}
+
+// A message stays under the UDP size limit and UDP_MAX_SEGMENTS
+static void TestLimits() {
+    static PacketBatch<TEST_CAPACITY> batch;
+    sz_t count;
+    sz_t per_message = UDP_MAX_SEGMENT_BYTES / 1412;
+
+    Reset(batch);
+    AddPackets(batch, 100, 1400);
+    count = Build(batch, true);
+    CHECK_EQ(count, (100 + per_message - 1) / per_message);
+    CHECK_EQ(batch.messages[0].msg_hdr.msg_iovlen, per_message * 2);
+    CHECK_EQ(batch.message_packets[1], per_message);
+
+    Reset(batch);
+    AddPackets(batch, 100, 100);
+    count = Build(batch, true);
+    CHECK_EQ(count, 2);
+    CHECK_EQ(batch.message_packets[1], UDP_MAX_SEGMENTS);
+}
+
+// Resend from the first packet the kernel did not take, without GSO
+static void TestFallback() {
+    static PacketBatch<TEST_CAPACITY> batch;
+    sz_t count;
+
+    Reset(batch);
+    AddPackets(batch, 4, 1000);
+    batch.packet_vectors[batch.packet_count] = batch.vector_count;
+    count = BuildMessages(batch, 2, false);
+    CHECK_EQ(count, 2);
+    CHECK_EQ(batch.message_packets[0], 2);
+    CHECK(batch.messages[0].msg_hdr.msg_iov == &batch.vectors[4]);
+}
+
+int main() {
+    TestRun();
+    TestRunEnds();
+    TestReport();
+    TestLimits();
+    TestFallback();
+    return TestResult("PacketBatchTest");
+}
@@ -0,0 +1,98 @@
+#include "utils/Packetizer.h"
+
+// Packets/sec of the H265 packetizer on a synthetic 1080p GOP
+// (one 120 KB IDR, 29 P-frames of 12 KB, 1400 bytes packets).
+// NALs are found once, only packetizing is timed.
+// Not a test, run it by hand: ./PacketizerBench [seconds]
+
+#define GOP_FRAMES 30
+#define IDR_SIZE (120 * 1024)
+#define P_SIZE (12 * 1024)
+#define BENCH_PACKET_SIZE 1400
+
+static byte_t frames[GOP_FRAMES][IDR_SIZE];
+static sz_t frame_sizes[GOP_FRAMES];
+static NalUnit frame_nals[GOP_FRAMES][16];
+static sz_t nal_counts[GOP_FRAMES];
+
+// Start code + NAL header, the rest never contains 00 00
+static void MakeFrame(byte_t *dst, sz_t size, bool_t idr) {
+    sz_t i;
+
+    dst[0] = 0x00;
+    dst[1] = 0x00;
+    dst[2] = 0x00;
+    dst[3] = 0x01;
+    dst[4] = idr ? 0x26 : 0x02;
+    dst[5] = 0x01;
+    for (i = 6; i < size; ++i) {
+        dst[i] = (byte_t)(1 + (i * 131) % 255);
+    }
+}
+
+// Return the number of packets
+static sz_t PacketizeGop(const RtpHeader& header, bool_t copy, ushort_t& seq) {
+    static byte_t dst[RTP_MAX_HEADER_SIZE + BENCH_PACKET_SIZE];
+    const NalUnit *nals;
+    const byte_t *payload;
+    sz_t payload_size;
+    sz_t packets = 0;
+    sz_t offset;
+    sz_t f;
+    sz_t i;
+    int_t read;
+
+    for (f = 0; f < GOP_FRAMES; ++f) {
+        nals = frame_nals[f];
+        for (i = 0; i < nal_counts[f]; ++i) {
+            offset = nals[i].start;
+            while (offset < nals[i].end) {
+                if (copy) {
+                    read = PacketizeH265(header, seq, f * 3000, frames[f], frame_sizes[f], offset,
+                                         nals[i], dst, sizeof(dst));
+                } else {
+                    read = PacketizeH265Header(header, seq, f * 3000, frames[f], frame_sizes[f], offset,
+                                               nals[i], BENCH_PACKET_SIZE, dst, payload, payload_size);
+                }
+                if (read < 0) {
+                    return packets;
+                }
+                seq++;
+                packets++;
+            }
+        }
+    }
+    return packets;
+}
+
+static void Run(const char *name, bool_t copy, tm_t duration_us) {
+    RtpHeader header;
+    ushort_t seq = 0;
+    sz_t packets = 0;
+    tm_t start;
+    tm_t elapsed;
+
+    Init(header, 0, 96, 0x11223344);
+    start = NowMicros();
+    do {
+        packets += PacketizeGop(header, copy, seq);
+        elapsed = NowMicros() - start;
+    } while (elapsed < duration_us);
+
+    printf("%-12s %8.2f Mpackets/s\n", name, (double)packets / (double)elapsed);
+}
+
+int main(int argc, char **argv) {
+    tm_t duration_us = (argc > 1 ? atoi(argv[1]) : 2) * 1000000;
+    sz_t f;
+
+    for (f = 0; f < GOP_FRAMES; ++f) {
+        frame_sizes[f] = f == 0 ? IDR_SIZE : P_SIZE;
+        MakeFrame(frames[f], frame_sizes[f], f == 0);
+        nal_counts[f] = ExtractNal(frames[f], 0, frame_sizes[f], frame_nals[f], 16);
+    }
+
+    Run("header-only", false, duration_us);
+    Run("copy", true, duration_us);
+    return 0;
+}
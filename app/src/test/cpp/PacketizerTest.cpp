@@ -0,0 +1,117 @@
+#include "utils/Packetizer.h"
+#include "Test.h"
+
+#define TEST_SSRC 0x11223344
+
+// VPS, SPS, PPS, then an IDR slice
+static const byte_t frame[] = {
+    0x00, 0x00, 0x00, 0x01, 0x40, 0x01, 0x0C, 0x01, 0xFF,
+    0x00, 0x00, 0x00, 0x01, 0x42, 0x01, 0x01, 0x01, 0x60, 0x00,
+    0x00, 0x00, 0x00, 0x01, 0x44, 0x01, 0xC1, 0x72,
+    0x00, 0x00, 0x01, 0x26, 0x01, 0xAF, 0x06, 0xB8, 0x63, 0xEF, 0x3A
+};
+
+static bool_t Marker(const byte_t *packet) {
+    return (packet[5] & 0x80) != 0;
+}
+
+static uint_t ReadU32(const byte_t *src) {
+    return ((uint_t)src[0] << 24) | ((uint_t)src[1] << 16) | ((uint_t)src[2] << 8) | src[3];
+}
+
+// Constant fields come from the template, the rest is patched per packet
+static void TestRtpHeader() {
+    RtpHeader header;
+    NalUnit nals[8];
+    byte_t dst[RTP_MAX_HEADER_SIZE];
+    const byte_t *payload;
+    sz_t payload_size;
+    sz_t offset;
+    int_t read;
+
+    Init(header, 2, 96, TEST_SSRC);
+    ExtractNal(frame, 0, sizeof(frame), nals, 8);
+
+    // Single NAL packet: the NAL header is the payload header
+    offset = nals[0].start;
+    read = PacketizeH265Header(header, 0xABCD, 0x01020304, frame, sizeof(frame), offset, nals[0],
+                               1400, dst, payload, payload_size);
+    CHECK_EQ(read, RtpPayloadStart());
+    CHECK_EQ(dst[0], '$');
+    CHECK_EQ(dst[1], 2);
+    CHECK_EQ((dst[2] << 8) | dst[3], 12 + 5);
+    CHECK_EQ(dst[4], 0x80);
+    CHECK_EQ(dst[5], 0x80 | 96);
+    CHECK_EQ((dst[6] << 8) | dst[7], 0xABCD);
+    CHECK_EQ(ReadU32(dst + 8), 0x01020304);
+    CHECK_EQ(ReadU32(dst + 12), TEST_SSRC);
+    CHECK(payload == frame + 4);
+    CHECK_EQ(payload_size, 5);
+    CHECK_EQ(offset, nals[0].end);
+
+    // Fragmented: FU start without marker, the template is left untouched
+    offset = nals[3].start;
+    read = PacketizeH265Header(header, 1, 2, frame, sizeof(frame), offset, nals[3],
+                               12 + 3 + 4, dst, payload, payload_size);
+    CHECK_EQ(read, RtpPayloadStart() + 3);
+    CHECK_EQ(dst[5], 96);
+    CHECK_EQ((dst[16] >> 1) & 0x3F, 49);
+    CHECK_EQ(dst[18], 0x80 | 19);
+    CHECK_EQ(payload_size, 4);
+    CHECK_EQ(header.bytes[5], 96);
+    CHECK_EQ(header.bytes[6], 0);
+
+    // Last fragment ends the NAL
+    read = PacketizeH265Header(header, 2, 2, frame, sizeof(frame), offset, nals[3],
+                               1400, dst, payload, payload_size);
+    CHECK_EQ(dst[5], 0x80 | 96);
+    CHECK_EQ(dst[18], 0x40 | 19);
+    CHECK_EQ(offset, nals[3].end);
+
+    // Another client: its channel, seq, timestamp and SSRC, marker kept
+    PatchRtpHeader(dst, 4, 0x1234, 0xA0B0C0D0, 0x55667788);
+    CHECK_EQ(dst[1], 4);
+    CHECK_EQ(dst[5], 0x80 | 96);
+    CHECK_EQ((dst[6] << 8) | dst[7], 0x1234);
+    CHECK_EQ(ReadU32(dst + 8), 0xA0B0C0D0);
+    CHECK_EQ(ReadU32(dst + 12), 0x55667788);
+}
+
+// The AP carries the marker only when nothing follows it in the frame
+static void TestAggregationMarker() {
+    RtpHeader header;
+    NalUnit nals[8];
+    byte_t dst[RTP_AP_HEADER_SIZE];
+    sz_t count;
+    sz_t aggregated;
+    int_t read;
+
+    Init(header, 0, 96, TEST_SSRC);
+    count = ExtractNal(frame, 0, sizeof(frame), nals, 8);
+    CHECK_EQ(count, 4);
+
+    // Parameter sets only: the slice does not fit
+    aggregated = CountH265Aggregation(nals, count, RTP_AP_HEADER_SIZE + 20);
+    CHECK_EQ(aggregated, 3);
+
+    read = PacketizeH265AggregationHeader(header, 7, 9000, frame, nals, aggregated,
+                                          aggregated == count, dst);
+    CHECK_EQ(read, RTP_AP_HEADER_SIZE);
+    CHECK(!Marker(dst));
+    CHECK_EQ((dst[16] >> 1) & 0x3F, 48);
+
+    // The whole frame in one AP ends the access unit
+    aggregated = CountH265Aggregation(nals, count, 1400);
+    CHECK_EQ(aggregated, 4);
+
+    read = PacketizeH265AggregationHeader(header, 7, 9000, frame, nals, aggregated,
+                                          aggregated == count, dst);
+    CHECK_EQ(read, RTP_AP_HEADER_SIZE);
+    CHECK(Marker(dst));
+}
+
+int main() {
+    TestRtpHeader();
+    TestAggregationMarker();
+    return TestResult("PacketizerTest");
+}
@@ -0,0 +1,279 @@
+#include "server/S_RateControl.h"
+#include "server/S_SendQueue.h"
+#include "Test.h"
+
+// A keyframe worth this much of the video rate, sent at once
+#define TEST_KEYFRAME_MS 200
+
+// Throttled loopback path: the sender sends the encoder rate every tick,
+// the reader takes TEST_SLOW_RATE, samples come every TEST_SAMPLE_TICKS
+#define TEST_TICK_US 10000
+#define TEST_TICKS_PER_S (1000000 / TEST_TICK_US)
+#define TEST_SAMPLE_TICKS 10
+#define TEST_SLOW_RATE 800000
+#define TEST_RCVBUF 8192
+#define TEST_SNDBUF 16384
+
+void E_SetBitRate(E_H265 &encoder, int_t bit_rate) {
+    encoder.bit_rate = bit_rate;
+    encoder.set_calls++;
+}
+
+int_t E_GetBitRate(E_H265 &encoder) {
+    return encoder.bit_rate;
+}
+
+typedef struct {
+    E_H265 encoder;
+    S_RateControl control;
+    CancellableSocket socket;
+    S_SendQueue queue;
+} TestSession;
+
+static void Open(TestSession& session) {
+    session.encoder.bit_rate = RATE_MAX_BIT_RATE;
+    session.encoder.set_calls = 0;
+    S_Init(session.control, &session.encoder);
+
+    session.socket.socket = -1;
+    Init(&session.socket.send_lock);
+    S_Init(session.queue, &session.socket);
+}
+
+static sz_t KeyframeBytes(const TestSession& session) {
+    return (sz_t)session.encoder.bit_rate / 8 * TEST_KEYFRAME_MS / 1000;
+}
+
+// One rate control interval of a single client, as the server runs it
+static int_t Update(TestSession& session, int_t depth_ms) {
+    S_RateSample sample = {};
+    int_t bit_rate;
+
+    sample.delivery_rate = -1;
+    sample.rtt_growth_ms = -1;
+    sample.loss_percent = -1;
+    sample.queue_ms = S_BacklogMs(session.queue, depth_ms);
+
+    bit_rate = S_Update(session.control, &sample, 1);
+    S_SetBitRate(session.queue, bit_rate + AUDIO_BIT_RATE);
+    return bit_rate;
+}
+
+// Every sample lands right after an IDR: the queue is the keyframe only,
+// the rate must not ratchet down
+static void TestKeyframeIsNotCongestion() {
+    static TestSession session;
+    sz_t key;
+    int_t i;
+
+    Open(session);
+    key = KeyframeBytes(session);
+    CHECK(S_BytesToMs(session.queue, key) > RATE_CONGESTED_MS);
+
+    for (i = 0; i < 20; ++i) {
+        S_AddBurst(session.queue, key);
+        CHECK_EQ(Update(session, S_BytesToMs(session.queue, key)), RATE_MAX_BIT_RATE);
+    }
+    CHECK_EQ(session.encoder.bit_rate, RATE_MAX_BIT_RATE);
+    CHECK_EQ(session.encoder.set_calls, 0);
+}
+
+// A keyframe sent in batches adds up
+static void TestBurstAddsUp() {
+    static TestSession session;
+    sz_t key;
+
+    Open(session);
+    key = KeyframeBytes(session);
+    S_AddBurst(session.queue, key / 2);
+    S_AddBurst(session.queue, key - key / 2);
+    CHECK(S_BacklogMs(session.queue, S_BytesToMs(session.queue, key)) <= 1);
+}
+
+// What the keyframe doesn't explain still cuts, once per interval
+static void TestBacklogPastKeyframe() {
+    static TestSession session;
+    sz_t key;
+    int_t expected = (int_t)((long_t)RATE_MAX_BIT_RATE * RATE_DECREASE / 100);
+
+    Open(session);
+    key = KeyframeBytes(session);
+    S_AddBurst(session.queue, key);
+    CHECK_EQ(Update(session, S_BytesToMs(session.queue, key) + 2 * RATE_CONGESTED_MS), expected);
+    CHECK_EQ(session.encoder.bit_rate, expected);
+    CHECK_EQ(session.encoder.set_calls, 1);
+}
+
+// Once the path had time to send the keyframe, its bytes are congestion
+static void TestBurstDrains() {
+    static TestSession session;
+    sz_t key;
+    int_t depth_ms;
+
+    Open(session);
+    key = KeyframeBytes(session);
+    depth_ms = S_BytesToMs(session.queue, key);
+    S_AddBurst(session.queue, key);
+    usleep((TEST_KEYFRAME_MS + 100) * 1000);
+    CHECK_EQ(S_BacklogMs(session.queue, depth_ms), depth_ms);
+}
+
+typedef struct {
+    int_t fd;
+    a_int_t rate;  // Bytes per tick, 0: as fast as it comes
+    a_int_t stop;
+} TestReader;
+
+static void* Read(void* arg) {
+    static byte_t buffer[256 * 1024];
+    TestReader& reader = *static_cast<TestReader *>(arg);
+    ssz_t received;
+    int_t rate;
+
+    while (Load(&reader.stop) == 0) {
+        rate = Load(&reader.rate);
+        received = recv(reader.fd, buffer, rate > 0 ? (sz_t)rate : sizeof(buffer), MSG_DONTWAIT);
+        if (rate > 0 || received <= 0) {
+            usleep(rate > 0 ? TEST_TICK_US : 1000);
+        }
+    }
+    return nullptr;
+}
+
+// Small buffers on both ends, so the backlog shows in seconds, not minutes
+static int_t Connect(int_t &peer) {
+    sockaddr_in addr {};
+    socklen_t len = sizeof(addr);
+    int_t listener = socket(AF_INET, SOCK_STREAM, 0);
+    int_t fd = socket(AF_INET, SOCK_STREAM, 0);
+    int_t rcvbuf = TEST_RCVBUF;
+    int_t sndbuf = TEST_SNDBUF;
+
+    setsockopt(listener, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+    setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    bind(listener, reinterpret_cast<sockaddr *>(&addr), sizeof(addr));
+    listen(listener, 1);
+    getsockname(listener, reinterpret_cast<sockaddr *>(&addr), &len);
+    connect(fd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr));
+    peer = accept(listener, nullptr, nullptr);
+    close(listener);
+    return fd;
+}
+
+// One tick of media at the encoder rate, skipped when over budget
+// like the video stream does, and the drain the reactor would do
+static void SendTick(TestSession& session) {
+    static byte_t media[(RATE_MAX_BIT_RATE + AUDIO_BIT_RATE) / 8 / TEST_TICKS_PER_S];
+    sz_t size = (sz_t)(session.encoder.bit_rate + AUDIO_BIT_RATE) / 8 / TEST_TICKS_PER_S;
+    s_iovec_t vec;
+    sz_t calls = 0;
+
+    S_Drain(session.queue);
+    if (S_CheckBudget(session.queue, session.socket.socket) == 0) {
+        SetVector(vec, media, size);
+        Lock(&session.socket.send_lock);
+        S_SendMedia(session.queue, &vec, 1, 0, calls);
+        Unlock(&session.socket.send_lock);
+    }
+}
+
+// Samples of the real socket, as the server takes them.
+// Return the lowest bit rate, delivered: a sample had a delivery rate.
+static int_t RunPath(TestSession& session, sz_t samples, bool_t& delivered) {
+    S_RateSample sample;
+    int_t lowest = session.encoder.bit_rate;
+    sz_t i;
+    sz_t tick;
+
+    for (i = 0; i < samples; ++i) {
+        for (tick = 0; tick < TEST_SAMPLE_TICKS; ++tick) {
+            SendTick(session);
+            usleep(TEST_TICK_US);
+        }
+        S_SampleSocket(session.queue, session.socket.socket, true, sample);
+        delivered = delivered || sample.delivery_rate > 0;
+        S_SetBitRate(session.queue, S_Update(session.control, &sample, 1) + AUDIO_BIT_RATE);
+        if (session.encoder.bit_rate < lowest) {
+            lowest = session.encoder.bit_rate;
+        }
+    }
+    return lowest;
+}
+
+// A reader slower than the encoder: the rate goes down to about what
+// it takes, then back up once the reader keeps up again
+static void TestThrottledPath() {
+    static TestSession session;
+    TestReader reader;
+    pthread_t thread;
+    bool_t delivered = false;
+    int_t lowest;
+
+    Open(session);
+    session.socket.socket = Connect(reader.fd);
+    Store(&reader.rate, TEST_SLOW_RATE / 8 / TEST_TICKS_PER_S);
+    Store(&reader.stop, 0);
+    pthread_create(&thread, nullptr, Read, &reader);
+
+    lowest = RunPath(session, 30, delivered);
+    CHECK(delivered);
+    CHECK(lowest < TEST_SLOW_RATE);
+    CHECK(session.encoder.set_calls > 0);
+
+    Store(&reader.rate, 0);
+    RunPath(session, 4 * RATE_INCREASE_SAMPLES, delivered);
+    CHECK(session.encoder.bit_rate > lowest);
+
+    Store(&reader.stop, 1);
+    pthread_join(thread, nullptr);
+    close(session.socket.socket);
+    close(reader.fd);
+}
+
+// Down to what the path delivered, up only after enough clear samples
+static void TestDecreaseAndIncrease() {
+    static TestSession session;
+    S_RateSample sample = {};
+    int_t bit_rate;
+    int_t i;
+
+    Open(session);
+    sample.queue_ms = RATE_CONGESTED_MS + 1;
+    sample.delivery_rate = RATE_MIN_BIT_RATE * 2;
+    sample.rtt_growth_ms = -1;
+    sample.loss_percent = -1;
+    bit_rate = S_Update(session.control, &sample, 1);
+    CHECK_EQ(bit_rate, RATE_MIN_BIT_RATE * 2 - AUDIO_BIT_RATE);
+
+    // Between the thresholds: hold
+    sample.queue_ms = RATE_CLEAR_MS + 1;
+    sample.delivery_rate = -1;
+    for (i = 0; i < RATE_INCREASE_SAMPLES * 2; ++i) {
+        CHECK_EQ(S_Update(session.control, &sample, 1), bit_rate);
+    }
+
+    sample.queue_ms = 0;
+    for (i = 0; i < RATE_INCREASE_SAMPLES - 1; ++i) {
+        CHECK_EQ(S_Update(session.control, &sample, 1), bit_rate);
+    }
+    CHECK_EQ(S_Update(session.control, &sample, 1), bit_rate + bit_rate * RATE_INCREASE / 100);
+    CHECK_EQ(session.encoder.set_calls, 2);
+
+    // Never under the floor
+    sample.queue_ms = RATE_CONGESTED_MS + 1;
+    sample.delivery_rate = 1;
+    CHECK_EQ(S_Update(session.control, &sample, 1), RATE_MIN_BIT_RATE);
+    CHECK_EQ(session.encoder.bit_rate, RATE_MIN_BIT_RATE);
+}
+
+int main() {
+    TestKeyframeIsNotCongestion();
+    TestBurstAddsUp();
+    TestBacklogPastKeyframe();
+    TestBurstDrains();
+    TestDecreaseAndIncrease();
+    TestThrottledPath();
+    return TestResult("RateControlTest");
+}
@@ -0,0 +1,180 @@
+#include "server/S_Platform.h"
+#include "Test.h"
+
+// The reactor helpers of S_Platform.h, used like S_RtspServer does:
+// one thread, edge-triggered, a listen socket, many idle clients,
+// an event fd to stop and a timer fd.
+
+#define TEST_CLIENTS 500
+#define TEST_IDLE_MS 1000
+#define TEST_TIMER_MS 100
+#define TEST_MAX_EVENTS 64
+
+#define TOKEN_LISTEN 1000000
+#define TOKEN_STOP 1000001
+#define TOKEN_TIMER 1000002
+
+typedef struct {
+    CancellableSocket server_socket;
+    int_t poll_fd;
+    int_t event_fd;
+    int_t timer_fd;
+    int_t clients[TEST_CLIENTS];
+    a_int_t accepted;
+    a_int_t wakeups;
+    a_int_t timer_events;
+    a_int_t client_events;
+    a_int_t bytes;
+    tm_t cpu_us;
+} TestReactor;
+
+static tm_t ThreadCpuMicros() {
+    struct timespec ts {};
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void AcceptAll(TestReactor& reactor) {
+    CancellableSocket client;
+    int_t idx;
+
+    while (Accept(client, reactor.server_socket) == 0) {
+        idx = Load(&reactor.accepted);
+        fcntl(client.socket, F_SETFL, fcntl(client.socket, F_GETFL, 0) | O_NONBLOCK);
+        reactor.clients[idx] = client.socket;
+        AddPoll(reactor.poll_fd, client.socket, (s_token_t)idx);
+        Store(&reactor.accepted, idx + 1);
+    }
+}
+
+// Edge-triggered: read until EAGAIN
+static void ReadClient(TestReactor& reactor, int_t idx) {
+    byte_t buf[256];
+    ssz_t read;
+
+    Add(&reactor.client_events, 1);
+    while ((read = recv(reactor.clients[idx], buf, sizeof(buf), 0)) > 0) {
+        Add(&reactor.bytes, (int_t)read);
+    }
+}
+
+static void *Run(void *arg) {
+    TestReactor& reactor = *(TestReactor *)arg;
+    s_event_t events[TEST_MAX_EVENTS];
+    int_t count;
+    int_t i;
+    tm_t start = ThreadCpuMicros();
+
+    while (true) {
+        count = WaitPoll(reactor.poll_fd, events, TEST_MAX_EVENTS);
+        Add(&reactor.wakeups, 1);
+        for (i = 0; i < count; ++i) {
+            switch (Token(events[i])) {
+                case TOKEN_STOP:
+                    ReadEvent(reactor.event_fd);
+                    reactor.cpu_us = ThreadCpuMicros() - start;
+                    return nullptr;
+                case TOKEN_LISTEN:
+                    AcceptAll(reactor);
+                    break;
+                case TOKEN_TIMER:
+                    ReadTimer(reactor.timer_fd);
+                    Add(&reactor.timer_events, 1);
+                    break;
+                default:
+                    ReadClient(reactor, (int_t)Token(events[i]));
+                    break;
+            }
+        }
+    }
+}
+
+static int_t Connect(int_t port) {
+    s_addr_t address {};
+    int_t fd = socket(AF_INET, SOCK_STREAM, 0);
+
+    address.sin_family = AF_INET;
+    address.sin_port = htons(port);
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (connect(fd, (sockaddr *)&address, sizeof(address)) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// Many idle clients cost nothing: the reactor only wakes for the timer
+static void TestIdleClients() {
+    static TestReactor reactor;
+    static int_t fds[TEST_CLIENTS];
+    thread_t thread;
+    s_addr_t address {};
+    s_addrlen_t addrlen = sizeof(address);
+    int_t port;
+    int_t wakeups;
+    int_t timer_events;
+    sz_t i;
+
+    reactor.server_socket.addrlen = sizeof(reactor.server_socket.address);
+    CHECK(InitServer(reactor.server_socket, 0, TEST_CLIENTS) >= 0);
+    getsockname(reactor.server_socket.socket, (sockaddr *)&address, &addrlen);
+    port = ntohs(address.sin_port);
+
+    reactor.poll_fd = InitPoll();
+    reactor.event_fd = InitEvent();
+    reactor.timer_fd = InitTimer(TEST_TIMER_MS);
+    CHECK(reactor.poll_fd >= 0 && reactor.event_fd >= 0 && reactor.timer_fd >= 0);
+    AddPoll(reactor.poll_fd, reactor.server_socket.socket, TOKEN_LISTEN);
+    AddPoll(reactor.poll_fd, reactor.event_fd, TOKEN_STOP);
+    AddPoll(reactor.poll_fd, reactor.timer_fd, TOKEN_TIMER);
+
+    Init(&thread);
+    Start(&thread, Run, &reactor);
+
+    for (i = 0; i < TEST_CLIENTS; ++i) {
+        fds[i] = Connect(port);
+        CHECK(fds[i] >= 0);
+    }
+    while (Load(&reactor.accepted) < TEST_CLIENTS) {
+        usleep(1000);
+    }
+
+    // Idle
+    wakeups = Load(&reactor.wakeups);
+    timer_events = Load(&reactor.timer_events);
+    usleep(TEST_IDLE_MS * 1000);
+    wakeups = Load(&reactor.wakeups) - wakeups;
+    timer_events = Load(&reactor.timer_events) - timer_events;
+    CHECK(timer_events >= TEST_IDLE_MS / TEST_TIMER_MS - 2);
+    CHECK(wakeups <= timer_events + 1);
+    CHECK_EQ(Load(&reactor.client_events), 0);
+
+    // One event per burst, however many bytes
+    for (i = 0; i < 10; ++i) {
+        CHECK_EQ(send(fds[7], "OPTIONS ", 8, 0), 8);
+    }
+    usleep(50000);
+    CHECK(Load(&reactor.client_events) >= 1 && Load(&reactor.client_events) <= 10);
+    CHECK_EQ(Load(&reactor.bytes), 80);
+
+    Notify(reactor.event_fd);
+    Join(&thread);
+
+    printf("%d idle clients, %d ms: %d wakeups (%d timer), reactor CPU %.1f ms in total\n",
+           TEST_CLIENTS, TEST_IDLE_MS, wakeups, timer_events, (double_t)reactor.cpu_us / 1000);
+    CHECK(reactor.cpu_us < 200000);
+
+    for (i = 0; i < TEST_CLIENTS; ++i) {
+        close(fds[i]);
+        close(reactor.clients[i]);
+    }
+    close(reactor.timer_fd);
+    close(reactor.event_fd);
+    close(reactor.poll_fd);
+    Destroy(reactor.server_socket);
+}
+
+int main() {
+    TestIdleClients();
+    return TestResult("ReactorTest");
+}
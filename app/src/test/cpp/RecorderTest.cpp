@@ -0,0 +1,361 @@
+#include <utime.h>
+
+#include "server/S_Recorder.h"
+#include "Mp4Test.h"
+#include "Test.h"
+
+// Recording to RECORD_DIR in the build tree, a ring of RECORD_FILE_COUNT (3)
+// files of RECORD_SEGMENT_S (2 s), see CMakeLists.txt. 30 fps with an IDR
+// every second; each frame carries its index, so a file tells where it starts.
+
+#define TEST_GOP_FRAMES 30
+#define TEST_FRAME_SIZE 200
+#define TEST_LARGE_FRAME_SIZE 20000 // 30 of them pass 3/4 of RECORD_FILE_SIZE
+#define TEST_AUDIO_SIZE 32
+#define TEST_VIDEO_POOL 192         // > pre-roll + ring
+#define TEST_AUDIO_POOL 256
+#define TEST_MAX_FILE_SIZE (2 * 1024 * 1024)
+#define TEST_MAX_WRITES 256
+
+// What a file on disk holds
+typedef struct {
+    bool_t valid;       // ftyp, moov, then moof / mdat / free boxes to the end
+    int_t first_frame;  // Index of the first sample, an IDR
+    sz_t fragments;
+    sz_t video_samples;
+    sz_t free_boxes;    // Padding of early batches
+} TestFile;
+
+typedef struct {
+    const void *data;
+    sz_t size;
+    sz_t offset;
+} TestWrite;
+
+static E_H265 video_encoder;
+static E_AAC audio_encoder;
+static S_Recorder recorder;
+static FramePool<TEST_VIDEO_POOL, H265_CONFIG_SIZE + TEST_LARGE_FRAME_SIZE> video_pool;
+static FramePool<TEST_AUDIO_POOL, TEST_AUDIO_SIZE> audio_pool;
+static byte_t file_data[TEST_MAX_FILE_SIZE];
+static TestWrite writes[TEST_MAX_WRITES];
+static sz_t write_count = 0;
+static sz_t video_frames = 0;
+static sz_t audio_frames = 0;
+
+extern "C" ssize_t __real_pwrite(int fd, const void *buf, size_t count, off_t offset);
+
+// Linked with --wrap=pwrite: every write of the writer thread,
+// read once S_Stop() joined it
+extern "C" ssize_t __wrap_pwrite(int fd, const void *buf, size_t count, off_t offset) {
+    if (write_count < TEST_MAX_WRITES) {
+        writes[write_count++] = {buf, count, (sz_t)offset};
+    }
+    return __real_pwrite(fd, buf, count, offset);
+}
+
+static tm_t VideoTime(sz_t index) {
+    return (tm_t)index * 1000000 / VIDEO_DEFAULT_FRAME_RATE;
+}
+
+static tm_t AudioTime(sz_t index) {
+    return (tm_t)index * MP4_AAC_FRAME_SAMPLES * 1000000 / AUDIO_SAMPLE_RATE;
+}
+
+// The index in 2 bytes after the NAL header, no zero byte in the frame
+static void WriteIndex(byte_t *dst, sz_t index) {
+    dst[0] = (byte_t)(0x80 | (index >> 7));
+    dst[1] = (byte_t)(0x80 | (index & 0x7F));
+}
+
+static int_t ReadIndex(const byte_t *src) {
+    return ((src[0] & 0x7F) << 7) | (src[1] & 0x7F);
+}
+
+// AUs up to each frame, then the frame: parameter sets + IDR every
+// TEST_GOP_FRAMES, else one TRAIL_R. Returns once the muxer took them.
+static void FeedFrames(sz_t count, sz_t size) {
+    static byte_t au[H265_CONFIG_SIZE + TEST_LARGE_FRAME_SIZE];
+    byte_t aac[TEST_AUDIO_SIZE];
+    SharedFrame* frame;
+    bool_t keyframe;
+    sz_t length;
+
+    for (sz_t i = 0; i < count; ++i) {
+        while (AudioTime(audio_frames) <= VideoTime(video_frames)) {
+            Reset(aac, sizeof(aac));
+            frame = Acquire(audio_pool, sizeof(aac));
+            CHECK(frame != nullptr);
+            if (!frame) {
+                return;
+            }
+            Fill(frame, aac, sizeof(aac), AudioTime(audio_frames), 0);
+            audio_encoder.callback(audio_encoder.context, frame);
+            Release(frame);
+            audio_frames++;
+        }
+
+        keyframe = video_frames % TEST_GOP_FRAMES == 0;
+        length = 0;
+        if (keyframe) {
+            Copy(au, kTestConfig, sizeof(kTestConfig));
+            length = sizeof(kTestConfig);
+        }
+        au[length++] = 0x00;
+        au[length++] = 0x00;
+        au[length++] = 0x01;
+        au[length++] = keyframe ? 0x26 : 0x02;
+        au[length++] = 0x01;
+        WriteIndex(au + length, video_frames);
+        length += 2;
+        memset(au + length, 0x55, size - 7);
+        length += size - 7;
+
+        frame = Acquire(video_pool, length);
+        CHECK(frame != nullptr);
+        if (!frame) {
+            return;
+        }
+        Fill(frame, au, length, VideoTime(video_frames), keyframe ? E_INFO_FLAG_KEY_FRAME : 0);
+        video_encoder.callback(video_encoder.context, frame);
+        Release(frame);
+        video_frames++;
+
+        while (!Empty(recorder.video_ring)) {
+            usleep(1000);
+        }
+    }
+}
+
+static void RecordPath(int_t slot, char_t *path) {
+    WriteStream(path, RECORD_PATH_SIZE, "%s/record_%02d.mp4", RECORD_DIR, slot);
+}
+
+static void RemoveRecords() {
+    char_t path[RECORD_PATH_SIZE];
+
+    for (int_t slot = 0; slot < RECORD_FILE_COUNT; ++slot) {
+        RecordPath(slot, path);
+        unlink(path);
+    }
+}
+
+// Return false if the slot has no file
+static bool_t ReadRecord(int_t slot, TestFile& file) {
+    char_t path[RECORD_PATH_SIZE];
+    char_t types[2][5];
+    TestBox trun;
+    sz_t offset;
+    sz_t box_size;
+    sz_t index;
+    ssz_t size;
+    int_t fd;
+
+    Reset(&file, sizeof(file));
+    file.first_frame = -1;
+    RecordPath(slot, path);
+    fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+    size = read(fd, file_data, sizeof(file_data));
+    close(fd);
+
+    // Cut to what was written: the boxes end with the file
+    file.valid = size > 0 &&
+                 ListBoxes(file_data, size, types, 2) > 2 &&
+                 strcmp(types[0], "ftyp") == 0 &&
+                 strcmp(types[1], "moov") == 0;
+    if (!file.valid) {
+        return true;
+    }
+
+    for (offset = 0, index = 0; offset < (sz_t)size; offset += box_size, ++index) {
+        const byte_t *box = file_data + offset;
+        box_size = ReadBox32(box);
+
+        if (memcmp(box + 4, "moof", 4) == 0) {
+            CHECK(FindPath(box + 8, box_size - 8, "traf/trun", trun));
+            file.video_samples += ReadBox32(trun.data + 4);
+
+            // Files start on an IDR: first sample flags, then its NAL
+            if (file.fragments++ == 0) {
+                const byte_t *nal = box + ReadBox32(trun.data + 8) + MP4_NAL_LENGTH_SIZE;
+                CHECK_EQ(ReadBox32(trun.data + 20), 0x02000000);
+                CHECK_EQ(nal[0], 0x26);
+                file.first_frame = ReadIndex(nal + 2);
+            }
+        } else if (memcmp(box + 4, "free", 4) == 0) {
+            // The next batch is written from an aligned offset
+            CHECK_EQ((offset + box_size) % RECORD_ALIGN, 0);
+            file.free_boxes++;
+        } else if (index >= 2) {
+            CHECK(memcmp(box + 4, "mdat", 4) == 0);
+        }
+    }
+    return true;
+}
+
+static void CheckRecord(int_t slot, int_t first_frame, sz_t video_samples) {
+    TestFile file;
+
+    CHECK(ReadRecord(slot, file));
+    CHECK(file.valid);
+    CHECK_EQ(file.first_frame, first_frame);
+    CHECK_EQ(file.video_samples, video_samples);
+}
+
+static void Start(bool_t recording) {
+    video_frames = 0;
+    audio_frames = 0;
+    write_count = 0;
+    S_Start(recorder, true);
+    if (recording) {
+        S_SetRecording(recorder, true);
+    }
+}
+
+// A file ends at the first IDR RECORD_SEGMENT_S after its start,
+// fragments end at each IDR
+static void TestRotation() {
+    TestFile file;
+
+    RemoveRecords();
+    Start(true);
+    FeedFrames(5 * TEST_GOP_FRAMES, TEST_FRAME_SIZE);
+    S_Stop(recorder);
+
+    CheckRecord(0, 0, 2 * TEST_GOP_FRAMES);
+    CheckRecord(1, 2 * TEST_GOP_FRAMES, 2 * TEST_GOP_FRAMES);
+    CheckRecord(2, 4 * TEST_GOP_FRAMES, TEST_GOP_FRAMES);
+    CHECK(ReadRecord(0, file));
+    CHECK_EQ(file.fragments, 2);
+}
+
+// Not recording: nothing is written, the file starts with the last IDR
+// at least RECORD_PREROLL_MS before the trigger
+static void TestPreroll() {
+    TestFile file;
+    sz_t samples = 0;
+
+    RemoveRecords();
+    Start(false);
+    CHECK(!Load(&recorder.recording));
+
+    // Trigger at 10.5 s: the pre-roll starts at the IDR at 7 s
+    FeedFrames(10 * TEST_GOP_FRAMES + TEST_GOP_FRAMES / 2, TEST_FRAME_SIZE);
+    CHECK(!ReadRecord(0, file));
+    S_SetRecording(recorder, true);
+    FeedFrames(TEST_GOP_FRAMES + TEST_GOP_FRAMES / 2, TEST_FRAME_SIZE);
+    S_Stop(recorder);
+
+    CheckRecord(0, 7 * TEST_GOP_FRAMES, 2 * TEST_GOP_FRAMES);
+    for (int_t slot = 0; slot < RECORD_FILE_COUNT; ++slot) {
+        CHECK(ReadRecord(slot, file));
+        samples += file.video_samples;
+    }
+    CHECK_EQ(samples, video_frames - 7 * TEST_GOP_FRAMES);
+}
+
+// Slots go round, a restart goes on at the oldest file
+static void TestRing() {
+    char_t path[RECORD_PATH_SIZE];
+    utimbuf times;
+    time_t now = time(nullptr);
+    time_t ages[RECORD_FILE_COUNT] = {100, 300, 200};
+
+    RemoveRecords();
+    Start(true);
+    FeedFrames(9 * TEST_GOP_FRAMES, TEST_FRAME_SIZE);
+    S_Stop(recorder);
+
+    // Files at 0, 2, 4, 6, 8 s
+    CheckRecord(0, 6 * TEST_GOP_FRAMES, 2 * TEST_GOP_FRAMES);
+    CheckRecord(1, 8 * TEST_GOP_FRAMES, TEST_GOP_FRAMES);
+    CheckRecord(2, 4 * TEST_GOP_FRAMES, 2 * TEST_GOP_FRAMES);
+
+    for (int_t slot = 0; slot < RECORD_FILE_COUNT; ++slot) {
+        RecordPath(slot, path);
+        times.actime = now - ages[slot];
+        times.modtime = now - ages[slot];
+        CHECK_EQ(utime(path, &times), 0);
+    }
+    Start(true);
+    FeedFrames(TEST_GOP_FRAMES, TEST_FRAME_SIZE);
+    S_Stop(recorder);
+
+    CheckRecord(1, 0, TEST_GOP_FRAMES);
+    CheckRecord(0, 6 * TEST_GOP_FRAMES, 2 * TEST_GOP_FRAMES);
+    CheckRecord(2, 4 * TEST_GOP_FRAMES, 2 * TEST_GOP_FRAMES);
+}
+
+// Each pwrite() is a batch from an aligned buffer to an aligned offset.
+// Only the last one of a file may be cut short, one that waited
+// RECORD_SYNC_MS is padded with a free box.
+static void TestAlignedBatches() {
+    S_RecordStats stats;
+    TestFile file;
+    sz_t full = 0;
+    sz_t bytes = 0;
+    sz_t i;
+
+    RemoveRecords();
+    Start(true);
+    FeedFrames(TEST_GOP_FRAMES + TEST_GOP_FRAMES / 2, TEST_LARGE_FRAME_SIZE);
+    usleep((RECORD_SYNC_MS + 200) * 1000);
+    FeedFrames(TEST_GOP_FRAMES + TEST_GOP_FRAMES / 2, TEST_LARGE_FRAME_SIZE);
+    S_Stop(recorder);
+
+    CHECK(write_count > 0);
+    for (i = 0; i < write_count; ++i) {
+        CHECK_EQ(reinterpret_cast<uintptr_t>(writes[i].data) % RECORD_ALIGN, 0);
+        CHECK_EQ(writes[i].offset % RECORD_ALIGN, 0);
+        if (i + 1 < write_count && writes[i + 1].offset != 0) {
+            CHECK_EQ(writes[i].size % RECORD_ALIGN, 0);
+        }
+        full += writes[i].size == RECORD_BATCH_SIZE;
+        bytes += writes[i].size;
+    }
+    CHECK(full > 0);
+
+    CHECK(ReadRecord(0, file));
+    CHECK(file.valid);
+    CHECK(file.free_boxes > 0);
+
+    // Large files end early and ask for an IDR
+    CheckRecord(1, TEST_GOP_FRAMES, TEST_GOP_FRAMES);
+    CHECK(Load(&video_encoder.key_frame_requests) > 0);
+
+    S_GetStats(recorder, stats);
+    CHECK_EQ(stats.written_bytes, bytes);
+    CHECK_EQ(stats.dropped_fragments, 0);
+    CHECK_EQ(stats.errors, 0);
+}
+
+// Every frame goes back to the encoders
+static void TestReleased() {
+    CHECK(video_encoder.callback == nullptr);
+    CHECK(audio_encoder.callback == nullptr);
+    for (sz_t i = 0; i < TEST_VIDEO_POOL; ++i) {
+        CHECK_EQ(Load(&video_pool.frames[i].refs), 0);
+    }
+    for (sz_t i = 0; i < TEST_AUDIO_POOL; ++i) {
+        CHECK_EQ(Load(&audio_pool.frames[i].refs), 0);
+    }
+}
+
+int main() {
+    Init(video_pool);
+    Init(audio_pool);
+    Copy(video_encoder.config, kTestConfig, sizeof(kTestConfig));
+    video_encoder.config_size = sizeof(kTestConfig);
+    video_encoder.params_version = 1;
+    S_Init(recorder, &video_encoder, &audio_encoder);
+
+    TestRotation();
+    TestPreroll();
+    TestRing();
+    TestAlignedBatches();
+    TestReleased();
+    return TestResult("RecorderTest");
+}
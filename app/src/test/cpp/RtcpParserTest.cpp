@@ -0,0 +1,222 @@
+#include "utils/RtcpParser.h"
+#include "Test.h"
+
+#define TEST_SSRC 0x11223344
+#define TEST_OTHER_SSRC 0x55667788
+#define TEST_CLIENT_SSRC 0x0A0B0C0D
+
+static void Write16(byte_t *dst, ushort_t value) {
+    dst[0] = (byte_t)(value >> 8);
+    dst[1] = (byte_t)value;
+}
+
+static void Write32(byte_t *dst, uint_t value) {
+    dst[0] = (byte_t)(value >> 24);
+    dst[1] = (byte_t)(value >> 16);
+    dst[2] = (byte_t)(value >> 8);
+    dst[3] = (byte_t)value;
+}
+
+// Common header, size in bytes, multiple of 4
+static sz_t WriteHeader(byte_t *dst, byte_t count, byte_t type, sz_t size) {
+    dst[0] = (byte_t)(0x80 | count);
+    dst[1] = type;
+    Write16(dst + 2, (ushort_t)(size / 4 - 1));
+    Write32(dst + 4, TEST_CLIENT_SSRC);
+    return 8;
+}
+
+static sz_t WriteBlock(byte_t *dst, uint_t ssrc, byte_t fraction, int_t lost, uint_t jitter) {
+    Reset(dst, 24);
+    Write32(dst, ssrc);
+    dst[4] = fraction;
+    dst[5] = (byte_t)(lost >> 16);
+    dst[6] = (byte_t)(lost >> 8);
+    dst[7] = (byte_t)lost;
+    Write32(dst + 8, 1000);
+    Write32(dst + 12, jitter);
+    return 24;
+}
+
+// RR with a block about another stream, then ours
+static sz_t WriteRr(byte_t *dst, byte_t fraction, int_t lost, uint_t jitter) {
+    sz_t size = WriteHeader(dst, 2, 201, 8 + 2 * 24);
+
+    size += WriteBlock(dst + size, TEST_OTHER_SSRC, 255, 100, 1);
+    size += WriteBlock(dst + size, TEST_SSRC, fraction, lost, jitter);
+    return size;
+}
+
+static sz_t WriteSr(byte_t *dst) {
+    sz_t size = WriteHeader(dst, 0, 200, 28);
+
+    Reset(dst + size, 20);
+    return size + 20;
+}
+
+static sz_t WriteNack(byte_t *dst, uint_t ssrc, ushort_t pid, ushort_t blp) {
+    sz_t size = WriteHeader(dst, 1, 205, 16);
+
+    Write32(dst + size, ssrc);
+    Write16(dst + size + 4, pid);
+    Write16(dst + size + 6, blp);
+    return size + 8;
+}
+
+static sz_t WritePli(byte_t *dst, uint_t ssrc) {
+    sz_t size = WriteHeader(dst, 1, 206, 12);
+
+    Write32(dst + size, ssrc);
+    return size + 4;
+}
+
+// FIR: media SSRC 0, the target in the FCI
+static sz_t WriteFir(byte_t *dst, uint_t ssrc) {
+    sz_t size = WriteHeader(dst, 4, 206, 20);
+
+    Write32(dst + size, 0);
+    Write32(dst + size + 4, ssrc);
+    Write32(dst + size + 8, 0x01000000);
+    return size + 12;
+}
+
+static bool_t Parse(const byte_t *data, sz_t size, RtcpFeedback& feedback) {
+    Reset(feedback);
+    return ParseRtcp(data, size, TEST_SSRC, feedback);
+}
+
+static void TestReport() {
+    byte_t packet[256];
+    RtcpFeedback feedback;
+    sz_t size;
+
+    size = WriteRr(packet, 64, -3, 900);
+    CHECK(Parse(packet, size, feedback));
+    CHECK(feedback.has_report);
+    CHECK_EQ(feedback.fraction_lost, 64);
+    CHECK_EQ(feedback.cumulative_lost, -3);
+    CHECK_EQ(feedback.jitter, 900);
+    CHECK_EQ(feedback.highest_seq, 1000);
+    CHECK(!feedback.key_frame);
+    CHECK_EQ(feedback.nack_count, 0);
+    // No SR sent yet
+    CHECK(RoundTripMs(feedback) < 0);
+
+    // Only about another stream
+    size = WriteHeader(packet, 1, 201, 8 + 24);
+    size += WriteBlock(packet + size, TEST_OTHER_SSRC, 10, 10, 10);
+    CHECK(Parse(packet, size, feedback));
+    CHECK(!feedback.has_report);
+}
+
+static void TestNack() {
+    byte_t packet[64];
+    RtcpFeedback feedback;
+    sz_t size;
+
+    // 100, then 101 and 116 from the bitmask
+    size = WriteNack(packet, TEST_SSRC, 100, 0x8001);
+    CHECK(Parse(packet, size, feedback));
+    CHECK_EQ(feedback.nack_count, 3);
+    CHECK_EQ(feedback.nacks[0], 100);
+    CHECK_EQ(feedback.nacks[1], 101);
+    CHECK_EQ(feedback.nacks[2], 116);
+
+    // Wraps around
+    size = WriteNack(packet, TEST_SSRC, 0xFFFF, 0x0001);
+    CHECK(Parse(packet, size, feedback));
+    CHECK_EQ(feedback.nack_count, 2);
+    CHECK_EQ(feedback.nacks[1], 0);
+
+    size = WriteNack(packet, TEST_OTHER_SSRC, 100, 0xFFFF);
+    CHECK(Parse(packet, size, feedback));
+    CHECK_EQ(feedback.nack_count, 0);
+}
+
+static void TestKeyFrameRequests() {
+    byte_t packet[64];
+    RtcpFeedback feedback;
+    sz_t size;
+
+    size = WritePli(packet, TEST_SSRC);
+    CHECK(Parse(packet, size, feedback));
+    CHECK(feedback.key_frame);
+
+    size = WritePli(packet, TEST_OTHER_SSRC);
+    CHECK(Parse(packet, size, feedback));
+    CHECK(!feedback.key_frame);
+
+    size = WriteFir(packet, TEST_SSRC);
+    CHECK(Parse(packet, size, feedback));
+    CHECK(feedback.key_frame);
+
+    size = WriteFir(packet, TEST_OTHER_SSRC);
+    CHECK(Parse(packet, size, feedback));
+    CHECK(!feedback.key_frame);
+}
+
+// SR + RR + NACK + PLI, as a client sends them together
+static void TestCompound() {
+    byte_t packet[256];
+    RtcpFeedback feedback;
+    sz_t size = 0;
+
+    size += WriteSr(packet + size);
+    size += WriteRr(packet + size, 128, 42, 90);
+    size += WriteNack(packet + size, TEST_SSRC, 7, 0);
+    size += WritePli(packet + size, TEST_SSRC);
+
+    CHECK(Parse(packet, size, feedback));
+    CHECK(feedback.has_report);
+    CHECK_EQ(feedback.fraction_lost, 128);
+    CHECK_EQ(feedback.cumulative_lost, 42);
+    CHECK_EQ(feedback.nack_count, 1);
+    CHECK_EQ(feedback.nacks[0], 7);
+    CHECK(feedback.key_frame);
+}
+
+static void TestMalformed() {
+    byte_t packet[256];
+    RtcpFeedback feedback;
+    sz_t first;
+    sz_t size;
+
+    // Not version 2, after a valid packet
+    first = WriteRr(packet, 1, 1, 1);
+    size = first + WritePli(packet + first, TEST_SSRC);
+    packet[first] = (byte_t)(0x40 | 1);
+    CHECK(!Parse(packet, size, feedback));
+
+    // Length past the end of the compound packet
+    size = WriteRr(packet, 1, 1, 1);
+    size += WritePli(packet + size, TEST_SSRC);
+    CHECK(!Parse(packet, size - 1, feedback));
+    Write16(packet + 2, 100);
+    CHECK(!Parse(packet, size, feedback));
+
+    // Fewer report blocks than counted: the ones there are read
+    size = WriteHeader(packet, 3, 201, 8 + 24);
+    size += WriteBlock(packet + size, TEST_SSRC, 9, 9, 9);
+    CHECK(Parse(packet, size, feedback));
+    CHECK(feedback.has_report);
+    CHECK_EQ(feedback.fraction_lost, 9);
+
+    // Too short for its type: ignored, not read past
+    size = WriteHeader(packet, 1, 206, 8);
+    CHECK(Parse(packet, size, feedback));
+    CHECK(!feedback.key_frame);
+
+    // A trailing partial header is ignored
+    size = WritePli(packet, TEST_SSRC);
+    CHECK(Parse(packet, size + 2, feedback));
+    CHECK(feedback.key_frame);
+}
+
+int main() {
+    TestReport();
+    TestNack();
+    TestKeyFrameRequests();
+    TestCompound();
+    TestMalformed();
+    return TestResult("RtcpParserTest");
+}
@@ -0,0 +1,173 @@
+#include "utils/RtspParser.h"
+#include "Test.h"
+
+#define TEST_BUFFER_LEN 2048
+
+#define TEST_OPTIONS "OPTIONS rtsp://host/stream RTSP/1.0\r\n" \
+                     "CSeq: 2\r\n"                             \
+                     "\r\n"
+#define TEST_SET_PARAMETER "SET_PARAMETER rtsp://host/stream RTSP/1.0\r\n" \
+                           "CSeq: 3\r\n"                                   \
+                           "Session: client_0;timeout=60\r\n"              \
+                           "Content-Length: 4\r\n"                         \
+                           "\r\n"                                          \
+                           "ping"
+
+// The client's receive loop: read into the free end of a fixed buffer,
+// parse what is there, compact when the end is reached
+typedef struct {
+    RtspParser parser;
+    byte_t buffer[TEST_BUFFER_LEN];
+    sz_t start;
+    sz_t end;
+
+    sz_t skipped;
+    sz_t interleaved;
+    sz_t interleaved_size;
+    byte_t channel;
+    sz_t requests;
+    int_t cseq;
+    sz_t dropped;
+} TestReader;
+
+static void Open(TestReader& reader) {
+    Reset(&reader, sizeof(reader));
+    Reset(reader.parser);
+}
+
+static void Parse(TestReader& reader) {
+    RtspMessage message;
+    sz_t consumed;
+
+    while ((consumed = ParseRtsp(reader.parser,
+                                 reader.buffer + reader.start,
+                                 reader.end - reader.start,
+                                 TEST_BUFFER_LEN,
+                                 message)) > 0) {
+        if (message.type == RTSP_SKIPPED) {
+            reader.skipped += message.size;
+        } else if (message.type == RTSP_INTERLEAVED) {
+            reader.interleaved++;
+            reader.interleaved_size = message.size;
+            reader.channel = message.channel;
+        } else if (message.type == RTSP_REQUEST) {
+            reader.requests++;
+            reader.cseq = message.request.cseq;
+        }
+        reader.start += consumed;
+    }
+    if (reader.start == reader.end) {
+        reader.start = 0;
+        reader.end = 0;
+    }
+    if (reader.start == 0 && reader.end == TEST_BUFFER_LEN) {
+        reader.dropped += reader.end;
+        reader.end = 0;
+        Reset(reader.parser);
+    }
+}
+
+// Pieces of at most piece bytes, as recv() may return them
+static void Feed(TestReader& reader, const byte_t *data, sz_t size, sz_t piece) {
+    sz_t count;
+
+    while (size > 0) {
+        if (reader.end == TEST_BUFFER_LEN && reader.start > 0) {
+            Move(reader.buffer, reader.buffer + reader.start, reader.end - reader.start);
+            reader.end -= reader.start;
+            reader.start = 0;
+        }
+        count = size < piece ? size : piece;
+        if (count > TEST_BUFFER_LEN - reader.end) {
+            count = TEST_BUFFER_LEN - reader.end;
+        }
+        Copy(reader.buffer + reader.end, data, count);
+        reader.end += count;
+        data += count;
+        size -= count;
+        Parse(reader);
+    }
+}
+
+static sz_t WriteFrame(byte_t *dst, byte_t channel, sz_t size) {
+    dst[0] = '$';
+    dst[1] = channel;
+    dst[2] = (byte_t)(size >> 8);
+    dst[3] = (byte_t)size;
+    for (sz_t i = 0; i < size; ++i) {
+        // Payload that looks like the start of a request
+        dst[RTSP_INTERLEAVED_PREFIX_LEN + i] = i % 8 == 0 ? '$' : 'R';
+    }
+    return RTSP_INTERLEAVED_PREFIX_LEN + size;
+}
+
+// A frame larger than the buffer is dropped as it comes,
+// the messages after it are found
+static void TestOversizedFrame() {
+    static TestReader reader;
+    static byte_t stream[16384];
+    sz_t pieces[] = {1, 7, 700, 1500, TEST_BUFFER_LEN};
+    sz_t size = 0;
+    sz_t frame;
+
+    frame = WriteFrame(stream, 1, 5000);
+    size += frame;
+    Copy(stream + size, TEST_OPTIONS, Len(TEST_OPTIONS));
+    size += Len(TEST_OPTIONS);
+    size += WriteFrame(stream + size, 3, 60);
+
+    for (sz_t piece: pieces) {
+        Open(reader);
+        Feed(reader, stream, size, piece);
+        CHECK_EQ(reader.skipped, frame);
+        CHECK_EQ(reader.requests, 1);
+        CHECK_EQ(reader.cseq, 2);
+        CHECK_EQ(reader.interleaved, 1);
+        CHECK_EQ(reader.interleaved_size, 60);
+        CHECK_EQ(reader.channel, 3);
+        CHECK_EQ(reader.dropped, 0);
+        CHECK_EQ(reader.end, 0);
+    }
+}
+
+// A frame that fits waits for its last byte and is taken whole
+static void TestSplitFrame() {
+    static TestReader reader;
+    static byte_t stream[TEST_BUFFER_LEN];
+    sz_t size;
+
+    Open(reader);
+    size = WriteFrame(stream, 1, TEST_BUFFER_LEN - RTSP_INTERLEAVED_PREFIX_LEN);
+    Feed(reader, stream, size - 1, 100);
+    CHECK_EQ(reader.interleaved, 0);
+    Feed(reader, stream + size - 1, 1, 1);
+    CHECK_EQ(reader.interleaved, 1);
+    CHECK_EQ(reader.interleaved_size, TEST_BUFFER_LEN - RTSP_INTERLEAVED_PREFIX_LEN);
+    CHECK_EQ(reader.skipped, 0);
+}
+
+static void TestRequest() {
+    RtspParser parser;
+    RtspMessage message;
+    const byte_t *data = reinterpret_cast<const byte_t *>(TEST_SET_PARAMETER);
+    sz_t size = Len(TEST_SET_PARAMETER);
+
+    Reset(parser);
+    CHECK_EQ(ParseRtsp(parser, data, size - 1, TEST_BUFFER_LEN, message), 0);
+    CHECK_EQ(message.type, RTSP_NEED_MORE);
+
+    CHECK_EQ(ParseRtsp(parser, data, size, TEST_BUFFER_LEN, message), size);
+    CHECK_EQ(message.type, RTSP_REQUEST);
+    CHECK(Equals(message.request.method, "SET_PARAMETER"));
+    CHECK(Equals(message.request.uri, "rtsp://host/stream"));
+    CHECK_EQ(message.request.cseq, 3);
+    CHECK(Equals(FirstParam(message.request.session), "client_0"));
+    CHECK(Equals(message.request.body, "ping"));
+}
+
+int main() {
+    TestOversizedFrame();
+    TestSplitFrame();
+    TestRequest();
+    return TestResult("RtspParserTest");
+}
@@ -0,0 +1,147 @@
+#include "server/S_SendQueue.h"
+#include "Test.h"
+
+#define TEST_CHUNK 4096
+#define TEST_RESPONSE "RTSP/1.0 200 OK\r\nCSeq: 3\r\n\r\n"
+
+static byte_t chunk[TEST_CHUNK];
+static byte_t received[4 * 1024 * 1024];
+
+typedef struct {
+    CancellableSocket socket;
+    S_SendQueue queue;
+    int_t peer;
+    int_t poll_fd;
+} TestClient;
+
+static void Open(TestClient& client) {
+    int_t fds[2];
+    int_t size = 16384;
+
+    socketpair(AF_UNIX, SOCK_STREAM, 0, fds);
+    setsockopt(fds[0], SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+    client.socket.socket = fds[0];
+    client.peer = fds[1];
+    Init(&client.socket.send_lock);
+    S_Init(client.queue, &client.socket);
+
+    client.poll_fd = InitPoll();
+    AddPollWritable(client.poll_fd, client.socket.socket, 1);
+}
+
+static void Close(TestClient& client) {
+    close(client.poll_fd);
+    close(client.peer);
+    Destroy(client.socket);
+}
+
+// Fill the socket until some media waits in the queue
+static sz_t FillSocket(TestClient& client) {
+    s_iovec_t vec;
+    sz_t calls = 0;
+    sz_t total = 0;
+    ssz_t sent;
+
+    SetVector(vec, chunk, sizeof(chunk));
+    do {
+        Lock(&client.socket.send_lock);
+        sent = S_SendMedia(client.queue, &vec, 1, 0, calls);
+        Unlock(&client.socket.send_lock);
+        CHECK_EQ(sent, TEST_CHUNK);
+        total += TEST_CHUNK;
+    } while (S_PendingBytes(client.queue) == 0 && total < sizeof(received) / 2);
+    return total;
+}
+
+static sz_t ReadAll(TestClient& client, sz_t offset) {
+    ssz_t read;
+
+    while ((read = recv(client.peer, received + offset, sizeof(received) - offset, MSG_DONTWAIT)) > 0) {
+        offset += read;
+    }
+    return offset;
+}
+
+// A response on a full socket neither blocks nor cuts into the media,
+// the reactor sends it when the socket is writable again
+static void TestControlBehindMedia() {
+    static TestClient client;
+    s_event_t event;
+    sz_t media;
+    sz_t offset = 0;
+    ssz_t sent;
+    tm_t start;
+    int_t i;
+
+    Open(client);
+    media = FillSocket(client);
+    CHECK(S_PendingBytes(client.queue) > 0);
+
+    // Drop the EPOLLOUT of the empty socket
+    epoll_wait(client.poll_fd, &event, 1, 0);
+
+    start = NowMicros();
+    Lock(&client.socket.send_lock);
+    sent = S_SendControl(client.queue, TEST_RESPONSE, Len(TEST_RESPONSE));
+    Unlock(&client.socket.send_lock);
+    CHECK_EQ(sent, Len(TEST_RESPONSE));
+    CHECK(NowMicros() - start < 100000);
+
+    // The client reads, the socket becomes writable, the reactor drains
+    for (i = 0; i < 100 && S_PendingBytes(client.queue) > 0; ++i) {
+        offset = ReadAll(client, offset);
+        if (epoll_wait(client.poll_fd, &event, 1, 1000) != 1) {
+            break;
+        }
+        CHECK(event.events & EPOLLOUT);
+        CHECK_EQ(S_Drain(client.queue), 0);
+    }
+    CHECK_EQ(S_PendingBytes(client.queue), 0);
+    offset = ReadAll(client, offset);
+
+    CHECK_EQ(offset, media + Len(TEST_RESPONSE));
+    CHECK(memcmp(received + media, TEST_RESPONSE, Len(TEST_RESPONSE)) == 0);
+    CHECK_EQ(received[media - 1], chunk[TEST_CHUNK - 1]);
+    Close(client);
+}
+
+// A client that reads nothing can't make responses pile up
+static void TestControlOverflow() {
+    static TestClient client;
+    static byte_t response[SEND_QUEUE_SIZE / 2 + 1];
+    ssz_t sent;
+
+    Open(client);
+    FillSocket(client);
+
+    Reset(response, sizeof(response));
+    Lock(&client.socket.send_lock);
+    sent = S_SendControl(client.queue, response, sizeof(response));
+    CHECK_EQ(sent, sizeof(response));
+    sent = S_SendControl(client.queue, response, sizeof(response));
+    CHECK_EQ(sent, -1);
+    Unlock(&client.socket.send_lock);
+    Close(client);
+}
+
+// The peer left: the reactor closes the client
+static void TestDrainClosed() {
+    static TestClient client;
+
+    Open(client);
+    FillSocket(client);
+    close(client.peer);
+    CHECK_EQ(S_Drain(client.queue), -1);
+    client.peer = -1;
+    Close(client);
+}
+
+int main() {
+    for (sz_t i = 0; i < TEST_CHUNK; ++i) {
+        chunk[i] = (byte_t)i;
+    }
+    TestControlBehindMedia();
+    TestControlOverflow();
+    TestDrainClosed();
+    return TestResult("SendQueueTest");
+}
@@ -0,0 +1,35 @@
+#pragma once
+
+#include <stdio.h>
+
+// Checks of the host tests: a failed one is printed and the test
+// exits non-zero at the end, ctest shows the output.
+static int test_failures = 0;
+
+#define CHECK(cond)                                                              \
+    do {                                                                         \
+        if (!(cond)) {                                                           \
+            fprintf(stderr, "%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #cond); \
+            test_failures++;                                                     \
+        }                                                                        \
+    } while (0)
+
+#define CHECK_EQ(actual, expected)                                               \
+    do {                                                                         \
+        long long actual_ = (long long)(actual);                                 \
+        long long expected_ = (long long)(expected);                             \
+        if (actual_ != expected_) {                                              \
+            fprintf(stderr, "%s:%d: %s is %lld, expected %lld\n",                \
+                    __FILE__, __LINE__, #actual, actual_, expected_);            \
+            test_failures++;                                                     \
+        }                                                                        \
+    } while (0)
+
+static inline int TestResult(const char *name) {
+    if (test_failures > 0) {
+        fprintf(stderr, "%s: %d checks failed\n", name, test_failures);
+        return 1;
+    }
+    printf("%s: ok\n", name);
+    return 0;
+}
@@ -0,0 +1,174 @@
+#include <sys/resource.h>
+
+#include "server/S_Uring.h"
+#include "utils/Configs.h"
+
+// Sending thread cost of UDP video batches over loopback: send() per
+// packet, sendmmsg() (the default) and io_uring linked SENDMSG entries,
+// with and without the socket registered. Reports syscalls/s and CPU
+// of the sending thread per Mbps sent.
+// Not a test, run it by hand:
+//   ./UringBench [packets per batch]
+
+#define BENCH_PACKET_SIZE 1200
+#define BENCH_HEADER_SIZE 12 // RTP header
+#define BENCH_MAX_PACKETS RTP_BATCH_MAX_PACKETS
+#define BENCH_BYTES (1024LL * 1024 * 1024)
+
+enum BenchMode {
+    BENCH_SEND,
+    BENCH_SENDMMSG,
+    BENCH_URING,
+    BENCH_URING_FIXED
+};
+
+static byte_t frame[BENCH_MAX_PACKETS * BENCH_PACKET_SIZE];
+static byte_t headers[BENCH_MAX_PACKETS][BENCH_HEADER_SIZE];
+static s_iovec_t vectors[BENCH_MAX_PACKETS][2];
+static s_mmsghdr_t messages[BENCH_MAX_PACKETS];
+
+typedef struct {
+    int_t fd;
+    a_int_t stop;
+} BenchReader;
+
+static void* Receive(void* arg) {
+    static byte_t buffer[2048];
+    BenchReader& reader = *static_cast<BenchReader *>(arg);
+
+    while (Load(&reader.stop) == 0) {
+        if (recv(reader.fd, buffer, sizeof(buffer), 0) < 0 && errno != EAGAIN) {
+            break;
+        }
+    }
+    return nullptr;
+}
+
+// Connected pair, the reader times out so it sees the stop
+static int_t Connect(int_t &peer) {
+    sockaddr_in addr {};
+    socklen_t len = sizeof(addr);
+    timeval timeout = {0, 100000};
+    int_t fd = socket(AF_INET, SOCK_DGRAM, 0);
+
+    peer = socket(AF_INET, SOCK_DGRAM, 0);
+    setsockopt(peer, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    bind(peer, reinterpret_cast<sockaddr *>(&addr), sizeof(addr));
+    getsockname(peer, reinterpret_cast<sockaddr *>(&addr), &len);
+    connect(fd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr));
+    return fd;
+}
+
+static double_t ThreadCpuMs() {
+    rusage usage {};
+
+    getrusage(RUSAGE_THREAD, &usage);
+    return (double_t)(usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1000.0 +
+           (double_t)(usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1000.0;
+}
+
+static sz_t SendEach(int_t fd, sz_t packets, sz_t &calls) {
+    sz_t i;
+
+    for (i = 0; i < packets; ++i) {
+        ++calls;
+        if (sendmsg(fd, &messages[i].msg_hdr, MSG_DONTWAIT) < 0) {
+            break;
+        }
+    }
+    return i;
+}
+
+static void Run(const char *name, BenchMode mode, sz_t packets) {
+    S_Uring uring;
+    BenchReader reader;
+    pthread_t receiver;
+    int_t fd = Connect(reader.fd);
+    long long bytes = 0;
+    sz_t calls = 0;
+    sz_t sent;
+    double_t cpu_ms;
+    double_t seconds;
+    double_t mbps;
+    tm_t start;
+
+    S_Init(uring);
+    if (mode == BENCH_URING || mode == BENCH_URING_FIXED) {
+        if (!S_Open(uring, (uint_t)packets)) {
+            printf("%-14s io_uring not available, error %d\n", name, errno);
+            close(fd);
+            close(reader.fd);
+            return;
+        }
+        if (mode == BENCH_URING_FIXED && !S_Register(uring, fd)) {
+            printf("%-14s registered files not available\n", name);
+            S_Close(uring);
+            close(fd);
+            close(reader.fd);
+            return;
+        }
+    }
+    Store(&reader.stop, 0);
+    pthread_create(&receiver, nullptr, Receive, &reader);
+
+    start = NowMicros();
+    cpu_ms = ThreadCpuMs();
+    while (bytes < BENCH_BYTES) {
+        if (mode == BENCH_SEND) {
+            sent = SendEach(fd, packets, calls);
+        } else if (mode == BENCH_SENDMMSG) {
+            sent = SendMessages(fd, messages, packets, calls);
+        } else {
+            sent = S_SendMessages(uring, fd, messages, packets, calls);
+        }
+        // Socket buffer full: lost, like on the network
+        bytes += (long long)sent * (BENCH_HEADER_SIZE + BENCH_PACKET_SIZE);
+        if (sent < packets && errno != EAGAIN && errno != EWOULDBLOCK &&
+            errno != ECONNREFUSED && errno != ENOBUFS) {
+            printf("%-14s send failed, error %d\n", name, errno);
+            break;
+        }
+    }
+    cpu_ms = ThreadCpuMs() - cpu_ms;
+    seconds = (double_t)(NowMicros() - start) / 1e6;
+    mbps = (double_t)bytes * 8 / seconds / 1e6;
+
+    printf("%-14s %8.0f Mbps  %9.0f syscalls/s  sender CPU %6.3f ms/s per Mbps\n",
+           name,
+           mbps,
+           (double_t)calls / seconds,
+           cpu_ms / seconds / mbps);
+
+    Store(&reader.stop, 1);
+    pthread_join(receiver, nullptr);
+    S_Close(uring);
+    close(fd);
+    close(reader.fd);
+}
+
+int main(int argc, char **argv) {
+    sz_t packets = argc > 1 ? (sz_t)atoi(argv[1]) : 64;
+    sz_t i;
+
+    if (packets == 0 || packets > BENCH_MAX_PACKETS) {
+        printf("Packets per batch 1..%d\n", BENCH_MAX_PACKETS);
+        return 1;
+    }
+    for (i = 0; i < sizeof(frame); ++i) {
+        frame[i] = (byte_t)i;
+    }
+    for (i = 0; i < packets; ++i) {
+        SetVector(vectors[i][0], headers[i], BENCH_HEADER_SIZE);
+        SetVector(vectors[i][1], frame + i * BENCH_PACKET_SIZE, BENCH_PACKET_SIZE);
+        messages[i].msg_hdr.msg_iov = vectors[i];
+        messages[i].msg_hdr.msg_iovlen = 2;
+    }
+    printf("%zu packets of %d bytes per batch\n", packets, BENCH_PACKET_SIZE);
+    Run("send", BENCH_SEND, packets);
+    Run("sendmmsg", BENCH_SENDMMSG, packets);
+    Run("io_uring", BENCH_URING, packets);
+    Run("io_uring fixed", BENCH_URING_FIXED, packets);
+    return 0;
+}
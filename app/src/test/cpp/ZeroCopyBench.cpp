@@ -0,0 +1,146 @@
+#include <sys/resource.h>
+
+#include "server/S_Platform.h"
+#include "utils/Configs.h"
+
+// CPU of the sending thread for keyframe sized TCP batches, copied by
+// send() vs MSG_ZEROCOPY with ZEROCOPY_MAX_INFLIGHT sends at most, like
+// the video stream. Over loopback the kernel copies zerocopy sends
+// anyway (reported as "copied"), only a NIC shows the saving.
+// Not a test, run it by hand:
+//   ./ZeroCopyBench [frame KB]
+
+#define BENCH_PACKET_SIZE RTP_TCP_PACKET_SIZE
+#define BENCH_HEADER_SIZE 16 // '$' prefix + RTP header
+#define BENCH_MAX_PACKETS 32
+#define BENCH_BYTES (2048LL * 1024 * 1024)
+
+static byte_t frame[BENCH_MAX_PACKETS * BENCH_PACKET_SIZE];
+static byte_t headers[BENCH_MAX_PACKETS][BENCH_HEADER_SIZE];
+
+static void* Receive(void* arg) {
+    static byte_t buffer[1024 * 1024];
+    int_t fd = *static_cast<int_t *>(arg);
+
+    while (recv(fd, buffer, sizeof(buffer), 0) > 0);
+    return nullptr;
+}
+
+static int_t Connect(int_t &peer) {
+    sockaddr_in addr {};
+    socklen_t len = sizeof(addr);
+    int_t listener = socket(AF_INET, SOCK_STREAM, 0);
+    int_t fd = socket(AF_INET, SOCK_STREAM, 0);
+
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    bind(listener, reinterpret_cast<sockaddr *>(&addr), sizeof(addr));
+    listen(listener, 1);
+    getsockname(listener, reinterpret_cast<sockaddr *>(&addr), &len);
+    connect(fd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr));
+    peer = accept(listener, nullptr, nullptr);
+    close(listener);
+    return fd;
+}
+
+static double_t ThreadCpuMs() {
+    rusage usage {};
+
+    getrusage(RUSAGE_THREAD, &usage);
+    return (double_t)(usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1000.0 +
+           (double_t)(usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1000.0;
+}
+
+static void Run(const char *name, sz_t packets, bool_t zerocopy) {
+    s_iovec_t vectors[BENCH_MAX_PACKETS * 2];
+    pthread_t receiver;
+    msghdr msg {};
+    int_t peer;
+    int_t fd = Connect(peer);
+    uint_t ids = 0;
+    uint_t done = 0;
+    uint_t lo;
+    uint_t hi;
+    bool_t copied;
+    bool_t slot;
+    ssz_t sent;
+    sz_t copied_count = 0;
+    sz_t frames = 0;
+    long long bytes = 0;
+    double_t cpu_ms;
+    tm_t start;
+    sz_t i;
+
+    if (zerocopy && EnableZeroCopy(fd) < 0) {
+        printf("%-10s SO_ZEROCOPY not supported, error %d\n", name, errno);
+        close(fd);
+        close(peer);
+        return;
+    }
+    pthread_create(&receiver, nullptr, Receive, &peer);
+
+    for (i = 0; i < packets; ++i) {
+        SetVector(vectors[2 * i], headers[i], BENCH_HEADER_SIZE);
+        SetVector(vectors[2 * i + 1], frame + i * BENCH_PACKET_SIZE, BENCH_PACKET_SIZE);
+    }
+    msg.msg_iov = vectors;
+    msg.msg_iovlen = packets * 2;
+
+    start = NowMicros();
+    cpu_ms = ThreadCpuMs();
+    while (bytes < BENCH_BYTES) {
+        // Every slot in flight: a copy, as SendZeroCopy() does
+        slot = zerocopy && ids - done < ZEROCOPY_MAX_INFLIGHT;
+        sent = sendmsg(fd, &msg, slot ? MSG_ZEROCOPY : 0);
+
+        if (sent < 0) {
+            printf("%-10s send failed, error %d\n", name, errno);
+            break;
+        }
+        bytes += sent;
+        frames++;
+        ids += slot ? 1 : 0;
+        while (zerocopy && ReadZeroCopy(fd, lo, hi, copied)) {
+            done += hi - lo + 1;
+            copied_count += copied ? hi - lo + 1 : 0;
+        }
+    }
+    // The last completions, before the frames could be reused
+    while (done < ids) {
+        if (ReadZeroCopy(fd, lo, hi, copied)) {
+            done += hi - lo + 1;
+            copied_count += copied ? hi - lo + 1 : 0;
+        }
+    }
+    cpu_ms = ThreadCpuMs() - cpu_ms;
+
+    printf("%-10s %6.2f GB/s  sender CPU %6.1f ms/GB  zerocopy %zu / %zu frames (%zu copied)\n",
+           name,
+           (double_t)bytes / (double_t)(NowMicros() - start) / 1000.0,
+           cpu_ms * 1e9 / (double_t)bytes,
+           (sz_t)ids,
+           frames,
+           copied_count);
+
+    shutdown(fd, SHUT_WR);
+    pthread_join(receiver, nullptr);
+    close(fd);
+    close(peer);
+}
+
+int main(int argc, char **argv) {
+    sz_t kb = argc > 1 ? (sz_t)atoi(argv[1]) : 256;
+    sz_t packets = (kb * 1024 + BENCH_PACKET_SIZE - 1) / BENCH_PACKET_SIZE;
+
+    if (packets == 0 || packets > BENCH_MAX_PACKETS) {
+        printf("Frame size 1..%d KB\n", BENCH_MAX_PACKETS * BENCH_PACKET_SIZE / 1024);
+        return 1;
+    }
+    for (sz_t i = 0; i < sizeof(frame); ++i) {
+        frame[i] = (byte_t)i;
+    }
+    printf("%zu KB frames, %zu packets\n", packets * BENCH_PACKET_SIZE / 1024, packets);
+    Run("copy", packets, false);
+    Run("zerocopy", packets, true);
+    return 0;
+}
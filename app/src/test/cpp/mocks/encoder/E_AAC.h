@@ -0,0 +1,18 @@
+#pragma once
+
+#include "utils/Configs.h"
+#include "utils/FramePool.h"
+#include "utils/Platform.h"
+
+typedef void (*E_AACFrameCallback)(void *context, SharedFrame *frame);
+
+// Stands in for the MediaCodec encoder in host tests
+typedef struct {
+    E_AACFrameCallback callback;
+    void *context;
+} E_AAC;
+
+bool E_AddListener(E_AAC &encoder,
+                   E_AACFrameCallback callback,
+                   void *ctx);
+bool E_RemoveListener(E_AAC &encoder, void *ctx);
@@ -0,0 +1,51 @@
+#include "encoder/E_AAC.h"
+#include "encoder/E_H265.h"
+
+// One listener per mock encoder, the parameter sets are what the test put in
+
+bool E_AddListener(E_H265 &encoder, E_H265FrameCallback callback, void *ctx) {
+    encoder.callback = callback;
+    encoder.context = ctx;
+    return true;
+}
+
+bool E_RemoveListener(E_H265 &encoder, void *ctx) {
+    if (encoder.context != ctx) {
+        return false;
+    }
+    encoder.callback = nullptr;
+    encoder.context = nullptr;
+    return true;
+}
+
+void E_RequestKeyFrame(E_H265 &encoder) {
+    Add(&encoder.key_frame_requests, 1);
+}
+
+int_t E_ParamsVersion(E_H265 &encoder) {
+    return encoder.params_version;
+}
+
+int_t E_GetConfig(E_H265 &encoder, byte_t *data, sz_t size, sz_t &length) {
+    if (encoder.config_size > size) {
+        return 0;
+    }
+    Copy(data, encoder.config, encoder.config_size);
+    length = encoder.config_size;
+    return encoder.params_version;
+}
+
+bool E_AddListener(E_AAC &encoder, E_AACFrameCallback callback, void *ctx) {
+    encoder.callback = callback;
+    encoder.context = ctx;
+    return true;
+}
+
+bool E_RemoveListener(E_AAC &encoder, void *ctx) {
+    if (encoder.context != ctx) {
+        return false;
+    }
+    encoder.callback = nullptr;
+    encoder.context = nullptr;
+    return true;
+}
@@ -0,0 +1,35 @@
+#pragma once
+
+#include "utils/Configs.h"
+#include "utils/FramePool.h"
+#include "utils/Platform.h"
+
+// As in E_Platform.h
+#define E_INFO_FLAG_KEY_FRAME 1
+
+typedef void (*E_H265FrameCallback)(void *context, SharedFrame *frame);
+
+// Stands in for the MediaCodec encoder in host tests,
+// records what the server asked of it. The test calls the
+// listener with its frames, as the encoding thread would.
+typedef struct {
+    int_t bit_rate;
+    sz_t set_calls;
+
+    E_H265FrameCallback callback;
+    void *context;
+    a_int_t key_frame_requests;
+    byte_t config[H265_CONFIG_SIZE];
+    sz_t config_size;
+    int_t params_version;
+} E_H265;
+
+bool E_AddListener(E_H265 &encoder,
+                   E_H265FrameCallback callback,
+                   void *ctx);
+bool E_RemoveListener(E_H265 &encoder, void *ctx);
+void E_RequestKeyFrame(E_H265 &encoder);
+void E_SetBitRate(E_H265 &encoder, int_t bit_rate);
+int_t E_GetBitRate(E_H265 &encoder);
+int_t E_ParamsVersion(E_H265 &encoder);
+int_t E_GetConfig(E_H265 &encoder, byte_t *data, sz_t size, sz_t &length);
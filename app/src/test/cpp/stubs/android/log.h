@@ -0,0 +1,12 @@
+#pragma once
+
+#include <stdio.h>
+
+// Host build of the native code: logs go to stderr
+enum {
+    ANDROID_LOG_INFO = 4,
+    ANDROID_LOG_ERROR = 6
+};
+
+#define __android_log_print(prio, tag, ...) \
+    ((void)(prio), fprintf(stderr, "%s: ", tag), fprintf(stderr, __VA_ARGS__), fprintf(stderr, "\n"))